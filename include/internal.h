@@ -45,6 +45,8 @@
 #include <assert.h>
 #include <endian.h>
 
+#include <sys/queue.h>
+
 #include <uuid/uuid.h>
 
 _EXTERN_C_BEG
@@ -67,11 +69,16 @@ struct backend_ops {
     int                 (*close)(struct zhpeq *zq, int open_idx);
     int                 (*wq_signal)(struct zhpeq *zq);
     ssize_t             (*cq_poll)(struct zhpeq *zq, size_t len);
+    bool                (*cq_can_block)(struct zhpeq *zq);
     int                 (*mr_reg)(struct zhpeq_dom *zdom,
                                   const void *buf, size_t len, uint32_t access,
                                   struct zhpeq_key_data **kdata_out);
     int                 (*mr_free)(struct zhpeq_dom *zdom,
                                    struct zhpeq_key_data *kdata);
+    int                 (*mr_reg_batch)(struct zhpeq_dom *zdom,
+                                        const struct zhpeq_iov *iov,
+                                        size_t n_iov, uint32_t access,
+                                        struct zhpeq_key_data **kdata_out);
     int                 (*zmmu_free)(struct zhpeq_dom *zdom,
                                      struct zhpeq_key_data *kdata);
     int                 (*zmmu_import)(struct zhpeq_dom *zdom, int open_idx,
@@ -92,9 +99,24 @@ struct backend_ops {
 
 extern uuid_t           zhpeq_uuid;
 
-void zhpeq_register_backend(enum zhpe_offloaded_backend backend, struct backend_ops *ops);
+void zhpeq_register_backend(enum zhpeq_backend backend, struct backend_ops *ops);
 void zhpeq_backend_libfabric_init(int fd);
 void zhpeq_backend_zhpe_offloaded_init(int fd);
+void zhpeq_backend_loopback_init(int fd);
+
+/* How the zhpe backend talks to the driver; the mock is driver_mock.c. */
+struct zhpe_offloaded_driver_ops {
+    int                 (*open)(void);
+    ssize_t             (*write)(int fd, const void *buf, size_t len);
+    ssize_t             (*read)(int fd, void *buf, size_t len);
+    void                *(*mmap)(size_t len, int fd, off_t offset,
+                                 int *error);
+};
+
+extern struct zhpe_offloaded_driver_ops zhpe_offloaded_mock_ops;
+
+int zhpe_offloaded_mock_open(void);
+bool zhpe_offloaded_mock_enabled(void);
 
 #define FREE_END        ((intptr_t)-1)
 
@@ -108,10 +130,79 @@ struct zhpeq_ht {
     uint32_t            tail;
 } INT64_ALIGNED;
 
+struct zhpeq_mr_cache;
+struct zhpeq_mem;
+
 struct zhpeq_dom {
     void                *backend_data;
+    struct zhpeq_mr_cache *mr_cache;
+    struct zhpeq_mem    *mem;
+    pthread_mutex_t     stats_mutex;
+    LIST_HEAD(, zhpeq)  stats_head;
+    struct zhpeq_stats  stats_retired;
+};
+
+/* Registration cache (mr_cache.c); enabled by ZHPEQ_MR_CACHE_MAX. */
+int zhpeq_mr_cache_init(struct zhpeq_dom *zdom, struct backend_ops *ops,
+                        uint64_t max_bytes);
+int zhpeq_mr_cache_destroy(struct zhpeq_dom *zdom);
+int zhpeq_mr_cache_reg(struct zhpeq_dom *zdom, const void *buf, size_t len,
+                       uint32_t access, struct zhpeq_key_data **qkdata_out);
+int zhpeq_mr_cache_free(struct zhpeq_dom *zdom,
+                        struct zhpeq_key_data *qkdata);
+
+/* Registered memory allocator (mem_alloc.c). */
+int zhpeq_mem_init(struct zhpeq_dom *zdom, struct backend_ops *ops,
+                   uint64_t arena_size);
+int zhpeq_mem_destroy(struct zhpeq_dom *zdom);
+
+/*
+ * Software-only opcodes for zhpeq_putv()/zhpeq_getv() on backends that
+ * process the command queue themselves: dma.rd_addr points to a
+ * struct zhpeq_vec the backend frees once the operation is posted.
+ */
+#define ZHPEQ_SW_OPCODE_PUTV    (0xF0)
+#define ZHPEQ_SW_OPCODE_GETV    (0xF1)
+
+struct zhpeq_vec {
+    void                *context;
+    int32_t             pending;
+    uint8_t             status;
+    uint8_t             n_lcl;
+    uint8_t             n_rem;
+    struct zhpeq_iov    iov[];
+};
+
+/*
+ * zhpeq_atomicv() on backends that process the command queue themselves:
+ * one WQE whose dma.rd_addr points to a struct zhpeq_atmv; the backend
+ * writes a single completion and frees it when every element is done.
+ * On zhpe, each element is its own WQE with a context slot pointing at
+ * an elem and zhpeq_cq_read() reports only the last one to complete.
+ */
+#define ZHPEQ_SW_OPCODE_ATMV    (0xF2)
+
+struct zhpeq_atmv;
+
+struct zhpeq_atmv_elem {
+    struct zhpeq_atmv   *atmv;
+    uint32_t            idx;
+};
+
+struct zhpeq_atmv {
+    void                *context;
+    void                *results;
+    struct zhpeq_atmv_elem *elem;
+    int32_t             pending;
+    uint32_t            n_ent;
+    uint32_t            posted;
+    uint8_t             status;
+    uint8_t             size;
+    struct zhpeq_atomic_ent ent[];
 };
 
+struct zhpeq_ctx_cache;
+
 struct zhpeq {
     struct zhpeq_dom    *zdom;
     struct zhpe_offloaded_xqinfo  xqinfo;
@@ -119,13 +210,67 @@ struct zhpeq {
     union zhpe_offloaded_hw_wq_entry *wq;
     union zhpe_offloaded_hw_cq_entry *cq;
     void                **context;
+    uint8_t             *context_flags;
+    struct zhpeq_ctx_cache *ctx_cache;
+    uint32_t            context_ent;
+    uint32_t            n_ctx_cache;
+    uint32_t            flags;
+    uint64_t            ctx_gen;
     void                *backend_data;
     int                 fd;
+    int                 cq_efd;
     struct zhpeq_ht     head_tail CACHE_ALIGNED;
     struct free_index   context_free;
     uint32_t            tail_commit CACHE_ALIGNED;
+    uint32_t            cq_waiters CACHE_ALIGNED;
+    uint64_t            cq_wait_ns;
+    uint32_t            ctx_cache_users;
+    uint32_t            stats_users;
+    union zhpeq_stats_blk *stats_blk;
+    struct zhpeq_stats_shm_queue *stats_shm;
+    LIST_ENTRY(zhpeq)   stats_lentry;
+    pthread_t           stats_owner[ZHPEQ_STATS_THREADS];
 };
 
+/*
+ * Counter blocks (stats.c): the backend owns stats_blk[0], threads own
+ * one each, and the last is shared, so needs atomic updates.
+ */
+#define ZHPEQ_STATS_BLK_BACKEND (0)
+#define ZHPEQ_STATS_BLK_SHARED  (ZHPEQ_STATS_BLKS - 1)
+
+#define ZHPEQ_STATS_ADD(_s, _field, _v)                                 \
+do {                                                                    \
+    atm_store_rlx(&(_s)->_field, atm_load_rlx(&(_s)->_field) + (_v));   \
+} while (0)
+
+static inline struct zhpeq_stats *zhpeq_stats_backend(struct zhpeq *zq)
+{
+    return &zq->stats_blk[ZHPEQ_STATS_BLK_BACKEND].s;
+}
+
+void zhpeq_stats_lib_init(void);
+void zhpeq_stats_dom_init(struct zhpeq_dom *zdom);
+void zhpeq_stats_dom_destroy(struct zhpeq_dom *zdom);
+int zhpeq_stats_qinit(struct zhpeq *zq);
+void zhpeq_stats_qfini(struct zhpeq *zq);
+
+/*
+ * Software backends call this after making CQEs valid to wake any thread
+ * blocked in zhpeq_cq_wait(); the fence pairs with the waiter's increment
+ * of cq_waiters before its final check of the CQ.
+ */
+static inline void zhpeq_cq_notify(struct zhpeq *zq)
+{
+    uint64_t            one = 1;
+
+    smp_mb();
+    /* EAGAIN: the counter is saturated, so the waiter will wake anyway. */
+    if (unlikely(atm_load_rlx(&zq->cq_waiters)) &&
+        write(zq->cq_efd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        print_func_err(__func__, __LINE__, "write", "", -errno);
+}
+
 static inline uint8_t cq_valid(uint32_t idx, uint32_t qmask)
 {
     return ((idx & (qmask + 1)) ? 0 : ZHPE_OFFLOADED_HW_CQ_VALID);
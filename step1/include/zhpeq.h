@@ -99,14 +99,22 @@ union zhpeq_atomic {
 enum zhpeq_backend {
     ZHPEQ_BACKEND_ZHPE          = ZHPE_BACKEND_ZHPE,
     ZHPEQ_BACKEND_LIBFABRIC     = ZHPE_BACKEND_LIBFABRIC,
-    ZHPEQ_BACKEND_MAX           = ZHPE_BACKEND_MAX,
+    ZHPEQ_BACKEND_LOOPBACK      = ZHPE_BACKEND_MAX,
+    ZHPEQ_BACKEND_MAX,
 };
 
 enum {
     ZHPEQ_PRI_MAX               = 1,
     ZHPEQ_TC_MAX                = 15,
     ZHPEQ_IMM_MAX               = ZHPE_IMM_MAX,
-    ZHPEQ_KEY_BLOB_MAX          = 32,
+    ZHPEQ_KEY_BLOB_MAX          = 64,
+    ZHPEQ_IOV_MAX               = 16,
+};
+
+/* One segment of a zhpeq_putv()/zhpeq_getv(); addr is a zaddr. */
+struct zhpeq_iov {
+    uint64_t            addr;
+    size_t              len;
 };
 
 struct zhpeq_attr {
@@ -126,6 +134,48 @@ struct zhpeq_cq_entry {
     struct zhpe_cq_entry z;
 };
 
+enum zhpeq_op_type {
+    ZHPEQ_OP_NOP,
+    ZHPEQ_OP_PUT,
+    ZHPEQ_OP_PUTI,
+    ZHPEQ_OP_GET,
+    ZHPEQ_OP_GETI,
+    ZHPEQ_OP_ATOMIC,
+};
+
+/* One element of a zhpeq_atomicv(); operands as for zhpeq_atomic(). */
+struct zhpeq_atomic_ent {
+    enum zhpeq_atomic_op op;
+    uint64_t            rem_addr;
+    union zhpeq_atomic  operands[2];
+};
+
+/* One command for zhpeq_submit_batch(); arguments as for the single calls. */
+struct zhpeq_op {
+    enum zhpeq_op_type  op;
+    bool                fence;
+    void                *context;
+    union {
+        struct {
+            uint64_t    lcl_addr;
+            size_t      len;
+            uint64_t    rem_addr;
+        } rw;
+        struct {
+            const void  *buf;
+            size_t      len;
+            uint64_t    rem_addr;
+        } imm;
+        struct {
+            bool        retval;
+            enum zhpeq_atomic_size datasize;
+            enum zhpeq_atomic_op op;
+            uint64_t    rem_addr;
+            const union zhpeq_atomic *operands;
+        } atm;
+    };
+};
+
 /* Forward references to shut the compiler up. */
 struct zhpeq;
 struct zhpeq_dom;
@@ -177,6 +227,24 @@ int zhpeq_alloc(struct zhpeq_dom *zdom, int cmd_qlen, int cmp_qlen,
                 int traffic_class, int priority, int slice_mask,
                 struct zhpeq **zq_out);
 
+/* zhpeq_alloc_flags() flags */
+enum {
+    /*
+     * Only one thread at a time reserves and fills entries. Context
+     * slots are WQE indices, so zhpeq_reserve() also returns -EAGAIN
+     * while an older command still holds the next slot; read
+     * completions before retrying.
+     */
+    ZHPEQ_ALLOC_SP              = 0x1,
+    /* Only one thread at a time reads completions. */
+    ZHPEQ_ALLOC_SC              = 0x2,
+    ZHPEQ_ALLOC_SPSC            = (ZHPEQ_ALLOC_SP | ZHPEQ_ALLOC_SC),
+};
+
+int zhpeq_alloc_flags(struct zhpeq_dom *zdom, int cmd_qlen, int cmp_qlen,
+                      int traffic_class, int priority, int slice_mask,
+                      uint32_t flags, struct zhpeq **zq_out);
+
 int zhpeq_free(struct zhpeq *zq);
 
 int zhpeq_backend_exchange(struct zhpeq *zq, int sock_fd,
@@ -189,11 +257,54 @@ int zhpeq_backend_close(struct zhpeq *zq, int open_idx);
 ssize_t zhpeq_cq_read(struct zhpeq *zq, struct zhpeq_cq_entry *entries,
                       size_t n_entries);
 
+/*
+ * Wait until at least min_entries completions can be read or timeout_ms
+ * (-1 for forever) expires; returns the number available, which is less
+ * than min_entries only on timeout. Spins for a while based on recent
+ * completion latency, then blocks if the backend can wake us.
+ */
+ssize_t zhpeq_cq_wait(struct zhpeq *zq, size_t min_entries, int timeout_ms);
+
 int zhpeq_mr_reg(struct zhpeq_dom *zdom, const void *buf, size_t len,
                  uint32_t access, struct zhpeq_key_data **qkdata_out);
 
 int zhpeq_mr_free(struct zhpeq_dom *zdom, struct zhpeq_key_data *qkdata);
 
+/*
+ * Register n_iov buffers (iov[].addr is a virtual address) with the same
+ * access; qkdata_out[i] receives the key for iov[i]. On failure nothing
+ * stays registered. Backends that can will overlap the driver work.
+ */
+int zhpeq_mr_reg_batch(struct zhpeq_dom *zdom, const struct zhpeq_iov *iov,
+                       size_t n_iov, uint32_t access,
+                       struct zhpeq_key_data **qkdata_out);
+
+enum {
+    ZHPEQ_MEM_HUGE_2M   = 0x1,
+    ZHPEQ_MEM_HUGE_1G   = 0x2,
+    ZHPEQ_MEM_NUMA      = 0x4,
+};
+
+/*
+ * Allocate len bytes of memory that is already registered for all access
+ * types; *qkdata_out covers it and belongs to the allocator, so don't
+ * zhpeq_mr_free() it. HUGE_2M/HUGE_1G ask for hugepages and NUMA for the
+ * caller's node. Memory is not zeroed; allocations up to 1 MiB are
+ * aligned to their size rounded up to a power of two (64 bytes minimum).
+ */
+int zhpeq_mem_alloc(struct zhpeq_dom *zdom, size_t len, uint32_t flags,
+                    void **buf_out, struct zhpeq_key_data **qkdata_out);
+
+int zhpeq_mem_free(struct zhpeq_dom *zdom, void *buf);
+
+/*
+ * With ZHPEQ_MR_CACHE_MAX set, zhpeq_mr_free() leaves idle registrations
+ * cached; call this before unmapping or freeing memory that may have been
+ * registered so stale translations are dropped.
+ */
+int zhpeq_mr_cache_invalidate(struct zhpeq_dom *zdom, const void *buf,
+                              size_t len);
+
 int zhpeq_zmmu_export(struct zhpeq_dom *zdom,
                       const struct zhpeq_key_data *qkdata,
                       void *blob, size_t *blob_len);
@@ -235,11 +346,79 @@ int zhpeq_geti(struct zhpeq *zq, uint32_t qindex, bool fence,
 int zhpeq_nop(struct zhpeq *zq, uint32_t qindex, bool fence,
               void *context);
 
+/*
+ * Scatter/gather transfers: the local and remote lists may be split
+ * differently, but must have the same total length and at most
+ * ZHPEQ_IOV_MAX entries each; all remote segments must be on one peer.
+ * These reserve and commit their own queue entries and produce a single
+ * completion for context; they return -EAGAIN if the queue is full or the
+ * caller still holds an uncommitted zhpeq_reserve() on zq.
+ */
+int zhpeq_putv(struct zhpeq *zq, bool fence,
+               const struct zhpeq_iov *lcl, size_t n_lcl,
+               const struct zhpeq_iov *rem, size_t n_rem, void *context);
+
+int zhpeq_getv(struct zhpeq *zq, bool fence,
+               const struct zhpeq_iov *lcl, size_t n_lcl,
+               const struct zhpeq_iov *rem, size_t n_rem, void *context);
+
 int zhpeq_atomic(struct zhpeq *zq, uint32_t qindex, bool fence, bool retval,
                  enum zhpeq_atomic_size datasize, enum zhpeq_atomic_op op,
                  uint64_t remote_addr, const union zhpeq_atomic *operands,
                  void *context);
 
+/*
+ * Issue n_ents atomics of one size with a single completion. If results
+ * is not NULL, the old values are stored there as a packed array of
+ * uint32_t or uint64_t before the completion is reported. Like
+ * zhpeq_putv(), returns -EAGAIN if the caller still holds an uncommitted
+ * zhpeq_reserve() on zq.
+ */
+int zhpeq_atomicv(struct zhpeq *zq, bool fence,
+                  enum zhpeq_atomic_size datasize,
+                  const struct zhpeq_atomic_ent *ents, size_t n_ents,
+                  void *results, void *context);
+
+/*
+ * Reserve, build, and commit n_ops commands with one reservation, one
+ * context allocation, and one doorbell. All commands are validated before
+ * anything is reserved; returns 0, -EINVAL, or -EAGAIN if the queue is full
+ * or the caller still holds an uncommitted zhpeq_reserve() on zq: commit
+ * that first, since entries are committed in reservation order.
+ */
+int zhpeq_submit_batch(struct zhpeq *zq, const struct zhpeq_op *zops,
+                       size_t n_ops);
+
+/*
+ * Striped transfers over n_zq queues of qlen entries allocated on
+ * successive slices: each transfer is split into chunk-byte pieces
+ * (0 for ZHPEQ_STRIPE_CHUNK or 256 KiB) spread across the queues, and
+ * zhpeq_stripe_cq_read() reports its context once every piece is done.
+ * Pieces that don't fit are posted as completions are read; an error
+ * hit after completions were collected is returned by the next call. A
+ * fenced transfer starts after all earlier ones complete. Use
+ * zhpeq_stripe_zq() for zhpeq_backend_exchange()/open(); the queues carry
+ * no other traffic.
+ */
+struct zhpeq_stripe;
+
+int zhpeq_stripe_alloc(struct zhpeq_dom *zdom, size_t n_zq, int qlen,
+                       int traffic_class, int priority, uint64_t chunk,
+                       struct zhpeq_stripe **zs_out);
+
+int zhpeq_stripe_free(struct zhpeq_stripe *zs);
+
+struct zhpeq *zhpeq_stripe_zq(struct zhpeq_stripe *zs, size_t idx);
+
+int zhpeq_stripe_put(struct zhpeq_stripe *zs, bool fence, uint64_t lcl_addr,
+                     size_t len, uint64_t rem_addr, void *context);
+
+int zhpeq_stripe_get(struct zhpeq_stripe *zs, bool fence, uint64_t lcl_addr,
+                     size_t len, uint64_t rem_addr, void *context);
+
+ssize_t zhpeq_stripe_cq_read(struct zhpeq_stripe *zs,
+                             struct zhpeq_cq_entry *entries, size_t n_entries);
+
 void zhpeq_print_info(struct zhpeq *zq);
 
 struct zhpeq_dom *zhpeq_dom(struct zhpeq *zq);
@@ -253,6 +432,119 @@ bool zhpeq_is_asic(void);
 
 int zhpeq_getaddr(struct zhpeq *zq, void *sa, size_t *sa_len);
 
+/*
+ * Always-on queue counters. ops[] is indexed by enum zhpeq_op_type; the
+ * vector calls count as PUT/GET and zhpeq_atomicv() as one ATOMIC per
+ * element. occupancy[] counts successful zhpeq_reserve() calls by how
+ * full the command queue was, in eighths; cq_read_full counts
+ * zhpeq_cq_read() calls that filled the caller's whole array.
+ * rail_bytes[] splits the bytes a multi-rail backend moved by rail.
+ */
+#define ZHPEQ_STATS_OCC_BUCKETS (8)
+#define ZHPEQ_RAILS_MAX         (4)
+
+struct zhpeq_stats {
+    uint64_t            ops[ZHPEQ_OP_ATOMIC + 1];
+    uint64_t            bytes;
+    uint64_t            fences;
+    uint64_t            fence_stalls;
+    uint64_t            reserve_eagain;
+    uint64_t            cq_entries;
+    uint64_t            cq_errors;
+    uint64_t            cq_read_full;
+    uint64_t            occupancy[ZHPEQ_STATS_OCC_BUCKETS];
+    uint64_t            rail_bytes[ZHPEQ_RAILS_MAX];
+};
+
+/* Domain counters include the queues that have already been freed. */
+int zhpeq_stats_get(struct zhpeq *zq, struct zhpeq_stats *stats);
+
+int zhpeq_domain_stats_get(struct zhpeq_dom *zdom, struct zhpeq_stats *stats);
+
+/*
+ * With ZHPEQ_STATS_SHM=<queues> set, the counters live in the shared
+ * memory object /zhpeq_stats.<pid> (/dev/shm on Linux) so a monitor can
+ * map it read-only and sum them while the job runs. Each queue has one
+ * block for the backend, one per thread, and one shared by any threads
+ * beyond ZHPEQ_STATS_THREADS; a queue's counters are the sum of its
+ * blocks.
+ */
+#define ZHPEQ_STATS_SHM_MAGIC   (0x7473716570687aULL)
+#define ZHPEQ_STATS_SHM_VERSION (2)
+#define ZHPEQ_STATS_THREADS     (16)
+#define ZHPEQ_STATS_BLKS        (ZHPEQ_STATS_THREADS + 2)
+
+union zhpeq_stats_blk {
+    struct zhpeq_stats  s;
+    uint64_t            pad[32];
+};
+
+struct zhpeq_stats_shm_queue {
+    uint64_t            in_use;
+    uint64_t            zq_id;
+    uint64_t            dom_id;
+    uint64_t            pad[5];
+    union zhpeq_stats_blk blk[ZHPEQ_STATS_BLKS];
+};
+
+struct zhpeq_stats_shm {
+    uint64_t            magic;
+    uint32_t            version;
+    uint32_t            n_queues;
+    uint64_t            pad[6];
+    struct zhpeq_stats_shm_queue queue[];
+};
+
+/*
+ * With ZHPE_OFFLOADED_BACKEND_LIBFABRIC_IO_RECORD=<entries> set, each
+ * libfabric engine records every operation it posts and every completion
+ * it writes in a ring in the shared memory object /zhpeq_io.<pid>. Each
+ * engine is the only writer of its ring and bumps idx after filling
+ * rec[idx % ring_ents]; a reader that copies the ring between two loads
+ * of idx can trust the records from the second idx - ring_ents + 1 up to
+ * the first idx. Rings are ring_len bytes apart, starting after the
+ * header; tsc_freq converts timestamps to time.
+ */
+#define ZHPEQ_IO_SHM_MAGIC      (0x6f69716570687aULL)
+#define ZHPEQ_IO_SHM_VERSION    (1)
+
+enum {
+    ZHPEQ_IO_REC_POST   = 1,
+    ZHPEQ_IO_REC_DONE   = 2,
+};
+
+struct zhpeq_io_rec {
+    uint64_t            tsc;
+    uint64_t            seq;
+    uint64_t            zq_id;
+    uint64_t            context;
+    uint64_t            fi_addr;
+    uint64_t            buf;
+    uint64_t            raddr;
+    uint64_t            rkey;
+    uint64_t            len;
+    int32_t             status;
+    uint8_t             type;
+    uint8_t             op;
+    uint16_t            pad;
+};
+
+struct zhpeq_io_ring {
+    uint64_t            idx;
+    uint64_t            pad[7];
+    struct zhpeq_io_rec rec[];
+};
+
+struct zhpeq_io_shm {
+    uint64_t            magic;
+    uint32_t            version;
+    uint32_t            n_rings;
+    uint64_t            ring_ents;
+    uint64_t            ring_len;
+    uint64_t            tsc_freq;
+    uint64_t            pad[3];
+};
+
 _EXTERN_C_END
 
 #endif /* _ZHPEQ_H_ */
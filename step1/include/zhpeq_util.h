@@ -66,8 +66,6 @@
 
 #include <zhpe_externc.h>
 
-#define PRINT_DEBUG printf("zhpe-support Within function: %s in file %s \n", __func__, __FILE__)
-
 _EXTERN_C_BEG
 
 #ifndef likely
@@ -766,6 +764,106 @@ static inline uint64_t get_tsc_freq(void)
     return zhpeq_cycles_freq;
 }
 
+/* Nanoseconds per cycle as 32.32 fixed point. */
+extern uint64_t         zhpeq_ns_mult;
+
+static inline uint64_t cycles_to_ns(uint64_t cycles)
+{
+    return (uint64_t)(((__uint128_t)cycles * zhpeq_ns_mult) >> 32);
+}
+
+/*
+ * A monotonic nanosecond clock with an arbitrary epoch, read from the
+ * calibrated TSC without a system call.
+ */
+static inline uint64_t zhpeq_ns_now(void)
+{
+    return cycles_to_ns(get_cycles(NULL));
+}
+
+/* Function tracing.
+ *
+ * zhpeu_trace() compiles to nothing unless the tree is built with
+ * -DZHPEQ_TRACE=<entries>, where <entries> is a power of 2. In that case,
+ * every tracepoint stores a cycle stamp, the cpu, and a call site index into
+ * a per-thread ring of the last <entries> records; no locks, no syscalls.
+ * If ZHPEQ_TRACE_DIR is set in the environment, each ring is written to
+ * <dir>/<app>.<pid>.<tid>.trace when the thread (or process) exits and can
+ * be decoded with tracedump.py; otherwise, the rings are only visible
+ * from a debugger.
+ */
+
+#ifdef ZHPEQ_TRACE
+
+static_assert(ZHPEQ_TRACE > 0 && !(ZHPEQ_TRACE & (ZHPEQ_TRACE - 1)),
+              "ZHPEQ_TRACE must be a power of 2");
+
+struct zhpeu_trace_site {
+    const char          *func;
+    const char          *file;
+    uint32_t            line;
+    int32_t             id;
+};
+
+struct zhpeu_trace_rec {
+    uint64_t            cycles;
+    uint32_t            site;
+    uint32_t            cpu;
+};
+
+struct zhpeu_trace_ring {
+    uint64_t            idx;
+    struct zhpeu_trace_rec rec[ZHPEQ_TRACE];
+};
+
+extern __thread struct zhpeu_trace_ring *zhpeu_trace_thr;
+
+struct zhpeu_trace_ring *zhpeu_trace_ring_alloc(void);
+
+int32_t zhpeu_trace_site_register(struct zhpeu_trace_site *site);
+
+static inline void zhpeu_trace_site_rec(struct zhpeu_trace_site *site)
+{
+    struct zhpeu_trace_ring *ring = zhpeu_trace_thr;
+    struct zhpeu_trace_rec *rec;
+    int32_t             id;
+    uint32_t            cpu;
+
+    /* Nothing to stamp with until the library constructor has run. */
+    if (unlikely(!zhpeq_cycles_get))
+        return;
+    if (unlikely(!ring)) {
+        ring = zhpeu_trace_ring_alloc();
+        if (!ring)
+            return;
+    }
+    id = atm_load_rlx(&site->id);
+    if (unlikely(id <= 0))
+        id = zhpeu_trace_site_register(site);
+    rec = &ring->rec[ring->idx & (ZHPEQ_TRACE - 1)];
+    rec->cycles = get_cycles(&cpu);
+    rec->site = id;
+    rec->cpu = cpu;
+    ring->idx++;
+}
+
+#define zhpeu_trace()                                           \
+do {                                                            \
+    static struct zhpeu_trace_site __site = {                   \
+        .func           = __func__,                             \
+        .file           = __FILE__,                             \
+        .line           = __LINE__,                             \
+    };                                                          \
+                                                                \
+    zhpeu_trace_site_rec(&__site);                              \
+} while (0)
+
+#else
+
+#define zhpeu_trace()   do {} while (0)
+
+#endif
+
 #define abort_syscall(_func, ...)                               \
 do {                                                            \
     int                 __ret = _func(__VA_ARGS__);             \
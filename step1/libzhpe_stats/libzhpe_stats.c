@@ -36,7 +36,9 @@
 
 #include <zhpeq_util.h>
 
-#include <zhpe_offlaoded_stats_types.h>
+#include <zhpe_offloaded_stats_types.h>
+
+#include <linux/perf_event.h>
 
 #include <sys/syscall.h>
 
@@ -64,6 +66,12 @@ struct zhpe_offloaded_stats {
     struct zhpe_offloaded_stats_delta *delta;
     struct zhpe_offloaded_stats_delta *delta_paused;
     struct zhpe_offloaded_stats_delta *delta_free;
+    struct stats_hist   *hist;
+    struct stats_perf   *perf;
+    char                *map;
+    uint64_t            map_len;
+    uint64_t            map_off;
+    uint64_t            map_pos;
     uint64_t            buf_len;
     char                buf[0];
 };
@@ -123,11 +131,11 @@ static struct zhpe_offloaded_stats_ops zhpe_offloaded_stats_nops = {
 
 struct zhpe_offloaded_stats_ops *zhpe_offloaded_stats_ops = &zhpe_offloaded_stats_nops;
 
-#ifdef HAVE_ZHPE_OFFLOADED_SIM
-
 #include <zhpe_offloaded_stats.h>
 
+#ifdef HAVE_ZHPE_OFFLOADED_SIM
 #include <hpe_sim_api_linux64.h>
+#endif
 
 #ifdef LIKWID_PERFMON
 #include <likwid.h>
@@ -140,11 +148,15 @@ struct zhpe_offloaded_stats_ops *zhpe_offloaded_stats_ops = &zhpe_offloaded_stat
 
 /* Common defintions/code */
 
+/* Records are appended to a window of the stats file mapped this size. */
+#define STATS_MAP_LEN   (1024 * 1024)
+
 static char             *zhpe_offloaded_stats_dir;
 static char             *zhpe_offloaded_stats_unique;
 static pthread_key_t    zhpe_offloaded_stats_key;
 static pthread_mutex_t  zhpe_offloaded_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
 static bool             zhpe_offloaded_stats_init_once;
+static uint64_t         zhpe_offloaded_stats_map_len = STATS_MAP_LEN;
 
 static inline struct zhpe_offloaded_stats_extra *
 stats_cmn_extra(struct zhpe_offloaded_stats *stats, void *buf)
@@ -173,6 +185,8 @@ static const char *stats_cmn_state_str(uint8_t state)
 }
 #endif
 
+#ifdef HAVE_ZHPE_OFFLOADED_SIM
+
 static void stats_cmn_stats_sub(struct zhpe_offloaded_stats *stats, char *old, char *new)
 {
     size_t              o;
@@ -253,6 +267,8 @@ static void stats_cmn_update_stats(struct zhpe_offloaded_stats *stats)
     memcpy(old, new, stats->buf_len);
 }
 
+#endif
+
 static struct zhpe_offloaded_stats_delta *
 stats_cmn_delta_find(struct zhpe_offloaded_stats *stats,
                      struct zhpe_offloaded_stats_delta **list, uint32_t subid,
@@ -272,16 +288,41 @@ stats_cmn_delta_find(struct zhpe_offloaded_stats *stats,
     return ret;
 }
 
-static inline void stats_cmn_buf_write(struct zhpe_offloaded_stats *stats, void *buf)
+/*
+ * Slide the mapped window of the stats file forward to the next record.
+ * The old window is only scheduled for writeback; the kernel flushes it
+ * while the thread carries on.
+ */
+static void stats_cmn_map(struct zhpe_offloaded_stats *stats)
 {
-    ssize_t             res;
+    uint64_t            off = stats->map_off + stats->map_pos;
+    int                 err;
 
-    res = write(stats->fd, buf, stats->buf_len);
-    if (check_func_ion(__func__, __LINE__, "write", stats->buf_len, false,
-                       stats->buf_len, res, 0) < 0)
+    if (stats->map) {
+        msync(stats->map, stats->map_len, MS_ASYNC);
+        munmap(stats->map, stats->map_len);
+    }
+    stats->map_off = off & ~((uint64_t)page_size - 1);
+    stats->map_pos = off - stats->map_off;
+    if (ftruncate(stats->fd, stats->map_off + stats->map_len) == -1) {
+        print_func_errn(__func__, __LINE__, "ftruncate",
+                        stats->map_off + stats->map_len, false, -errno);
+        abort();
+    }
+    stats->map = do_mmap(NULL, stats->map_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, stats->fd, stats->map_off, &err);
+    if (!stats->map)
         abort();
 }
 
+static inline void stats_cmn_buf_write(struct zhpe_offloaded_stats *stats, void *buf)
+{
+    if (unlikely(stats->map_pos + stats->buf_len > stats->map_len))
+        stats_cmn_map(stats);
+    memcpy(stats->map + stats->map_pos, buf, stats->buf_len);
+    stats->map_pos += stats->buf_len;
+}
+
 static inline void stats_cmn_delta_write(struct zhpe_offloaded_stats *stats,
                                          struct zhpe_offloaded_stats_delta *delta)
 {
@@ -344,6 +385,13 @@ static void stats_cmn_close(struct zhpe_offloaded_stats *stats)
 
     abort_posix(pthread_setspecific, zhpe_offloaded_stats_key, NULL);
 
+    if (stats->map) {
+        munmap(stats->map, stats->map_len);
+        /* Drop the unused tail of the last window. */
+        if (ftruncate(stats->fd, stats->map_off + stats->map_pos) == -1)
+            print_func_errn(__func__, __LINE__, "ftruncate",
+                            stats->map_off + stats->map_pos, false, -errno);
+    }
     if (stats->fd != -1)
         close(stats->fd);
 
@@ -366,7 +414,7 @@ static void stats_cmn_close(struct zhpe_offloaded_stats *stats)
     free(stats);
 }
 
-static void stats_cmn_open(uint16_t uid, size_t buf_len)
+static void stats_cmn_open(uint16_t uid, size_t buf_len, bool map)
 {
     char                *fname = NULL;
     struct zhpe_offloaded_stats   *stats;
@@ -392,6 +440,13 @@ static void stats_cmn_open(uint16_t uid, size_t buf_len)
         print_func_err(__func__, __LINE__, "open", fname, -errno);
         abort();
     }
+    if (map) {
+        /* Room for a record that starts anywhere in the first page. */
+        stats->map_len = roundup64(zhpe_offloaded_stats_map_len, page_size);
+        if (stats->map_len < roundup64(buf_len, page_size) + page_size)
+            stats->map_len = roundup64(buf_len, page_size) + page_size;
+        stats_cmn_map(stats);
+    }
 
     abort_posix(pthread_setspecific, zhpe_offloaded_stats_key, stats);
     stats->state = ZHPE_OFFLOADED_STATS_STOPPED;
@@ -422,131 +477,18 @@ static void stats_cmn_disable(void)
     stats->enabled = false;
 }
 
-/* Carbon code */
-
-static void sim_check_rec(struct zhpe_offloaded_stats *stats)
-{
-    static bool         once = false;
-    size_t              rlen;
-    ProcCtlData         *procp;
-    CacheData           *cachep;
-
-    if (once)
-        return;
-
-    rlen = sizeof(*procp) + sizeof(*cachep) + sizeof(struct zhpe_offloaded_stats_extra);
-    if (stats->buf_len != rlen) {
-        print_err("%s,%u:Unexpected record length %lu != %lu\n",
-                  __func__, __LINE__, stats->buf_len, rlen);
-        abort();
-    }
-
-    procp = (void *)stats->buf;
-    if (procp->header.version != DATA_REC_VER ||
-        procp->header.id.val != PROC_DATA_ID) {
-        print_err("%s,%u:ProcCtlData version/id 0x%02x/0x%04x "
-                  "!= 0x%02x/0x%04x\n", __func__, __LINE__,
-                  procp->header.version, procp->header.id.val,
-                  DATA_REC_VER, PROC_DATA_ID);
-        abort();
-    }
-
-    cachep = (void *)(stats->buf + sizeof(*procp));
-    if (cachep->header.version != DATA_REC_VER ||
-        cachep->header.id.val != DATA_REC_CACHE_ID) {
-        print_err("%s,%u:CacheData version/id 0x%02x/0x%04x "
-                  "!= 0x%02x/0x%04x\n", __func__, __LINE__,
-                  cachep->header.version, cachep->header.id.val,
-                  DATA_REC_VER, DATA_REC_CACHE_ID);
-        abort();
-    }
-}
-
-static void sim_start(struct zhpe_offloaded_stats *stats)
-{
-    /* Init/save snapshot for next time. */
-    if (stats->state == ZHPE_OFFLOADED_STATS_STOPPED)
-        memset(stats->buf, 0, 2 * stats->buf_len);
-   if (sim_api_data_rec(DATA_REC_START, stats->uid, (uintptr_t)stats->buf)) {
-        print_func_err(__func__, __LINE__, "sim_api_data_rec",
-                       "DATA_REC_START", -EINVAL);
-        abort();
-    }
-    stats_cmn_extra(stats, stats->buf)->starts++;
-    stats->state = ZHPE_OFFLOADED_STATS_RUNNING;
-}
-
-static void sim_stop(struct zhpe_offloaded_stats *stats)
-{
-    if (sim_api_data_rec(DATA_REC_STOP, stats->uid, (uintptr_t)stats->buf)) {
-        print_func_err(__func__, __LINE__, "sim_api_data_rec",
-                       "DATA_REC_STOP", -EINVAL);
-        abort();
-    }
-    stats->state = ZHPE_OFFLOADED_STATS_STOPPED;
-
-    sim_check_rec(stats);
-    stats_cmn_update_stats(stats);
-}
-
-#if 0
-static void sim_pause(struct zhpe_offloaded_stats *stats)
-{
-    if (sim_api_data_rec(DATA_REC_PAUSE, stats->uid, (uintptr_t)stats->buf)) {
-        print_func_err(__func__, __LINE__, "sim_api_data_rec",
-                       "DATA_REC_STOP", -EINVAL);
-        abort();
-    }
-    stats->state = ZHPE_OFFLOADED_STATS_PAUSED;
-    stats_cmn_extra(stats, stats->buf)->pauses++;
-}
-#endif
-
-static void sim_close(struct zhpe_offloaded_stats *stats)
-{
-    if (sim_api_data_rec(DATA_REC_END, stats->uid, (uintptr_t)stats->buf))
-        print_func_err(__func__, __LINE__, "sim_api_data_rec",
-                       "DATA_REC_END", -EINVAL);
-    stats_cmn_close(stats);
-}
-
-static void stats_sim_close(void)
-{
-    struct zhpe_offloaded_stats   *stats;
-
-    stats = pthread_getspecific(zhpe_offloaded_stats_key);
-    if (!stats)
-        return;
-    sim_close(stats);
-}
-
-static void stats_sim_open(uint16_t uid)
-{
-    uint64_t            buf_len;
-    struct zhpe_offloaded_stats   *stats;
-
-    stats = pthread_getspecific(zhpe_offloaded_stats_key);
-    if (stats) {
-        if (stats->uid == uid)
-            return;
-        print_err("%s,%u:tid %ld, uid 0x%03x active, cannot open 0x%03x\n",
-                  __func__, __LINE__, syscall(SYS_gettid), stats->uid, uid);
-        abort();
-    }
-    if (sim_api_data_rec(DATA_REC_CREAT, uid, (uintptr_t)&buf_len)) {
-        print_func_err(__func__, __LINE__, "sim_api_data_rec",
-                       "DATA_REC_CREAT", -EINVAL);
-        abort();
-    }
-    stats_cmn_open(uid, buf_len);
-}
+/*
+ * Nesting: each running subid has a delta that every counter update is
+ * added to; hw_start()/hw_stop() resume and stop the counters.
+ */
 
-static void stats_sim_pause_all(struct zhpe_offloaded_stats *stats)
+static void stats_cmn_pause_all(struct zhpe_offloaded_stats *stats)
 {
     stats->pause_all = true;
 }
 
-static void stats_sim_restart_all(void)
+static void
+stats_cmn_restart_all(void (*hw_start)(struct zhpe_offloaded_stats *stats))
 {
     struct zhpe_offloaded_stats   *stats;
 
@@ -561,10 +503,11 @@ static void stats_sim_restart_all(void)
     stats->pause_all = false;
 
     if (stats->delta)
-        sim_start(stats);
+        hw_start(stats);
 }
 
-static struct zhpe_offloaded_stats *stats_sim_stop_counters(void)
+static struct zhpe_offloaded_stats *
+stats_cmn_stop_counters(void (*hw_stop)(struct zhpe_offloaded_stats *stats))
 {
     struct zhpe_offloaded_stats   *stats;
 
@@ -575,12 +518,13 @@ static struct zhpe_offloaded_stats *stats_sim_stop_counters(void)
         return NULL;
 
     if (stats->state != ZHPE_OFFLOADED_STATS_STOPPED)
-        sim_stop(stats);
+        hw_stop(stats);
 
     return stats;
 }
 
-static void stats_sim_start(struct zhpe_offloaded_stats *stats, uint32_t subid)
+static void stats_cmn_start(struct zhpe_offloaded_stats *stats, uint32_t subid,
+                            void (*hw_start)(struct zhpe_offloaded_stats *stats))
 {
     struct zhpe_offloaded_stats_delta *active;
 
@@ -601,10 +545,11 @@ static void stats_sim_start(struct zhpe_offloaded_stats *stats, uint32_t subid)
         stats_cmn_delta_alloc(stats, subid);
 
  do_start:
-    sim_start(stats);
+    hw_start(stats);
 }
 
-static void stats_sim_stop(struct zhpe_offloaded_stats *stats, uint32_t subid)
+static void stats_cmn_stop(struct zhpe_offloaded_stats *stats, uint32_t subid,
+                           void (*hw_start)(struct zhpe_offloaded_stats *stats))
 {
     struct zhpe_offloaded_stats_delta *active;
     struct zhpe_offloaded_stats_delta *delta;
@@ -632,10 +577,10 @@ static void stats_sim_stop(struct zhpe_offloaded_stats *stats, uint32_t subid)
 
  do_start:
     if (stats->delta)
-        sim_start(stats);
+        hw_start(stats);
 }
 
-static void stats_sim_stop_all(struct zhpe_offloaded_stats *stats)
+static void stats_cmn_stop_all(struct zhpe_offloaded_stats *stats)
 {
     struct zhpe_offloaded_stats_delta *delta;
     struct zhpe_offloaded_stats_delta *next;
@@ -652,7 +597,8 @@ static void stats_sim_stop_all(struct zhpe_offloaded_stats *stats)
     }
 }
 
-static void stats_sim_pause(struct zhpe_offloaded_stats *stats, uint32_t subid)
+static void stats_cmn_pause(struct zhpe_offloaded_stats *stats, uint32_t subid,
+                            void (*hw_start)(struct zhpe_offloaded_stats *stats))
 {
     struct zhpe_offloaded_stats_delta *active;
     struct zhpe_offloaded_stats_delta *delta;
@@ -677,76 +623,222 @@ static void stats_sim_pause(struct zhpe_offloaded_stats *stats, uint32_t subid)
 
  do_start:
     if (stats->delta)
-        sim_start(stats);
+        hw_start(stats);
 }
 
-static void stats_sim_finalize(void)
-{
-    /* Delete all trackers. */
-    sim_api_data_rec(DATA_REC_START, -2, (uintptr_t)NULL);
+/* Carbon code */
 
-    mutex_lock(&zhpe_offloaded_stats_mutex);
-    stats_cmn_finalize();
-    mutex_unlock(&zhpe_offloaded_stats_mutex);
-}
+#ifdef HAVE_ZHPE_OFFLOADED_SIM
 
-static void stats_sim_key_destructor(void *vstats)
+static void sim_check_rec(struct zhpe_offloaded_stats *stats)
 {
-    struct zhpe_offloaded_stats   *stats = vstats;
+    static bool         once = false;
+    size_t              rlen;
+    ProcCtlData         *procp;
+    CacheData           *cachep;
 
-    if (!stats)
+    if (once)
         return;
 
-    if (!stats->enabled)
-        return;
+    rlen = sizeof(*procp) + sizeof(*cachep) + sizeof(struct zhpe_offloaded_stats_extra);
+    if (stats->buf_len != rlen) {
+        print_err("%s,%u:Unexpected record length %lu != %lu\n",
+                  __func__, __LINE__, stats->buf_len, rlen);
+        abort();
+    }
 
-    sim_close(stats);
+    procp = (void *)stats->buf;
+    if (procp->header.version != DATA_REC_VER ||
+        procp->header.id.val != PROC_DATA_ID) {
+        print_err("%s,%u:ProcCtlData version/id 0x%02x/0x%04x "
+                  "!= 0x%02x/0x%04x\n", __func__, __LINE__,
+                  procp->header.version, procp->header.id.val,
+                  DATA_REC_VER, PROC_DATA_ID);
+        abort();
+    }
+
+    cachep = (void *)(stats->buf + sizeof(*procp));
+    if (cachep->header.version != DATA_REC_VER ||
+        cachep->header.id.val != DATA_REC_CACHE_ID) {
+        print_err("%s,%u:CacheData version/id 0x%02x/0x%04x "
+                  "!= 0x%02x/0x%04x\n", __func__, __LINE__,
+                  cachep->header.version, cachep->header.id.val,
+                  DATA_REC_VER, DATA_REC_CACHE_ID);
+        abort();
+    }
 }
 
-static void stats_sim_stamp(struct zhpe_offloaded_stats *stats, uint32_t subid,
-                            uint32_t items, uint64_t *data)
+static void sim_start(struct zhpe_offloaded_stats *stats)
 {
-    char                *clock = stats->buf + 2 * stats->buf_len;
-    size_t              o;
-    size_t              n;
-    uint64_t            *u64np;
-    char                buf[stats->buf_len];
-    struct zhpe_offloaded_stats_extra *extra = stats_cmn_extra(stats, buf);;
-
-    /* Fill in instruction counts amd extra from clock data. */
-    memcpy(buf, clock, sizeof(ProcCtlData));
-    memcpy(extra, stats_cmn_extra(stats, clock), sizeof(*extra));
-
-    /* Put user data in CacheData. */
-    o = offsetof(CacheData, coherencyCastoutDataL1);
-    n = ((sizeof(CacheData) - o) / sizeof(*u64np));
-    u64np = (void *)(buf + sizeof(ProcCtlData) + o);
-    if (items > n)
-        items = n;
-    n -= items;
-    for (; items > 0; items--, u64np++, data++)
-        *u64np = *data;
-    for (; n > 0; n--, u64np++)
-        *u64np = 0;
+    /* Init/save snapshot for next time. */
+    if (stats->state == ZHPE_OFFLOADED_STATS_STOPPED)
+        memset(stats->buf, 0, 2 * stats->buf_len);
+   if (sim_api_data_rec(DATA_REC_START, stats->uid, (uintptr_t)stats->buf)) {
+        print_func_err(__func__, __LINE__, "sim_api_data_rec",
+                       "DATA_REC_START", -EINVAL);
+        abort();
+    }
+    stats_cmn_extra(stats, stats->buf)->starts++;
+    stats->state = ZHPE_OFFLOADED_STATS_RUNNING;
+}
 
-    extra->subid = subid;
-    if (stats->delta)
-        extra->nesting = stats_cmn_extra(stats, stats->delta->buf)->nesting + 1;
-    stats_cmn_buf_write(stats, buf);
+static void sim_stop(struct zhpe_offloaded_stats *stats)
+{
+    if (sim_api_data_rec(DATA_REC_STOP, stats->uid, (uintptr_t)stats->buf)) {
+        print_func_err(__func__, __LINE__, "sim_api_data_rec",
+                       "DATA_REC_STOP", -EINVAL);
+        abort();
+    }
+    stats->state = ZHPE_OFFLOADED_STATS_STOPPED;
 
-    /* Restart I/O, if active. */
-    if (stats->delta)
-        sim_start(stats);
+    sim_check_rec(stats);
+    stats_cmn_update_stats(stats);
 }
 
-static struct zhpe_offloaded_stats_ops stats_ops_sim = {
-    .open               = stats_sim_open,
-    .close              = stats_sim_close,
-    .enable             = stats_cmn_enable,
+#if 0
+static void sim_pause(struct zhpe_offloaded_stats *stats)
+{
+    if (sim_api_data_rec(DATA_REC_PAUSE, stats->uid, (uintptr_t)stats->buf)) {
+        print_func_err(__func__, __LINE__, "sim_api_data_rec",
+                       "DATA_REC_STOP", -EINVAL);
+        abort();
+    }
+    stats->state = ZHPE_OFFLOADED_STATS_PAUSED;
+    stats_cmn_extra(stats, stats->buf)->pauses++;
+}
+#endif
+
+static void sim_close(struct zhpe_offloaded_stats *stats)
+{
+    if (sim_api_data_rec(DATA_REC_END, stats->uid, (uintptr_t)stats->buf))
+        print_func_err(__func__, __LINE__, "sim_api_data_rec",
+                       "DATA_REC_END", -EINVAL);
+    stats_cmn_close(stats);
+}
+
+static void stats_sim_close(void)
+{
+    struct zhpe_offloaded_stats   *stats;
+
+    stats = pthread_getspecific(zhpe_offloaded_stats_key);
+    if (!stats)
+        return;
+    sim_close(stats);
+}
+
+static void stats_sim_open(uint16_t uid)
+{
+    uint64_t            buf_len;
+    struct zhpe_offloaded_stats   *stats;
+
+    stats = pthread_getspecific(zhpe_offloaded_stats_key);
+    if (stats) {
+        if (stats->uid == uid)
+            return;
+        print_err("%s,%u:tid %ld, uid 0x%03x active, cannot open 0x%03x\n",
+                  __func__, __LINE__, syscall(SYS_gettid), stats->uid, uid);
+        abort();
+    }
+    if (sim_api_data_rec(DATA_REC_CREAT, uid, (uintptr_t)&buf_len)) {
+        print_func_err(__func__, __LINE__, "sim_api_data_rec",
+                       "DATA_REC_CREAT", -EINVAL);
+        abort();
+    }
+    stats_cmn_open(uid, buf_len, true);
+}
+
+static void stats_sim_restart_all(void)
+{
+    stats_cmn_restart_all(sim_start);
+}
+
+static struct zhpe_offloaded_stats *stats_sim_stop_counters(void)
+{
+    return stats_cmn_stop_counters(sim_stop);
+}
+
+static void stats_sim_start(struct zhpe_offloaded_stats *stats, uint32_t subid)
+{
+    stats_cmn_start(stats, subid, sim_start);
+}
+
+static void stats_sim_stop(struct zhpe_offloaded_stats *stats, uint32_t subid)
+{
+    stats_cmn_stop(stats, subid, sim_start);
+}
+
+static void stats_sim_pause(struct zhpe_offloaded_stats *stats, uint32_t subid)
+{
+    stats_cmn_pause(stats, subid, sim_start);
+}
+
+static void stats_sim_finalize(void)
+{
+    /* Delete all trackers. */
+    sim_api_data_rec(DATA_REC_START, -2, (uintptr_t)NULL);
+
+    mutex_lock(&zhpe_offloaded_stats_mutex);
+    stats_cmn_finalize();
+    mutex_unlock(&zhpe_offloaded_stats_mutex);
+}
+
+static void stats_sim_key_destructor(void *vstats)
+{
+    struct zhpe_offloaded_stats   *stats = vstats;
+
+    if (!stats)
+        return;
+
+    if (!stats->enabled)
+        return;
+
+    sim_close(stats);
+}
+
+static void stats_sim_stamp(struct zhpe_offloaded_stats *stats, uint32_t subid,
+                            uint32_t items, uint64_t *data)
+{
+    char                *clock = stats->buf + 2 * stats->buf_len;
+    size_t              o;
+    size_t              n;
+    uint64_t            *u64np;
+    char                buf[stats->buf_len];
+    struct zhpe_offloaded_stats_extra *extra = stats_cmn_extra(stats, buf);;
+
+    /* Fill in instruction counts amd extra from clock data. */
+    memcpy(buf, clock, sizeof(ProcCtlData));
+    memcpy(extra, stats_cmn_extra(stats, clock), sizeof(*extra));
+
+    /* Put user data in CacheData. */
+    o = offsetof(CacheData, coherencyCastoutDataL1);
+    n = ((sizeof(CacheData) - o) / sizeof(*u64np));
+    u64np = (void *)(buf + sizeof(ProcCtlData) + o);
+    if (items > n)
+        items = n;
+    n -= items;
+    for (; items > 0; items--, u64np++, data++)
+        *u64np = *data;
+    for (; n > 0; n--, u64np++)
+        *u64np = 0;
+
+    extra->subid = subid;
+    if (stats->delta)
+        extra->nesting = stats_cmn_extra(stats, stats->delta->buf)->nesting + 1;
+    stats_cmn_buf_write(stats, buf);
+
+    /* Restart I/O, if active. */
+    if (stats->delta)
+        sim_start(stats);
+}
+
+static struct zhpe_offloaded_stats_ops stats_ops_sim = {
+    .open               = stats_sim_open,
+    .close              = stats_sim_close,
+    .enable             = stats_cmn_enable,
     .disable            = stats_cmn_disable,
     .stop_counters      = stats_sim_stop_counters,
-    .stop_all           = stats_sim_stop_all,
-    .pause_all          = stats_sim_pause_all,
+    .stop_all           = stats_cmn_stop_all,
+    .pause_all          = stats_cmn_pause_all,
     .restart_all        = stats_sim_restart_all,
     .start              = stats_sim_start,
     .stop               = stats_sim_stop,
@@ -756,6 +848,8 @@ static struct zhpe_offloaded_stats_ops stats_ops_sim = {
     .stamp              = stats_sim_stamp,
 };
 
+#endif
+
 /* LIKWID code */
 
 #ifdef LIKWID_PERFMON
@@ -833,9 +927,683 @@ static struct zhpe_offloaded_stats_ops stats_ops_likwid = {
 
 #endif
 
+/* perf_event code */
+
+/*
+ * Counters are opened per thread as a group and read from user space
+ * with rdpmc through each event's mmap page; if the kernel does not
+ * allow rdpmc, the group is read with one read() instead. Records are
+ * the counter deltas followed by the usual extra data; unpackdata.py -p
+ * decodes them, so keep it in step with perf_events[].
+ */
+
+static const struct {
+    uint32_t            type;
+    uint64_t            config;
+} perf_events[] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+#define PERF_EVENTS     ARRAY_SIZE(perf_events)
+
+struct stats_perf {
+    int                 fd[PERF_EVENTS];
+    struct perf_event_mmap_page *pc[PERF_EVENTS];
+    bool                rdpmc;
+};
+
+static int perf_event_open(struct perf_event_attr *attr, int group_fd)
+{
+    return syscall(SYS_perf_event_open, attr, 0, -1, group_fd, 0);
+}
+
+static int perf_open_one(size_t i, int group_fd)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = perf_events[i].type;
+    attr.config = perf_events[i].config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+
+    return perf_event_open(&attr, group_fd);
+}
+
+static bool perf_probe(void)
+{
+    int                 fd;
+
+    fd = perf_open_one(0, -1);
+    if (fd == -1)
+        return false;
+    close(fd);
+
+    return true;
+}
+
+static inline uint64_t perf_rdpmc(uint32_t counter)
+{
+    uint32_t            lo;
+    uint32_t            hi;
+
+    asm volatile("rdpmc" : "=a" (lo), "=d" (hi) : "c" (counter));
+
+    return (((uint64_t)hi << 32) | lo);
+}
+
+static inline uint64_t perf_read_one(struct perf_event_mmap_page *pc)
+{
+    uint64_t            ret;
+    uint64_t            pmc;
+    uint32_t            seq;
+    uint32_t            idx;
+    uint32_t            shift;
+
+    do {
+        seq = atm_load(&pc->lock);
+        idx = pc->index;
+        ret = pc->offset;
+        if (likely(pc->cap_user_rdpmc && idx)) {
+            shift = 64 - pc->pmc_width;
+            pmc = perf_rdpmc(idx - 1) << shift;
+            ret += (int64_t)pmc >> shift;
+        }
+        smp_rmb();
+    } while (unlikely(atm_load_rlx(&pc->lock) != seq));
+
+    return ret;
+}
+
+static void perf_read(struct zhpe_offloaded_stats *stats, uint64_t *val)
+{
+    struct stats_perf   *perf = stats->perf;
+    uint64_t            buf[PERF_EVENTS + 1];
+    ssize_t             res;
+    size_t              i;
+
+    if (likely(perf->rdpmc)) {
+        for (i = 0; i < PERF_EVENTS; i++)
+            val[i] = perf_read_one(perf->pc[i]);
+        return;
+    }
+    memset(val, 0, PERF_EVENTS * sizeof(*val));
+    if (perf->fd[0] == -1)
+        return;
+    /* Group format: the count of events, then the values. */
+    res = read(perf->fd[0], buf, sizeof(buf));
+    if (res < (ssize_t)sizeof(buf[0]))
+        return;
+    for (i = 0; i < PERF_EVENTS && i < buf[0]; i++)
+        val[i] = buf[i + 1];
+}
+
+static void perf_stats_sub(struct zhpe_offloaded_stats *stats, char *old, char *new)
+{
+    size_t              n;
+    uint64_t            *u64op = (void *)old;
+    uint64_t            *u64np = (void *)new;
+    uint32_t            *u32op;
+    uint32_t            *u32np;
+
+    /* old = new - old */
+    for (n = PERF_EVENTS; n > 0; n--, u64op++, u64np++)
+        *u64op = *u64np - *u64op;
+
+    n = offsetof(struct zhpe_offloaded_stats_extra, subid) / sizeof(*u32np);
+    u32op = (void *)stats_cmn_extra(stats, old);
+    u32np = (void *)stats_cmn_extra(stats, new);
+    for (; n > 0; n--, u32op++, u32np++)
+        *u32op = *u32np - *u32op;
+}
+
+static void perf_stats_add(struct zhpe_offloaded_stats *stats, char *old, char *new)
+{
+    size_t              n;
+    uint64_t            *u64op = (void *)old;
+    uint64_t            *u64np = (void *)new;
+    uint32_t            *u32op;
+    uint32_t            *u32np;
+
+    /* old = new + old */
+    for (n = PERF_EVENTS; n > 0; n--, u64op++, u64np++)
+        *u64op = *u64np + *u64op;
+
+    n = offsetof(struct zhpe_offloaded_stats_extra, subid) / sizeof(*u32np);
+    u32op = (void *)stats_cmn_extra(stats, old);
+    u32np = (void *)stats_cmn_extra(stats, new);
+    for (; n > 0; n--, u32op++, u32np++)
+        *u32op = *u32np + *u32op;
+}
+
+static void perf_start(struct zhpe_offloaded_stats *stats)
+{
+    char                *new = stats->buf;
+    char                *old = stats->buf + stats->buf_len;
+
+    if (stats->state == ZHPE_OFFLOADED_STATS_STOPPED)
+        memset(stats->buf, 0, 2 * stats->buf_len);
+    /* The counters never stop; snapshot them so the gap is not counted. */
+    perf_read(stats, (uint64_t *)new);
+    memcpy(old, new, stats->buf_len);
+    stats_cmn_extra(stats, new)->starts++;
+    stats->state = ZHPE_OFFLOADED_STATS_RUNNING;
+}
+
+static void perf_stop(struct zhpe_offloaded_stats *stats)
+{
+    char                *new = stats->buf;
+    char                *old = stats->buf + stats->buf_len;
+    struct zhpe_offloaded_stats_delta *delta;
+
+    perf_read(stats, (uint64_t *)new);
+    stats->state = ZHPE_OFFLOADED_STATS_STOPPED;
+
+    /* Same bookkeeping as stats_cmn_update_stats(). */
+    perf_stats_sub(stats, old, new);
+    for (delta = stats->delta; delta; delta = delta->next)
+        perf_stats_add(stats, delta->buf, old);
+    perf_stats_add(stats, old + stats->buf_len, old);
+    memcpy(old, new, stats->buf_len);
+}
+
+static void perf_close(struct zhpe_offloaded_stats *stats)
+{
+    struct stats_perf   *perf = stats->perf;
+    size_t              i;
+
+    for (i = PERF_EVENTS; i > 0; i--) {
+        if (perf->pc[i - 1])
+            munmap(perf->pc[i - 1], page_size);
+        if (perf->fd[i - 1] != -1)
+            close(perf->fd[i - 1]);
+    }
+    free(perf);
+    stats_cmn_close(stats);
+}
+
+static void stats_perf_close(void)
+{
+    struct zhpe_offloaded_stats   *stats;
+
+    stats = pthread_getspecific(zhpe_offloaded_stats_key);
+    if (!stats)
+        return;
+    perf_close(stats);
+}
+
+static void stats_perf_open(uint16_t uid)
+{
+    struct zhpe_offloaded_stats   *stats;
+    struct stats_perf   *perf;
+    size_t              i;
+    int                 err;
+
+    stats = pthread_getspecific(zhpe_offloaded_stats_key);
+    if (stats) {
+        if (stats->uid == uid)
+            return;
+        print_err("%s,%u:tid %ld, uid 0x%03x active, cannot open 0x%03x\n",
+                  __func__, __LINE__, syscall(SYS_gettid), stats->uid, uid);
+        abort();
+    }
+    stats_cmn_open(uid, PERF_EVENTS * sizeof(uint64_t), true);
+    stats = pthread_getspecific(zhpe_offloaded_stats_key);
+    perf = calloc(1, sizeof(*perf));
+    if (!perf)
+        abort();
+    stats->perf = perf;
+    for (i = 0; i < PERF_EVENTS; i++)
+        perf->fd[i] = -1;
+
+    /* A thread that cannot get counters records zeros. */
+    perf->rdpmc = true;
+    for (i = 0; i < PERF_EVENTS; i++) {
+        perf->fd[i] = perf_open_one(i, perf->fd[0]);
+        if (perf->fd[i] == -1) {
+            print_func_err(__func__, __LINE__, "perf_event_open", "",
+                           -errno);
+            perf->rdpmc = false;
+            break;
+        }
+        perf->pc[i] = do_mmap(NULL, page_size, PROT_READ, MAP_SHARED,
+                              perf->fd[i], 0, &err);
+        if (!perf->pc[i] || !perf->pc[i]->cap_user_rdpmc)
+            perf->rdpmc = false;
+    }
+}
+
+static void stats_perf_restart_all(void)
+{
+    stats_cmn_restart_all(perf_start);
+}
+
+static struct zhpe_offloaded_stats *stats_perf_stop_counters(void)
+{
+    return stats_cmn_stop_counters(perf_stop);
+}
+
+static void stats_perf_start(struct zhpe_offloaded_stats *stats, uint32_t subid)
+{
+    stats_cmn_start(stats, subid, perf_start);
+}
+
+static void stats_perf_stop(struct zhpe_offloaded_stats *stats, uint32_t subid)
+{
+    stats_cmn_stop(stats, subid, perf_start);
+}
+
+static void stats_perf_pause(struct zhpe_offloaded_stats *stats, uint32_t subid)
+{
+    stats_cmn_pause(stats, subid, perf_start);
+}
+
+static void stats_perf_finalize(void)
+{
+    mutex_lock(&zhpe_offloaded_stats_mutex);
+    stats_cmn_finalize();
+    mutex_unlock(&zhpe_offloaded_stats_mutex);
+}
+
+static void stats_perf_key_destructor(void *vstats)
+{
+    struct zhpe_offloaded_stats   *stats = vstats;
+
+    if (!stats)
+        return;
+
+    if (!stats->enabled)
+        return;
+
+    perf_close(stats);
+}
+
+static void stats_perf_stamp(struct zhpe_offloaded_stats *stats, uint32_t subid,
+                             uint32_t items, uint64_t *data)
+{
+    char                *clock = stats->buf + 2 * stats->buf_len;
+    char                buf[stats->buf_len];
+    struct zhpe_offloaded_stats_extra *extra = stats_cmn_extra(stats, buf);
+    uint64_t            *u64np = (void *)buf;
+    size_t              n = PERF_EVENTS;
+
+    /* User data replaces the counters; extra comes from the clock. */
+    memcpy(extra, stats_cmn_extra(stats, clock), sizeof(*extra));
+    if (items > n)
+        items = n;
+    n -= items;
+    for (; items > 0; items--, u64np++, data++)
+        *u64np = *data;
+    for (; n > 0; n--, u64np++)
+        *u64np = 0;
+
+    extra->subid = subid;
+    if (stats->delta)
+        extra->nesting = stats_cmn_extra(stats, stats->delta->buf)->nesting + 1;
+    stats_cmn_buf_write(stats, buf);
+
+    if (stats->delta)
+        perf_start(stats);
+}
+
+static struct zhpe_offloaded_stats_ops stats_ops_perf = {
+    .open               = stats_perf_open,
+    .close              = stats_perf_close,
+    .enable             = stats_cmn_enable,
+    .disable            = stats_cmn_disable,
+    .stop_counters      = stats_perf_stop_counters,
+    .stop_all           = stats_cmn_stop_all,
+    .pause_all          = stats_cmn_pause_all,
+    .restart_all        = stats_perf_restart_all,
+    .start              = stats_perf_start,
+    .stop               = stats_perf_stop,
+    .pause              = stats_perf_pause,
+    .finalize           = stats_perf_finalize,
+    .key_destructor     = stats_perf_key_destructor,
+    .stamp              = stats_perf_stamp,
+};
+
+/*
+ * Histogram code: no counters and no per-record writes; each subid gets
+ * an HDR-style log-linear histogram of start-to-stop times in cycles.
+ * Values below HIST_HALF * 2 are exact; above that, each power of two is
+ * split into HIST_HALF buckets, bounding the error to 1/HIST_HALF. The
+ * percentiles are written to the per-thread stats file at close.
+ */
+
+#define HIST_SUB_BITS   (7)
+#define HIST_HALF       (1U << (HIST_SUB_BITS - 1))
+#define HIST_MSB_MAX    (47)
+#define HIST_BUCKETS    ((HIST_MSB_MAX - HIST_SUB_BITS + 3) * HIST_HALF)
+#define HIST_SLOTS      (64)
+
+struct stats_hist_ent {
+    uint32_t            subid;
+    uint8_t             state;
+    uint8_t             pause_all:1;
+    uint64_t            start;
+    uint64_t            elapsed;
+    uint64_t            count;
+    uint64_t            sum;
+    uint64_t            min;
+    uint64_t            max;
+    uint64_t            buckets[HIST_BUCKETS];
+};
+
+struct stats_hist {
+    uint64_t            dropped;
+    struct stats_hist_ent *ent[HIST_SLOTS];
+};
+
+static inline uint32_t hist_index(uint64_t v)
+{
+    int                 msb;
+
+    if (v < 2 * HIST_HALF)
+        return v;
+    msb = fls64(v);
+    if (msb > HIST_MSB_MAX)
+        return HIST_BUCKETS - 1;
+
+    return ((msb - HIST_SUB_BITS + 2) * HIST_HALF +
+            (v >> (msb - HIST_SUB_BITS + 1)) - HIST_HALF);
+}
+
+/* Highest value that lands in bucket idx. */
+static uint64_t hist_value(uint32_t idx)
+{
+    uint32_t            shift;
+
+    if (idx < 2 * HIST_HALF)
+        return idx;
+    shift = idx / HIST_HALF - 1;
+
+    return ((((uint64_t)(idx % HIST_HALF + HIST_HALF) + 1) << shift) - 1);
+}
+
+static struct stats_hist_ent *hist_find(struct zhpe_offloaded_stats *stats,
+                                        uint32_t subid, bool create)
+{
+    struct stats_hist   *hist = stats->hist;
+    struct stats_hist_ent *ent;
+    uint32_t            i;
+    uint32_t            h;
+
+    for (i = 0, h = subid % HIST_SLOTS; i < HIST_SLOTS;
+         i++, h = (h + 1) % HIST_SLOTS) {
+        ent = hist->ent[h];
+        if (likely(ent && ent->subid == subid))
+            return ent;
+        if (!ent)
+            break;
+    }
+    if (!create || i == HIST_SLOTS) {
+        if (create)
+            hist->dropped++;
+        return NULL;
+    }
+    ent = calloc(1, sizeof(*ent));
+    if (!ent)
+        abort();
+    ent->subid = subid;
+    ent->min = UINT64_MAX;
+    ent->state = ZHPE_OFFLOADED_STATS_STOPPED;
+    hist->ent[h] = ent;
+
+    return ent;
+}
+
+static inline void hist_record(struct stats_hist_ent *ent, uint64_t v)
+{
+    ent->buckets[hist_index(v)]++;
+    ent->count++;
+    ent->sum += v;
+    if (v < ent->min)
+        ent->min = v;
+    if (v > ent->max)
+        ent->max = v;
+}
+
+static void hist_stop_ent(struct stats_hist_ent *ent, uint64_t now)
+{
+    if (ent->state == ZHPE_OFFLOADED_STATS_RUNNING)
+        ent->elapsed += now - ent->start;
+    else if (ent->state != ZHPE_OFFLOADED_STATS_PAUSED)
+        return;
+    hist_record(ent, ent->elapsed);
+    ent->state = ZHPE_OFFLOADED_STATS_STOPPED;
+    ent->pause_all = false;
+}
+
+static uint64_t hist_percentile(struct stats_hist_ent *ent, double pct)
+{
+    uint64_t            want;
+    uint64_t            seen = 0;
+    uint64_t            ret;
+    uint32_t            i;
+
+    /* Rank of the percentile, rounded up. */
+    want = (ent->count * (uint64_t)(pct * 1000) + 99999) / 100000;
+    for (i = 0; i < HIST_BUCKETS - 1; i++) {
+        seen += ent->buckets[i];
+        if (seen >= want)
+            break;
+    }
+    ret = hist_value(i);
+
+    return (ret < ent->max ? ret : ent->max);
+}
+
+static void hist_dump(struct zhpe_offloaded_stats *stats)
+{
+    struct stats_hist   *hist = stats->hist;
+    static const double pcts[] = { 50.0, 90.0, 99.0, 99.9, 99.99 };
+    struct stats_hist_ent *ent;
+    uint32_t            i;
+    uint32_t            j;
+
+    dprintf(stats->fd, "#subid count min mean");
+    for (j = 0; j < ARRAY_SIZE(pcts); j++)
+        dprintf(stats->fd, " p%g", pcts[j]);
+    dprintf(stats->fd, " max (usec)\n");
+    for (i = 0; i < HIST_SLOTS; i++) {
+        ent = hist->ent[i];
+        if (!ent || !ent->count)
+            continue;
+        dprintf(stats->fd, "%u %Lu %.3f %.3f", ent->subid, (ullong)ent->count,
+                cycles_to_usec(ent->min, 1),
+                cycles_to_usec(ent->sum, ent->count));
+        for (j = 0; j < ARRAY_SIZE(pcts); j++)
+            dprintf(stats->fd, " %.3f",
+                    cycles_to_usec(hist_percentile(ent, pcts[j]), 1));
+        dprintf(stats->fd, " %.3f\n", cycles_to_usec(ent->max, 1));
+    }
+    if (hist->dropped)
+        dprintf(stats->fd, "#dropped %Lu\n", (ullong)hist->dropped);
+}
+
+static void hist_close(struct zhpe_offloaded_stats *stats)
+{
+    struct stats_hist   *hist = stats->hist;
+    uint32_t            i;
+
+    if (stats->fd != -1)
+        hist_dump(stats);
+    for (i = 0; i < HIST_SLOTS; i++)
+        free(hist->ent[i]);
+    free(hist);
+    stats_cmn_close(stats);
+}
+
+static void stats_hist_open(uint16_t uid)
+{
+    struct zhpe_offloaded_stats   *stats;
+
+    stats = pthread_getspecific(zhpe_offloaded_stats_key);
+    if (stats) {
+        if (stats->uid == uid)
+            return;
+        print_err("%s,%u:tid %ld, uid 0x%03x active, cannot open 0x%03x\n",
+                  __func__, __LINE__, syscall(SYS_gettid), stats->uid, uid);
+        abort();
+    }
+    /* The histogram is written as text at close, not mapped. */
+    stats_cmn_open(uid, 0, false);
+    stats = pthread_getspecific(zhpe_offloaded_stats_key);
+    stats->hist = calloc(1, sizeof(*stats->hist));
+    if (!stats->hist)
+        abort();
+}
+
+static void stats_hist_close(void)
+{
+    struct zhpe_offloaded_stats   *stats;
+
+    stats = pthread_getspecific(zhpe_offloaded_stats_key);
+    if (!stats)
+        return;
+    hist_close(stats);
+}
+
+static struct zhpe_offloaded_stats *stats_hist_stop_counters(void)
+{
+    struct zhpe_offloaded_stats   *stats;
+
+    stats = pthread_getspecific(zhpe_offloaded_stats_key);
+    if (!stats || !stats->enabled)
+        return NULL;
+
+    return stats;
+}
+
+static void stats_hist_start(struct zhpe_offloaded_stats *stats, uint32_t subid)
+{
+    struct stats_hist_ent *ent = hist_find(stats, subid, true);
+
+    if (!ent)
+        return;
+    if (ent->state == ZHPE_OFFLOADED_STATS_STOPPED)
+        ent->elapsed = 0;
+    ent->state = ZHPE_OFFLOADED_STATS_RUNNING;
+    ent->pause_all = false;
+    ent->start = get_cycles(NULL);
+}
+
+static void stats_hist_stop(struct zhpe_offloaded_stats *stats, uint32_t subid)
+{
+    uint64_t            now = get_cycles(NULL);
+    struct stats_hist_ent *ent = hist_find(stats, subid, false);
+
+    if (ent)
+        hist_stop_ent(ent, now);
+}
+
+static void stats_hist_pause(struct zhpe_offloaded_stats *stats, uint32_t subid)
+{
+    uint64_t            now = get_cycles(NULL);
+    struct stats_hist_ent *ent = hist_find(stats, subid, false);
+
+    if (!ent || ent->state != ZHPE_OFFLOADED_STATS_RUNNING)
+        return;
+    ent->elapsed += now - ent->start;
+    ent->state = ZHPE_OFFLOADED_STATS_PAUSED;
+}
+
+static void stats_hist_stop_all(struct zhpe_offloaded_stats *stats)
+{
+    uint64_t            now = get_cycles(NULL);
+    struct stats_hist_ent *ent;
+    uint32_t            i;
+
+    for (i = 0; i < HIST_SLOTS; i++) {
+        ent = stats->hist->ent[i];
+        if (ent)
+            hist_stop_ent(ent, now);
+    }
+}
+
+static void stats_hist_pause_all(struct zhpe_offloaded_stats *stats)
+{
+    uint64_t            now = get_cycles(NULL);
+    struct stats_hist_ent *ent;
+    uint32_t            i;
+
+    for (i = 0; i < HIST_SLOTS; i++) {
+        ent = stats->hist->ent[i];
+        if (!ent || ent->state != ZHPE_OFFLOADED_STATS_RUNNING)
+            continue;
+        ent->elapsed += now - ent->start;
+        ent->state = ZHPE_OFFLOADED_STATS_PAUSED;
+        ent->pause_all = true;
+    }
+}
+
+static void stats_hist_restart_all(void)
+{
+    struct zhpe_offloaded_stats   *stats;
+    struct stats_hist_ent *ent;
+    uint64_t            now;
+    uint32_t            i;
+
+    stats = stats_hist_stop_counters();
+    if (!stats)
+        return;
+
+    now = get_cycles(NULL);
+    for (i = 0; i < HIST_SLOTS; i++) {
+        ent = stats->hist->ent[i];
+        if (!ent || !ent->pause_all)
+            continue;
+        ent->state = ZHPE_OFFLOADED_STATS_RUNNING;
+        ent->pause_all = false;
+        ent->start = now;
+    }
+}
+
+static void stats_hist_finalize(void)
+{
+    mutex_lock(&zhpe_offloaded_stats_mutex);
+    stats_cmn_finalize();
+    mutex_unlock(&zhpe_offloaded_stats_mutex);
+}
+
+static void stats_hist_key_destructor(void *vstats)
+{
+    struct zhpe_offloaded_stats   *stats = vstats;
+
+    if (!stats)
+        return;
+
+    hist_close(stats);
+}
+
+static struct zhpe_offloaded_stats_ops stats_ops_hist = {
+    .open               = stats_hist_open,
+    .close              = stats_hist_close,
+    .enable             = stats_cmn_enable,
+    .disable            = stats_cmn_disable,
+    .stop_counters      = stats_hist_stop_counters,
+    .stop_all           = stats_hist_stop_all,
+    .pause_all          = stats_hist_pause_all,
+    .restart_all        = stats_hist_restart_all,
+    .start              = stats_hist_start,
+    .stop               = stats_hist_stop,
+    .pause              = stats_hist_pause,
+    .finalize           = stats_hist_finalize,
+    .key_destructor     = stats_hist_key_destructor,
+    /* Stamps carry no interval to histogram. */
+    .stamp              = stats_nop_stamp,
+};
+
 bool zhpe_offloaded_stats_init(const char *stats_dir, const char *stats_unique)
 {
     bool                ret = false;
+    const char          *s;
     int                 rc;
 
     if (!stats_dir && !stats_unique)
@@ -850,8 +1618,16 @@ bool zhpe_offloaded_stats_init(const char *stats_dir, const char *stats_unique)
         print_err("%s,%u:already initialized\n", __func__, __LINE__);
         goto done;
     }
+    s = getenv("ZHPE_OFFLOADED_STATS_MAP");
+    if (s && parse_kb_uint64_t(__func__, __LINE__, "ZHPE_OFFLOADED_STATS_MAP",
+                               s, &zhpe_offloaded_stats_map_len, 0, 1,
+                               SIZE_MAX, PARSE_KIB) < 0)
+        zhpe_offloaded_stats_map_len = STATS_MAP_LEN;
+    if (getenv("ZHPE_OFFLOADED_STATS_HIST"))
+        zhpe_offloaded_stats_ops = &stats_ops_hist;
 #ifdef HAVE_ZHPE_OFFLOADED_SIM
-    if (sim_api_is_sim())
+    if (zhpe_offloaded_stats_ops == &zhpe_offloaded_stats_nops &&
+        sim_api_is_sim())
         zhpe_offloaded_stats_ops = &stats_ops_sim;
 #endif
 #ifdef LIKWID_PERFMON
@@ -860,11 +1636,11 @@ bool zhpe_offloaded_stats_init(const char *stats_dir, const char *stats_unique)
         LIKWID_MARKER_INIT;
     }
 #endif
-    if (zhpe_offloaded_stats_ops == &zhpe_offloaded_stats_nops) {
-        print_err("%s,%u:no statistics support available\n",
-                  __func__, __LINE__);
-        goto done;
-    }
+    if (zhpe_offloaded_stats_ops == &zhpe_offloaded_stats_nops && perf_probe())
+        zhpe_offloaded_stats_ops = &stats_ops_perf;
+    /* Histograms need nothing from the platform. */
+    if (zhpe_offloaded_stats_ops == &zhpe_offloaded_stats_nops)
+        zhpe_offloaded_stats_ops = &stats_ops_hist;
 
     zhpe_offloaded_stats_dir = strdup_or_null(stats_dir);
     if (!zhpe_offloaded_stats_dir)
@@ -982,18 +1758,3 @@ void zhpe_offloaded_stats_test(uint16_t uid)
     zhpe_offloaded_stats_close();
 }
 
-#else
-
-void zhpe_offloaded_stats_init(const char *stats_dir, const char *stats_unique)
-{
-    if (!stats_dir && !stats_unique)
-        return;
-    print_err("%s,%u:libzhpe_offloaded_stats built without stats support\n",
-              __func__, __LINE__);
-}
-
-void zhpe_offloaded_stats_test(uint16_t uid)
-{
-}
-
-#endif
@@ -40,6 +40,25 @@ class ProcCtlCacheData(Structure):
                 ('zhpeSubId', c_uint32),
                 ('zhpeNesting', c_uint32)]
 
+# Records from the perf_event backend: four counter deltas, then the
+# same trailing words as the simulator's records.
+class PerfData(Structure):
+    _pack_ = 1
+    _fields_ = [('cycles', c_uint64),
+                ('instructions', c_uint64),
+                ('cacheMisses', c_uint64),
+                ('branchMisses', c_uint64),
+                ('zhpeStatsStarts', c_uint32),
+                ('zhpeStatsPauses', c_uint32),
+                ('zhpeSubId', c_uint32),
+                ('zhpeNesting', c_uint32)]
+
+def printPerfDataHeader():
+    print(','.join(f[0] for f in PerfData._fields_))
+
+def printPerfData(aPerfData, anIdx):
+    print(','.join(str(getattr(aPerfData, f[0])) for f in PerfData._fields_))
+
 def printProcCtlCacheDataHeader():
     print('execInstTotal,cpl0ExecInstTotal,cpl1ExecInstTotal,cpl2ExecInstTotal,cpl3ExecInstTotal,coherencyCastoutDataL1,coherencyCastoutInstL1,capacityCastoutDataL1,capacityCastoutInstL1,lineMissDataL1,lineHitDataL1,lineMissInstL1,lineHitInstL1,uncachedReadInstL1,uncachedReadDataL1,uncachedWriteDataL1,lineCastoutDirtyDataL1,coherencyCastoutDataL2,capacityCastoutDataL2,lineMissDataL2,lineHitDataL2,lineCastoutDirtyDataL2,lineMissWriteThroughL2,zhpeStatsStarts,zhpeStatsPauses,zhpeSubId,zhpeNesting')
 
@@ -82,9 +101,21 @@ def unpackfile(afilename):
         total_array=[]
         cpl0_array=[]
         cpl3_array=[]
+        # A writer that never closed leaves its last mapped window
+        # zero-filled past the final record.
+        data = file.read()
+        rlen = sizeof(PerfData if perf else ProcCtlCacheData)
+        end = len(data.rstrip(b'\0'))
+        end = (end + rlen - 1) // rlen * rlen
+        if perf:
+            printPerfDataHeader()
+            for off in range(0, end - rlen + 1, rlen):
+                printPerfData(PerfData.from_buffer_copy(data, off), my_idx)
+                my_idx = my_idx + 1
+            return
         printProcCtlCacheDataHeader()
-        x = ProcCtlCacheData()
-        while file.readinto(x):
+        for off in range(0, end - rlen + 1, rlen):
+            x = ProcCtlCacheData.from_buffer_copy(data, off)
             all_totals_array.append(x.execInstTotal)
             all_cpl0_array.append(x.cpl0ExecInstTotal)
             all_cpl3_array.append(x.cpl3ExecInstTotal)
@@ -104,7 +135,17 @@ all_totals_array=[]
 all_cpl0_array=[]
 all_cpl3_array=[]
 
-filename = sys.argv[-1]
+# -p: the files came from the perf_event backend, not the simulator.
+args = sys.argv[1:]
+perf = False
+if args and args[0] == '-p':
+    perf = True
+    args = args[1:]
+if len(args) != 1:
+    print('Usage: {} [-p] <file|directory>'.format(sys.argv[0]))
+    sys.exit(255)
+
+filename = args[-1]
 
 if os.path.isdir(filename):
     flist=[ os.path.basename(i) for i in os.listdir(filename)]
@@ -38,9 +38,10 @@
 
 #include <dlfcn.h>
 #include <limits.h>
+#include <poll.h>
 #include <stdio.h>
 
-#define PRINT_DEBUG printf("zhpe-support Within function: %s in file %s \n", __func__, __FILE__)
+#include <sys/eventfd.h>
 
 static_assert(sizeof(union zhpe_offloaded_hw_wq_entry) ==  ZHPE_OFFLOADED_ENTRY_LEN,
               "zhpe_offloaded_hw_wq_entry");
@@ -53,31 +54,108 @@ static_assert(sizeof(union zhpe_offloaded_hw_cq_entry) ==  ZHPE_OFFLOADED_ENTRY_
 #define LIBNAME         "libzhpeq"
 #define BACKNAME        "libzhpeq_backend.so"
 
+/* zhpeq_cq_wait() spin limits; the max may be set with ZHPEQ_CQ_SPIN_NS. */
+#define CQ_SPIN_MIN_NS  ((uint64_t)1000)
+#define CQ_SPIN_MAX_NS  ((uint64_t)100000)
+/* Sleep interval for backends that can't wake us. */
+#define CQ_NOBLOCK_MS   (1)
+/* Default zhpeq_mem_alloc() arena; see ZHPEQ_MEM_ARENA. */
+#define MEM_ARENA_SIZE  ((uint64_t)32 << 20)
+
 static pthread_mutex_t  init_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static bool             b_zhpe;
 static struct backend_ops *b_ops;
 static struct zhpeq_attr b_attr;
+static uint64_t         cq_spin_max_ns = CQ_SPIN_MAX_NS;
+static uint64_t         mr_cache_max;
+static uint64_t         mem_arena_size = MEM_ARENA_SIZE;
+
+/*
+ * Context slots. Normally free slots are chained on zq->context_free and
+ * each thread keeps a small cache of them, so the shared head is only
+ * touched to move a batch at a time. The context array is larger than
+ * the queue by everything the caches can hold, so slots parked in an idle
+ * thread's cache can never starve the shared list. With ZHPEQ_ALLOC_SP the
+ * slot is just the WQE index and there is no free list at all.
+ */
+
+#define CTX_CACHE_MAX   (32)
+#define CTX_CACHE_BATCH (16)
+#define CTX_CACHES_MAX  (64)
+#define CTX_TLS_SLOTS   (4)
+/* cmp_index is 16 bits. */
+#define CTX_INDEX_MAX   (1U << 16)
+
+enum {
+    CTX_VEC             = 0x1,
+    CTX_BUSY            = 0x2,
+    CTX_ATMV            = 0x4,
+};
+
+struct zhpeq_ctx_cache {
+    pthread_t           owner;
+    int32_t             head;
+    uint32_t            count;
+} CACHE_ALIGNED;
+
+/* Per-thread state for the last few queues a thread used. */
+static __thread struct ctx_tls {
+    struct zhpeq        *zq;
+    uint64_t            gen;
+    struct zhpeq_ctx_cache *cache;
+    struct zhpeq_stats  *stats;
+    bool                stats_shared;
+} ctx_tls[CTX_TLS_SLOTS];
+
+/* Owned counter blocks need no atomics; the shared one does. */
+#define STATS_ADD(_tls, _field, _v)                                     \
+do {                                                                    \
+    if (likely(!(_tls)->stats_shared))                                  \
+        ZHPEQ_STATS_ADD((_tls)->stats, _field, _v);                     \
+    else                                                                \
+        atm_add(&(_tls)->stats->_field, _v);                            \
+} while (0)
+
+static uint64_t         ctx_gen;
 
 uuid_t                  zhpeq_uuid;
 
 static void __attribute__((constructor)) lib_init(void)
 {
     void                *dlhandle = dlopen(BACKNAME, RTLD_NOW);
-    PRINT_DEBUG;
+    const char          *s;
+    zhpeu_trace();
 
     if (!dlhandle) {
         print_err("Failed to load %s:%s\n", BACKNAME, dlerror());
         abort();
     }
+    s = getenv("ZHPEQ_CQ_SPIN_NS");
+    if (s && parse_kb_uint64_t(__func__, __LINE__, "ZHPEQ_CQ_SPIN_NS", s,
+                               &cq_spin_max_ns, 0, 0, UINT64_MAX,
+                               PARSE_NUM) < 0)
+        cq_spin_max_ns = CQ_SPIN_MAX_NS;
+    s = getenv("ZHPEQ_MR_CACHE_MAX");
+    if (s && parse_kb_uint64_t(__func__, __LINE__, "ZHPEQ_MR_CACHE_MAX", s,
+                               &mr_cache_max, 0, 0, UINT64_MAX,
+                               PARSE_KIB) < 0)
+        mr_cache_max = 0;
+    s = getenv("ZHPEQ_MEM_ARENA");
+    if (s && parse_kb_uint64_t(__func__, __LINE__, "ZHPEQ_MEM_ARENA", s,
+                               &mem_arena_size, 0, 1, UINT64_MAX,
+                               PARSE_KIB) < 0)
+        mem_arena_size = MEM_ARENA_SIZE;
+    zhpeq_stats_lib_init();
 }
 
-void zhpeq_register_backend(enum zhpe_offloaded_backend backend, struct backend_ops *ops)
+void zhpeq_register_backend(enum zhpeq_backend backend, struct backend_ops *ops)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     /* For the moment, the zhpe backend will only register if the zhpe device
      * can be opened and the libfabric backend will only register if the zhpe
-     * device can't be opened.
+     * device can't be opened. The loopback backend registers last, and
+     * only when asked for, so it replaces either.
      */
 
     switch (backend) {
@@ -91,6 +169,11 @@ void zhpeq_register_backend(enum zhpe_offloaded_backend backend, struct backend_
         b_ops = ops;
         break;
 
+    case ZHPEQ_BACKEND_LOOPBACK:
+        b_zhpe = false;
+        b_ops = ops;
+        break;
+
     default:
         print_err("Unexpected backed %d\n", backend);
         break;
@@ -99,7 +182,7 @@ void zhpeq_register_backend(enum zhpe_offloaded_backend backend, struct backend_
 
 int zhpeq_init(int api_version)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret = -EINVAL;
     static int          init_status = 1;
 
@@ -121,7 +204,7 @@ int zhpeq_init(int api_version)
 
 int zhpeq_query_attr(struct zhpeq_attr *attr)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret = -EINVAL;
 
     /* Compatibility handling is left for another day. */
@@ -138,15 +221,23 @@ int zhpeq_query_attr(struct zhpeq_attr *attr)
 
 int zhpeq_domain_free(struct zhpeq_dom *zdom)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret = -EINVAL;
+    int                 rc;
 
     if (!zdom)
         goto done;
 
-    ret = 0;
-    if (b_ops->domain_free)
-        ret = b_ops->domain_free(zdom);
+    ret = zhpeq_mem_destroy(zdom);
+    rc = zhpeq_mr_cache_destroy(zdom);
+    if (ret >= 0)
+        ret = rc;
+    if (b_ops->domain_free) {
+        rc = b_ops->domain_free(zdom);
+        if (ret >= 0)
+            ret = rc;
+    }
+    zhpeq_stats_dom_destroy(zdom);
     free(zdom);
 
  done:
@@ -155,7 +246,7 @@ int zhpeq_domain_free(struct zhpeq_dom *zdom)
 
 int zhpeq_domain_alloc(struct zhpeq_dom **zdom_out)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret = -EINVAL;
     struct zhpeq_dom    *zdom = NULL;
 
@@ -167,10 +258,15 @@ int zhpeq_domain_alloc(struct zhpeq_dom **zdom_out)
     zdom = calloc_cachealigned(1, sizeof(*zdom));
     if (!zdom)
         goto done;
+    zhpeq_stats_dom_init(zdom);
 
     ret = 0;
     if (b_ops->domain)
         ret = b_ops->domain(zdom);
+    if (ret >= 0 && mr_cache_max)
+        ret = zhpeq_mr_cache_init(zdom, b_ops, mr_cache_max);
+    if (ret >= 0)
+        ret = zhpeq_mem_init(zdom, b_ops, mem_arena_size);
 
  done:
     if (ret >= 0)
@@ -183,7 +279,7 @@ int zhpeq_domain_alloc(struct zhpeq_dom **zdom_out)
 
 int zhpeq_free(struct zhpeq *zq)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret = -EINVAL;
     int                 rc;
     union xdm_active    active;
@@ -201,6 +297,7 @@ int zhpeq_free(struct zhpeq *zq)
     }
     if (b_ops->qfree_pre)
         rc = b_ops->qfree_pre(zq);
+    FD_CLOSE(zq->cq_efd);
 
     ret = 0;
     /* Unmap qcm, wq, and cq. */
@@ -217,8 +314,11 @@ int zhpeq_free(struct zhpeq *zq)
     rc = b_ops->qfree(zq);
     if (ret >= 0 && rc < 0)
         ret = rc;
+    zhpeq_stats_qfini(zq);
     /* Free queue memory. */
     free(zq->context);
+    free(zq->context_flags);
+    free(zq->ctx_cache);
     free(zq);
 
  done:
@@ -229,13 +329,22 @@ int zhpeq_alloc(struct zhpeq_dom *zdom, int cmd_qlen, int cmp_qlen,
                 int traffic_class, int priority, int slice_mask,
                 struct zhpeq **zq_out)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
+    return zhpeq_alloc_flags(zdom, cmd_qlen, cmp_qlen, traffic_class,
+                             priority, slice_mask, 0, zq_out);
+}
+
+int zhpeq_alloc_flags(struct zhpeq_dom *zdom, int cmd_qlen, int cmp_qlen,
+                      int traffic_class, int priority, int slice_mask,
+                      uint32_t flags, struct zhpeq **zq_out)
+{
+    zhpeu_trace();
     int                 ret = -EINVAL;
     struct zhpeq        *zq = NULL;
     union xdm_cmp_tail  tail = {
         .bits.toggle_valid = 1,
     };
-    int                 flags;
+    int                 mflags;
     size_t              i;
 
     if (!zq_out)
@@ -246,7 +355,8 @@ int zhpeq_alloc(struct zhpeq_dom *zdom, int cmd_qlen, int cmp_qlen,
         cmp_qlen < 2 || cmp_qlen > b_attr.z.max_tx_qlen ||
         traffic_class < 0 || traffic_class > ZHPEQ_TC_MAX ||
         priority < 0 || priority > ZHPEQ_PRI_MAX ||
-        (slice_mask & ~(ALL_SLICES | SLICE_DEMAND)))
+        (slice_mask & ~(ALL_SLICES | SLICE_DEMAND)) ||
+        (flags & ~ZHPEQ_ALLOC_SPSC))
         goto done;
 
     ret = -ENOMEM;
@@ -254,6 +364,17 @@ int zhpeq_alloc(struct zhpeq_dom *zdom, int cmd_qlen, int cmp_qlen,
     if (!zq)
         goto done;
     zq->zdom = zdom;
+    zq->flags = flags;
+    zq->ctx_gen = atm_inc(&ctx_gen) + 1;
+    zq->cq_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (zq->cq_efd == -1) {
+        ret = -errno;
+        print_func_err(__func__, __LINE__, "eventfd", "", ret);
+        goto done;
+    }
+    ret = zhpeq_stats_qinit(zq);
+    if (ret < 0)
+        goto done;
 
     cmd_qlen = roundup_pow_of_2(cmd_qlen);
     cmp_qlen = roundup_pow_of_2(cmp_qlen);
@@ -263,30 +384,53 @@ int zhpeq_alloc(struct zhpeq_dom *zdom, int cmd_qlen, int cmp_qlen,
     if (ret < 0)
         goto done;
 
-    zq->context = calloc_cachealigned(zq->xqinfo.cmplq.ent,
-                                      sizeof(*zq->context));
+    /*
+     * One context per outstanding command, plus headroom for the
+     * per-thread caches.
+     */
+    zq->context_ent = zq->xqinfo.cmdq.ent;
+    if (zq->context_ent < zq->xqinfo.cmplq.ent)
+        zq->context_ent = zq->xqinfo.cmplq.ent;
+    if (!(flags & ZHPEQ_ALLOC_SP) && zq->context_ent < CTX_INDEX_MAX) {
+        zq->n_ctx_cache = (CTX_INDEX_MAX - zq->context_ent) / CTX_CACHE_MAX;
+        if (zq->n_ctx_cache > CTX_CACHES_MAX)
+            zq->n_ctx_cache = CTX_CACHES_MAX;
+        zq->context_ent += zq->n_ctx_cache * CTX_CACHE_MAX;
+    }
+    ret = -ENOMEM;
+    zq->context = calloc_cachealigned(zq->context_ent, sizeof(*zq->context));
     if (!zq->context)
         goto done;
+    zq->context_flags = calloc_cachealigned(zq->context_ent,
+                                            sizeof(*zq->context_flags));
+    if (!zq->context_flags)
+        goto done;
+    if (zq->n_ctx_cache) {
+        zq->ctx_cache = calloc_cachealigned(zq->n_ctx_cache,
+                                            sizeof(*zq->ctx_cache));
+        if (!zq->ctx_cache)
+            goto done;
+    }
 
     /* Initialize context storage free list. */
-    for (i = 0; i < zq->xqinfo.cmplq.ent - 1; i++)
+    for (i = 0; i < zq->context_ent - 1; i++)
         zq->context[i] = TO_PTR(i + 1);
     zq->context[i] = TO_PTR(FREE_END);
     /* context_free is zeroed. */
 
     /* zq->fd == -1 means we're faking things out. */
-    flags = (zq->fd == -1 ? MAP_ANONYMOUS | MAP_PRIVATE : MAP_SHARED);
+    mflags = (zq->fd == -1 ? MAP_ANONYMOUS | MAP_PRIVATE : MAP_SHARED);
     /* Map registers, wq, and cq. */
     zq->qcm = do_mmap(NULL, zq->xqinfo.qcm.size, PROT_READ | PROT_WRITE,
-                      flags, zq->fd, zq->xqinfo.qcm.off, &ret);
+                      mflags, zq->fd, zq->xqinfo.qcm.off, &ret);
     if (!zq->qcm)
         goto done;
     zq->wq = do_mmap(NULL, zq->xqinfo.cmdq.size, PROT_READ | PROT_WRITE,
-                     flags, zq->fd, zq->xqinfo.cmdq.off, &ret);
+                     mflags, zq->fd, zq->xqinfo.cmdq.off, &ret);
     if (!zq->wq)
         goto done;
     zq->cq = do_mmap(NULL, zq->xqinfo.cmplq.size, PROT_READ | PROT_WRITE,
-                     flags, zq->fd, zq->xqinfo.cmplq.off, &ret);
+                     mflags, zq->fd, zq->xqinfo.cmplq.off, &ret);
     if (!zq->cq)
         goto done;
     if (b_ops->qalloc_post) {
@@ -316,7 +460,7 @@ int zhpeq_alloc(struct zhpeq_dom *zdom, int cmd_qlen, int cmp_qlen,
 int zhpeq_backend_exchange(struct zhpeq *zq, int sock_fd,
                            void *sa, size_t *sa_len)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret = -EINVAL;
 
     if (!zq || !sa || !sa_len)
@@ -330,7 +474,7 @@ int zhpeq_backend_exchange(struct zhpeq *zq, int sock_fd,
 
 int zhpeq_backend_open(struct zhpeq *zq, void *sa)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret = -EINVAL;
 
     if (!zq)
@@ -344,7 +488,7 @@ int zhpeq_backend_open(struct zhpeq *zq, void *sa)
 
 int zhpeq_backend_close(struct zhpeq *zq, int open_idx)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret = -EINVAL;
 
     if (!zq)
@@ -356,9 +500,191 @@ int zhpeq_backend_close(struct zhpeq *zq, int open_idx)
     return ret;
 }
 
+/* Find or claim this thread's cache for zq; NULL if none are left. */
+static struct zhpeq_ctx_cache *ctx_cache_claim(struct zhpeq *zq,
+                                               pthread_t self)
+{
+    struct zhpeq_ctx_cache *ret;
+    uint32_t            i;
+    uint32_t            n;
+
+    if (!zq->n_ctx_cache)
+        return NULL;
+
+    /* A new thread with a dead thread's id inherits its slots. */
+    n = atm_load_rlx(&zq->ctx_cache_users);
+    if (n > zq->n_ctx_cache)
+        n = zq->n_ctx_cache;
+    for (i = 0; i < n; i++) {
+        if (pthread_equal(zq->ctx_cache[i].owner, self))
+            return &zq->ctx_cache[i];
+    }
+    i = atm_inc(&zq->ctx_cache_users);
+    if (i >= zq->n_ctx_cache)
+        return NULL;
+    ret = &zq->ctx_cache[i];
+    ret->head = FREE_END;
+    ret->count = 0;
+    ret->owner = self;
+
+    return ret;
+}
+
+static void stats_claim(struct zhpeq *zq, pthread_t self,
+                        struct ctx_tls *tls)
+{
+    uint32_t            i;
+    uint32_t            n;
+
+    n = atm_load_rlx(&zq->stats_users);
+    if (n > ZHPEQ_STATS_THREADS)
+        n = ZHPEQ_STATS_THREADS;
+    for (i = 0; i < n; i++) {
+        if (pthread_equal(zq->stats_owner[i], self))
+            goto found;
+    }
+    i = atm_inc(&zq->stats_users);
+    if (i >= ZHPEQ_STATS_THREADS) {
+        tls->stats = &zq->stats_blk[ZHPEQ_STATS_BLK_SHARED].s;
+        tls->stats_shared = true;
+        return;
+    }
+    zq->stats_owner[i] = self;
+ found:
+    tls->stats = &zq->stats_blk[i + 1].s;
+    tls->stats_shared = false;
+}
+
+static inline struct ctx_tls *tls_get(struct zhpeq *zq)
+{
+    struct ctx_tls      *ret;
+    pthread_t           self;
+
+    ret = &ctx_tls[((uintptr_t)zq / sizeof(*zq)) & (CTX_TLS_SLOTS - 1)];
+    if (likely(ret->zq == zq && ret->gen == zq->ctx_gen))
+        return ret;
+
+    self = pthread_self();
+    ret->cache = ctx_cache_claim(zq, self);
+    stats_claim(zq, self, ret);
+    ret->zq = zq;
+    ret->gen = zq->ctx_gen;
+
+    return ret;
+}
+
+static inline struct zhpeq_ctx_cache *ctx_cache_get(struct zhpeq *zq)
+{
+    return tls_get(zq)->cache;
+}
+
+static inline void stats_reserve(struct zhpeq *zq, int64_t ret,
+                                 uint32_t qmask)
+{
+    struct ctx_tls      *tls = tls_get(zq);
+    uint64_t            bucket;
+
+    if (ret < 0) {
+        STATS_ADD(tls, reserve_eagain, 1);
+        return;
+    }
+    bucket = (((uint32_t)ret - atm_load_rlx(&zq->head_tail.head)) & qmask);
+    bucket = bucket * ZHPEQ_STATS_OCC_BUCKETS / (qmask + 1);
+    STATS_ADD(tls, occupancy[bucket], 1);
+}
+
+/* Count what was just committed; the WQEs are still in cache. */
+static void stats_commit(struct zhpeq *zq, uint32_t qindex,
+                         uint32_t n_entries, uint32_t qmask)
+{
+    struct ctx_tls      *tls = tls_get(zq);
+    union zhpe_offloaded_hw_wq_entry *wqe;
+    uint64_t            ops[ZHPEQ_OP_ATOMIC + 1] = { 0 };
+    uint64_t            bytes = 0;
+    uint64_t            fences = 0;
+    uint32_t            i;
+
+    for (i = 0; i < n_entries; i++) {
+        wqe = zq->wq + ((qindex + i) & qmask);
+        if (wqe->hdr.opcode & ZHPE_OFFLOADED_HW_OPCODE_FENCE)
+            fences++;
+        switch (wqe->hdr.opcode & ~ZHPE_OFFLOADED_HW_OPCODE_FENCE) {
+
+        case ZHPE_OFFLOADED_HW_OPCODE_NOP:
+            ops[ZHPEQ_OP_NOP]++;
+            break;
+
+        case ZHPE_OFFLOADED_HW_OPCODE_PUT:
+        case ZHPEQ_SW_OPCODE_PUTV:
+            ops[ZHPEQ_OP_PUT]++;
+            bytes += wqe->dma.len;
+            break;
+
+        case ZHPE_OFFLOADED_HW_OPCODE_GET:
+        case ZHPEQ_SW_OPCODE_GETV:
+            ops[ZHPEQ_OP_GET]++;
+            bytes += wqe->dma.len;
+            break;
+
+        case ZHPE_OFFLOADED_HW_OPCODE_PUTIMM:
+            ops[ZHPEQ_OP_PUTI]++;
+            bytes += wqe->imm.len;
+            break;
+
+        case ZHPE_OFFLOADED_HW_OPCODE_GETIMM:
+            ops[ZHPEQ_OP_GETI]++;
+            bytes += wqe->imm.len;
+            break;
+
+        case ZHPEQ_SW_OPCODE_ATMV:
+            /* dma.len is the element count. */
+            ops[ZHPEQ_OP_ATOMIC] += wqe->dma.len;
+            break;
+
+        default:
+            ops[ZHPEQ_OP_ATOMIC]++;
+            break;
+        }
+    }
+    for (i = 0; i < ARRAY_SIZE(ops); i++) {
+        if (ops[i])
+            STATS_ADD(tls, ops[i], ops[i]);
+    }
+    if (bytes)
+        STATS_ADD(tls, bytes, bytes);
+    if (fences)
+        STATS_ADD(tls, fences, fences);
+}
+
+/*
+ * With a single producer, tail is ours alone and only head moves under
+ * us, so plain loads and stores will do. The context slot is the WQE
+ * index, and head counts completions read, not slots freed: out-of-order
+ * completion can leave an older command in a slot we are about to reuse,
+ * so that is -EAGAIN too, and the caller must reap before retrying.
+ */
+static inline int64_t reserve_sp(struct zhpeq *zq, uint32_t n_entries,
+                                 uint32_t qmask)
+{
+    uint32_t            head = atm_load(&zq->head_tail.head);
+    uint32_t            tail = zq->head_tail.tail;
+    uint32_t            i;
+
+    if (qmask - (tail - head) < n_entries)
+        return -EAGAIN;
+    for (i = 0; i < n_entries; i++) {
+        if (unlikely(atm_load(&zq->context_flags[(tail + i) & qmask]) &
+                     CTX_BUSY))
+            return -EAGAIN;
+    }
+    atm_store_rlx(&zq->head_tail.tail, tail + n_entries);
+
+    return tail;
+}
+
 int64_t zhpeq_reserve(struct zhpeq *zq, uint32_t n_entries)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int64_t             ret = -EINVAL;
     uint32_t            qmask;
     uint32_t            avail;
@@ -371,6 +697,11 @@ int64_t zhpeq_reserve(struct zhpeq *zq, uint32_t n_entries)
     if (!zq || n_entries < 1 || n_entries > qmask)
         goto done;
 
+    if (zq->flags & ZHPEQ_ALLOC_SP) {
+        ret = reserve_sp(zq, n_entries, qmask);
+        goto stats;
+    }
+
     ret = 0;
     for (old = atm_load_rlx(&zq->head_tail) ;;) {
         avail = qmask - (old.tail - old.head);
@@ -385,13 +716,27 @@ int64_t zhpeq_reserve(struct zhpeq *zq, uint32_t n_entries)
             break;
     }
 
+ stats:
+    stats_reserve(zq, ret, qmask);
  done:
     return ret;
 }
 
+/*
+ * The calls that commit their own reservations must not wait behind one
+ * the caller still holds uncommitted: that wait would never end. They
+ * refuse with -EAGAIN up front instead; anything left uncommitted after
+ * that belongs to another thread that is filling its entries now.
+ */
+static inline bool commit_pending(struct zhpeq *zq)
+{
+    return (atm_load_rlx(&zq->tail_commit) !=
+            atm_load_rlx(&zq->head_tail.tail));
+}
+
 int zhpeq_commit(struct zhpeq *zq, uint32_t qindex, uint32_t n_entries)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret = -EINVAL;
     uint32_t            qmask;
     uint32_t            old;
@@ -427,6 +772,7 @@ int zhpeq_commit(struct zhpeq *zq, uint32_t qindex, uint32_t n_entries)
               zq->qcm + ZHPE_OFFLOADED_XDM_QCM_CMD_QUEUE_TAIL_OFFSET);
     io_wmb();
     atm_store_rlx(&zq->tail_commit, new);
+    stats_commit(zq, qindex, n_entries, qmask);
     ret = 0;
 
  done:
@@ -435,55 +781,159 @@ int zhpeq_commit(struct zhpeq *zq, uint32_t qindex, uint32_t n_entries)
 
 int zhpeq_signal(struct zhpeq *zq)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     return b_ops->wq_signal(zq);
 }
 
-static inline void set_context(struct zhpeq *zq, union zhpe_offloaded_hw_wq_entry *wqe,
-                               void *context)
+/*
+ * Pop at least min and at most max slots off the shared free list with a
+ * single CAS; returns the first slot. The slots remain chained through
+ * zq->context[]; *last and *n_out describe the end of the chain.
+ */
+static int32_t ctx_pop(struct zhpeq *zq, uint32_t min, uint32_t max,
+                       int32_t *last, uint32_t *n_out)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     struct free_index   old;
     struct free_index   new;
+    uint32_t            i;
+    int32_t             index;
+    int32_t             prev;
 
     for (old = atm_load_rlx(&zq->context_free);;) {
-        if (unlikely(old.index == FREE_END)) {
+        /*
+         * The links may change under us; the seq protects the CAS, we only
+         * need to be careful not to walk off the array.
+         */
+        for (i = 0, index = old.index, prev = FREE_END; i < max; i++) {
+            if (unlikely(index < 0 || (uint32_t)index >= zq->context_ent))
+                break;
+            prev = index;
+            index = (int32_t)(uintptr_t)zq->context[index];
+        }
+        if (unlikely(i < min)) {
             /* Tiny race between head moving and context slot freed. */
             sched_yield();
             old = atm_load_rlx(&zq->context_free);
             continue;
         }
-        new.index = (int32_t)(uintptr_t)zq->context[old.index];
+        new.index = index;
         new.seq = old.seq + 1;
         if (atm_cmpxchg(&zq->context_free, &old, new))
             break;
     }
-    zq->context[old.index] = context;
-    wqe->hdr.cmp_index = old.index;
+    *last = prev;
+    *n_out = i;
+
+    return old.index;
 }
 
-static inline void *get_context(struct zhpeq *zq, struct zhpe_offloaded_cq_entry *cqe)
+/* Push the chain of context slots first..last back on the free list. */
+static void ctx_push(struct zhpeq *zq, int32_t first, int32_t last)
 {
-    PRINT_DEBUG;
-    void                *ret = zq->context[cqe->index];
+    zhpeu_trace();
     struct free_index   old;
     struct free_index   new;
 
     for (old = atm_load_rlx(&zq->context_free) ;;) {
-        zq->context[cqe->index] = TO_PTR(old.index);
-        new.index = cqe->index;
+        zq->context[last] = TO_PTR(old.index);
+        new.index = first;
         new.seq = old.seq + 1;
         if (atm_cmpxchg(&zq->context_free, &old, new))
             break;
     }
+}
+
+/*
+ * Claim n_entries slots for the WQEs starting at wq index windex; returns
+ * the first and ctx_set() returns each following one.
+ */
+static inline int32_t ctx_alloc(struct zhpeq *zq, uint32_t windex,
+                                uint32_t n_entries)
+{
+    zhpeu_trace();
+    struct zhpeq_ctx_cache *cache;
+    int32_t             ret;
+    int32_t             last;
+    uint32_t            n;
+    uint32_t            i;
+
+    /* reserve_sp() has already checked the slots are free. */
+    if (zq->flags & ZHPEQ_ALLOC_SP)
+        return windex;
+
+    cache = ctx_cache_get(zq);
+    if (!cache || n_entries > CTX_CACHE_BATCH)
+        return ctx_pop(zq, n_entries, n_entries, &last, &n);
+
+    if (unlikely(cache->count < n_entries)) {
+        ret = ctx_pop(zq, n_entries - cache->count, CTX_CACHE_BATCH,
+                      &last, &n);
+        zq->context[last] = TO_PTR(cache->head);
+        cache->head = ret;
+        cache->count += n;
+    }
+    ret = cache->head;
+    for (i = 0; i < n_entries; i++)
+        cache->head = (int32_t)(uintptr_t)zq->context[cache->head];
+    cache->count -= n_entries;
 
     return ret;
 }
 
+/* Return n_entries slots chained first..last. */
+static inline void ctx_free(struct zhpeq *zq, int32_t first, int32_t last,
+                            uint32_t n_entries)
+{
+    zhpeu_trace();
+    struct zhpeq_ctx_cache *cache = ctx_cache_get(zq);
+
+    if (!cache || cache->count + n_entries > CTX_CACHE_MAX) {
+        ctx_push(zq, first, last);
+        return;
+    }
+    zq->context[last] = TO_PTR(cache->head);
+    cache->head = first;
+    cache->count += n_entries;
+}
+
+/* Fill slot cindex for wqe; returns the next slot of the allocation. */
+static inline int32_t ctx_set(struct zhpeq *zq, int32_t cindex,
+                              union zhpe_offloaded_hw_wq_entry *wqe,
+                              void *context, uint8_t flags)
+{
+    int32_t             ret;
+
+    if (zq->flags & ZHPEQ_ALLOC_SP) {
+        ret = (cindex + 1) & (zq->xqinfo.cmdq.ent - 1);
+        flags |= CTX_BUSY;
+    } else
+        ret = (int32_t)(uintptr_t)zq->context[cindex];
+    zq->context[cindex] = context;
+    zq->context_flags[cindex] = flags;
+    wqe->hdr.cmp_index = cindex;
+
+    return ret;
+}
+
+static inline void set_context(struct zhpeq *zq,
+                               union zhpe_offloaded_hw_wq_entry *wqe,
+                               void *context)
+{
+    zhpeu_trace();
+    (void)ctx_set(zq, ctx_alloc(zq, wqe - zq->wq, 1), wqe, context, 0);
+}
+
+static inline void wqe_nop(union zhpe_offloaded_hw_wq_entry *wqe, bool fence)
+{
+    wqe->hdr.opcode = ZHPE_OFFLOADED_HW_OPCODE_NOP;
+    wqe->hdr.opcode |= (fence ? ZHPE_OFFLOADED_HW_OPCODE_FENCE : 0);
+}
+
 int zhpeq_nop(struct zhpeq *zq, uint32_t qindex, bool fence,
               void *context)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret = -EINVAL;
     union zhpe_offloaded_hw_wq_entry *wqe;
 
@@ -495,7 +945,7 @@ int zhpeq_nop(struct zhpeq *zq, uint32_t qindex, bool fence,
     qindex = qindex & (zq->xqinfo.cmdq.ent - 1);
     wqe = zq->wq + qindex;
 
-    wqe->hdr.opcode = ZHPE_OFFLOADED_HW_OPCODE_NOP;
+    wqe_nop(wqe, fence);
     set_context(zq, wqe, context);
 
     ret = 0;
@@ -504,29 +954,41 @@ int zhpeq_nop(struct zhpeq *zq, uint32_t qindex, bool fence,
     return ret;
 }
 
+static inline int rw_check(size_t len)
+{
+    return (len > b_attr.z.max_dma_len ? -EINVAL : 0);
+}
+
+static inline void wqe_rw(union zhpe_offloaded_hw_wq_entry *wqe, bool fence,
+                          uint64_t rd_addr, size_t len, uint64_t wr_addr,
+                          uint16_t opcode)
+{
+    opcode |= (fence ? ZHPE_OFFLOADED_HW_OPCODE_FENCE : 0);
+    wqe->hdr.opcode = opcode;
+    wqe->dma.len = len;
+    wqe->dma.rd_addr = rd_addr;
+    wqe->dma.wr_addr = wr_addr;
+}
+
 static inline int zhpeq_rw(struct zhpeq *zq, uint32_t qindex, bool fence,
                            uint64_t rd_addr, size_t len, uint64_t wr_addr,
                            void *context, uint16_t opcode)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret = -EINVAL;
     union zhpe_offloaded_hw_wq_entry *wqe;
 
     if (!zq)
         goto done;
-    if (len > b_attr.z.max_dma_len)
+    ret = rw_check(len);
+    if (ret < 0)
         goto done;
 
     qindex = qindex & (zq->xqinfo.cmdq.ent - 1);
     wqe = zq->wq + qindex;
 
-    opcode |= (fence ? ZHPE_OFFLOADED_HW_OPCODE_FENCE : 0);
-    wqe->hdr.opcode = opcode;
+    wqe_rw(wqe, fence, rd_addr, len, wr_addr, opcode);
     set_context(zq, wqe, context);
-    wqe->dma.len = len;
-    wqe->dma.rd_addr = rd_addr;
-    wqe->dma.wr_addr = wr_addr;
-    ret = 0;
 
  done:
     return ret;
@@ -536,35 +998,53 @@ int zhpeq_put(struct zhpeq *zq, uint32_t qindex, bool fence,
               uint64_t lcl_addr, size_t len, uint64_t rem_addr,
               void *context)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     return zhpeq_rw(zq, qindex, fence, lcl_addr, len, rem_addr, context,
                     ZHPE_OFFLOADED_HW_OPCODE_PUT);
 }
 
+static inline int imm_check(const void *buf, size_t len, bool put)
+{
+    union zhpe_offloaded_hw_wq_entry *wqe;
+
+    if ((put && !buf) || !len || len > sizeof(wqe->imm.data))
+        return -EINVAL;
+
+    return 0;
+}
+
+static inline void wqe_imm(union zhpe_offloaded_hw_wq_entry *wqe, bool fence,
+                           const void *buf, size_t len, uint64_t remote_addr,
+                           uint16_t opcode)
+{
+    wqe->hdr.opcode = opcode;
+    wqe->hdr.opcode |= (fence ? ZHPE_OFFLOADED_HW_OPCODE_FENCE : 0);
+    wqe->imm.len = len;
+    wqe->imm.rem_addr = remote_addr;
+    if (buf)
+        memcpy(wqe->imm.data, buf, len);
+}
+
 int zhpeq_puti(struct zhpeq *zq, uint32_t qindex, bool fence,
                const void *buf, size_t len, uint64_t remote_addr,
                void *context)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret = -EINVAL;
     union zhpe_offloaded_hw_wq_entry *wqe;
 
     if (!zq)
         goto done;
-    if (!buf || !len || len > sizeof(wqe->imm.data))
+    ret = imm_check(buf, len, true);
+    if (ret < 0)
         goto done;
 
     qindex = qindex & (zq->xqinfo.cmdq.ent - 1);
     wqe = zq->wq + qindex;
 
-    wqe->hdr.opcode = ZHPE_OFFLOADED_HW_OPCODE_PUTIMM;
-    wqe->hdr.opcode |= (fence ? ZHPE_OFFLOADED_HW_OPCODE_FENCE : 0);
+    wqe_imm(wqe, fence, buf, len, remote_addr,
+            ZHPE_OFFLOADED_HW_OPCODE_PUTIMM);
     set_context(zq, wqe, context);
-    wqe->imm.len = len;
-    wqe->imm.rem_addr = remote_addr;
-    memcpy(wqe->imm.data, buf, len);
-
-    ret = 0;
 
  done:
     return ret;
@@ -574,7 +1054,7 @@ int zhpeq_get(struct zhpeq *zq, uint32_t qindex, bool fence,
               uint64_t lcl_addr, size_t len, uint64_t rem_addr,
               void *context)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     return zhpeq_rw(zq, qindex, fence, rem_addr, len, lcl_addr, context,
                     ZHPE_OFFLOADED_HW_OPCODE_GET);
 }
@@ -582,49 +1062,73 @@ int zhpeq_get(struct zhpeq *zq, uint32_t qindex, bool fence,
 int zhpeq_geti(struct zhpeq *zq, uint32_t qindex, bool fence,
                size_t len, uint64_t remote_addr, void *context)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret = -EINVAL;
     union zhpe_offloaded_hw_wq_entry *wqe;
 
     if (!zq)
         goto done;
-    if (!len || len > sizeof(wqe->imm.data))
+    ret = imm_check(NULL, len, false);
+    if (ret < 0)
         goto done;
 
     qindex = qindex & (zq->xqinfo.cmdq.ent - 1);
     wqe = zq->wq + qindex;
 
-    wqe->hdr.opcode = ZHPE_OFFLOADED_HW_OPCODE_GETIMM;
-    wqe->hdr.opcode |= (fence ? ZHPE_OFFLOADED_HW_OPCODE_FENCE : 0);
+    wqe_imm(wqe, fence, NULL, len, remote_addr,
+            ZHPE_OFFLOADED_HW_OPCODE_GETIMM);
     set_context(zq, wqe, context);
-    wqe->imm.len = len;
-    wqe->imm.rem_addr = remote_addr;
 
-    ret = 0;
  done:
     return ret;
 }
 
-int zhpeq_atomic(struct zhpeq *zq, uint32_t qindex, bool fence, bool retval,
-                 enum zhpeq_atomic_size datasize, enum zhpeq_atomic_op op,
-                 uint64_t remote_addr, const union zhpeq_atomic *operands,
-                 void *context)
+static inline int atomic_check(enum zhpeq_atomic_size datasize,
+                               enum zhpeq_atomic_op op,
+                               const union zhpeq_atomic *operands)
 {
-    PRINT_DEBUG;
-    int                 ret = -EINVAL;
-    union zhpe_offloaded_hw_wq_entry *wqe;
-    size_t              n_operands;
-
-    if (!zq)
-        goto done;
     if (!operands)
-        goto done;
+        return -EINVAL;
 
-    qindex = qindex & (zq->xqinfo.cmdq.ent - 1);
-    wqe = zq->wq + qindex;
+    switch (op) {
+
+    case ZHPEQ_ATOMIC_SWAP:
+    case ZHPEQ_ATOMIC_ADD:
+    case ZHPEQ_ATOMIC_AND:
+    case ZHPEQ_ATOMIC_OR:
+    case ZHPEQ_ATOMIC_XOR:
+    case ZHPEQ_ATOMIC_SMIN:
+    case ZHPEQ_ATOMIC_SMAX:
+    case ZHPEQ_ATOMIC_UMIN:
+    case ZHPEQ_ATOMIC_UMAX:
+    case ZHPEQ_ATOMIC_CAS:
+        break;
+
+    default:
+        return -EINVAL;
+    }
+
+    switch (datasize) {
+
+    case ZHPEQ_ATOMIC_SIZE32:
+    case ZHPEQ_ATOMIC_SIZE64:
+        break;
+
+    default:
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static inline void wqe_atomic(union zhpe_offloaded_hw_wq_entry *wqe, bool fence,
+                              bool retval, enum zhpeq_atomic_size datasize,
+                              enum zhpeq_atomic_op op, uint64_t remote_addr,
+                              const union zhpeq_atomic *operands)
+{
+    size_t              n_operands;
 
     wqe->hdr.opcode = (fence ? ZHPE_OFFLOADED_HW_OPCODE_FENCE : 0);
-    set_context(zq, wqe, context);
 
     switch (op) {
 
@@ -643,8 +1147,43 @@ int zhpeq_atomic(struct zhpeq *zq, uint32_t qindex, bool fence, bool retval,
         n_operands = 1;
         break;
 
+    case ZHPEQ_ATOMIC_AND:
+        wqe->hdr.opcode |= ZHPE_OFFLOADED_HW_OPCODE_ATM_AND;
+        n_operands = 1;
+        break;
+
+    case ZHPEQ_ATOMIC_OR:
+        wqe->hdr.opcode |= ZHPE_OFFLOADED_HW_OPCODE_ATM_OR;
+        n_operands = 1;
+        break;
+
+    case ZHPEQ_ATOMIC_XOR:
+        wqe->hdr.opcode |= ZHPE_OFFLOADED_HW_OPCODE_ATM_XOR;
+        n_operands = 1;
+        break;
+
+    case ZHPEQ_ATOMIC_SMIN:
+        wqe->hdr.opcode |= ZHPE_OFFLOADED_HW_OPCODE_ATM_SMIN;
+        n_operands = 1;
+        break;
+
+    case ZHPEQ_ATOMIC_SMAX:
+        wqe->hdr.opcode |= ZHPE_OFFLOADED_HW_OPCODE_ATM_SMAX;
+        n_operands = 1;
+        break;
+
+    case ZHPEQ_ATOMIC_UMIN:
+        wqe->hdr.opcode |= ZHPE_OFFLOADED_HW_OPCODE_ATM_UMIN;
+        n_operands = 1;
+        break;
+
+    case ZHPEQ_ATOMIC_UMAX:
+        wqe->hdr.opcode |= ZHPE_OFFLOADED_HW_OPCODE_ATM_UMAX;
+        n_operands = 1;
+        break;
+
     default:
-        goto done;
+        abort();
     }
 
     wqe->atm.size = (retval ? ZHPE_OFFLOADED_HW_ATOMIC_RETURN : 0);
@@ -660,15 +1199,402 @@ int zhpeq_atomic(struct zhpeq *zq, uint32_t qindex, bool fence, bool retval,
         break;
 
     default:
-        goto done;
+        abort();
     }
 
-    wqe->hdr.cmp_index = qindex;
     wqe->atm.rem_addr = remote_addr;
     while (n_operands-- > 0)
         wqe->atm.operands[n_operands] = operands[n_operands].z;
+}
 
-    ret = 0;
+int zhpeq_atomic(struct zhpeq *zq, uint32_t qindex, bool fence, bool retval,
+                 enum zhpeq_atomic_size datasize, enum zhpeq_atomic_op op,
+                 uint64_t remote_addr, const union zhpeq_atomic *operands,
+                 void *context)
+{
+    zhpeu_trace();
+    int                 ret = -EINVAL;
+    union zhpe_offloaded_hw_wq_entry *wqe;
+
+    if (!zq)
+        goto done;
+    ret = atomic_check(datasize, op, operands);
+    if (ret < 0)
+        goto done;
+
+    qindex = qindex & (zq->xqinfo.cmdq.ent - 1);
+    wqe = zq->wq + qindex;
+
+    wqe_atomic(wqe, fence, retval, datasize, op, remote_addr, operands);
+    set_context(zq, wqe, context);
+
+ done:
+    return ret;
+}
+
+int zhpeq_atomicv(struct zhpeq *zq, bool fence,
+                  enum zhpeq_atomic_size datasize,
+                  const struct zhpeq_atomic_ent *ents, size_t n_ents,
+                  void *results, void *context)
+{
+    zhpeu_trace();
+    int                 ret = -EINVAL;
+    struct zhpeq_atmv   *atmv = NULL;
+    union zhpe_offloaded_hw_wq_entry *wqe;
+    size_t              req;
+    size_t              i;
+    size_t              n_wqe;
+    int64_t             qindex;
+    uint32_t            qmask;
+    int32_t             cindex;
+
+    if (!zq || !ents || n_ents < 1 || n_ents > UINT32_MAX)
+        goto done;
+    for (i = 0; i < n_ents; i++) {
+        ret = atomic_check(datasize, ents[i].op, ents[i].operands);
+        if (ret < 0)
+            goto done;
+    }
+    ret = -EINVAL;
+    qmask = zq->xqinfo.cmdq.ent - 1;
+    n_wqe = (b_zhpe ? n_ents : 1);
+    if (n_wqe > qmask)
+        goto done;
+    ret = -EAGAIN;
+    if (commit_pending(zq))
+        goto done;
+
+    ret = -ENOMEM;
+    req = sizeof(*atmv) + n_ents * sizeof(atmv->ent[0]);
+    if (b_zhpe)
+        req += n_ents * sizeof(atmv->elem[0]);
+    atmv = malloc(req);
+    if (!atmv)
+        goto done;
+    atmv->context = context;
+    atmv->results = results;
+    atmv->n_ent = n_ents;
+    atmv->posted = 0;
+    atmv->status = ZHPEQ_CQ_STATUS_SUCCESS;
+    atmv->size = (datasize == ZHPEQ_ATOMIC_SIZE64 ?
+                  sizeof(uint64_t) : sizeof(uint32_t));
+    memcpy(atmv->ent, ents, n_ents * sizeof(atmv->ent[0]));
+    atmv->elem = (b_zhpe ? (void *)(atmv->ent + n_ents) : NULL);
+    /* The backend holds one count until it has posted every element. */
+    atmv->pending = (b_zhpe ? n_ents : 1);
+
+    qindex = zhpeq_reserve(zq, n_wqe);
+    if (qindex < 0) {
+        ret = qindex;
+        goto done;
+    }
+    if (!b_zhpe) {
+        wqe = zq->wq + (qindex & qmask);
+        wqe->hdr.opcode = ZHPEQ_SW_OPCODE_ATMV;
+        wqe->hdr.opcode |= (fence ? ZHPE_OFFLOADED_HW_OPCODE_FENCE : 0);
+        wqe->dma.len = n_ents;
+        wqe->dma.rd_addr = (uintptr_t)atmv;
+        wqe->dma.wr_addr = 0;
+        set_context(zq, wqe, context);
+    } else {
+        /* The fence goes on the first element. */
+        cindex = ctx_alloc(zq, qindex & qmask, n_wqe);
+        for (i = 0; i < n_wqe; i++) {
+            wqe = zq->wq + ((qindex + i) & qmask);
+            wqe_atomic(wqe, (fence && !i), !!results, datasize, ents[i].op,
+                       ents[i].rem_addr, ents[i].operands);
+            atmv->elem[i].atmv = atmv;
+            atmv->elem[i].idx = i;
+            cindex = ctx_set(zq, cindex, wqe, &atmv->elem[i], CTX_ATMV);
+        }
+    }
+    atmv = NULL;
+
+    /* Wait for other threads' earlier reservations to be committed. */
+    while ((ret = zhpeq_commit(zq, qindex, n_wqe)) == -EAGAIN)
+        nop();
+
+ done:
+    free(atmv);
+
+    return ret;
+}
+
+struct iov_walk {
+    const struct zhpeq_iov *lcl;
+    const struct zhpeq_iov *rem;
+    size_t              n_lcl;
+    size_t              n_rem;
+    size_t              l;
+    size_t              r;
+    uint64_t            loff;
+    uint64_t            roff;
+};
+
+/* Next piece that is contiguous on both sides. */
+static inline bool iov_next(struct iov_walk *w, uint64_t *laddr,
+                            uint64_t *raddr, size_t *len)
+{
+    if (w->l >= w->n_lcl || w->r >= w->n_rem)
+        return false;
+    *laddr = w->lcl[w->l].addr + w->loff;
+    *raddr = w->rem[w->r].addr + w->roff;
+    *len = w->lcl[w->l].len - w->loff;
+    if (*len > w->rem[w->r].len - w->roff)
+        *len = w->rem[w->r].len - w->roff;
+    w->loff += *len;
+    w->roff += *len;
+    if (w->loff == w->lcl[w->l].len) {
+        w->l++;
+        w->loff = 0;
+    }
+    if (w->roff == w->rem[w->r].len) {
+        w->r++;
+        w->roff = 0;
+    }
+
+    return true;
+}
+
+static int zhpeq_rwv(struct zhpeq *zq, bool fence,
+                     const struct zhpeq_iov *lcl, size_t n_lcl,
+                     const struct zhpeq_iov *rem, size_t n_rem,
+                     void *context, bool put)
+{
+    zhpeu_trace();
+    int                 ret = -EINVAL;
+    struct zhpeq_vec    *vec = NULL;
+    struct iov_walk     walk = {
+        .lcl            = lcl,
+        .rem            = rem,
+        .n_lcl          = n_lcl,
+        .n_rem          = n_rem,
+    };
+    union zhpe_offloaded_hw_wq_entry *wqe;
+    uint64_t            lcl_len = 0;
+    uint64_t            rem_len = 0;
+    uint64_t            laddr;
+    uint64_t            raddr;
+    size_t              len;
+    size_t              i;
+    size_t              n_wqe;
+    int64_t             qindex;
+    uint32_t            qmask;
+    int32_t             cindex;
+
+    if (!zq || !lcl || !rem || n_lcl < 1 || n_lcl > ZHPEQ_IOV_MAX ||
+        n_rem < 1 || n_rem > ZHPEQ_IOV_MAX)
+        goto done;
+    for (i = 0; i < n_lcl; i++) {
+        if (!lcl[i].len)
+            goto done;
+        lcl_len += lcl[i].len;
+    }
+    for (i = 0; i < n_rem; i++) {
+        if (!rem[i].len)
+            goto done;
+        rem_len += rem[i].len;
+    }
+    if (lcl_len != rem_len || lcl_len > b_attr.z.max_dma_len)
+        goto done;
+    qmask = zq->xqinfo.cmdq.ent - 1;
+    if (commit_pending(zq)) {
+        ret = -EAGAIN;
+        goto done;
+    }
+
+    ret = -ENOMEM;
+    vec = malloc(sizeof(*vec) + (n_lcl + n_rem) * sizeof(vec->iov[0]));
+    if (!vec)
+        goto done;
+    vec->context = context;
+    vec->status = ZHPEQ_CQ_STATUS_SUCCESS;
+    vec->n_lcl = n_lcl;
+    vec->n_rem = n_rem;
+    memcpy(vec->iov, lcl, n_lcl * sizeof(vec->iov[0]));
+    memcpy(vec->iov + n_lcl, rem, n_rem * sizeof(vec->iov[0]));
+
+    if (!b_zhpe) {
+        /* The backend walks the lists itself. */
+        qindex = zhpeq_reserve(zq, 1);
+        if (qindex < 0) {
+            ret = qindex;
+            goto done;
+        }
+        n_wqe = 1;
+        wqe = zq->wq + (qindex & qmask);
+        wqe->hdr.opcode = (put ? ZHPEQ_SW_OPCODE_PUTV : ZHPEQ_SW_OPCODE_GETV);
+        wqe->hdr.opcode |= (fence ? ZHPE_OFFLOADED_HW_OPCODE_FENCE : 0);
+        wqe->dma.len = lcl_len;
+        wqe->dma.rd_addr = (uintptr_t)vec;
+        wqe->dma.wr_addr = 0;
+        set_context(zq, wqe, context);
+        vec = NULL;
+    } else {
+        /*
+         * Chain one WQE per contiguous piece; every piece gets a context
+         * slot pointing at vec and zhpeq_cq_read() reports only the last
+         * one to complete. The fence goes on the first piece.
+         */
+        for (n_wqe = 0; iov_next(&walk, &laddr, &raddr, &len); n_wqe++);
+        ret = -EINVAL;
+        if (n_wqe > qmask)
+            goto done;
+        walk.l = walk.r = walk.loff = walk.roff = 0;
+        vec->pending = n_wqe;
+        qindex = zhpeq_reserve(zq, n_wqe);
+        if (qindex < 0) {
+            ret = qindex;
+            goto done;
+        }
+        cindex = ctx_alloc(zq, qindex & qmask, n_wqe);
+        for (i = 0; iov_next(&walk, &laddr, &raddr, &len); i++) {
+            wqe = zq->wq + ((qindex + i) & qmask);
+            if (put)
+                wqe_rw(wqe, (fence && !i), laddr, len, raddr,
+                       ZHPE_OFFLOADED_HW_OPCODE_PUT);
+            else
+                wqe_rw(wqe, (fence && !i), raddr, len, laddr,
+                       ZHPE_OFFLOADED_HW_OPCODE_GET);
+            cindex = ctx_set(zq, cindex, wqe, vec, CTX_VEC);
+        }
+        vec = NULL;
+    }
+
+    /* Wait for other threads' earlier reservations to be committed. */
+    while ((ret = zhpeq_commit(zq, qindex, n_wqe)) == -EAGAIN)
+        nop();
+
+ done:
+    free(vec);
+
+    return ret;
+}
+
+int zhpeq_putv(struct zhpeq *zq, bool fence,
+               const struct zhpeq_iov *lcl, size_t n_lcl,
+               const struct zhpeq_iov *rem, size_t n_rem, void *context)
+{
+    zhpeu_trace();
+    return zhpeq_rwv(zq, fence, lcl, n_lcl, rem, n_rem, context, true);
+}
+
+int zhpeq_getv(struct zhpeq *zq, bool fence,
+               const struct zhpeq_iov *lcl, size_t n_lcl,
+               const struct zhpeq_iov *rem, size_t n_rem, void *context)
+{
+    zhpeu_trace();
+    return zhpeq_rwv(zq, fence, lcl, n_lcl, rem, n_rem, context, false);
+}
+
+static int op_check(const struct zhpeq_op *zop)
+{
+    switch (zop->op) {
+
+    case ZHPEQ_OP_NOP:
+        return (zop->context ? 0 : -EINVAL);
+
+    case ZHPEQ_OP_PUT:
+    case ZHPEQ_OP_GET:
+        return rw_check(zop->rw.len);
+
+    case ZHPEQ_OP_PUTI:
+        return imm_check(zop->imm.buf, zop->imm.len, true);
+
+    case ZHPEQ_OP_GETI:
+        return imm_check(NULL, zop->imm.len, false);
+
+    case ZHPEQ_OP_ATOMIC:
+        return atomic_check(zop->atm.datasize, zop->atm.op,
+                            zop->atm.operands);
+
+    default:
+        return -EINVAL;
+    }
+}
+
+static void op_fill(union zhpe_offloaded_hw_wq_entry *wqe,
+                    const struct zhpeq_op *zop)
+{
+    switch (zop->op) {
+
+    case ZHPEQ_OP_NOP:
+        wqe_nop(wqe, zop->fence);
+        break;
+
+    case ZHPEQ_OP_PUT:
+        wqe_rw(wqe, zop->fence, zop->rw.lcl_addr, zop->rw.len,
+               zop->rw.rem_addr, ZHPE_OFFLOADED_HW_OPCODE_PUT);
+        break;
+
+    case ZHPEQ_OP_GET:
+        wqe_rw(wqe, zop->fence, zop->rw.rem_addr, zop->rw.len,
+               zop->rw.lcl_addr, ZHPE_OFFLOADED_HW_OPCODE_GET);
+        break;
+
+    case ZHPEQ_OP_PUTI:
+        wqe_imm(wqe, zop->fence, zop->imm.buf, zop->imm.len,
+                zop->imm.rem_addr, ZHPE_OFFLOADED_HW_OPCODE_PUTIMM);
+        break;
+
+    case ZHPEQ_OP_GETI:
+        wqe_imm(wqe, zop->fence, NULL, zop->imm.len,
+                zop->imm.rem_addr, ZHPE_OFFLOADED_HW_OPCODE_GETIMM);
+        break;
+
+    case ZHPEQ_OP_ATOMIC:
+        wqe_atomic(wqe, zop->fence, zop->atm.retval, zop->atm.datasize,
+                   zop->atm.op, zop->atm.rem_addr, zop->atm.operands);
+        break;
+
+    default:
+        abort();
+    }
+}
+
+int zhpeq_submit_batch(struct zhpeq *zq, const struct zhpeq_op *zops,
+                       size_t n_ops)
+{
+    zhpeu_trace();
+    int                 ret = -EINVAL;
+    union zhpe_offloaded_hw_wq_entry *wqe;
+    int64_t             qindex;
+    uint32_t            qmask;
+    int32_t             cindex;
+    size_t              i;
+
+    if (!zq || !zops)
+        goto done;
+    qmask = zq->xqinfo.cmdq.ent - 1;
+    if (n_ops < 1 || n_ops > qmask)
+        goto done;
+
+    /* Nothing can fail once the slots are reserved. */
+    for (i = 0; i < n_ops; i++) {
+        ret = op_check(&zops[i]);
+        if (ret < 0)
+            goto done;
+    }
+
+    if (commit_pending(zq)) {
+        ret = -EAGAIN;
+        goto done;
+    }
+    qindex = zhpeq_reserve(zq, n_ops);
+    if (qindex < 0) {
+        ret = qindex;
+        goto done;
+    }
+    cindex = ctx_alloc(zq, qindex & qmask, n_ops);
+    for (i = 0; i < n_ops; i++) {
+        wqe = zq->wq + ((qindex + i) & qmask);
+        op_fill(wqe, &zops[i]);
+        cindex = ctx_set(zq, cindex, wqe, zops[i].context, 0);
+    }
+
+    /* Wait for other threads' earlier reservations to be committed. */
+    while ((ret = zhpeq_commit(zq, qindex, n_ops)) == -EAGAIN)
+        nop();
 
  done:
     return ret;
@@ -677,7 +1603,7 @@ int zhpeq_atomic(struct zhpeq *zq, uint32_t qindex, bool fence, bool retval,
 int zhpeq_mr_reg(struct zhpeq_dom *zdom, const void *buf, size_t len,
                  uint32_t access, struct zhpeq_key_data **qkdata_out)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     zhpe_offloaded_stats_start(zhpe_offloaded_stats_subid(ZHPQ, 0));
 
     int                 ret = -EINVAL;
@@ -688,7 +1614,10 @@ int zhpeq_mr_reg(struct zhpeq_dom *zdom, const void *buf, size_t len,
     if (!zdom)
          goto done;
 
-    ret = b_ops->mr_reg(zdom, buf, len, access, qkdata_out);
+    if (zdom->mr_cache)
+        ret = zhpeq_mr_cache_reg(zdom, buf, len, access, qkdata_out);
+    else
+        ret = b_ops->mr_reg(zdom, buf, len, access, qkdata_out);
 #if QKDATA_DUMP
     if (ret >= 0)
         zhpeq_print_qkdata(__func__, __LINE__, zdom, *qkdata_out);
@@ -700,9 +1629,46 @@ int zhpeq_mr_reg(struct zhpeq_dom *zdom, const void *buf, size_t len,
     return ret;
 }
 
+int zhpeq_mr_reg_batch(struct zhpeq_dom *zdom, const struct zhpeq_iov *iov,
+                       size_t n_iov, uint32_t access,
+                       struct zhpeq_key_data **qkdata_out)
+{
+    zhpeu_trace();
+    int                 ret = -EINVAL;
+    size_t              i;
+
+    if (!qkdata_out)
+        goto done;
+    memset(qkdata_out, 0, n_iov * sizeof(*qkdata_out));
+    if (!zdom || (n_iov && !iov))
+        goto done;
+
+    /* The cache works a key at a time. */
+    if (b_ops->mr_reg_batch && !zdom->mr_cache) {
+        ret = b_ops->mr_reg_batch(zdom, iov, n_iov, access, qkdata_out);
+        goto done;
+    }
+    for (i = 0; i < n_iov; i++) {
+        ret = zhpeq_mr_reg(zdom, (void *)(uintptr_t)iov[i].addr, iov[i].len,
+                           access, &qkdata_out[i]);
+        if (ret < 0) {
+            while (i > 0) {
+                i--;
+                (void)zhpeq_mr_free(zdom, qkdata_out[i]);
+                qkdata_out[i] = NULL;
+            }
+            goto done;
+        }
+    }
+    ret = 0;
+
+ done:
+    return ret;
+}
+
 int zhpeq_mr_free(struct zhpeq_dom *zdom, struct zhpeq_key_data *qkdata)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     zhpe_offloaded_stats_start(zhpe_offloaded_stats_subid(ZHPQ, 10));
 
     int                 ret = 0;
@@ -716,7 +1682,10 @@ int zhpeq_mr_free(struct zhpeq_dom *zdom, struct zhpeq_key_data *qkdata)
 #if QKDATA_DUMP
     zhpeq_print_qkdata(__func__, __LINE__, zdom, qkdata);
 #endif
-    ret = b_ops->mr_free(zdom, qkdata);
+    if (zdom->mr_cache)
+        ret = zhpeq_mr_cache_free(zdom, qkdata);
+    else
+        ret = b_ops->mr_free(zdom, qkdata);
 
  done:
     zhpe_offloaded_stats_stop(zhpe_offloaded_stats_subid(ZHPQ, 10));
@@ -728,7 +1697,7 @@ int zhpeq_zmmu_import(struct zhpeq_dom *zdom, int open_idx, const void *blob,
                       size_t blob_len, bool cpu_visible,
                       struct zhpeq_key_data **qkdata_out)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     zhpe_offloaded_stats_start(zhpe_offloaded_stats_subid(ZHPQ, 40));
 
     int                 ret = -EINVAL;
@@ -755,7 +1724,7 @@ int zhpeq_zmmu_import(struct zhpeq_dom *zdom, int open_idx, const void *blob,
 int zhpeq_zmmu_fam_import(struct zhpeq_dom *zdom, int open_idx,
                           bool cpu_visible, struct zhpeq_key_data **qkdata_out)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret = -EINVAL;
 
     zhpe_offloaded_stats_start(zhpe_offloaded_stats_subid(ZHPQ, 20));
@@ -786,7 +1755,7 @@ int zhpeq_zmmu_export(struct zhpeq_dom *zdom,
                       const struct zhpeq_key_data *qkdata,
                       void *blob, size_t *blob_len)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     zhpe_offloaded_stats_start(zhpe_offloaded_stats_subid(ZHPQ, 30));
 
     int                 ret = -EINVAL;
@@ -811,7 +1780,7 @@ int zhpeq_zmmu_export(struct zhpeq_dom *zdom,
 
 int zhpeq_zmmu_free(struct zhpeq_dom *zdom, struct zhpeq_key_data *qkdata)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret = 0;
 
     zhpe_offloaded_stats_start(zhpe_offloaded_stats_subid(ZHPQ, 50));
@@ -836,14 +1805,27 @@ int zhpeq_zmmu_free(struct zhpeq_dom *zdom, struct zhpeq_key_data *qkdata)
 ssize_t zhpeq_cq_read(struct zhpeq *zq, struct zhpeq_cq_entry *entries,
                       size_t n_entries)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     ssize_t             ret = -EINVAL;
     bool                polled = false;
     union zhpe_offloaded_hw_cq_entry *cqe;
-    ssize_t             i;
+    struct zhpe_offloaded_cq_entry *entry;
+    struct zhpeq_vec    *vec;
+    struct zhpeq_atmv_elem *elem;
+    struct zhpeq_atmv   *atmv;
+    struct ctx_tls      *tls;
+    void                *context;
+    size_t              i;
+    size_t              j;
+    size_t              n;
+    size_t              n_err = 0;
     uint32_t            qmask;
     uint32_t            old;
     uint32_t            new;
+    int32_t             first;
+    int32_t             prev;
+    uint32_t            n_free;
+    uint8_t             flags;
 
     if (!zq || !entries || n_entries > SSIZE_MAX)
         goto done;
@@ -851,9 +1833,15 @@ ssize_t zhpeq_cq_read(struct zhpeq *zq, struct zhpeq_cq_entry *entries,
     qmask = zq->xqinfo.cmplq.ent - 1;
 
     for (i = 0, old = atm_load_rlx(&zq->head_tail.head) ; i < n_entries ;) {
-        cqe = zq->cq + (old & qmask);
-        if ((atm_load_rlx((uint8_t *)cqe) & ZHPE_OFFLOADED_HW_CQ_VALID) !=
-             cq_valid(old, qmask)) {
+        /* Copy out the run of valid entries and claim it with one CAS. */
+        for (n = 0; i + n < n_entries; n++) {
+            cqe = zq->cq + ((old + n) & qmask);
+            if ((atm_load_rlx((uint8_t *)cqe) & ZHPE_OFFLOADED_HW_CQ_VALID) !=
+                cq_valid(old + n, qmask))
+                break;
+            entries[i + n].z = cqe->entry;
+        }
+        if (!n) {
             if (i > 0 || !b_ops->cq_poll || polled) {
                 if (i == 0)
                     zhpe_offloaded_stats_stamp(zhpe_offloaded_stats_subid(ZHPQ, 70), (uintptr_t)zq);
@@ -865,17 +1853,188 @@ ssize_t zhpeq_cq_read(struct zhpeq *zq, struct zhpeq_cq_entry *entries,
             polled = true;
             continue;
         }
-        entries[i].z = cqe->entry;
-        new = old + 1;
-        if (!atm_cmpxchg(&zq->head_tail.head, &old, new))
+        new = old + n;
+        if (zq->flags & ZHPEQ_ALLOC_SC)
+            atm_store(&zq->head_tail.head, new);
+        else if (!atm_cmpxchg(&zq->head_tail.head, &old, new))
             continue;
-        entries[i].z.context = get_context(zq, &entries[i].z);
-        zhpe_offloaded_stats_stamp(zhpe_offloaded_stats_subid(ZHPQ, 80), (uintptr_t)zq,
-                         entries[i].z.index, (uintptr_t)entries[i].z.context);
         old = new;
-        i++;
+
+        /*
+         * Fetch the contexts, compacting out the swallowed pieces of
+         * chained zhpeq_putv()/zhpeq_getv(), and chain the slots together
+         * so they can be freed at once.
+         */
+        first = prev = -1;
+        n_free = n;
+        for (j = i, n += i; j < n; j++) {
+            entry = &entries[j].z;
+            context = zq->context[entry->index];
+            flags = zq->context_flags[entry->index];
+            if (zq->flags & ZHPEQ_ALLOC_SP)
+                atm_store(&zq->context_flags[entry->index], 0);
+            else if (first < 0)
+                first = entry->index;
+            else
+                zq->context[prev] = TO_PTR(entry->index);
+            prev = entry->index;
+            if (unlikely(flags & CTX_VEC)) {
+                vec = context;
+                if (entry->status != ZHPEQ_CQ_STATUS_SUCCESS)
+                    atm_store_rlx(&vec->status, entry->status);
+                if (zq->flags & ZHPEQ_ALLOC_SC) {
+                    if (--vec->pending > 0)
+                        continue;
+                } else if (atm_dec(&vec->pending) > 1)
+                    continue;
+                context = vec->context;
+                entry->status = atm_load_rlx(&vec->status);
+                free(vec);
+            } else if (unlikely(flags & CTX_ATMV)) {
+                elem = context;
+                atmv = elem->atmv;
+                if (entry->status != ZHPEQ_CQ_STATUS_SUCCESS)
+                    atm_store_rlx(&atmv->status, entry->status);
+                else if (atmv->results)
+                    memcpy((char *)atmv->results + elem->idx * atmv->size,
+                           entry->result.data, atmv->size);
+                if (zq->flags & ZHPEQ_ALLOC_SC) {
+                    if (--atmv->pending > 0)
+                        continue;
+                } else if (atm_dec(&atmv->pending) > 1)
+                    continue;
+                context = atmv->context;
+                entry->status = atm_load_rlx(&atmv->status);
+                free(atmv);
+            }
+            entries[i].z = *entry;
+            entries[i].z.context = context;
+            if (unlikely(entry->status != ZHPEQ_CQ_STATUS_SUCCESS))
+                n_err++;
+            zhpe_offloaded_stats_stamp(zhpe_offloaded_stats_subid(ZHPQ, 80), (uintptr_t)zq,
+                             entries[i].z.index, (uintptr_t)entries[i].z.context);
+            i++;
+        }
+        if (first >= 0)
+            ctx_free(zq, first, prev, n_free);
     }
     ret = i;
+    if (i) {
+        tls = tls_get(zq);
+        STATS_ADD(tls, cq_entries, i);
+        if (n_err)
+            STATS_ADD(tls, cq_errors, n_err);
+        if (i == n_entries)
+            STATS_ADD(tls, cq_read_full, 1);
+    }
+
+ done:
+    return ret;
+}
+
+static size_t cq_avail(struct zhpeq *zq, size_t n_entries)
+{
+    uint32_t            qmask = zq->xqinfo.cmplq.ent - 1;
+    uint32_t            head = atm_load_rlx(&zq->head_tail.head);
+    union zhpe_offloaded_hw_cq_entry *cqe;
+    size_t              ret;
+
+    for (ret = 0; ret < n_entries; ret++, head++) {
+        cqe = zq->cq + (head & qmask);
+        if ((atm_load_rlx((uint8_t *)cqe) & ZHPE_OFFLOADED_HW_CQ_VALID) !=
+            cq_valid(head, qmask))
+            break;
+    }
+    smp_rmb();
+
+    return ret;
+}
+
+static inline uint64_t cycles_since_ns(uint64_t start)
+{
+    return cycles_to_usec(get_cycles(NULL) - start, 1) * 1000;
+}
+
+ssize_t zhpeq_cq_wait(struct zhpeq *zq, size_t min_entries, int timeout_ms)
+{
+    zhpeu_trace();
+    ssize_t             ret = -EINVAL;
+    struct pollfd       pfd;
+    uint64_t            start;
+    uint64_t            elapsed_ns;
+    uint64_t            spin_ns;
+    uint64_t            timeout_ns;
+    uint64_t            val;
+    int                 poll_ms;
+    bool                can_block;
+    ssize_t             rc;
+
+    if (!zq || min_entries < 1 || min_entries >= zq->xqinfo.cmplq.ent)
+        goto done;
+
+    /* Spin for about twice the recent completion latency, within limits. */
+    spin_ns = 2 * atm_load_rlx(&zq->cq_wait_ns);
+    if (spin_ns < CQ_SPIN_MIN_NS)
+        spin_ns = CQ_SPIN_MIN_NS;
+    if (spin_ns > cq_spin_max_ns)
+        spin_ns = cq_spin_max_ns;
+    timeout_ns = (timeout_ms < 0 ? UINT64_MAX :
+                  (uint64_t)timeout_ms * (NS_PER_SEC / MS_PER_SEC));
+    can_block = (b_ops->cq_can_block && b_ops->cq_can_block(zq));
+
+    start = get_cycles(NULL);
+    for (;;) {
+        ret = cq_avail(zq, min_entries);
+        if ((size_t)ret >= min_entries)
+            break;
+        if (b_ops->cq_poll) {
+            rc = b_ops->cq_poll(zq, min_entries);
+            if (rc < 0) {
+                ret = rc;
+                goto done;
+            }
+        }
+        elapsed_ns = cycles_since_ns(start);
+        if (elapsed_ns >= timeout_ns)
+            goto done;
+        if (elapsed_ns < spin_ns) {
+            nop();
+            continue;
+        }
+
+        /* Block: announce ourselves, then check once more before sleeping. */
+        poll_ms = CQ_NOBLOCK_MS;
+        if (can_block) {
+            if (timeout_ms < 0)
+                poll_ms = -1;
+            else
+                poll_ms = ((timeout_ns - elapsed_ns +
+                            NS_PER_SEC / MS_PER_SEC - 1) /
+                           (NS_PER_SEC / MS_PER_SEC));
+        }
+        atm_inc(&zq->cq_waiters);
+        ret = cq_avail(zq, min_entries);
+        if ((size_t)ret < min_entries) {
+            pfd.fd = zq->cq_efd;
+            pfd.events = POLLIN;
+            if (poll(&pfd, 1, poll_ms) == -1 && errno != EINTR) {
+                ret = -errno;
+                print_func_err(__func__, __LINE__, "poll", "", ret);
+                atm_dec(&zq->cq_waiters);
+                goto done;
+            }
+            /* EAGAIN: nothing was signalled before the timeout. */
+            if (read(zq->cq_efd, &val, sizeof(val)) == -1 &&
+                errno != EAGAIN)
+                print_func_err(__func__, __LINE__, "read", "", -errno);
+        }
+        atm_dec(&zq->cq_waiters);
+    }
+
+    /* Moving average (1/8) of the time to satisfy a wait. */
+    elapsed_ns = cycles_since_ns(start);
+    val = atm_load_rlx(&zq->cq_wait_ns);
+    atm_store_rlx(&zq->cq_wait_ns, val - val / 8 + elapsed_ns / 8);
 
  done:
     return ret;
@@ -883,7 +2042,7 @@ ssize_t zhpeq_cq_read(struct zhpeq *zq, struct zhpeq_cq_entry *entries,
 
 void zhpeq_print_info(struct zhpeq *zq)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     const char          *b_str = "unknown";
     struct zhpe_offloaded_attr    *attr = &b_attr.z;
 
@@ -897,6 +2056,10 @@ void zhpeq_print_info(struct zhpeq *zq)
         b_str = "libfabric";
         break;
 
+    case ZHPEQ_BACKEND_LOOPBACK:
+        b_str = "loopback";
+        break;
+
     default:
         break;
     }
@@ -917,13 +2080,13 @@ void zhpeq_print_info(struct zhpeq *zq)
 
 struct zhpeq_dom *zhpeq_dom(struct zhpeq *zq)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     return zq->zdom;
 }
 
 int zhpeq_getaddr(struct zhpeq *zq, void *sa, size_t *sa_len)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     ssize_t             ret = -EINVAL;
 
     if (!zq || !sa || !sa_len)
@@ -938,7 +2101,7 @@ int zhpeq_getaddr(struct zhpeq *zq, void *sa, size_t *sa_len)
 void zhpeq_print_qkdata(const char *func, uint line, struct zhpeq_dom *zdom,
                         const struct zhpeq_key_data *qkdata)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     char                *id_str = NULL;
 
     if (b_ops->qkdata_id_str)
@@ -954,14 +2117,14 @@ void zhpeq_print_qkdata(const char *func, uint line, struct zhpeq_dom *zdom,
 static void print_qcm1(const char *func, uint line, const volatile void *qcm,
                       uint offset)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     printf("%s,%u:qcm[0x%03x] = 0x%lx\n",
            func, line, offset, ioread64(qcm + offset));
 }
 
 void zhpeq_print_qcm(const char *func, uint line, const struct zhpeq *zq)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     uint                i;
 
     printf("%s,%u:%s %p\n", func, line, __func__, zq->qcm);
@@ -973,6 +2136,6 @@ void zhpeq_print_qcm(const char *func, uint line, const struct zhpeq *zq)
 
 bool zhpeq_is_asic(void)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     return b_zhpe;
 }
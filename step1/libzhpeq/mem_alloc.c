@@ -0,0 +1,439 @@
+/*
+ * Copyright (C) 2019 Hewlett Packard Enterprise Development LP.
+ * All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <internal.h>
+
+#include <search.h>
+
+#include <linux/mempolicy.h>
+
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/syscall.h>
+
+/*
+ * Registered memory allocator: arenas are mapped with hugepages (falling
+ * back to transparent hugepages if none are reserved), optionally bound
+ * to the caller's NUMA node, and registered once for all access types.
+ * Small requests are carved out of 2 MiB slabs in power-of-two size
+ * classes; requests bigger than half a slab get an arena of their own.
+ * Arenas are kept until the domain is freed.
+ */
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT  (26)
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB    (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB    (30 << MAP_HUGE_SHIFT)
+#endif
+
+#define MEM_SLAB_SHIFT  (21)
+#define MEM_SLAB_SIZE   ((size_t)1 << MEM_SLAB_SHIFT)
+#define MEM_MIN_SHIFT   (6)
+#define MEM_CLASSES     (MEM_SLAB_SHIFT - MEM_MIN_SHIFT)
+#define MEM_NODES_MAX   (1024)
+
+#define MEM_ACCESS      (ZHPEQ_MR_GET | ZHPEQ_MR_PUT | \
+                         ZHPEQ_MR_GET_REMOTE | ZHPEQ_MR_PUT_REMOTE)
+#define MEM_HUGE        (ZHPEQ_MEM_HUGE_2M | ZHPEQ_MEM_HUGE_1G)
+
+struct mem_chunk {
+    struct mem_chunk    *next;
+};
+
+struct mem_pool;
+
+struct mem_arena {
+    LIST_ENTRY(mem_arena) lentry;
+    struct mem_pool     *pool;
+    void                *base;
+    size_t              len;
+    size_t              slabs_used;
+    struct zhpeq_key_data *qkdata;
+    bool                large;
+    int8_t              slab_class[];
+};
+
+struct mem_pool {
+    LIST_ENTRY(mem_pool) lentry;
+    LIST_HEAD(, mem_arena) arena_head;
+    uint32_t            huge;
+    int                 node;
+    struct mem_chunk    *free[MEM_CLASSES];
+};
+
+struct zhpeq_mem {
+    pthread_mutex_t     mutex;
+    struct backend_ops  *ops;
+    struct zhpeq_dom    *zdom;
+    size_t              arena_size;
+    LIST_HEAD(, mem_pool) pool_head;
+    void                *arena_tree;
+};
+
+/* Arenas don't overlap: any address inside one compares equal. */
+static int arena_compare(const void *key1, const void *key2)
+{
+    const struct mem_arena *a1 = key1;
+    const struct mem_arena *a2 = key2;
+
+    if ((uintptr_t)a1->base + a1->len <= (uintptr_t)a2->base)
+        return -1;
+    if ((uintptr_t)a1->base >= (uintptr_t)a2->base + a2->len)
+        return 1;
+
+    return 0;
+}
+
+static inline size_t huge_size(uint32_t huge)
+{
+    if (huge & ZHPEQ_MEM_HUGE_1G)
+        return (size_t)1 << 30;
+    if (huge & ZHPEQ_MEM_HUGE_2M)
+        return MEM_SLAB_SIZE;
+
+    return page_size;
+}
+
+static void *mem_map(size_t len, uint32_t huge, int node, int *error)
+{
+    void                *ret;
+    int                 flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    unsigned long       mask[MEM_NODES_MAX / (8 * sizeof(unsigned long))];
+
+    if (huge & ZHPEQ_MEM_HUGE_1G)
+        flags |= MAP_HUGETLB | MAP_HUGE_1GB;
+    else if (huge & ZHPEQ_MEM_HUGE_2M)
+        flags |= MAP_HUGETLB | MAP_HUGE_2MB;
+    ret = mmap(NULL, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (ret == MAP_FAILED && (flags & MAP_HUGETLB)) {
+        /* No reserved hugepages of that size: ask for transparent ones. */
+        ret = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ret != MAP_FAILED)
+            (void)madvise(ret, len, MADV_HUGEPAGE);
+    }
+    if (ret == MAP_FAILED) {
+        *error = -errno;
+        print_func_errn(__func__, __LINE__, "mmap", len, false, *error);
+        return NULL;
+    }
+    /* Before anything touches it; a failure just loses the placement. */
+    if (node >= 0 && node < MEM_NODES_MAX) {
+        memset(mask, 0, sizeof(mask));
+        mask[node / (8 * sizeof(mask[0]))] |=
+            1UL << (node % (8 * sizeof(mask[0])));
+        (void)syscall(SYS_mbind, ret, len, MPOL_PREFERRED, mask,
+                      (unsigned long)MEM_NODES_MAX, 0);
+    }
+
+    return ret;
+}
+
+static void arena_free(struct zhpeq_mem *mem, struct mem_arena *arena)
+{
+    int                 rc;
+
+    if (!arena)
+        return;
+    (void)tdelete(arena, &mem->arena_tree, arena_compare);
+    LIST_REMOVE(arena, lentry);
+    if (arena->qkdata) {
+        rc = mem->ops->mr_free(mem->zdom, arena->qkdata);
+        if (rc < 0)
+            print_func_err(__func__, __LINE__, "mr_free", "", rc);
+    }
+    if (arena->base)
+        munmap(arena->base, arena->len);
+    free(arena);
+}
+
+static struct mem_arena *arena_alloc(struct zhpeq_mem *mem,
+                                     struct mem_pool *pool, size_t len,
+                                     bool large, int *error)
+{
+    struct mem_arena    *ret;
+    size_t              hsize = huge_size(pool->huge);
+    size_t              n_slabs;
+
+    len = (len + hsize - 1) & ~(hsize - 1);
+    n_slabs = (large ? 0 : len >> MEM_SLAB_SHIFT);
+    ret = calloc(1, sizeof(*ret) + n_slabs * sizeof(ret->slab_class[0]));
+    if (!ret) {
+        *error = -ENOMEM;
+        return NULL;
+    }
+    ret->pool = pool;
+    ret->len = len;
+    ret->large = large;
+    LIST_INSERT_HEAD(&pool->arena_head, ret, lentry);
+    ret->base = mem_map(len, pool->huge, pool->node, error);
+    if (!ret->base)
+        goto fail;
+    *error = mem->ops->mr_reg(mem->zdom, ret->base, len, MEM_ACCESS,
+                              &ret->qkdata);
+    if (*error < 0) {
+        ret->qkdata = NULL;
+        goto fail;
+    }
+    if (!tsearch(ret, &mem->arena_tree, arena_compare)) {
+        *error = -ENOMEM;
+        goto fail;
+    }
+
+    return ret;
+
+ fail:
+    arena_free(mem, ret);
+
+    return NULL;
+}
+
+static struct mem_pool *pool_get(struct zhpeq_mem *mem, uint32_t huge,
+                                 int node)
+{
+    struct mem_pool     *ret;
+
+    LIST_FOREACH(ret, &mem->pool_head, lentry) {
+        if (ret->huge == huge && ret->node == node)
+            return ret;
+    }
+    ret = calloc(1, sizeof(*ret));
+    if (!ret)
+        return NULL;
+    LIST_INIT(&ret->arena_head);
+    ret->huge = huge;
+    ret->node = node;
+    LIST_INSERT_HEAD(&mem->pool_head, ret, lentry);
+
+    return ret;
+}
+
+/* Carve a fresh slab into chunks of class cls. */
+static int slab_fill(struct zhpeq_mem *mem, struct mem_pool *pool, int cls)
+{
+    int                 ret = 0;
+    struct mem_arena    *arena;
+    struct mem_chunk    *chunk;
+    size_t              csize = (size_t)1 << (cls + MEM_MIN_SHIFT);
+    size_t              slab;
+    char                *p;
+
+    LIST_FOREACH(arena, &pool->arena_head, lentry) {
+        if (!arena->large && arena->slabs_used < arena->len >> MEM_SLAB_SHIFT)
+            break;
+    }
+    if (!arena) {
+        arena = arena_alloc(mem, pool, mem->arena_size, false, &ret);
+        if (!arena)
+            return ret;
+    }
+    slab = arena->slabs_used++;
+    arena->slab_class[slab] = cls;
+    p = (char *)arena->base + (slab << MEM_SLAB_SHIFT);
+    for (p += MEM_SLAB_SIZE - csize; ; p -= csize) {
+        chunk = (void *)p;
+        chunk->next = pool->free[cls];
+        pool->free[cls] = chunk;
+        if (p == (char *)arena->base + (slab << MEM_SLAB_SHIFT))
+            break;
+    }
+
+    return ret;
+}
+
+int zhpeq_mem_init(struct zhpeq_dom *zdom, struct backend_ops *ops,
+                   uint64_t arena_size)
+{
+    struct zhpeq_mem    *mem;
+
+    mem = calloc(1, sizeof(*mem));
+    if (!mem)
+        return -ENOMEM;
+    mutex_init(&mem->mutex, NULL);
+    mem->ops = ops;
+    mem->zdom = zdom;
+    mem->arena_size = (arena_size + MEM_SLAB_SIZE - 1) & ~(MEM_SLAB_SIZE - 1);
+    if (!mem->arena_size)
+        mem->arena_size = MEM_SLAB_SIZE;
+    LIST_INIT(&mem->pool_head);
+    zdom->mem = mem;
+
+    return 0;
+}
+
+int zhpeq_mem_destroy(struct zhpeq_dom *zdom)
+{
+    struct zhpeq_mem    *mem = zdom->mem;
+    struct mem_pool     *pool;
+
+    if (!mem)
+        return 0;
+    zdom->mem = NULL;
+
+    while ((pool = LIST_FIRST(&mem->pool_head))) {
+        while (!LIST_EMPTY(&pool->arena_head))
+            arena_free(mem, LIST_FIRST(&pool->arena_head));
+        LIST_REMOVE(pool, lentry);
+        free(pool);
+    }
+    mutex_destroy(&mem->mutex);
+    free(mem);
+
+    return 0;
+}
+
+int zhpeq_mem_alloc(struct zhpeq_dom *zdom, size_t len, uint32_t flags,
+                    void **buf_out, struct zhpeq_key_data **qkdata_out)
+{
+    zhpeu_trace();
+    int                 ret = -EINVAL;
+    struct zhpeq_mem    *mem;
+    struct mem_pool     *pool;
+    struct mem_arena    *arena;
+    struct mem_chunk    *chunk;
+    struct mem_arena    key;
+    void                **tval;
+    int                 node = -1;
+    uint                cpu;
+    uint                unode;
+    int                 cls;
+
+    if (!buf_out)
+        goto done;
+    *buf_out = NULL;
+    if (!zdom || !zdom->mem || !len || !qkdata_out ||
+        (flags & ~(MEM_HUGE | ZHPEQ_MEM_NUMA)) ||
+        (flags & MEM_HUGE) == MEM_HUGE)
+        goto done;
+    mem = zdom->mem;
+    if ((flags & ZHPEQ_MEM_NUMA) && !syscall(SYS_getcpu, &cpu, &unode, NULL))
+        node = unode;
+
+    mutex_lock(&mem->mutex);
+    ret = -ENOMEM;
+    pool = pool_get(mem, flags & MEM_HUGE, node);
+    if (!pool)
+        goto unlock;
+
+    if (len > MEM_SLAB_SIZE / 2) {
+        arena = arena_alloc(mem, pool, len, true, &ret);
+        if (!arena)
+            goto unlock;
+        *buf_out = arena->base;
+        *qkdata_out = arena->qkdata;
+        ret = 0;
+        goto unlock;
+    }
+
+    cls = (len <= ((size_t)1 << MEM_MIN_SHIFT) ? 0 :
+           fls64(len - 1) + 1 - MEM_MIN_SHIFT);
+    if (!pool->free[cls]) {
+        ret = slab_fill(mem, pool, cls);
+        if (ret < 0)
+            goto unlock;
+    }
+    chunk = pool->free[cls];
+    pool->free[cls] = chunk->next;
+    key.base = chunk;
+    key.len = 1;
+    tval = tfind(&key, &mem->arena_tree, arena_compare);
+    assert(tval);
+    arena = *tval;
+    *buf_out = chunk;
+    *qkdata_out = arena->qkdata;
+    ret = 0;
+
+ unlock:
+    mutex_unlock(&mem->mutex);
+ done:
+
+    return ret;
+}
+
+int zhpeq_mem_free(struct zhpeq_dom *zdom, void *buf)
+{
+    zhpeu_trace();
+    int                 ret = -EINVAL;
+    struct zhpeq_mem    *mem;
+    struct mem_arena    *arena;
+    struct mem_chunk    *chunk;
+    struct mem_arena    key;
+    void                **tval;
+    size_t              slab;
+    int                 cls;
+
+    if (!buf)
+        return 0;
+    if (!zdom || !zdom->mem)
+        goto done;
+    mem = zdom->mem;
+
+    mutex_lock(&mem->mutex);
+    key.base = buf;
+    key.len = 1;
+    tval = tfind(&key, &mem->arena_tree, arena_compare);
+    if (!tval)
+        goto unlock;
+    arena = *tval;
+    if (arena->large) {
+        if (buf != arena->base)
+            goto unlock;
+        arena_free(mem, arena);
+        ret = 0;
+        goto unlock;
+    }
+    slab = ((uintptr_t)buf - (uintptr_t)arena->base) >> MEM_SLAB_SHIFT;
+    if (slab >= arena->slabs_used)
+        goto unlock;
+    cls = arena->slab_class[slab];
+    if (((uintptr_t)buf - (uintptr_t)arena->base) &
+        (((size_t)1 << (cls + MEM_MIN_SHIFT)) - 1))
+        goto unlock;
+    chunk = buf;
+    chunk->next = arena->pool->free[cls];
+    arena->pool->free[cls] = chunk;
+    ret = 0;
+
+ unlock:
+    mutex_unlock(&mem->mutex);
+ done:
+
+    return ret;
+}
@@ -0,0 +1,480 @@
+/*
+ * Copyright (C) 2019 Hewlett Packard Enterprise Development LP.
+ * All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <internal.h>
+
+#include <search.h>
+
+#include <sys/queue.h>
+
+/*
+ * Registration cache: registrations live in an interval tree (a treap
+ * keyed on start address, augmented with the maximum end address in each
+ * subtree) so a request for any sub-range of an existing registration
+ * with compatible access is a hit. Entries no one holds go on an LRU list
+ * and are deregistered when the registered total exceeds the budget.
+ *
+ * We can't see munmap()/free(), so a cached registration can go stale if
+ * its memory is unmapped and the address reused; callers that do that
+ * must call zhpeq_mr_cache_invalidate() first. That is why the cache is
+ * off unless ZHPEQ_MR_CACHE_MAX is set.
+ */
+
+struct mr_node {
+    struct mr_node      *left;
+    struct mr_node      *right;
+    uint64_t            start;
+    uint64_t            end;
+    uint64_t            max_end;
+    uint32_t            prio;
+    uint32_t            access;
+    int32_t             use_count;
+    bool                stale;
+    struct zhpeq_key_data *qkdata;
+    TAILQ_ENTRY(mr_node) lru;
+    TAILQ_ENTRY(mr_node) all;
+};
+
+TAILQ_HEAD(mr_lru_head, mr_node);
+
+struct zhpeq_mr_cache {
+    pthread_mutex_t     mutex;
+    struct backend_ops  *ops;
+    struct zhpeq_dom    *zdom;
+    struct mr_node      *root;
+    void                *qk_tree;
+    struct mr_lru_head  lru_head;
+    struct mr_lru_head  all_head;
+    uint64_t            max_bytes;
+    uint64_t            cur_bytes;
+    uint32_t            seed;
+};
+
+/* Access bits that must match exactly so a hit never widens remote access. */
+#define MR_REMOTE_ACCESS (ZHPEQ_MR_GET_REMOTE | ZHPEQ_MR_PUT_REMOTE)
+
+static inline uint64_t node_max_end(struct mr_node *node)
+{
+    return (node ? node->max_end : 0);
+}
+
+static inline void node_update(struct mr_node *node)
+{
+    uint64_t            max_end = node->end;
+
+    if (node_max_end(node->left) > max_end)
+        max_end = node_max_end(node->left);
+    if (node_max_end(node->right) > max_end)
+        max_end = node_max_end(node->right);
+    node->max_end = max_end;
+}
+
+static struct mr_node *rotate_right(struct mr_node *node)
+{
+    struct mr_node      *ret = node->left;
+
+    node->left = ret->right;
+    ret->right = node;
+    node_update(node);
+    node_update(ret);
+
+    return ret;
+}
+
+static struct mr_node *rotate_left(struct mr_node *node)
+{
+    struct mr_node      *ret = node->right;
+
+    node->right = ret->left;
+    ret->left = node;
+    node_update(node);
+    node_update(ret);
+
+    return ret;
+}
+
+/*
+ * Several registrations can share a start address and rotations move
+ * them to either side of one another, so the node pointer breaks ties:
+ * insert and remove must agree on which side a node is on.
+ */
+static inline bool node_before(struct mr_node *node1, struct mr_node *node2)
+{
+    if (node1->start != node2->start)
+        return (node1->start < node2->start);
+
+    return ((uintptr_t)node1 < (uintptr_t)node2);
+}
+
+static struct mr_node *tree_insert(struct mr_node *root, struct mr_node *node)
+{
+    if (!root) {
+        node->left = node->right = NULL;
+        node_update(node);
+        return node;
+    }
+    if (node_before(node, root)) {
+        root->left = tree_insert(root->left, node);
+        if (root->left->prio > root->prio)
+            return rotate_right(root);
+    } else {
+        root->right = tree_insert(root->right, node);
+        if (root->right->prio > root->prio)
+            return rotate_left(root);
+    }
+    node_update(root);
+
+    return root;
+}
+
+static struct mr_node *tree_remove(struct mr_node *root, struct mr_node *node)
+{
+    if (!root)
+        return NULL;
+    if (root == node) {
+        if (!root->left)
+            return root->right;
+        if (!root->right)
+            return root->left;
+        /* Rotate the node down until it has only one child. */
+        if (root->left->prio > root->right->prio) {
+            root = rotate_right(root);
+            root->right = tree_remove(root->right, node);
+        } else {
+            root = rotate_left(root);
+            root->left = tree_remove(root->left, node);
+        }
+    } else if (node_before(node, root))
+        root->left = tree_remove(root->left, node);
+    else
+        root->right = tree_remove(root->right, node);
+    node_update(root);
+
+    return root;
+}
+
+/* Find a live registration covering [start, end) with compatible access. */
+static struct mr_node *tree_cover(struct mr_node *root, uint64_t start,
+                                  uint64_t end, uint32_t access)
+{
+    struct mr_node      *ret;
+
+    if (!root || root->max_end < end)
+        return NULL;
+    ret = tree_cover(root->left, start, end, access);
+    if (ret)
+        return ret;
+    if (root->start > start)
+        return NULL;
+    if (root->end >= end && (root->access & access) == access &&
+        (root->access & MR_REMOTE_ACCESS) == (access & MR_REMOTE_ACCESS))
+        return root;
+
+    return tree_cover(root->right, start, end, access);
+}
+
+/* Find any registration overlapping [start, end). */
+static struct mr_node *tree_overlap(struct mr_node *root, uint64_t start,
+                                    uint64_t end)
+{
+    struct mr_node      *ret;
+
+    if (!root || root->max_end <= start)
+        return NULL;
+    ret = tree_overlap(root->left, start, end);
+    if (ret)
+        return ret;
+    if (root->start >= end)
+        return NULL;
+    if (root->end > start)
+        return root;
+
+    return tree_overlap(root->right, start, end);
+}
+
+static int compare_qk(const void *key1, const void *key2)
+{
+    const struct mr_node *node1 = key1;
+    const struct mr_node *node2 = key2;
+
+    return arithcmp((uintptr_t)node1->qkdata, (uintptr_t)node2->qkdata);
+}
+
+static struct mr_node *qk_find(struct zhpeq_mr_cache *cache,
+                               struct zhpeq_key_data *qkdata)
+{
+    struct mr_node      key = { .qkdata = qkdata };
+    void                **tval;
+
+    tval = tfind(&key, &cache->qk_tree, compare_qk);
+
+    return (tval ? *tval : NULL);
+}
+
+/* Unlink node from everything; caller deregisters it and frees it. */
+static void node_forget(struct zhpeq_mr_cache *cache, struct mr_node *node)
+{
+    if (!node->stale)
+        cache->root = tree_remove(cache->root, node);
+    (void)tdelete(node, &cache->qk_tree, compare_qk);
+    TAILQ_REMOVE(&cache->all_head, node, all);
+    cache->cur_bytes -= node->end - node->start;
+}
+
+/* Move idle entries to evict while over budget; caller deregisters them. */
+static void lru_evict(struct zhpeq_mr_cache *cache, struct mr_lru_head *evict)
+{
+    struct mr_node      *node;
+
+    while (cache->cur_bytes > cache->max_bytes &&
+           (node = TAILQ_FIRST(&cache->lru_head))) {
+        TAILQ_REMOVE(&cache->lru_head, node, lru);
+        node_forget(cache, node);
+        TAILQ_INSERT_TAIL(evict, node, lru);
+    }
+}
+
+static int evict_free(struct zhpeq_mr_cache *cache, struct mr_lru_head *evict)
+{
+    int                 ret = 0;
+    int                 rc;
+    struct mr_node      *node;
+
+    while ((node = TAILQ_FIRST(evict))) {
+        TAILQ_REMOVE(evict, node, lru);
+        rc = cache->ops->mr_free(cache->zdom, node->qkdata);
+        if (ret >= 0 && rc < 0)
+            ret = rc;
+        free(node);
+    }
+
+    return ret;
+}
+
+int zhpeq_mr_cache_init(struct zhpeq_dom *zdom, struct backend_ops *ops,
+                        uint64_t max_bytes)
+{
+    zhpeu_trace();
+    int                 ret = -ENOMEM;
+    struct zhpeq_mr_cache *cache;
+
+    cache = calloc_cachealigned(1, sizeof(*cache));
+    if (!cache)
+        goto done;
+    mutex_init(&cache->mutex, NULL);
+    cache->ops = ops;
+    cache->zdom = zdom;
+    cache->max_bytes = max_bytes;
+    cache->seed = (uintptr_t)cache;
+    TAILQ_INIT(&cache->lru_head);
+    TAILQ_INIT(&cache->all_head);
+    zdom->mr_cache = cache;
+    ret = 0;
+
+ done:
+    return ret;
+}
+
+int zhpeq_mr_cache_destroy(struct zhpeq_dom *zdom)
+{
+    zhpeu_trace();
+    int                 ret = 0;
+    struct zhpeq_mr_cache *cache = zdom->mr_cache;
+    struct mr_lru_head  evict;
+    struct mr_node      *node;
+
+    if (!cache)
+        goto done;
+    zdom->mr_cache = NULL;
+
+    /* Deregister everything, held or not. */
+    TAILQ_INIT(&evict);
+    while ((node = TAILQ_FIRST(&cache->all_head))) {
+        if (!node->use_count && !node->stale)
+            TAILQ_REMOVE(&cache->lru_head, node, lru);
+        node_forget(cache, node);
+        TAILQ_INSERT_TAIL(&evict, node, lru);
+    }
+    ret = evict_free(cache, &evict);
+    mutex_destroy(&cache->mutex);
+    free(cache);
+
+ done:
+    return ret;
+}
+
+int zhpeq_mr_cache_reg(struct zhpeq_dom *zdom, const void *buf, size_t len,
+                       uint32_t access, struct zhpeq_key_data **qkdata_out)
+{
+    zhpeu_trace();
+    int                 ret;
+    struct zhpeq_mr_cache *cache = zdom->mr_cache;
+    uint64_t            start = (uintptr_t)buf;
+    struct mr_node      *node;
+    struct mr_node      *old;
+    struct mr_lru_head  evict;
+
+    mutex_lock(&cache->mutex);
+    node = tree_cover(cache->root, start, start + len, access);
+    if (node) {
+        if (!node->use_count++)
+            TAILQ_REMOVE(&cache->lru_head, node, lru);
+        *qkdata_out = node->qkdata;
+        mutex_unlock(&cache->mutex);
+        return 0;
+    }
+    mutex_unlock(&cache->mutex);
+
+    ret = -ENOMEM;
+    node = malloc(sizeof(*node));
+    if (!node)
+        goto done;
+    ret = cache->ops->mr_reg(zdom, buf, len, access, qkdata_out);
+    if (ret < 0)
+        goto done;
+    /*
+     * Backends may hand back a registration we already track: drop the
+     * backend reference we just took and count it on the existing entry.
+     */
+    mutex_lock(&cache->mutex);
+    old = qk_find(cache, *qkdata_out);
+    if (old) {
+        if (!old->use_count++ && !old->stale)
+            TAILQ_REMOVE(&cache->lru_head, old, lru);
+        mutex_unlock(&cache->mutex);
+        ret = cache->ops->mr_free(zdom, *qkdata_out);
+        if (ret >= 0)
+            *qkdata_out = old->qkdata;
+        goto done;
+    }
+    node->start = start;
+    node->end = start + len;
+    node->access = access;
+    node->use_count = 1;
+    node->stale = false;
+    node->qkdata = *qkdata_out;
+    node->prio = rand_r(&cache->seed);
+    if (!tsearch(node, &cache->qk_tree, compare_qk)) {
+        mutex_unlock(&cache->mutex);
+        (void)cache->ops->mr_free(zdom, *qkdata_out);
+        *qkdata_out = NULL;
+        ret = -ENOMEM;
+        goto done;
+    }
+    cache->root = tree_insert(cache->root, node);
+    TAILQ_INSERT_TAIL(&cache->all_head, node, all);
+    cache->cur_bytes += len;
+    node = NULL;
+    TAILQ_INIT(&evict);
+    lru_evict(cache, &evict);
+    mutex_unlock(&cache->mutex);
+    ret = evict_free(cache, &evict);
+
+ done:
+    free(node);
+
+    return ret;
+}
+
+int zhpeq_mr_cache_free(struct zhpeq_dom *zdom, struct zhpeq_key_data *qkdata)
+{
+    zhpeu_trace();
+    int                 ret = 0;
+    struct zhpeq_mr_cache *cache = zdom->mr_cache;
+    struct mr_node      *node;
+    struct mr_lru_head  evict;
+
+    TAILQ_INIT(&evict);
+    mutex_lock(&cache->mutex);
+    node = qk_find(cache, qkdata);
+    if (!node) {
+        /* Not ours. */
+        mutex_unlock(&cache->mutex);
+        return cache->ops->mr_free(zdom, qkdata);
+    }
+    if (!--node->use_count) {
+        if (node->stale) {
+            node_forget(cache, node);
+            TAILQ_INSERT_TAIL(&evict, node, lru);
+        } else {
+            TAILQ_INSERT_TAIL(&cache->lru_head, node, lru);
+            lru_evict(cache, &evict);
+        }
+    }
+    mutex_unlock(&cache->mutex);
+    ret = evict_free(cache, &evict);
+
+    return ret;
+}
+
+int zhpeq_mr_cache_invalidate(struct zhpeq_dom *zdom, const void *buf,
+                              size_t len)
+{
+    zhpeu_trace();
+    int                 ret = -EINVAL;
+    struct zhpeq_mr_cache *cache;
+    uint64_t            start = (uintptr_t)buf;
+    struct mr_node      *node;
+    struct mr_lru_head  evict;
+
+    if (!zdom)
+        goto done;
+    ret = 0;
+    cache = zdom->mr_cache;
+    if (!cache || !len)
+        goto done;
+
+    /*
+     * Overlapping entries leave the tree so they can't be hit again; idle
+     * ones are deregistered now, held ones when the last holder frees them.
+     */
+    TAILQ_INIT(&evict);
+    mutex_lock(&cache->mutex);
+    while ((node = tree_overlap(cache->root, start, start + len))) {
+        cache->root = tree_remove(cache->root, node);
+        node->stale = true;
+        if (node->use_count)
+            continue;
+        TAILQ_REMOVE(&cache->lru_head, node, lru);
+        node_forget(cache, node);
+        TAILQ_INSERT_TAIL(&evict, node, lru);
+    }
+    mutex_unlock(&cache->mutex);
+    ret = evict_free(cache, &evict);
+
+ done:
+    return ret;
+}
@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) 2019 Hewlett Packard Enterprise Development LP.
+ * All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <internal.h>
+
+#include <fcntl.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Queue counters: each queue has a small array of counter blocks (see
+ * internal.h) that are summed on read. They are allocated from the heap
+ * or, with ZHPEQ_STATS_SHM set, from a shared memory object that outside
+ * monitors can map; if the object runs out of queue slots, later queues
+ * fall back to the heap.
+ */
+
+#define STATS_SHM_QUEUES (64)
+
+static struct zhpeq_stats_shm *stats_shm;
+static char             stats_shm_name[32];
+
+void zhpeq_stats_lib_init(void)
+{
+    const char          *s = getenv("ZHPEQ_STATS_SHM");
+    uint64_t            n_queues = STATS_SHM_QUEUES;
+    struct zhpeq_stats_shm *shm = NULL;
+    int                 fd = -1;
+    int                 err = 0;
+    size_t              req;
+
+    if (!s)
+        return;
+    if (*s && parse_kb_uint64_t(__func__, __LINE__, "ZHPEQ_STATS_SHM", s,
+                                &n_queues, 0, 1, UINT32_MAX, PARSE_NUM) < 0)
+        return;
+
+    snprintf(stats_shm_name, sizeof(stats_shm_name), "/zhpeq_stats.%d",
+             getpid());
+    /* Owner only; replace any stale object, which would keep its mode. */
+    (void)shm_unlink(stats_shm_name);
+    fd = shm_open(stats_shm_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1) {
+        err = -errno;
+        print_func_err(__func__, __LINE__, "shm_open", stats_shm_name, err);
+        goto done;
+    }
+    req = sizeof(*shm) + n_queues * sizeof(shm->queue[0]);
+    if (ftruncate(fd, req) == -1) {
+        err = -errno;
+        print_func_errn(__func__, __LINE__, "ftruncate", req, false, err);
+        goto done;
+    }
+    shm = do_mmap(NULL, req, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0,
+                  &err);
+    if (!shm)
+        goto done;
+    shm->version = ZHPEQ_STATS_SHM_VERSION;
+    shm->n_queues = n_queues;
+    /* Monitors check the magic last. */
+    atm_store(&shm->magic, ZHPEQ_STATS_SHM_MAGIC);
+    stats_shm = shm;
+
+ done:
+    if (fd != -1)
+        close(fd);
+    if (err < 0 && fd != -1)
+        shm_unlink(stats_shm_name);
+}
+
+static void __attribute__((destructor)) stats_lib_fini(void)
+{
+    if (stats_shm)
+        shm_unlink(stats_shm_name);
+}
+
+void zhpeq_stats_dom_init(struct zhpeq_dom *zdom)
+{
+    mutex_init(&zdom->stats_mutex, NULL);
+    LIST_INIT(&zdom->stats_head);
+}
+
+void zhpeq_stats_dom_destroy(struct zhpeq_dom *zdom)
+{
+    mutex_destroy(&zdom->stats_mutex);
+}
+
+int zhpeq_stats_qinit(struct zhpeq *zq)
+{
+    struct zhpeq_dom    *zdom = zq->zdom;
+    struct zhpeq_stats_shm_queue *sq;
+    uint64_t            old;
+    uint32_t            i;
+
+    for (i = 0; stats_shm && i < stats_shm->n_queues; i++) {
+        sq = &stats_shm->queue[i];
+        old = 0;
+        if (atm_load_rlx(&sq->in_use) ||
+            !atm_cmpxchg(&sq->in_use, &old, 1))
+            continue;
+        memset(sq->blk, 0, sizeof(sq->blk));
+        sq->zq_id = (uintptr_t)zq;
+        sq->dom_id = (uintptr_t)zdom;
+        zq->stats_shm = sq;
+        zq->stats_blk = sq->blk;
+        break;
+    }
+    if (!zq->stats_blk) {
+        zq->stats_blk = calloc_cachealigned(ZHPEQ_STATS_BLKS,
+                                            sizeof(*zq->stats_blk));
+        if (!zq->stats_blk)
+            return -ENOMEM;
+    }
+
+    mutex_lock(&zdom->stats_mutex);
+    LIST_INSERT_HEAD(&zdom->stats_head, zq, stats_lentry);
+    mutex_unlock(&zdom->stats_mutex);
+
+    return 0;
+}
+
+static void stats_sum(struct zhpeq_stats *sum,
+                      const union zhpeq_stats_blk *blk)
+{
+    uint64_t            *dst = (void *)sum;
+    const uint64_t      *src;
+    size_t              i;
+    size_t              j;
+
+    for (i = 0; i < ZHPEQ_STATS_BLKS; i++) {
+        src = (const void *)&blk[i].s;
+        for (j = 0; j < sizeof(*sum) / sizeof(*dst); j++)
+            dst[j] += atm_load_rlx(&src[j]);
+    }
+}
+
+void zhpeq_stats_qfini(struct zhpeq *zq)
+{
+    struct zhpeq_dom    *zdom = zq->zdom;
+
+    if (!zq->stats_blk)
+        return;
+
+    /* Fold the queue into the domain's totals. */
+    mutex_lock(&zdom->stats_mutex);
+    LIST_REMOVE(zq, stats_lentry);
+    stats_sum(&zdom->stats_retired, zq->stats_blk);
+    mutex_unlock(&zdom->stats_mutex);
+
+    if (zq->stats_shm)
+        atm_store(&zq->stats_shm->in_use, 0);
+    else
+        free(zq->stats_blk);
+    zq->stats_blk = NULL;
+    zq->stats_shm = NULL;
+}
+
+int zhpeq_stats_get(struct zhpeq *zq, struct zhpeq_stats *stats)
+{
+    zhpeu_trace();
+
+    if (!zq || !stats)
+        return -EINVAL;
+    memset(stats, 0, sizeof(*stats));
+    stats_sum(stats, zq->stats_blk);
+
+    return 0;
+}
+
+int zhpeq_domain_stats_get(struct zhpeq_dom *zdom, struct zhpeq_stats *stats)
+{
+    zhpeu_trace();
+    struct zhpeq        *zq;
+
+    if (!zdom || !stats)
+        return -EINVAL;
+    mutex_lock(&zdom->stats_mutex);
+    *stats = zdom->stats_retired;
+    LIST_FOREACH(zq, &zdom->stats_head, stats_lentry)
+        stats_sum(stats, zq->stats_blk);
+    mutex_unlock(&zdom->stats_mutex);
+
+    return 0;
+}
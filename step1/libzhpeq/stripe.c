@@ -0,0 +1,377 @@
+/*
+ * Copyright (C) 2019 Hewlett Packard Enterprise Development LP.
+ * All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <internal.h>
+
+/*
+ * Striped transfers: a stripe owns a set of queues spread over the
+ * slices and splits each transfer into chunk-sized pieces dealt
+ * round-robin across them. Transfers are started in order; pieces that
+ * don't fit in the queues wait on the pending list and are posted by
+ * zhpeq_stripe_cq_read() as earlier pieces complete, so a large transfer
+ * flows through every data mover at once. The transfer's context is
+ * reported once, after its last piece completes.
+ */
+
+#define STRIPE_CHUNK    ((uint64_t)256 * 1024)
+#define STRIPE_CQ_BATCH (64)
+
+struct stripe_op {
+    STAILQ_ENTRY(stripe_op) lentry;
+    void                *context;
+    uint64_t            lcl_addr;
+    uint64_t            rem_addr;
+    uint64_t            len;
+    uint64_t            off;
+    uint32_t            in_flight;
+    uint8_t             status;
+    bool                put;
+    bool                fence;
+};
+
+struct zhpeq_stripe {
+    pthread_mutex_t     mutex;
+    STAILQ_HEAD(, stripe_op) pending;
+    uint64_t            chunk;
+    uint64_t            in_flight;
+    size_t              next_zq;
+    size_t              n_zq;
+    int                 err;
+    struct zhpeq        *zq[];
+};
+
+int zhpeq_stripe_free(struct zhpeq_stripe *zs)
+{
+    zhpeu_trace();
+    int                 ret = 0;
+    int                 rc;
+    struct stripe_op    *op;
+    size_t              i;
+
+    if (!zs)
+        goto done;
+
+    for (i = 0; i < zs->n_zq; i++) {
+        if (!zs->zq[i])
+            continue;
+        rc = zhpeq_free(zs->zq[i]);
+        if (ret >= 0 && rc < 0)
+            ret = rc;
+    }
+    /* Fully posted transfers still in flight are abandoned. */
+    while ((op = STAILQ_FIRST(&zs->pending))) {
+        STAILQ_REMOVE_HEAD(&zs->pending, lentry);
+        free(op);
+    }
+    mutex_destroy(&zs->mutex);
+    free(zs);
+
+ done:
+    return ret;
+}
+
+int zhpeq_stripe_alloc(struct zhpeq_dom *zdom, size_t n_zq, int qlen,
+                       int traffic_class, int priority, uint64_t chunk,
+                       struct zhpeq_stripe **zs_out)
+{
+    zhpeu_trace();
+    int                 ret = -EINVAL;
+    struct zhpeq_stripe *zs = NULL;
+    struct zhpeq_attr   attr;
+    const char          *s;
+    int                 n_slices = __builtin_popcount(ALL_SLICES);
+    size_t              i;
+
+    if (!zs_out)
+        goto done;
+    *zs_out = NULL;
+    if (!zdom || n_zq < 1)
+        goto done;
+    ret = zhpeq_query_attr(&attr);
+    if (ret < 0)
+        goto done;
+    if (!chunk) {
+        chunk = STRIPE_CHUNK;
+        s = getenv("ZHPEQ_STRIPE_CHUNK");
+        if (s && parse_kb_uint64_t(__func__, __LINE__, "ZHPEQ_STRIPE_CHUNK",
+                                   s, &chunk, 0, 1, UINT64_MAX,
+                                   PARSE_KIB) < 0)
+            chunk = STRIPE_CHUNK;
+    }
+    if (chunk > attr.z.max_dma_len)
+        chunk = attr.z.max_dma_len;
+
+    ret = -ENOMEM;
+    zs = calloc_cachealigned(1, sizeof(*zs) + n_zq * sizeof(zs->zq[0]));
+    if (!zs)
+        goto done;
+    mutex_init(&zs->mutex, NULL);
+    STAILQ_INIT(&zs->pending);
+    zs->chunk = chunk;
+    zs->n_zq = n_zq;
+
+    /* Only the stripe uses its queues, and always under its mutex. */
+    for (i = 0; i < n_zq; i++) {
+        ret = zhpeq_alloc_flags(zdom, qlen, qlen, traffic_class, priority,
+                                1U << (i % n_slices), ZHPEQ_ALLOC_SPSC,
+                                &zs->zq[i]);
+        if (ret < 0)
+            goto done;
+    }
+    *zs_out = zs;
+    zs = NULL;
+
+ done:
+    (void)zhpeq_stripe_free(zs);
+
+    return ret;
+}
+
+struct zhpeq *zhpeq_stripe_zq(struct zhpeq_stripe *zs, size_t idx)
+{
+    zhpeu_trace();
+    if (!zs || idx >= zs->n_zq)
+        return NULL;
+
+    return zs->zq[idx];
+}
+
+/* Post one piece on the first queue, from next_zq on, that has room. */
+static int stripe_post(struct zhpeq_stripe *zs, struct stripe_op *op)
+{
+    zhpeu_trace();
+    int                 ret = -EAGAIN;
+    uint64_t            len = op->len - op->off;
+    struct zhpeq        *zq;
+    int64_t             qindex;
+    size_t              i;
+
+    if (len > zs->chunk)
+        len = zs->chunk;
+    for (i = 0; i < zs->n_zq; i++) {
+        zq = zs->zq[zs->next_zq];
+        zs->next_zq = (zs->next_zq + 1) % zs->n_zq;
+        qindex = zhpeq_reserve(zq, 1);
+        if (qindex == -EAGAIN)
+            continue;
+        if (qindex < 0) {
+            ret = qindex;
+            break;
+        }
+        if (op->put)
+            ret = zhpeq_put(zq, qindex, false, op->lcl_addr + op->off, len,
+                            op->rem_addr + op->off, op);
+        else
+            ret = zhpeq_get(zq, qindex, false, op->lcl_addr + op->off, len,
+                            op->rem_addr + op->off, op);
+        if (ret < 0) {
+            /*
+             * The slot must still be committed: fill it with a NOP and
+             * end the transfer here, so its completion carries the error.
+             */
+            (void)zhpeq_nop(zq, qindex, false, op);
+            if (op->status == ZHPEQ_CQ_STATUS_SUCCESS)
+                op->status = ZHPEQ_CQ_STATUS_BAD_CMD;
+            len = op->len - op->off;
+        }
+        ret = zhpeq_commit(zq, qindex, 1);
+        if (ret < 0)
+            break;
+        op->off += len;
+        op->in_flight++;
+        zs->in_flight++;
+        break;
+    }
+
+    return ret;
+}
+
+/*
+ * Post pieces in transfer order until the queues fill. A fenced transfer
+ * waits until everything before it has completed.
+ */
+static int stripe_progress(struct zhpeq_stripe *zs)
+{
+    zhpeu_trace();
+    int                 ret = 0;
+    struct stripe_op    *op;
+
+    while ((op = STAILQ_FIRST(&zs->pending))) {
+        if (op->fence && !op->off && zs->in_flight)
+            break;
+        ret = stripe_post(zs, op);
+        if (ret < 0) {
+            if (ret == -EAGAIN)
+                ret = 0;
+            break;
+        }
+        if (op->off == op->len)
+            STAILQ_REMOVE_HEAD(&zs->pending, lentry);
+    }
+
+    return ret;
+}
+
+static int stripe_rw(struct zhpeq_stripe *zs, bool fence, uint64_t lcl_addr,
+                     size_t len, uint64_t rem_addr, void *context, bool put)
+{
+    zhpeu_trace();
+    int                 ret = -EINVAL;
+    struct stripe_op    *op;
+
+    if (!zs || !len)
+        goto done;
+
+    ret = -ENOMEM;
+    op = malloc(sizeof(*op));
+    if (!op)
+        goto done;
+    op->context = context;
+    op->lcl_addr = lcl_addr;
+    op->rem_addr = rem_addr;
+    op->len = len;
+    op->off = 0;
+    op->in_flight = 0;
+    op->status = ZHPEQ_CQ_STATUS_SUCCESS;
+    op->put = put;
+    op->fence = fence;
+
+    mutex_lock(&zs->mutex);
+    STAILQ_INSERT_TAIL(&zs->pending, op, lentry);
+    ret = stripe_progress(zs);
+    if (ret < 0) {
+        /*
+         * With nothing posted, the error is the only report; otherwise
+         * the transfer is under way and will complete.
+         */
+        if (!op->off) {
+            STAILQ_REMOVE(&zs->pending, op, stripe_op, lentry);
+            free(op);
+        } else
+            ret = 0;
+    }
+    mutex_unlock(&zs->mutex);
+
+ done:
+    return ret;
+}
+
+int zhpeq_stripe_put(struct zhpeq_stripe *zs, bool fence, uint64_t lcl_addr,
+                     size_t len, uint64_t rem_addr, void *context)
+{
+    zhpeu_trace();
+    return stripe_rw(zs, fence, lcl_addr, len, rem_addr, context, true);
+}
+
+int zhpeq_stripe_get(struct zhpeq_stripe *zs, bool fence, uint64_t lcl_addr,
+                     size_t len, uint64_t rem_addr, void *context)
+{
+    zhpeu_trace();
+    return stripe_rw(zs, fence, lcl_addr, len, rem_addr, context, false);
+}
+
+ssize_t zhpeq_stripe_cq_read(struct zhpeq_stripe *zs,
+                             struct zhpeq_cq_entry *entries, size_t n_entries)
+{
+    zhpeu_trace();
+    ssize_t             ret = -EINVAL;
+    size_t              done = 0;
+    struct zhpeq_cq_entry zcqe[STRIPE_CQ_BATCH];
+    struct stripe_op    *op;
+    ssize_t             n;
+    ssize_t             j;
+    size_t              want;
+    size_t              i;
+
+    if (!zs || !entries || !n_entries)
+        goto done;
+
+    mutex_lock(&zs->mutex);
+    /* An error held back by the last call, which returned completions. */
+    if (zs->err < 0) {
+        ret = zs->err;
+        zs->err = 0;
+        goto unlock;
+    }
+    /* Each piece completes at most one transfer, so never read more. */
+    for (i = 0; i < zs->n_zq && done < n_entries; i++) {
+        want = n_entries - done;
+        if (want > STRIPE_CQ_BATCH)
+            want = STRIPE_CQ_BATCH;
+        n = zhpeq_cq_read(zs->zq[i], zcqe, want);
+        if (n < 0) {
+            /*
+             * Don't lose completions already taken from the queues:
+             * return them and the error on the next call.
+             */
+            if (done) {
+                zs->err = n;
+                ret = done;
+            } else
+                ret = n;
+            goto unlock;
+        }
+        for (j = 0; j < n; j++) {
+            op = zcqe[j].z.context;
+            /* Keep the first error. */
+            if (zcqe[j].z.status != ZHPEQ_CQ_STATUS_SUCCESS &&
+                op->status == ZHPEQ_CQ_STATUS_SUCCESS)
+                op->status = zcqe[j].z.status;
+            op->in_flight--;
+            zs->in_flight--;
+            if (op->in_flight || op->off != op->len)
+                continue;
+            entries[done] = zcqe[j];
+            entries[done].z.context = op->context;
+            entries[done].z.status = op->status;
+            done++;
+            free(op);
+        }
+    }
+    ret = stripe_progress(zs);
+    if (ret < 0 && done) {
+        /* The ops in entries[] are freed: report the error next time. */
+        zs->err = ret;
+        ret = 0;
+    }
+    if (ret >= 0)
+        ret = done;
+
+ unlock:
+    mutex_unlock(&zs->mutex);
+ done:
+    return ret;
+}
@@ -38,8 +38,11 @@
 
 #include <zhpeq_util.h>
 
+#include <cpuid.h>
 #include <libgen.h>
 
+#include <sys/syscall.h>
+
 const char              *appname;
 size_t                  page_size;
 
@@ -53,12 +56,20 @@ static uint64_t __get_tsc_freq(void);
 
 uint64_t                zhpeq_cycles_freq;
 uint64_t                (*zhpeq_cycles_get)(volatile uint32_t *cpup);
+uint64_t                zhpeq_ns_mult;
+
+/* Length of each of the three TSC calibration intervals. */
+#define TSC_CALIBRATE_NS (10000000)
 
 static struct zhpeu_atm_list_ptr atm_dummy;
 
+#ifdef ZHPEQ_TRACE
+static void trace_init(void);
+#endif
+
 static void __attribute__((constructor)) lib_init(void)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     long                rcl;
     struct zhpeu_atm_list_ptr oldh;
     struct zhpeu_atm_list_ptr newh;
@@ -88,11 +99,17 @@ static void __attribute__((constructor)) lib_init(void)
         atm_store_rlx(&zhpeq_cycles_get, get_clock_cycles);
         atm_store_rlx(&zhpeq_cycles_freq, (uint64_t)NSEC_PER_SEC);
     }
+    atm_store_rlx(&zhpeq_ns_mult,
+                  (uint64_t)(((__uint128_t)NSEC_PER_SEC << 32) /
+                             zhpeq_cycles_freq));
+#ifdef ZHPEQ_TRACE
+    trace_init();
+#endif
 }
 
 void zhpeq_util_init(char *argv0, int default_log_level, bool use_syslog)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     /* Allow to be called multiple times for testing. */
     appname = basename(argv0);
     log_level  = default_log_level;
@@ -106,7 +123,7 @@ void zhpeq_util_init(char *argv0, int default_log_level, bool use_syslog)
 static void vlog(int priority, FILE *file, const char *prefix,
                  const char *fmt, va_list ap)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     if (priority > log_level)
         return;
 
@@ -123,7 +140,7 @@ static void vlog(int priority, FILE *file, const char *prefix,
 
 void print_dbg(const char *fmt, ...)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     va_list             ap;
 
     va_start(ap, fmt);
@@ -133,7 +150,7 @@ void print_dbg(const char *fmt, ...)
 
 void print_info(const char *fmt, ...)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     va_list             ap;
 
     va_start(ap, fmt);
@@ -143,7 +160,7 @@ void print_info(const char *fmt, ...)
 
 void print_err(const char *fmt, ...)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     va_list             ap;
 
     va_start(ap, fmt);
@@ -153,7 +170,7 @@ void print_err(const char *fmt, ...)
 
 void print_usage(bool use_stdout, const char *fmt, ...)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     va_list             ap;
 
     va_start(ap, fmt);
@@ -164,7 +181,7 @@ void print_usage(bool use_stdout, const char *fmt, ...)
 void print_errs(const char *callf, uint line, char *errf_str,
                 int err, const char *errs)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     if (errf_str == (void *)(intptr_t)-1)
         print_err("%s,%u:fatal error, out of memory?\n", callf, line);
     else {
@@ -176,7 +193,7 @@ void print_errs(const char *callf, uint line, char *errf_str,
 
 char *errf_str(const char *fmt, ...)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     char                *ret = NULL;
     va_list             ap;
 
@@ -191,7 +208,7 @@ char *errf_str(const char *fmt, ...)
 void print_func_err(const char *callf, uint line, const char *errf,
                     const char *arg, int err)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     char                *estr = NULL;
 
     if (errf)
@@ -205,7 +222,7 @@ void print_func_err(const char *callf, uint line, const char *errf,
 void print_func_errn(const char *callf, uint line, const char *errf,
                      llong arg, bool arg_hex, int err)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     char                *estr = NULL;
 
     if (errf)
@@ -219,7 +236,7 @@ void print_func_errn(const char *callf, uint line, const char *errf,
 void print_range_err(const char *callf, uint line, const char *name,
                      int64_t val, int64_t min, int64_t max)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     print_err("%s,%u:%s = %Ld: out of range %Ld - %Ld\n",
               callf, line, name, (llong)val, (llong)min, (llong)max);
 }
@@ -227,7 +244,7 @@ void print_range_err(const char *callf, uint line, const char *name,
 void print_urange_err(const char *callf, uint line, const char *name,
                       uint64_t val, uint64_t min, uint64_t max)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     print_err("%s,%u:%s = %Lu: out of range %Lu - %Lu\n",
               callf, line, name, (ullong)val, (ullong)min, (ullong)max);
 }
@@ -237,7 +254,7 @@ static const char *cpuinfo_delim = " \t\n";
 char *get_cpuinfo_val(FILE *fp, char *buf, size_t buf_size,
                       uint field, const char *name, ...)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     char                *ret = NULL;
     bool                first = true;
     char                *tok;
@@ -289,135 +306,250 @@ char *get_cpuinfo_val(FILE *fp, char *buf, size_t buf_size,
     return ret;
 }
 
-static uint64_t __get_tsc_freq(void)
+/*
+ * The TSC is only usable as a clock if it is invariant: it must tick at a
+ * constant rate through P-states and C-states (CPUID 0x80000007 EDX bit 8,
+ * on both Intel and AMD).
+ */
+static bool tsc_invariant(void)
 {
-    PRINT_DEBUG;
-    uint64_t            ret = 0;
-    FILE                *fp = NULL;
-    const char          *fname_info = "/proc/cpuinfo";
-    const char          *fname_freq =
-        "/sys/devices/system/cpu/cpu0/cpufreq/cpuinfo_max_freq";
-    bool                intel = false;
-    const char          *fname;
-    char                buf[1024];
-    char                *sval;
-    char                *tok;
-    char                *endp;
-    uint64_t            val1;
-    uint64_t            val2;
+    uint32_t            eax;
+    uint32_t            ebx;
+    uint32_t            ecx;
+    uint32_t            edx;
+
+    if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) ||
+        eax < 0x80000007)
+        return false;
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+        return false;
+
+    return !!(edx & (1U << 8));
+}
+
+/* Intel parts that enumerate the crystal clock give an exact answer. */
+static uint64_t tsc_freq_cpuid(void)
+{
+    uint32_t            eax;
+    uint32_t            ebx;
+    uint32_t            ecx;
+    uint32_t            edx;
+
+    if (__get_cpuid_max(0, NULL) < 0x15 ||
+        !__get_cpuid(0x15, &eax, &ebx, &ecx, &edx))
+        return 0;
+    if (!eax || !ebx || !ecx)
+        return 0;
+
+    return (uint64_t)ecx * ebx / eax;
+}
+
+static uint64_t tsc_read(void)
+{
+    uint32_t            lo;
+    uint32_t            hi;
+
+    asm volatile("rdtscp" : "=a" (lo), "=d" (hi) : : "rcx");
+
+    return ((uint64_t)hi << 32 | lo);
+}
+
+/*
+ * Pair a CLOCK_MONOTONIC_RAW reading with the TSC at its midpoint; keep
+ * the tightest of a few tries, so a preemption cannot skew the sample.
+ */
+static void tsc_sample(uint64_t *tsc, uint64_t *ns)
+{
+    struct timespec     ts;
+    uint64_t            best = UINT64_MAX;
+    uint64_t            t0;
+    uint64_t            t1;
     uint                i;
 
-    fname = fname_info;
-    fp = fopen(fname, "r");
-    if (!fp) {
-        print_func_err(__func__, __LINE__, "fopen", fname, errno);
-        goto done;
+    for (i = 0; i < 5; i++) {
+        t0 = tsc_read();
+        clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+        t1 = tsc_read();
+        if (t1 - t0 >= best)
+            continue;
+        best = t1 - t0;
+        *tsc = t0 + best / 2;
+        *ns = (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
     }
-    /* We only handle Intel, for now */
-    sval = get_cpuinfo_val(fp, buf, sizeof(buf), 1, "vendor_id", NULL);
-    if (!sval)
-        goto done;
-    intel = !strcmp(sval, "GenuineIntel");
+}
 
-    /* We need "constant_tsc" and "nonstop_tsc" in flags. */
-    sval = get_cpuinfo_val(fp, buf, sizeof(buf), 0, "flags", NULL);
-    if (!sval)
-        goto done;
-    i = 0;
-    while ((tok = strsep(&sval, cpuinfo_delim))) {
-        if (!strcmp(tok, "constant_tsc"))
-            i |= 1;
-        if (!strcmp(tok, "nonstop_tsc"))
-            i |= 2;
-        if (i == 3)
-            break;
+/* Median of three TSC_CALIBRATE_NS intervals against the raw clock. */
+static uint64_t tsc_calibrate(void)
+{
+    uint64_t            freq[3];
+    struct timespec     delay = {
+        .tv_sec         = 0,
+        .tv_nsec        = TSC_CALIBRATE_NS,
+    };
+    uint64_t            tsc0;
+    uint64_t            tsc1;
+    uint64_t            ns0;
+    uint64_t            ns1;
+    uint64_t            tmp;
+    uint                i;
+
+    for (i = 0; i < ARRAY_SIZE(freq); i++) {
+        tsc_sample(&tsc0, &ns0);
+        while (nanosleep(&delay, &delay) == -1 && errno == EINTR);
+        delay.tv_nsec = TSC_CALIBRATE_NS;
+        tsc_sample(&tsc1, &ns1);
+        freq[i] = (uint64_t)((double)(tsc1 - tsc0) * NSEC_PER_SEC /
+                             (ns1 - ns0));
     }
-    if (!tok) {
-        print_err("%s:CPU missing constant_tsc/nonstop_tsc", __func__);
-        goto done;
+    if (freq[0] > freq[1]) {
+        tmp = freq[0];
+        freq[0] = freq[1];
+        freq[1] = tmp;
+    }
+    if (freq[1] > freq[2])
+        freq[1] = (freq[0] > freq[2] ? freq[0] : freq[2]);
+
+    return freq[1];
+}
+
+/*
+ * The calibration is cached per user and per boot: the file holds the
+ * kernel's boot_id and the frequency, and is ignored if it belongs to
+ * someone else or to an earlier boot.
+ */
+static char *tsc_cache_path(void)
+{
+    char                *ret = NULL;
+    const char          *s = getenv("ZHPEQ_TSC_CACHE");
+
+    if (s) {
+        if (*s)
+            ret = strdup_or_null(s);
+    } else if (zhpeu_asprintf(&ret, "/tmp/zhpeq_tsc.%u", getuid()) == -1)
+        ret = NULL;
+
+    return ret;
+}
+
+static bool tsc_boot_id(char *buf, size_t buf_size)
+{
+    bool                ret = false;
+    FILE                *fp;
+
+    fp = fopen("/proc/sys/kernel/random/boot_id", "r");
+    if (!fp)
+        return ret;
+    if (fgets(buf, buf_size, fp)) {
+        buf[strcspn(buf, "\n")] = '\0';
+        ret = !!*buf;
+    }
+    fclose(fp);
+
+    return ret;
+}
+
+static uint64_t tsc_cache_read(const char *path, const char *boot_id)
+{
+    uint64_t            ret = 0;
+    FILE                *fp;
+    struct stat         st;
+    char                id[64];
+    unsigned long long  freq;
+    int                 fd;
+
+    /* Don't follow a link someone else planted at the path. */
+    fd = open(path, O_RDONLY | O_NOFOLLOW);
+    if (fd == -1)
+        return ret;
+    fp = fdopen(fd, "r");
+    if (!fp) {
+        close(fd);
+        return ret;
     }
+    if (fstat(fileno(fp), &st) == -1 || st.st_uid != getuid())
+        goto done;
+    if (fscanf(fp, "%63s %llu", id, &freq) != 2 || strcmp(id, boot_id))
+        goto done;
+    ret = freq;
+
+ done:
+    fclose(fp);
+
+    return ret;
+}
+
+static void tsc_cache_write(const char *path, const char *boot_id,
+                            uint64_t freq)
+{
+    char                *tmp = NULL;
+    FILE                *fp;
+    int                 fd;
 
     /*
-     * Once we know nonstop_tsc exists, we could measure the frequency,
-     * but I don't want to slow down application launch to
-     * measure it. Measure it once, perhaps, at package install? Not today.
-     *
-     * For Intel, the TSC seems to use the listed frequency for the CPU.
-     * On real hardware, the /proc/cpuinfo "model name" gives you 3 digit
-     * accuracy and /sys/devices/system/cpu/cpu0/cpufreq/cpuinfo_max_freq,
-     * if available, gives you at least 4, it seems.
+     * Write a private file and rename it, so readers never see half;
+     * mkstemp() creates it exclusively with mode 0600, so nothing
+     * planted in a shared directory is followed or clobbered.
      */
-    tok = NULL;
-    if (intel) {
-        sval = get_cpuinfo_val(fp, buf, sizeof(buf), 0, "model", "name", NULL);
-        if (!sval)
-            goto done;
-        while ((tok = strsep(&sval, cpuinfo_delim))) {
-            if (strcmp(tok, "@"))
-                continue;
-            tok = strsep(&sval, cpuinfo_delim);
-            break;
-        }
+    if (zhpeu_asprintf(&tmp, "%s.XXXXXX", path) == -1)
+        return;
+    fd = mkstemp(tmp);
+    if (fd == -1)
+        goto done;
+    fp = fdopen(fd, "w");
+    if (!fp) {
+        close(fd);
+        unlink(tmp);
+        goto done;
     }
-    if (tok) {
-        errno = 0;
-        val1 = strtoull(tok, &endp, 0);
-        if (errno)
-            goto done;
-        if (*endp != '.')
-            goto done;
-        tok = ++endp;
-        val2 = strtoull(tok, &endp, 0);
-        if (errno)
-            goto done;
-        if (strcmp(endp, "GHz"))
-            goto done;
-        for (i = endp - tok; i > 0; i--)
-            val1 *= 10;
-        val1 += val2;
-        for (i = 9 - (endp - tok); i > 0; i--)
-            val1 *= 10;
-        ret = val1;
+    fprintf(fp, "%s %Lu\n", boot_id, (ullong)freq);
+    if (fclose(fp) || rename(tmp, path) == -1)
+        unlink(tmp);
+
+ done:
+    free(tmp);
+}
+
+static uint64_t __get_tsc_freq(void)
+{
+    zhpeu_trace();
+    uint64_t            ret = 0;
+    char                *path = NULL;
+    const char          *s;
+    char                boot_id[64];
+    bool                cache;
+
+    if (!tsc_invariant()) {
+        print_err("%s:CPU does not have an invariant TSC\n", __func__);
+        goto done;
     }
-    fclose(fp);
 
-    fname = fname_freq;
-    fp = fopen(fname, "r");
-    if (fp) {
-        if (!fgets(buf, sizeof(buf), fp))
-            goto done;
-        sval = buf;
-        tok = strsep(&sval, cpuinfo_delim);
-        if (!tok || *sval != '\0')
-            goto done;
-        errno = 0;
-        val1 = strtoull(tok, &endp, 0) * 1000;
-        if (errno || *endp != '\0')
-            goto done;
-        ret = val1;
-    } else if (!fp) {
-        if (errno != ENOENT) {
-            print_func_err(__func__, __LINE__, "fopen", fname, errno);
+    s = getenv("ZHPEQ_TSC_FREQ");
+    if (s && parse_kb_uint64_t(__func__, __LINE__, "ZHPEQ_TSC_FREQ", s,
+                               &ret, 0, 1, UINT64_MAX, PARSE_NUM) >= 0)
+        goto done;
+    ret = tsc_freq_cpuid();
+    if (ret)
+        goto done;
+
+    path = tsc_cache_path();
+    cache = (path && tsc_boot_id(boot_id, sizeof(boot_id)));
+    if (cache) {
+        ret = tsc_cache_read(path, boot_id);
+        if (ret)
             goto done;
-        }
     }
+    ret = tsc_calibrate();
+    if (cache && ret)
+        tsc_cache_write(path, boot_id, ret);
 
-done:
-    if (fp) {
-        if (ferror(fp)) {
-            print_err("%s,%u:Error reading %s\n",
-                      __func__, __LINE__, fname);
-            ret = 0;
-        }
-        fclose(fp);
-    }
+ done:
+    free(path);
 
     return ret;
 }
 
 static uint64_t get_tsc_cycles(volatile uint32_t *cpup)
 {
-    PRINT_DEBUG;
     uint32_t            lo;
     uint32_t            hi;
     uint32_t            cpu;
@@ -432,7 +564,6 @@ static uint64_t get_tsc_cycles(volatile uint32_t *cpup)
 
 static uint64_t get_clock_cycles(volatile uint32_t *cpup)
 {
-    PRINT_DEBUG;
     struct timespec     now;
 
     /* CPU not supported. */
@@ -448,7 +579,7 @@ int parse_kb_uint64_t(const char *callf, uint line,
                       const char *name, const char *sp, uint64_t *val,
                       int base, uint64_t min, uint64_t max, int flags)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret = -EINVAL;
     char                *ep;
 
@@ -534,7 +665,7 @@ int parse_kb_uint64_t(const char *callf, uint line,
 int check_func_io(const char *callf, uint line, const char *errf,
                   const char *arg, size_t req, ssize_t res, int flags)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret = 0;
 
     if (res == -1) {
@@ -557,7 +688,7 @@ int check_func_io(const char *callf, uint line, const char *errf,
 int check_func_ion(const char *callf, uint line, const char *errf,
                    long arg, bool arg_hex, size_t req, ssize_t res, int flags)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret = 0;
 
     if (res == -1) {
@@ -644,7 +775,7 @@ int do_getaddrinfo(const char *node, const char *service,
 
 int connect_sock(const char *node, const char *service)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret;
     struct addrinfo     *resp = NULL;
 
@@ -671,14 +802,14 @@ done:
 
 void random_seed(uint seed)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     srandom(seed);
 }
 
 /* [start, end] */
 uint random_range(uint start, uint end)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     const uint64_t      rand_max = (uint64_t)RAND_MAX + 1;
     uint64_t            range;
 
@@ -692,7 +823,7 @@ uint random_range(uint start, uint end)
 
 uint *random_array(uint *array, uint entries)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     uint                *ret = array;
     size_t              i;
     size_t              t;
@@ -715,7 +846,7 @@ uint *random_array(uint *array, uint entries)
 bool _expected_saw(const char *callf, uint line,
                    const char *label, uintptr_t expected, uintptr_t saw)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     if (expected == saw)
         return true;
 
@@ -727,7 +858,7 @@ bool _expected_saw(const char *callf, uint line,
 
 char *_sockaddr_port_str(const char *callf, uint line, const void *addr)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     char                *ret = NULL;
     const union sockaddr_in46 *sa = addr;
 
@@ -747,7 +878,7 @@ char *_sockaddr_port_str(const char *callf, uint line, const void *addr)
 
 char *_sockaddr_str(const char *callf, uint line, const void *addr)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     char                *ret = NULL;
     const char          ipv6_dual_pre[] = "::ffff:";
     const size_t        ipv6_dual_pre_len = sizeof(ipv6_dual_pre) - 1;
@@ -775,7 +906,7 @@ done:
 int _do_getsockname(const char *callf, uint line,
                     int sock_fd, union sockaddr_in46 *sa)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret = 0;
     socklen_t           addr_len;
 
@@ -793,7 +924,7 @@ int _do_getsockname(const char *callf, uint line,
 int _do_getpeername(const char *callf, uint line,
                     int sock_fd, union sockaddr_in46 *sa)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret = 0;
     socklen_t           addr_len;
 
@@ -811,7 +942,7 @@ int _do_getpeername(const char *callf, uint line,
 int _sock_send_blob(const char *callf, uint line, int fd,
                     const void *blob, size_t blob_len)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret = -EINVAL;
     uint32_t            wlen = blob_len;
     size_t              req;
@@ -841,7 +972,7 @@ int _sock_send_blob(const char *callf, uint line, int fd,
 int _sock_recv_fixed_blob(const char *callf, uint line,
                           int sock_fd, void *blob, size_t blob_len)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret;
     uint32_t            wlen;
     size_t              req;
@@ -872,7 +1003,7 @@ int _sock_recv_var_blob(const char *callf, uint line,
                         int sock_fd, size_t extra_len,
                         void **blob, size_t *blob_len)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret;
     uint32_t            wlen;
     size_t              req;
@@ -912,7 +1043,7 @@ int _sock_recv_var_blob(const char *callf, uint line,
 
 const char *sockaddr_ntop(const void *addr, char *buf, size_t len)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     const char          *ret = NULL;
     const union sockaddr_in46 *sa = addr;
 
@@ -955,7 +1086,7 @@ const char *sockaddr_ntop(const void *addr, char *buf, size_t len)
 int sockaddr_cmpx(const union sockaddr_in46 *sa1,
                   const union sockaddr_in46 *sa2, bool noport)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret;
     union sockaddr_in46 local1;
     union sockaddr_in46 local2;
@@ -1012,7 +1143,7 @@ int sockaddr_cmpx(const union sockaddr_in46 *sa1,
 
 int zhpeu_asprintf(char **strp, const char *fmt, ...)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret;
     va_list             ap;
 
@@ -1030,7 +1161,7 @@ int zhpeu_asprintf(char **strp, const char *fmt, ...)
 int zhpeu_posix_memalign(void **memptr, size_t alignment, size_t size,
                          const char *callf, uint line)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret = posix_memalign(memptr, alignment, size);
 
     if (unlikely(ret)) {
@@ -1045,7 +1176,7 @@ int zhpeu_posix_memalign(void **memptr, size_t alignment, size_t size,
 
 void *zhpeu_malloc(size_t size, const char *callf, uint line)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     void                *ret = malloc(size);
     int                 save_err;
 
@@ -1062,7 +1193,7 @@ void *zhpeu_malloc(size_t size, const char *callf, uint line)
 
 void *zhpeu_realloc(void *ptr, size_t size, const char *callf, uint line)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     void                *ret = realloc(ptr, size);
     int                 save_err;
 
@@ -1079,7 +1210,7 @@ void *zhpeu_realloc(void *ptr, size_t size, const char *callf, uint line)
 
 void *zhpeu_calloc(size_t nmemb, size_t size, const char *callf, uint line)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     void                *ret = calloc(nmemb, size);
     int                 save_err;
 
@@ -1095,7 +1226,7 @@ void *zhpeu_calloc(size_t nmemb, size_t size, const char *callf, uint line)
 /* For things that want a function pointer to free. */
 void zhpeu_free_ptr(void *ptr)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     free(ptr);
 }
 
@@ -1103,7 +1234,7 @@ void zhpeu_free_ptr(void *ptr)
 
 void zhpeu_free(void *ptr, const char *callf, uint line)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     /* XXX:Implement alloc/free tracking? */
     free(ptr);
 }
@@ -1111,7 +1242,7 @@ void zhpeu_free(void *ptr, const char *callf, uint line)
 void *zhpeu_malloc_aligned(size_t alignment, size_t size,
                            const char *callf, uint line)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     void                *ret;
 
     (void)zhpeu_posix_memalign(&ret, alignment, size, callf, line);
@@ -1122,7 +1253,7 @@ void *zhpeu_malloc_aligned(size_t alignment, size_t size,
 void *zhpeu_calloc_aligned(size_t alignment, size_t nmemb, size_t size,
                            const char *callf, uint line)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     void                *ret;
 
     size *= nmemb;
@@ -1132,3 +1263,175 @@ void *zhpeu_calloc_aligned(size_t alignment, size_t nmemb, size_t size,
 
     return ret;
 }
+
+#ifdef ZHPEQ_TRACE
+
+/* Nothing in this section may contain a tracepoint or call anything that
+ * does until the thread's ring exists.
+ */
+
+#define TRACE_MAGIC     (0x5A545243U)   /* "ZTRC" */
+#define TRACE_VERSION   (1U)
+#define TRACE_SITES_MAX (4096)
+
+struct trace_file_hdr {
+    uint32_t            magic;
+    uint32_t            version;
+    uint64_t            cycles_freq;
+    uint64_t            rec_total;
+    uint32_t            rec_entries;
+    uint32_t            n_sites;
+    uint32_t            pid;
+    uint32_t            tid;
+};
+
+struct trace_file_site {
+    uint32_t            id;
+    uint32_t            line;
+    uint16_t            func_len;
+    uint16_t            file_len;
+};
+
+__thread struct zhpeu_trace_ring *zhpeu_trace_thr;
+
+static pthread_key_t    trace_key;
+static struct zhpeu_trace_site *trace_sites[TRACE_SITES_MAX];
+static int32_t          trace_n_sites;
+
+int32_t zhpeu_trace_site_register(struct zhpeu_trace_site *site)
+{
+    int32_t             old = 0;
+    int32_t             id;
+
+    /* -1 marks a site that another thread is registering. */
+    if (!atm_cmpxchg(&site->id, &old, -1)) {
+        while (old < 0) {
+            nop();
+            old = atm_load(&site->id);
+        }
+        return old;
+    }
+    id = atm_inc(&trace_n_sites) + 1;
+    if (id <= TRACE_SITES_MAX)
+        atm_store(&trace_sites[id - 1], site);
+    atm_store(&site->id, id);
+
+    return id;
+}
+
+struct zhpeu_trace_ring *zhpeu_trace_ring_alloc(void)
+{
+    struct zhpeu_trace_ring *ret;
+
+    ret = mmap(NULL, sizeof(*ret), PROT_READ | PROT_WRITE,
+               MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (ret == MAP_FAILED)
+        return NULL;
+    zhpeu_trace_thr = ret;
+    (void)pthread_setspecific(trace_key, ret);
+
+    return ret;
+}
+
+static int trace_write(int fd, const void *buf, size_t len)
+{
+    ssize_t             res;
+
+    res = write(fd, buf, len);
+
+    return check_func_io(__func__, __LINE__, "write", "", len, res, 0);
+}
+
+static void trace_dump(struct zhpeu_trace_ring *ring)
+{
+    const char          *dir = getenv("ZHPEQ_TRACE_DIR");
+    int                 fd = -1;
+    char                *fname = NULL;
+    struct trace_file_hdr hdr;
+    struct trace_file_site fsite;
+    struct zhpeu_trace_site *site;
+    uint64_t            beg;
+    uint64_t            end;
+    uint64_t            i;
+    int32_t             id;
+
+    if (!dir)
+        return;
+
+    hdr.magic = TRACE_MAGIC;
+    hdr.version = TRACE_VERSION;
+    hdr.cycles_freq = zhpeq_cycles_freq;
+    hdr.rec_total = ring->idx;
+    hdr.rec_entries = ZHPEQ_TRACE;
+    hdr.n_sites = atm_load(&trace_n_sites);
+    if (hdr.n_sites > TRACE_SITES_MAX)
+        hdr.n_sites = TRACE_SITES_MAX;
+    hdr.pid = getpid();
+    hdr.tid = syscall(SYS_gettid);
+
+    if (zhpeu_asprintf(&fname, "%s/%s.%u.%u.trace", dir,
+                       (appname ?: program_invocation_short_name),
+                       hdr.pid, hdr.tid) == -1)
+        return;
+    fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC,
+              S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd == -1) {
+        print_func_err(__func__, __LINE__, "open", fname, -errno);
+        goto done;
+    }
+    if (trace_write(fd, &hdr, sizeof(hdr)) < 0)
+        goto done;
+    for (id = 1; id <= hdr.n_sites; id++) {
+        site = atm_load(&trace_sites[id - 1]);
+        fsite.id = id;
+        fsite.line = (site ? site->line : 0);
+        fsite.func_len = (site ? strlen(site->func) : 0);
+        fsite.file_len = (site ? strlen(site->file) : 0);
+        if (trace_write(fd, &fsite, sizeof(fsite)) < 0 ||
+            (site && (trace_write(fd, site->func, fsite.func_len) < 0 ||
+                      trace_write(fd, site->file, fsite.file_len) < 0)))
+            goto done;
+    }
+    /* Records oldest to newest; the ring may have wrapped. */
+    end = hdr.rec_total;
+    beg = (end > ZHPEQ_TRACE ? end - ZHPEQ_TRACE : 0);
+    for (i = beg; i < end; i++) {
+        if (trace_write(fd, &ring->rec[i & (ZHPEQ_TRACE - 1)],
+                        sizeof(ring->rec[0])) < 0)
+            goto done;
+    }
+
+ done:
+    FD_CLOSE(fd);
+    free(fname);
+}
+
+static void trace_key_destructor(void *vring)
+{
+    struct zhpeu_trace_ring *ring = vring;
+
+    if (!ring)
+        return;
+    trace_dump(ring);
+    zhpeu_trace_thr = NULL;
+    munmap(ring, sizeof(*ring));
+}
+
+static void trace_atexit(void)
+{
+    struct zhpeu_trace_ring *ring = zhpeu_trace_thr;
+
+    /* Key destructors are not called for the thread that calls exit(). */
+    if (!ring)
+        return;
+    (void)pthread_setspecific(trace_key, NULL);
+    trace_key_destructor(ring);
+}
+
+static void trace_init(void)
+{
+    abort_posix(pthread_key_create, &trace_key, trace_key_destructor);
+    atexit(trace_atexit);
+}
+
+#endif
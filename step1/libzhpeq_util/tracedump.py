@@ -0,0 +1,64 @@
+#!/usr/bin/python3
+
+# Decode the per-thread trace files written when the libraries are built
+# with -DZHPEQ_TRACE=<entries> and ZHPEQ_TRACE_DIR is set.
+
+import struct
+import sys
+
+TRACE_MAGIC = 0x5A545243
+TRACE_VERSION = 1
+
+HDR = struct.Struct('=IIQQIIII')
+SITE = struct.Struct('=IIHH')
+REC = struct.Struct('=QII')
+
+def dump(fname):
+    with open(fname, 'rb') as f:
+        data = f.read()
+
+    (magic, version, freq, total, entries, nsites, pid, tid) = \
+        HDR.unpack_from(data, 0)
+    if magic != TRACE_MAGIC or version != TRACE_VERSION:
+        print('{}: bad magic 0x{:x}/version {}'.format(fname, magic, version),
+              file=sys.stderr)
+        return 1
+    off = HDR.size
+
+    sites = {}
+    for i in range(nsites):
+        (sid, line, flen, filelen) = SITE.unpack_from(data, off)
+        off += SITE.size
+        func = data[off:off + flen].decode()
+        off += flen
+        file = data[off:off + filelen].decode()
+        off += filelen
+        sites[sid] = '{}:{}:{}'.format(file, func, line)
+
+    print('{} pid {} tid {} freq {} records {} of {}'.format(
+        fname, pid, tid, freq, min(total, entries), total))
+
+    start = None
+    prev = None
+    while off + REC.size <= len(data):
+        (cycles, sid, cpu) = REC.unpack_from(data, off)
+        off += REC.size
+        if start is None:
+            start = prev = cycles
+        # Times in ns relative to the first record and the previous record.
+        rel = (cycles - start) * 1000000000 // freq if freq else 0
+        delta = (cycles - prev) * 1000000000 // freq if freq else 0
+        prev = cycles
+        print('{:>14} {:>10} cpu {:>3} {}'.format(
+            rel, delta, cpu, sites.get(sid, 'site {}'.format(sid))))
+
+    return 0
+
+if __name__ == '__main__':
+    if len(sys.argv) < 2:
+        print('Usage: {} <tracefile>...'.format(sys.argv[0]), file=sys.stderr)
+        sys.exit(1)
+    ret = 0
+    for fname in sys.argv[1:]:
+        ret |= dump(fname)
+    sys.exit(ret)
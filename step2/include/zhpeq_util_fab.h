@@ -78,6 +78,8 @@ struct fab_dom {
     void                (*onfree)(struct fab_dom *dom, void *data);
     void                *onfree_data;
     int32_t             use_count;
+    /* Set before fab_dom_setup() to require a threading model. */
+    enum fi_threading   threading;
 };
 
 struct fab_conn {
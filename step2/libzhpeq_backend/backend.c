@@ -38,7 +38,7 @@
 
 static void __attribute__((constructor)) backend_lib_init(void)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 fd = -1;
     int                 err;
 
@@ -47,10 +47,12 @@ static void __attribute__((constructor)) backend_lib_init(void)
         err = errno;
         print_dbg("%s,%u:open(%s) returned error %d:%s\n",
                   __func__, __LINE__, DEV_NAME, err, strerror(err));
+        fd = zhpe_offloaded_mock_open();
     }
 
     zhpeq_backend_libfabric_init(fd);
     zhpeq_backend_zhpe_offloaded_init(fd);
+    zhpeq_backend_loopback_init(fd);
 
     if (fd != -1)
         close(fd);
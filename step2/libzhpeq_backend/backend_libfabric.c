@@ -38,15 +38,33 @@
 
 #include <zhpeq_util_fab.h>
 
+#include <dirent.h>
+
+#include <sys/mman.h>
+#include <sys/prctl.h>
 #include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 
 #define FIVERSION       FI_VERSION(1, 5)
 
 #define SLEEP_THRESHOLD_NS ((uint64_t)100000)
+/* Completion tail publication defaults; see cq_publish(). */
+#define CQ_MOD_COUNT    (16)
+#define CQ_MOD_NS       ((uint64_t)5000)
 #define QFREE_THRESHOLD_NS ((uint64_t)1000000000)
 
 #define AV_MAX          (16383)
 
+#define RAILS_MAX       ZHPEQ_RAILS_MAX
+/* Transfers this large rotate across the rails; see wqe_rail(). */
+#define RAIL_SPLIT      ((uint64_t)64 * 1024)
+
+/* zhpeq_atomicv() staging: elements per multi-ioc atomic, per engine. */
+#define ATMV_IOC_MAX    (16)
+#define ATMV_STAGES     (64)
+
 #define KEY_SHIFT       47
 #define KEY_MASK_ADDR   (((uint64_t)1 << KEY_SHIFT) - 1)
 #define KEYTAB_SHIFT    (64 - KEY_SHIFT)
@@ -57,6 +75,37 @@
 
 static const char       *backend_prov = NULL;
 static const char       *backend_dom = NULL;
+static const char       *backend_engines = NULL;
+static const char       *backend_cpus = NULL;
+static const char       *backend_shard = NULL;
+static uint64_t         cq_mod_count = CQ_MOD_COUNT;
+static uint64_t         cq_mod_cycles;
+static uint64_t         inject_max = UINT64_MAX;
+static uint64_t         io_rec_ents;
+static struct zhpeq_io_shm *io_shm;
+static size_t           io_shm_len;
+static char             io_shm_name[32];
+static uint64_t         cma_min = UINT64_MAX;
+static uint64_t         rail_split = RAIL_SPLIT;
+static uint             n_rails = 1;
+static uint64_t         rail_wr_flags;
+static char             *rail_names[RAILS_MAX];
+static char             *rail_buf;
+
+/*
+ * Sent after the fabric address by lfab_exchange(): peers with the same
+ * boot_id and pid namespace are on this node and their RMA can bypass
+ * the provider with process_vm_writev()/process_vm_readv(). The
+ * addresses of rails beyond the first follow, up to the smaller n_rails.
+ */
+struct lfab_node {
+    char                boot_id[40];
+    uint64_t            pidns;
+    uint32_t            pid;
+    uint32_t            n_rails;
+};
+
+static struct lfab_node local_node;
 
 STAILQ_HEAD(stailq_head, stailq_entry);
 
@@ -70,17 +119,49 @@ struct circleq_entry {
     CIRCLEQ_ENTRY(circleq_entry) ptrs;
 };
 
+/*
+ * The provider key and peer address per rail: av_idx[rail] is
+ * FI_ADDR_NOTAVAIL if the peer has no endpoint on that rail. pid is
+ * non-zero if the key belongs to a process on this node.
+ */
 struct rkey {
-    uint64_t            rkey;
-    uint64_t            av_idx;
+    uint64_t            rkey[RAILS_MAX];
+    uint64_t            av_idx[RAILS_MAX];
+    uint64_t            vaddr;
+    uint64_t            len;
+    pid_t               pid;
+    uint32_t            access;
+};
+
+/* What lfab_exchange() learned about a peer, for lfab_open(). */
+struct lfab_peer {
+    SLIST_ENTRY(lfab_peer) lentry;
+    union sockaddr_in46 ep_addr;
+    pid_t               pid;
+    uint32_t            n_rails;
+    union sockaddr_in46 rail_addr[RAILS_MAX];
+};
+
+/* Indexed by open_idx, which is the peer's address on rail 0. */
+struct lfab_av {
+    fi_addr_t           fi_addr[RAILS_MAX];
+    pid_t               pid;
 };
 
+/*
+ * One fabric domain per rail; memory is registered on all of them. The
+ * free list of local key indices is threaded through lcl_mr[0]; unused
+ * entries of the other rails hold TO_PTR(1).
+ */
 struct zdom_data {
-    struct fab_dom      *fab_dom;
-    struct fid_mr       **lcl_mr;
+    struct fab_dom      *fab_dom[RAILS_MAX];
+    struct fid_mr       **lcl_mr[RAILS_MAX];
     struct free_index   lcl_mr_free;
     struct rkey         *rkey;
     struct free_index   rkey_free;
+    struct lfab_av      *av;
+    pthread_mutex_t     peer_mutex;
+    SLIST_HEAD(, lfab_peer) peer_head;
 };
 
 enum engine_state {
@@ -93,6 +174,14 @@ enum engine_state {
  * deleting all the sockets derived from it. Seems stupid.
  */
 
+/* Registered operands and results for one multi-ioc atomic. */
+struct atmv_stage {
+    struct stailq_entry free_lentry;
+    uint8_t             op[ATMV_IOC_MAX * sizeof(uint64_t)];
+    uint8_t             cmp[ATMV_IOC_MAX * sizeof(uint64_t)];
+    uint8_t             res[ATMV_IOC_MAX * sizeof(uint64_t)];
+};
+
 struct context {
     union {
         struct fi_context2  opaque;
@@ -101,15 +190,34 @@ struct context {
     struct fab_conn_plus *fab_plus;
     struct stuff        *conn;
     struct zhpe_offloaded_result  *result;
+    struct zhpeq_atmv   *atmv;
+    struct atmv_stage   *stage;
+    uint32_t            atmv_idx;
+    uint32_t            atmv_n;
     uint16_t            cmp_index;
     uint8_t             result_len;
-#if ZHPE_IO_RECORD
-    bool                done;
-#endif
+};
+
+/*
+ * A WQE lfab_zq() could not post yet, copied out of the WQ; seq is its
+ * place in the queue, for fences.
+ */
+struct lfab_park {
+    struct stailq_entry lentry;
+    uint64_t            seq;
+    union zhpe_offloaded_hw_wq_entry wqe;
+};
+
+/* The parked WQEs for one peer, oldest first. */
+struct lfab_pend {
+    struct stailq_entry lentry;
+    struct stailq_head  park_head;
+    uint64_t            peer;
 };
 
 struct lfab_work_av_op {
     struct stuff        *conn;
+    uint                rail;
     fi_addr_t           fi_addr;
     union sockaddr_in46 ep_addr;
 };
@@ -135,18 +243,6 @@ struct lfab_work_qfree_pre {
     struct timespec     ts_last;
 };
 
-struct io_record {
-    struct stuff        *conn;
-    uint64_t            fi_addr;
-    void                *buf;
-    void                *desc;
-    uint64_t            raddr;
-    uint64_t            rkey;
-    uint64_t            len;
-    struct context      *context;
-    uint8_t             op;
-};
-
 struct stuff {
     struct circleq_entry lentry;
     struct zhpeq        *zq;
@@ -162,16 +258,33 @@ struct stuff {
     struct fi_ioc       atm_res_ioc;
     struct fi_rma_ioc   atm_rma_ioc;
     struct fi_msg_atomic atm_msg;
+    struct fi_ioc       atmv_op_ioc;
+    struct fi_ioc       atmv_cmp_ioc;
+    struct fi_ioc       atmv_res_ioc;
+    struct fi_rma_ioc   atmv_rma_ioc[ATMV_IOC_MAX];
+    struct fi_msg_atomic atmv_msg;
+    struct iovec        msgv_iov[ZHPEQ_IOV_MAX];
+    void                *ldscv[ZHPEQ_IOV_MAX];
+    struct fi_rma_iov   rmav_iov[ZHPEQ_IOV_MAX];
+    struct fi_msg_rma   msgv;
     uint32_t            cq_tail;
+    uint32_t            cq_published;
+    uint64_t            cq_unpub_cycles;
     bool                allocated;
-};
-
-struct engine {
-    struct zhpeu_work_head  work_head;
-    pthread_t           thread;
-    struct circleq_head zq_head;
-    enum engine_state   state;
-    bool                do_auto;
+    struct engine       *eng;
+    /* fab_plus and op_rail are those of the op being posted. */
+    uint                rail;
+    uint                rail_next;
+    uint                op_rail;
+    uint                n_fab;
+    /* Parked WQEs, by peer; the pools hold one per WQ entry. */
+    struct stailq_head  pend_head;
+    struct stailq_head  pend_free;
+    struct stailq_head  park_free;
+    struct lfab_pend    *pend;
+    struct lfab_park    *park;
+    uint64_t            wq_seq;
+    uint32_t            n_parked;
 };
 
 struct fab_conn_plus {
@@ -182,75 +295,161 @@ struct fab_conn_plus {
     struct zhpe_offloaded_result  *results;
     struct fid_mr       *results_mr;
     void                *results_desc;
+    size_t              inject_size;
+    struct stailq_head  stage_free;
+    struct atmv_stage   *stages;
+    struct fid_mr       *stages_mr;
+    void                *stages_desc;
+};
+
+/*
+ * Each engine thread owns a shard of the queues and, on each rail, its
+ * own endpoint and CQ; all engines share the rail's domain. Domain-wide
+ * work (domain setup, memory registration) is always done by engine 0.
+ */
+struct engine {
+    struct zhpeu_work_head  work_head;
+    pthread_t           thread;
+    struct circleq_head zq_head;
+    struct fab_conn_plus fab_plus[RAILS_MAX];
+    struct zhpeq_io_ring *io_ring;
+    enum engine_state   state;
+    bool                do_auto;
+    int                 cpu;
+    int                 node;
+    uint32_t            n_zq;
+    uint                rail_next;
 };
 
-/* A single engine thread, a single endpoint,and a single domain. */
-static struct engine    eng;
-static struct fab_dom   *one_dom;
-static struct fab_conn_plus one_conn;
+#define ENGINES_MAX     (256)
+
+static struct engine    *engines;
+static uint             n_engines = 1;
+static bool             shard_numa;
+static struct fab_dom   *rail_doms[RAILS_MAX];
 
 static void *lfab_eng_thread(void *veng);
 static void cq_update(void *arg, void *vcqe, bool err);
 static int stuff_free(struct stuff *stuff);
 static inline void cq_write(void *vcontext, int status);
 
-#ifdef ZHPE_IO_RECORD
-
-static struct io_record io_rec[ZHPE_IO_RECORD] __attribute__((used));
-static uint32_t         io_rec_idx;
+/*
+ * Runtime op tracing: see struct zhpeq_io_shm. Only the engine thread
+ * writes its ring, so the disabled case costs a pointer test.
+ */
+static void io_record(struct engine *eng, uint8_t type, int status,
+                      struct stuff *conn, uint64_t op, uint64_t fi_addr,
+                      void *buf, uint64_t raddr, uint64_t rkey, uint64_t len,
+                      struct context *context)
+{
+    struct zhpeq_io_ring *ring = eng->io_ring;
+    uint64_t            idx = atm_load_rlx(&ring->idx);
+    struct zhpeq_io_rec *rec = &ring->rec[idx & (io_rec_ents - 1)];
+
+    rec->tsc = get_cycles(NULL);
+    rec->seq = idx;
+    rec->zq_id = (uintptr_t)conn->zq;
+    rec->context = (uintptr_t)context;
+    rec->fi_addr = fi_addr;
+    rec->buf = (uintptr_t)buf;
+    rec->raddr = raddr;
+    rec->rkey = rkey;
+    rec->len = len;
+    rec->status = status;
+    rec->type = type;
+    rec->op = op;
+    /* Publish the record. */
+    atm_store(&ring->idx, idx + 1);
+}
 
-static void
+static inline void
 record_io_start(int rc, struct stuff *conn, uint64_t op, uint64_t fi_addr,
                 void *buf, void *desc, uint64_t raddr, uint64_t rkey,
                 uint64_t len, struct context *context)
 {
-    uint                idx;
-    struct io_record    *io;
-
-    if (rc == -FI_EAGAIN)
+    if (likely(!conn->eng->io_ring) || rc == -FI_EAGAIN)
         return;
+    io_record(conn->eng, ZHPEQ_IO_REC_POST, rc, conn, op, fi_addr, buf,
+              raddr, rkey, len, context);
+}
 
-    idx = atm_inc(&io_rec_idx);
-    io = &io_rec[idx & (ARRAY_SIZE(io_rec) - 1)];
-
-    io->conn = conn;
-    io->fi_addr = fi_addr;
-    io->buf = buf;
-    io->desc = desc;
-    io->raddr = raddr;
-    io->rkey = rkey;
-    io->len = len;
-    io->context = context;
-    io->op = op;
+static inline void record_io_done(struct context *context, int status)
+{
+    struct stuff        *conn = context->conn;
 
-    context->done = false;
+    if (likely(!conn || !conn->eng->io_ring))
+        return;
+    io_record(conn->eng, ZHPEQ_IO_REC_DONE, status, conn, 0, 0, NULL, 0, 0,
+              0, context);
 }
 
-static inline void record_io_done(struct context *context)
+static int io_record_init(void)
 {
-    context->done = true;
-}
+    zhpeu_trace();
+    int                 ret = 0;
+    int                 fd = -1;
+    size_t              ring_len;
+    uint                i;
 
-#else
+    if (!io_rec_ents)
+        goto done;
 
-static void
-record_io_start(int rc, struct stuff *conn, uint64_t op, uint64_t fi_addr,
-                void *buf, void *desc, uint64_t raddr, uint64_t rkey,
-                uint64_t len, void *context)
-{
-    PRINT_DEBUG;
+    io_rec_ents = roundup_pow_of_2(io_rec_ents);
+    ring_len = roundup64(sizeof(struct zhpeq_io_ring) +
+                         io_rec_ents * sizeof(struct zhpeq_io_rec),
+                         page_size);
+    io_shm_len = page_size + n_engines * ring_len;
+    snprintf(io_shm_name, sizeof(io_shm_name), "/zhpeq_io.%d", getpid());
+    /*
+     * The records hold remote addresses and keys: owner only. A stale
+     * object left by an earlier pid would keep its old mode, so replace it.
+     */
+    (void)shm_unlink(io_shm_name);
+    fd = shm_open(io_shm_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1) {
+        ret = -errno;
+        print_func_err(__func__, __LINE__, "shm_open", io_shm_name, ret);
+        goto done;
+    }
+    if (ftruncate(fd, io_shm_len) == -1) {
+        ret = -errno;
+        print_func_errn(__func__, __LINE__, "ftruncate", io_shm_len, false,
+                        ret);
+        goto done;
+    }
+    io_shm = do_mmap(NULL, io_shm_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     fd, 0, &ret);
+    if (!io_shm)
+        goto done;
+    for (i = 0; i < n_engines; i++)
+        engines[i].io_ring = (void *)((char *)io_shm + page_size +
+                                      i * ring_len);
+    io_shm->version = ZHPEQ_IO_SHM_VERSION;
+    io_shm->n_rings = n_engines;
+    io_shm->ring_ents = io_rec_ents;
+    io_shm->ring_len = ring_len;
+    io_shm->tsc_freq = get_tsc_freq();
+    atm_store(&io_shm->magic, ZHPEQ_IO_SHM_MAGIC);
+
+ done:
+    if (fd != -1)
+        close(fd);
+    if (ret < 0 && fd != -1)
+        shm_unlink(io_shm_name);
+
+    return ret;
 }
 
-static inline void record_io_done(struct context *context)
+static void __attribute__((destructor)) io_record_fini(void)
 {
-    PRINT_DEBUG;
+    if (io_shm)
+        shm_unlink(io_shm_name);
 }
-#endif
 
 static int lfab_eng_work_queue(struct engine *eng, zhpeu_worker worker,
                                void *data)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret = 0;
     struct zhpeu_work   work;
 
@@ -296,22 +495,24 @@ static int lfab_eng_work_queue(struct engine *eng, zhpeu_worker worker,
 static bool worker_qfree_pre(struct zhpeu_work_head *head,
                              struct zhpeu_work *work)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     struct lfab_work_qfree_pre *data = work->data;
     struct stuff        *conn = data->conn;
     struct engine       *eng = container_of(head, struct engine, work_head);
     struct timespec     ts_now;
+    struct fab_conn_plus *fab_plus;
     struct context      *context;
     size_t              i;
+    uint                r;
 
-    /* All operations done? */
-    if (conn->tx_queued == conn->tx_completed)
+    /* All operations done? Parked WQEs are still outstanding. */
+    if (conn->tx_queued == conn->tx_completed && !conn->n_parked)
         goto remove;
     /* First time? */
     clock_gettime_monotonic(&ts_now);
     if (!work->status) {
         /* Yes: snapshot initial state. */
-        data->tx_queued = conn->tx_queued;
+        data->tx_queued = conn->tx_queued + conn->n_parked;
         data->tx_completed = conn->tx_completed;
         data->ts_last = ts_now;
         work->status = 1;
@@ -320,7 +521,7 @@ static bool worker_qfree_pre(struct zhpeu_work_head *head,
     /* Making progress? */
     if (data->tx_completed != conn->tx_completed) {
         /* Yes: are new I/Os being started? */
-        if (conn->tx_queued == data->tx_queued) {
+        if (conn->tx_queued + conn->n_parked == data->tx_queued) {
             /* No: update state. */
             data->tx_completed = conn->tx_completed;
             data->ts_last = ts_now;
@@ -337,15 +538,19 @@ static bool worker_qfree_pre(struct zhpeu_work_head *head,
      * mark all contexts associated with this conn so they won't generate
      * completions.
      */
-    for (i = 0, context = conn->fab_plus->context;
-         i < conn->fab_plus->context_entries; i++, context++) {
-        if (context->conn == conn)
-            context->conn = NULL;
+    for (r = 0; r < conn->n_fab; r++) {
+        fab_plus = &eng->fab_plus[r];
+        for (i = 0, context = fab_plus->context;
+             i < fab_plus->context_entries; i++, context++) {
+            if (context->conn == conn)
+                context->conn = NULL;
+        }
     }
 
  remove:
     /* Remove the conn from the engine thread. */
     CIRCLEQ_REMOVE(&eng->zq_head, &conn->lentry, ptrs);
+    atm_dec(&eng->n_zq);
     work->status = stuff_free(conn);
 
     return false;
@@ -353,7 +558,7 @@ static bool worker_qfree_pre(struct zhpeu_work_head *head,
 
 static int retry_none(void *args)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     /* No retry, will be returned to av_wait caller. */
     return 1;
 }
@@ -361,10 +566,10 @@ static int retry_none(void *args)
 static bool worker_av_op_remove(struct zhpeu_work_head *head,
                                 struct zhpeu_work *work)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     struct lfab_work_av_op *data = work->data;
     struct stuff        *conn = data->conn;
-    struct fab_conn     *fab_conn = conn->fab_plus->fab_conn;
+    struct fab_conn     *fab_conn = conn->eng->fab_plus[data->rail].fab_conn;
 
     work->status = fab_av_remove(fab_conn->dom, data->fi_addr);
 
@@ -374,10 +579,10 @@ static bool worker_av_op_remove(struct zhpeu_work_head *head,
 static bool worker_av_op_recv(struct zhpeu_work_head *head,
                               struct zhpeu_work *work)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     struct lfab_work_av_op *data = work->data;
     struct stuff        *conn = data->conn;
-    struct fab_conn     *fab_conn = conn->fab_plus->fab_conn;
+    struct fab_conn     *fab_conn = conn->eng->fab_plus[data->rail].fab_conn;
     int                 rc;
 
     rc = fab_av_wait_recv(fab_conn, data->fi_addr, retry_none, NULL);
@@ -392,10 +597,10 @@ static bool worker_av_op_recv(struct zhpeu_work_head *head,
 static bool worker_av_op_send(struct zhpeu_work_head *head,
                               struct zhpeu_work *work)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     struct lfab_work_av_op *data = work->data;
     struct stuff        *conn = data->conn;
-    struct fab_conn     *fab_conn = conn->fab_plus->fab_conn;
+    struct fab_conn     *fab_conn = conn->eng->fab_plus[data->rail].fab_conn;
     int                 rc;
 
     rc = fab_av_wait_send(fab_conn, data->fi_addr, retry_none, NULL);
@@ -412,10 +617,10 @@ static bool worker_av_op_send(struct zhpeu_work_head *head,
 static bool worker_av_op_insert(struct zhpeu_work_head *head,
                                 struct zhpeu_work *work)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     struct lfab_work_av_op *data = work->data;
     struct stuff        *conn = data->conn;
-    struct fab_conn     *fab_conn = conn->fab_plus->fab_conn;
+    struct fab_conn     *fab_conn = conn->eng->fab_plus[data->rail].fab_conn;
     int                 rc;
 
     rc = fab_av_insert(fab_conn->dom, &data->ep_addr, &data->fi_addr);
@@ -430,16 +635,21 @@ static bool worker_av_op_insert(struct zhpeu_work_head *head,
 
 static int stuff_free(struct stuff *stuff)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret = 0;
     int                 rc;
+    uint                r;
 
     if (!stuff)
         goto done;
 
-    rc = fab_conn_free(stuff->fab_plus->fab_conn);
-    ret = (ret >= 0 ? rc : ret);
+    for (r = 0; r < stuff->n_fab; r++) {
+        rc = fab_conn_free(stuff->eng->fab_plus[r].fab_conn);
+        ret = (ret >= 0 ? rc : ret);
+    }
 
+    free(stuff->pend);
+    free(stuff->park);
     if (stuff->allocated)
         free(stuff);
 
@@ -450,12 +660,27 @@ static int stuff_free(struct stuff *stuff)
 static bool worker_domain_free(struct zhpeu_work_head *head,
                                struct zhpeu_work *work)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     struct zdom_data    *bdom = work->data;
+    struct lfab_peer    *peer;
+    int                 rc;
+    uint                r;
 
-    work->status = fab_dom_free(bdom->fab_dom);
-    free(bdom->lcl_mr);
+    work->status = 0;
+    for (r = 0; r < n_rails; r++) {
+        if (bdom->fab_dom[r]) {
+            rc = fab_dom_free(bdom->fab_dom[r]);
+            work->status = (work->status >= 0 ? rc : work->status);
+        }
+        free(bdom->lcl_mr[r]);
+    }
     free(bdom->rkey);
+    free(bdom->av);
+    while ((peer = SLIST_FIRST(&bdom->peer_head))) {
+        SLIST_REMOVE_HEAD(&bdom->peer_head, lentry);
+        free(peer);
+    }
+    mutex_destroy(&bdom->peer_mutex);
     free(bdom);
 
     return false;
@@ -463,36 +688,40 @@ static bool worker_domain_free(struct zhpeu_work_head *head,
 
 static int lfab_domain_free(struct zhpeq_dom *zdom)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret = 0;
     struct zdom_data    *bdom = zdom->backend_data;
 
     if (zdom->backend_data) {
         zdom->backend_data = NULL;
-        ret = lfab_eng_work_queue(&eng, worker_domain_free, bdom);
+        ret = lfab_eng_work_queue(engines, worker_domain_free, bdom);
     }
 
     return ret;
 }
 
-static void onfree_one_dom(struct fab_dom *dom, void *data)
+static void onfree_rail_dom(struct fab_dom *dom, void *data)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     *(void **)data = NULL;
     free(dom);
 }
 
 static void onfree_one_conn(struct fab_conn *conn, void *data)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     struct fab_conn_plus *fab_plus = data;
 
     FI_CLOSE(fab_plus->results_mr);
     fab_plus->results_mr = NULL;
+    FI_CLOSE(fab_plus->stages_mr);
+    fab_plus->stages_mr = NULL;
     free(fab_plus->context);
     fab_plus->context = NULL;
     free(fab_plus->results);
     fab_plus->results = NULL;
+    free(fab_plus->stages);
+    fab_plus->stages = NULL;
     free(fab_plus->fab_conn);
     fab_plus->fab_conn = NULL;
 }
@@ -500,47 +729,79 @@ static void onfree_one_conn(struct fab_conn *conn, void *data)
 static bool worker_domain(struct zhpeu_work_head *head,
                           struct zhpeu_work *work)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret = -ENOMEM;
     struct zhpeq_dom    *zdom = work->data;
     struct zdom_data    *bdom;
+    struct fab_dom      *fab_dom;
     size_t              i;
+    uint                r;
 
     bdom = zdom->backend_data = calloc_cachealigned(1, sizeof(*bdom));
     if (!bdom)
         goto done;
+    mutex_init(&bdom->peer_mutex, NULL);
+    SLIST_INIT(&bdom->peer_head);
 
-    bdom->lcl_mr = calloc_cachealigned(KEYTAB_SIZE, sizeof(*bdom->lcl_mr));
-    if (!bdom->lcl_mr)
+    bdom->av = calloc(AV_MAX + 1, sizeof(*bdom->av));
+    if (!bdom->av)
         goto done;
+
+    for (r = 0; r < n_rails; r++) {
+        bdom->lcl_mr[r] = calloc_cachealigned(KEYTAB_SIZE,
+                                              sizeof(*bdom->lcl_mr[r]));
+        if (!bdom->lcl_mr[r])
+            goto done;
+        if (!r)
+            continue;
+        for (i = 0; i < KEYTAB_SIZE; i++)
+            bdom->lcl_mr[r][i] = TO_PTR(1);
+    }
     bdom->lcl_mr_free.index = 1;
     for (i = 0; i < KEYTAB_SIZE - 1; i++)
-        bdom->lcl_mr[i] = TO_PTR(((i + 1) << 1) | 1);
-    bdom->lcl_mr[i] = TO_PTR(FREE_END);
+        bdom->lcl_mr[0][i] = TO_PTR(((i + 1) << 1) | 1);
+    bdom->lcl_mr[0][i] = TO_PTR(FREE_END);
 
     bdom->rkey = calloc_cachealigned(KEYTAB_SIZE, sizeof(*bdom->rkey));
     if (!bdom->rkey)
         goto done;
     bdom->rkey_free.index = 0;
     for (i = 0; i < KEYTAB_SIZE - 1; i++)
-        bdom->rkey[i].rkey = i + 1;
-    bdom->rkey[i].rkey = FI_KEY_NOTAVAIL;
+        bdom->rkey[i].rkey[0] = i + 1;
+    bdom->rkey[i].rkey[0] = FI_KEY_NOTAVAIL;
 
-    if (one_dom) {
-        bdom->fab_dom = one_dom;
-        atm_inc(&one_dom->use_count);
-        ret = 0;
-        goto done;
-    }
-
-    one_dom = fab_dom_alloc(onfree_one_dom, &one_dom);
-    if (!one_dom)
+    for (r = 0; r < n_rails; r++) {
+        if (rail_doms[r]) {
+            bdom->fab_dom[r] = rail_doms[r];
+            atm_inc(&rail_doms[r]->use_count);
+            continue;
+        }
+        ret = -ENOMEM;
+        fab_dom = rail_doms[r] = fab_dom_alloc(onfree_rail_dom, &rail_doms[r]);
+        if (!fab_dom)
             goto done;
-    bdom->fab_dom = one_dom;
-    ret = fab_dom_setup(NULL, NULL, false, backend_prov, backend_dom,
-                        FI_EP_RDM, one_dom);
-    if (ret < 0)
-        goto done;
+        bdom->fab_dom[r] = fab_dom;
+        /*
+         * Engines share the domain. engines_init() has already sized
+         * everything by n_engines, so a provider that can't be shared is
+         * an error rather than a reason to drop engines.
+         */
+        if (n_engines > 1)
+            fab_dom->threading = FI_THREAD_SAFE;
+        ret = fab_dom_setup(NULL, NULL, false, backend_prov, rail_names[r],
+                            FI_EP_RDM, fab_dom);
+        if (ret < 0)
+            goto done;
+        if (n_engines > 1 &&
+            fab_dom->finfo.info->domain_attr->threading != FI_THREAD_SAFE) {
+            print_err("%s,%u:provider %s not FI_THREAD_SAFE with %u engines\n",
+                      __func__, __LINE__,
+                      fab_dom->finfo.info->fabric_attr->prov_name, n_engines);
+            ret = -EINVAL;
+            goto done;
+        }
+    }
+    ret = 0;
 
  done:
     work->status = ret;
@@ -550,13 +811,13 @@ static bool worker_domain(struct zhpeu_work_head *head,
 
 static int lfab_domain(struct zhpeq_dom *zdom)
 {
-    PRINT_DEBUG;
-    return lfab_eng_work_queue(&eng, worker_domain, zdom);
+    zhpeu_trace();
+    return lfab_eng_work_queue(engines, worker_domain, zdom);
 }
 
 static struct stuff *stuff_alloc(void)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     struct stuff        *ret = NULL;
     int                 err = 0;
 
@@ -579,6 +840,12 @@ static struct stuff *stuff_alloc(void)
     ret->atm_msg.iov_count = 1;
     ret->atm_msg.rma_iov = &ret->atm_rma_ioc;
     ret->atm_msg.rma_iov_count = 1;
+    ret->atmv_msg.msg_iov = &ret->atmv_op_ioc;
+    ret->atmv_msg.iov_count = 1;
+    ret->atmv_msg.rma_iov = ret->atmv_rma_ioc;
+    ret->msgv.msg_iov = ret->msgv_iov;
+    ret->msgv.desc = ret->ldscv;
+    ret->msgv.rma_iov = ret->rmav_iov;
 
  done:
     if (err < 0) {
@@ -593,7 +860,7 @@ static struct stuff *stuff_alloc(void)
 static int lfab_qalloc(struct zhpeq *zq, int cmd_qlen, int cmp_qlen,
                        int traffic_class, int priority, int slice_mask)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     /* Tell caller we don't have a driver. */
     zq->fd = -1;
     /* Use xqinfo for compatiblity with asic code. */
@@ -610,34 +877,24 @@ static int lfab_qalloc(struct zhpeq *zq, int cmd_qlen, int cmp_qlen,
     return 0;
 }
 
-static bool worker_qalloc_post(struct zhpeu_work_head *head,
-                               struct zhpeu_work *work)
+/*
+ * Take a reference on the engine's endpoint on one rail, creating it if
+ * need be; fab_plus->fab_conn is non-NULL afterward if the reference was
+ * taken, even on error.
+ */
+static int fab_plus_setup(struct fab_conn_plus *fab_plus,
+                          struct fab_dom *fab_dom)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret = -ENOMEM;
-    struct zhpeq        *zq = work->data;
-    struct zhpeq_dom    *zdom = zq->zdom;
-    struct zdom_data    *bdom = zdom->backend_data;
-    struct engine       *eng = container_of(head, struct engine, work_head);
-    struct stuff        *conn;
-    struct fab_conn_plus *fab_plus;
     size_t              req;
     struct context      *context;
 
-    conn = stuff_alloc();
-    if (!conn)
-        goto done;
-    zq->backend_data = conn;
-    conn->zq = zq;
-    fab_plus = conn->fab_plus = &one_conn;
-
     if (fab_plus->fab_conn) {
-        ret = 0;
         atm_inc(&fab_plus->fab_conn->use_count);
-        goto link;
+        return 0;
     }
-    fab_plus->fab_conn = fab_conn_alloc(bdom->fab_dom, onfree_one_conn,
-                                        fab_plus);
+    fab_plus->fab_conn = fab_conn_alloc(fab_dom, onfree_one_conn, fab_plus);
     if (!fab_plus->fab_conn)
         goto done;
     ret = fab_ep_setup(fab_plus->fab_conn, NULL, 0, 0);
@@ -648,6 +905,10 @@ static bool worker_qalloc_post(struct zhpeu_work_head *head,
     ret = -ENOMEM;
     fab_plus->context_entries =
         fab_plus->fab_conn->dom->finfo.info->tx_attr->size;
+    fab_plus->inject_size =
+        fab_plus->fab_conn->dom->finfo.info->tx_attr->inject_size;
+    if (fab_plus->inject_size > inject_max)
+        fab_plus->inject_size = inject_max;
 
     req = fab_plus->context_entries * sizeof(*fab_plus->context);
     fab_plus->context = malloc_cachealigned(req);
@@ -667,6 +928,20 @@ static bool worker_qalloc_post(struct zhpeu_work_head *head,
     }
     fab_plus->results_desc = fi_mr_desc(fab_plus->results_mr);
 
+    ret = -ENOMEM;
+    req = ATMV_STAGES * sizeof(*fab_plus->stages);
+    fab_plus->stages = malloc_cachealigned(req);
+    if (!fab_plus->stages)
+        goto done;
+    ret = fi_mr_reg(fab_plus->fab_conn->dom->domain, fab_plus->stages, req,
+                    FI_READ | FI_WRITE, 0, 0, 0, &fab_plus->stages_mr, NULL);
+    if (ret < 0) {
+        fab_plus->stages_mr = NULL;
+        print_func_fi_err(__func__, __LINE__, "fi_mr_req", "", ret);
+        goto done;
+    }
+    fab_plus->stages_desc = fi_mr_desc(fab_plus->stages_mr);
+
     /* Initial contexts and free lists. */
     STAILQ_INIT(&fab_plus->context_free);
     for (req = 0, context = fab_plus->context;
@@ -674,12 +949,70 @@ static bool worker_qalloc_post(struct zhpeu_work_head *head,
         context->fab_plus = fab_plus;
         context->result = &fab_plus->results[req];
         context->result_len = 0;
+        context->atmv = NULL;
+        context->stage = NULL;
         STAILQ_INSERT_TAIL(&fab_plus->context_free,
                            &context->free_lentry, ptrs);
     }
+    STAILQ_INIT(&fab_plus->stage_free);
+    for (req = 0; req < ATMV_STAGES; req++)
+        STAILQ_INSERT_TAIL(&fab_plus->stage_free,
+                           &fab_plus->stages[req].free_lentry, ptrs);
+    ret = 0;
+
+ done:
+    return ret;
+}
+
+static bool worker_qalloc_post(struct zhpeu_work_head *head,
+                               struct zhpeu_work *work)
+{
+    zhpeu_trace();
+    int                 ret = -ENOMEM;
+    struct zhpeq        *zq = work->data;
+    struct zhpeq_dom    *zdom = zq->zdom;
+    struct zdom_data    *bdom = zdom->backend_data;
+    struct engine       *eng = container_of(head, struct engine, work_head);
+    struct stuff        *conn;
+    uint32_t            i;
+    uint                r;
+
+    conn = stuff_alloc();
+    if (!conn)
+        goto done;
+    zq->backend_data = conn;
+    conn->zq = zq;
+    conn->eng = eng;
+
+    /* No more WQEs than WQ entries can be outstanding, parked or not. */
+    conn->pend = calloc(zq->xqinfo.cmdq.ent, sizeof(*conn->pend));
+    conn->park = calloc(zq->xqinfo.cmdq.ent, sizeof(*conn->park));
+    if (!conn->pend || !conn->park)
+        goto done;
+    STAILQ_INIT(&conn->pend_head);
+    STAILQ_INIT(&conn->pend_free);
+    STAILQ_INIT(&conn->park_free);
+    for (i = 0; i < zq->xqinfo.cmdq.ent; i++) {
+        STAILQ_INSERT_TAIL(&conn->pend_free, &conn->pend[i].lentry, ptrs);
+        STAILQ_INSERT_TAIL(&conn->park_free, &conn->park[i].lentry, ptrs);
+    }
+
+    for (r = 0; r < n_rails; r++) {
+        ret = fab_plus_setup(&eng->fab_plus[r], bdom->fab_dom[r]);
+        if (eng->fab_plus[r].fab_conn)
+            conn->n_fab = r + 1;
+        if (ret < 0)
+            goto done;
+    }
+    /* The engine's queues take turns for their home rail. */
+    conn->rail = eng->rail_next;
+    eng->rail_next = (conn->rail + 1) % n_rails;
+    conn->rail_next = conn->rail;
+    conn->op_rail = conn->rail;
+    conn->fab_plus = &eng->fab_plus[conn->rail];
 
- link:
     CIRCLEQ_INSERT_TAIL(&eng->zq_head, &conn->lentry, ptrs);
+    atm_inc(&eng->n_zq);
 
  done:
     if (ret < 0) {
@@ -691,80 +1024,301 @@ static bool worker_qalloc_post(struct zhpeu_work_head *head,
     return false;
 }
 
+static struct engine *engine_pick(void)
+{
+    zhpeu_trace();
+    struct engine       *ret = NULL;
+    int                 node = -1;
+    uint32_t            min = UINT32_MAX;
+    uint                cpu;
+    uint                unode;
+    uint                i;
+    uint32_t            n_zq;
+
+    if (n_engines == 1)
+        return engines;
+
+    /* Least loaded engine; with shard_numa, on the caller's node if any. */
+    if (shard_numa && !syscall(SYS_getcpu, &cpu, &unode, NULL))
+        node = unode;
+    for (;;) {
+        for (i = 0; i < n_engines; i++) {
+            if (node != -1 && engines[i].node != node)
+                continue;
+            n_zq = atm_load_rlx(&engines[i].n_zq);
+            if (n_zq < min) {
+                min = n_zq;
+                ret = &engines[i];
+            }
+        }
+        if (ret || node == -1)
+            break;
+        node = -1;
+    }
+
+    return ret;
+}
+
 static int lfab_qalloc_post(struct zhpeq *zq)
 {
-    PRINT_DEBUG;
-    return lfab_eng_work_queue(&eng, worker_qalloc_post, zq);
+    zhpeu_trace();
+    return lfab_eng_work_queue(engine_pick(), worker_qalloc_post, zq);
+}
+
+static int peer_add(struct zdom_data *bdom, const void *sa, pid_t pid,
+                    uint32_t n, const union sockaddr_in46 *rail_addr)
+{
+    zhpeu_trace();
+    int                 ret = 0;
+    struct lfab_peer    *peer;
+    uint32_t            r;
+
+    mutex_lock(&bdom->peer_mutex);
+    SLIST_FOREACH(peer, &bdom->peer_head, lentry) {
+        if (!sockaddr_cmp(&peer->ep_addr, sa))
+            break;
+    }
+    if (!peer) {
+        peer = malloc(sizeof(*peer));
+        if (!peer) {
+            ret = -ENOMEM;
+            goto done;
+        }
+        sockaddr_cpy(&peer->ep_addr, sa);
+        SLIST_INSERT_HEAD(&bdom->peer_head, peer, lentry);
+    }
+    /* A restarted peer may reuse an address. */
+    peer->pid = pid;
+    peer->n_rails = n;
+    for (r = 1; r < n; r++)
+        sockaddr_cpy(&peer->rail_addr[r], &rail_addr[r]);
+
+ done:
+    mutex_unlock(&bdom->peer_mutex);
+
+    return ret;
+}
+
+/* Returns false, with one rail and no pid, for a peer never exchanged. */
+static bool peer_find(struct zdom_data *bdom, const void *sa,
+                      struct lfab_peer *out)
+{
+    zhpeu_trace();
+    struct lfab_peer    *peer;
+
+    mutex_lock(&bdom->peer_mutex);
+    SLIST_FOREACH(peer, &bdom->peer_head, lentry) {
+        if (!sockaddr_cmp(&peer->ep_addr, sa)) {
+            *out = *peer;
+            break;
+        }
+    }
+    mutex_unlock(&bdom->peer_mutex);
+    if (peer)
+        return true;
+    out->pid = 0;
+    out->n_rails = 1;
+
+    return false;
 }
 
 static int lfab_exchange(struct zhpeq *zq, int sock_fd, void *sa,
                          size_t *sa_len)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret;
     struct stuff        *conn = zq->backend_data;
-    struct fab_conn     *fab_conn = conn->fab_plus->fab_conn;
-
-    ret = fab_av_xchg_addr(fab_conn, sock_fd, sa);
-    if (ret >= 0)
-        *sa_len = sockaddr_len(sa);
+    struct engine       *eng = conn->eng;
+    struct lfab_node    node = local_node;
+    union sockaddr_in46 rail_addr[RAILS_MAX];
+    pid_t               pid = 0;
+    uint32_t            r;
+
+    /* Rail 0 is the address the caller gets to pass to lfab_open(). */
+    ret = fab_av_xchg_addr(eng->fab_plus[0].fab_conn, sock_fd, sa);
+    if (ret < 0)
+        goto done;
+    *sa_len = sockaddr_len(sa);
+    node.n_rails = n_rails;
+    if (sock_fd != -1) {
+        ret = sock_send_blob(sock_fd, &node, sizeof(node));
+        if (ret < 0)
+            goto done;
+        ret = sock_recv_fixed_blob(sock_fd, &node, sizeof(node));
+        if (ret < 0)
+            goto done;
+    }
+    if (node.n_rails > n_rails)
+        node.n_rails = n_rails;
+    if (!node.n_rails)
+        node.n_rails = 1;
+    for (r = 1; r < node.n_rails; r++) {
+        ret = fab_av_xchg_addr(eng->fab_plus[r].fab_conn, sock_fd,
+                               &rail_addr[r]);
+        if (ret < 0)
+            goto done;
+    }
+    if (node.pid && local_node.pid && node.pidns == local_node.pidns &&
+        !strncmp(node.boot_id, local_node.boot_id, sizeof(node.boot_id)))
+        pid = node.pid;
+    if (pid || node.n_rails > 1)
+        ret = peer_add(zq->zdom->backend_data, sa, pid, node.n_rails,
+                       rail_addr);
 
+ done:
     return ret;
 }
 
+static void av_remove(struct stuff *conn, const fi_addr_t *fi_addr,
+                      uint32_t n)
+{
+    zhpeu_trace();
+    struct lfab_work_av_op data = {
+        .conn           = conn,
+    };
+
+    while (n-- > 0) {
+        if (fi_addr[n] == FI_ADDR_NOTAVAIL)
+            continue;
+        data.rail = n;
+        data.fi_addr = fi_addr[n];
+        (void)lfab_eng_work_queue(conn->eng, worker_av_op_remove, &data);
+    }
+}
+
 static int lfab_open(struct zhpeq *zq, void *sa)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret;
     struct stuff        *conn = zq->backend_data;
+    struct zdom_data    *bdom = zq->zdom->backend_data;
     struct lfab_work_av_op data = {
         .conn           = conn,
-        .fi_addr        = FI_ADDR_UNSPEC,
     };
-
-    sockaddr_cpy(&data.ep_addr, sa);
-    ret = lfab_eng_work_queue(&eng, worker_av_op_insert, &data);
-    if (ret < 0)
-        goto done;
-    ret = data.fi_addr;
-    if (data.fi_addr > AV_MAX) {
+    fi_addr_t           fi_addr[RAILS_MAX];
+    struct lfab_peer    peer;
+    uint32_t            r;
+
+    for (r = 0; r < RAILS_MAX; r++)
+        fi_addr[r] = FI_ADDR_NOTAVAIL;
+    (void)peer_find(bdom, sa, &peer);
+    /* The peer's address on rail 0 is sa; on the others it is rail_addr. */
+    for (r = 0; r < peer.n_rails; r++) {
+        data.rail = r;
+        data.fi_addr = FI_ADDR_UNSPEC;
+        sockaddr_cpy(&data.ep_addr, (r ? &peer.rail_addr[r] : sa));
+        ret = lfab_eng_work_queue(conn->eng, worker_av_op_insert, &data);
+        if (ret < 0)
+            goto done;
+        fi_addr[r] = data.fi_addr;
+    }
+    if (fi_addr[0] > AV_MAX) {
         print_err("%s,%u:av %lu exceeds AV_MAX %u\n",
-                  __func__, __LINE__, data.fi_addr, AV_MAX);
-        (void)lfab_eng_work_queue(&eng, worker_av_op_remove, &data);
+                  __func__, __LINE__, fi_addr[0], AV_MAX);
         ret = -ENOSPC;
+        goto done;
     }
+    ret = fi_addr[0];
+    memcpy(bdom->av[ret].fi_addr, fi_addr, sizeof(fi_addr));
+    bdom->av[ret].pid = peer.pid;
 
  done:
+    if (ret < 0)
+        av_remove(conn, fi_addr, RAILS_MAX);
 
     return ret;
 }
 
 static int lfab_close(struct zhpeq *zq, int open_idx)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     struct stuff        *conn = zq->backend_data;
+    struct zdom_data    *bdom = zq->zdom->backend_data;
     struct lfab_work_av_op data = {
         .conn           = conn,
         .fi_addr        = open_idx,
     };
+    struct lfab_av      *av;
+    uint32_t            r;
+
+    if (open_idx >= 0 && open_idx <= AV_MAX) {
+        av = &bdom->av[open_idx];
+        av->pid = 0;
+        /* Rail 0 is open_idx itself, removed below. */
+        av->fi_addr[0] = FI_ADDR_NOTAVAIL;
+        av_remove(conn, av->fi_addr, RAILS_MAX);
+        for (r = 1; r < RAILS_MAX; r++)
+            av->fi_addr[r] = FI_ADDR_NOTAVAIL;
+    }
 
-    return lfab_eng_work_queue(&eng, worker_av_op_remove, &data);
+    return lfab_eng_work_queue(conn->eng, worker_av_op_remove, &data);
+}
+
+/*
+ * Readers only look at the valid bits, which cq_write() sets per entry;
+ * the tail register write and the waiter wakeup (which costs a fence) are
+ * moderated: done every cq_mod_count entries, or by lfab_zq() when the
+ * oldest unpublished entry is cq_mod_cycles old or the queue goes idle.
+ */
+static inline void cq_publish(struct stuff *conn)
+{
+    zhpeu_trace();
+    struct zhpeq        *zq = conn->zq;
+    uint32_t            qmask = zq->xqinfo.cmplq.ent - 1;
+
+    conn->cq_published = conn->cq_tail;
+    iowrite64(conn->cq_tail & qmask,
+              zq->qcm + ZHPE_XDM_QCM_CMPL_QUEUE_TAIL_TOGGLE_OFFSET);
+    zhpeq_cq_notify(zq);
+}
+
+/*
+ * One piece of a zhpeq_atomicv() has completed: store its results.
+ * Returns true, with the batch status, when it was the last piece.
+ */
+static bool atmv_done(struct context *context, int *status)
+{
+    zhpeu_trace();
+    struct zhpeq_atmv   *atmv = context->atmv;
+    struct atmv_stage   *stage = context->stage;
+
+    context->atmv = NULL;
+    if (stage) {
+        context->stage = NULL;
+        if (*status < 0)
+            atmv->status = ZHPEQ_CQ_STATUS_FABRIC_UNRECOVERABLE;
+        else if (atmv->results)
+            memcpy((char *)atmv->results + context->atmv_idx * atmv->size,
+                   stage->res, context->atmv_n * atmv->size);
+        STAILQ_INSERT_HEAD(&context->fab_plus->stage_free,
+                           &stage->free_lentry, ptrs);
+    }
+    if (--atmv->pending > 0)
+        return false;
+    *status = (atmv->status == ZHPEQ_CQ_STATUS_SUCCESS ? 0 : -EIO);
+    free(atmv);
+
+    return true;
 }
 
 static inline void cq_write(void *vcontext, int status)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     struct context      *context = vcontext;
     struct stuff        *conn;
     struct zhpeq        *zq;
     uint32_t            qmask;
     union zhpe_offloaded_hw_cq_entry *cqe;
 
-    record_io_done(context);
+    record_io_done(context, status);
 
     conn = context->conn;
     if (!conn)
         goto done;
+    if (unlikely(context->atmv) && !atmv_done(context, &status)) {
+        conn->tx_completed++;
+        goto done;
+    }
 
     zq = conn->zq;
     qmask = zq->xqinfo.cmplq.ent - 1;
@@ -783,9 +1337,11 @@ static inline void cq_write(void *vcontext, int status)
     smp_wmb();
     /* The following two events can be seen out of order: don't care. */
     cqe->entry.valid = cq_valid(conn->cq_tail, qmask);
+    if (conn->cq_tail == conn->cq_published)
+        conn->cq_unpub_cycles = get_cycles(NULL);
     conn->cq_tail++;
-    iowrite64(conn->cq_tail & qmask,
-              zq->qcm + ZHPE_XDM_QCM_CMPL_QUEUE_TAIL_TOGGLE_OFFSET);
+    if (conn->cq_tail - conn->cq_published >= cq_mod_count)
+        cq_publish(conn);
  done:
     /* Place context on free list. */
     STAILQ_INSERT_TAIL(&context->fab_plus->context_free,
@@ -794,7 +1350,7 @@ static inline void cq_write(void *vcontext, int status)
 
 static void cq_update(void *arg, void *vcqe, bool err)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     struct fi_cq_entry  *cqe;
     struct fi_cq_err_entry *cqerr;
 
@@ -809,288 +1365,954 @@ static void cq_update(void *arg, void *vcqe, bool err)
 
 static inline void cleanup_eagain(struct stuff *conn, struct context *context)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     conn->tx_queued--;
     /* Return context to head of free list. */
     STAILQ_INSERT_HEAD(&context->fab_plus->context_free,
                        &context->free_lentry, ptrs);
 }
 
-static bool lfab_zq(struct stuff *conn)
+/*
+ * Writes no larger than the provider's inject_size are posted with
+ * fi_inject_write(): the source buffer may be reused on return and no
+ * libfabric completion is generated, so the zhpeq completion is written
+ * immediately. Fenced writes, and all writes with more than one rail,
+ * take the normal path, since inject has no flags argument.
+ */
+static ssize_t lfab_inject(struct stuff *conn, struct zdom_data *bdom,
+                           struct context *context, uint64_t op,
+                           void *buf, size_t len, uint64_t raddr)
 {
-    PRINT_DEBUG;
-    struct zhpeq        *zq = conn->zq;
-    struct fab_conn_plus *fab_plus = conn->fab_plus;
-    struct fab_conn     *fab_conn = fab_plus->fab_conn;
-    struct zdom_data    *bdom = zq->zdom->backend_data;
-    struct fid_mr       **lcl_mr = bdom->lcl_mr;
-    uint16_t            qmask = zq->xqinfo.cmdq.ent - 1;
-    uint16_t            wq_head;
-    uint16_t            wq_tail;
-    union zhpe_offloaded_hw_wq_entry *wqe;
-    ssize_t             rc;
-    uint64_t            laddr;
-    uint64_t            raddr;
-    struct fid_mr       *mr;
-    uint64_t            flags;
-    struct context      *context;
-    char                *sendbuf;
-    struct stailq_entry *stailq_entry;
+    zhpeu_trace();
+    struct fab_conn     *fab_conn = conn->fab_plus->fab_conn;
+    uint                rail = conn->op_rail;
+    uint64_t            fi_addr = bdom->rkey[TO_KEYIDX(raddr)].av_idx[rail];
+    uint64_t            rkey = bdom->rkey[TO_KEYIDX(raddr)].rkey[rail];
+    ssize_t             ret;
+
+    ret = fi_inject_write(fab_conn->ep, buf, len, fi_addr,
+                          TO_ADDR(raddr), rkey);
+    record_io_start(ret, conn, op, fi_addr, buf, NULL, TO_ADDR(raddr), rkey,
+                    len, context);
+    if (likely(ret >= 0))
+        cq_write(context, 0);
 
-    wq_head = ioread64(zq->qcm + ZHPE_OFFLOADED_XDM_QCM_CMD_QUEUE_HEAD_OFFSET) & qmask;
-    smp_rmb();
-    wq_tail = ioread64(zq->qcm + ZHPE_OFFLOADED_XDM_QCM_CMD_QUEUE_TAIL_OFFSET) & qmask;
-    for (; wq_head != wq_tail; wq_head = (wq_head + 1) & qmask) {
+    return ret;
+}
 
-        wqe = zq->wq + wq_head;
+/*
+ * Map a zhpe atomic opcode onto a libfabric op and datatype; returns the
+ * operand size. The signed min/max ops use the signed datatypes.
+ */
+static int lfab_atomic_op(struct fi_msg_atomic *msg, uint8_t opcode,
+                          bool is64)
+{
+    zhpeu_trace();
+    bool                sgn = false;
 
-        /* Fences are now more compatible with libfabric: a fence bit
-         * on an operation means it is not dispatched until all previous
-         * operations are complete; however, we can't just rely on
-         * the libfabric fence, since that is per endpoint and ours
-         * are not. So, we must wait for all operations to complete.
-         *
-         * Completion does not guarantee delivery, but if the fence
-         * works as advertised on a per-endpoint basis, we don't
-         * care.
-         */
-        flags = 0;
-        if (wqe->hdr.opcode & ZHPE_OFFLOADED_HW_OPCODE_FENCE) {
-            flags = FI_FENCE;
-            /* Wait for all outstanding operations to complete. */
-            if (conn->tx_queued != conn->tx_completed) {
-                (void)fab_completions(fab_conn->tx_cq, 0, cq_update, NULL);
-                if (conn->tx_queued != conn->tx_completed)
-                    goto done;
-            }
+    switch (opcode & ~ZHPE_OFFLOADED_HW_OPCODE_FENCE) {
+
+    case ZHPE_OFFLOADED_HW_OPCODE_ATM_SWAP:
+        msg->op = FI_ATOMIC_WRITE;
+        break;
+
+    case ZHPE_OFFLOADED_HW_OPCODE_ATM_ADD:
+        msg->op = FI_SUM;
+        break;
+
+    case ZHPE_OFFLOADED_HW_OPCODE_ATM_AND:
+        msg->op = FI_BAND;
+        break;
+
+    case ZHPE_OFFLOADED_HW_OPCODE_ATM_OR:
+        msg->op = FI_BOR;
+        break;
+
+    case ZHPE_OFFLOADED_HW_OPCODE_ATM_XOR:
+        msg->op = FI_BXOR;
+        break;
+
+    case ZHPE_OFFLOADED_HW_OPCODE_ATM_SMIN:
+        sgn = true;
+        /* FALLTHROUGH */
+
+    case ZHPE_OFFLOADED_HW_OPCODE_ATM_UMIN:
+        msg->op = FI_MIN;
+        break;
+
+    case ZHPE_OFFLOADED_HW_OPCODE_ATM_SMAX:
+        sgn = true;
+        /* FALLTHROUGH */
+
+    case ZHPE_OFFLOADED_HW_OPCODE_ATM_UMAX:
+        msg->op = FI_MAX;
+        break;
+
+    case ZHPE_OFFLOADED_HW_OPCODE_ATM_CAS:
+        msg->op = FI_CSWAP;
+        break;
+
+    default:
+        return -EINVAL;
+    }
+
+    if (is64) {
+        msg->datatype = (sgn ? FI_INT64 : FI_UINT64);
+        return sizeof(uint64_t);
+    }
+    msg->datatype = (sgn ? FI_INT32 : FI_UINT32);
+
+    return sizeof(uint32_t);
+}
+
+/*
+ * Post the rest of a zhpeq_atomicv(), one multi-ioc atomic per run of
+ * elements with the same op and peer. Each piece takes its own context
+ * and staging buffer and counts against atmv->pending; on -FI_EAGAIN,
+ * atmv->posted records where to resume.
+ */
+static ssize_t lfab_atomicv(struct stuff *conn, struct zdom_data *bdom,
+                            struct zhpeq_atmv *atmv, uint16_t cmp_index,
+                            uint64_t flags)
+{
+    zhpeu_trace();
+    struct fab_conn_plus *fab_plus = conn->fab_plus;
+    struct fab_conn     *fab_conn = fab_plus->fab_conn;
+    struct fi_tx_attr   *tx_attr = fab_conn->dom->finfo.info->tx_attr;
+    struct fi_msg_atomic *msg = &conn->atmv_msg;
+    uint                rail = conn->op_rail;
+    size_t              max = ATMV_IOC_MAX;
+    struct zhpeq_atomic_ent *ent;
+    struct context      *context;
+    struct atmv_stage   *stage;
+    uint64_t            raddr;
+    ssize_t             rc;
+    size_t              size;
+    size_t              n;
+
+    if (max > tx_attr->rma_iov_limit)
+        max = tx_attr->rma_iov_limit;
+
+    while (atmv->posted < atmv->n_ent) {
+        if (STAILQ_EMPTY(&fab_plus->context_free) ||
+            STAILQ_EMPTY(&fab_plus->stage_free))
+            return -FI_EAGAIN;
+        ent = &atmv->ent[atmv->posted];
+        rc = lfab_atomic_op(msg, ent->op, (atmv->size == sizeof(uint64_t)));
+        if (rc < 0) {
+            atmv->status = ZHPEQ_CQ_STATUS_FABRIC_UNRECOVERABLE;
+            atmv->posted++;
+            continue;
+        }
+        size = rc;
+        msg->addr = bdom->rkey[TO_KEYIDX(ent->rem_addr)].av_idx[rail];
+
+        stage = container_of(STAILQ_FIRST(&fab_plus->stage_free),
+                             struct atmv_stage, free_lentry);
+        for (n = 0; n < max && atmv->posted + n < atmv->n_ent; n++) {
+            raddr = ent[n].rem_addr;
+            if (ent[n].op != ent->op ||
+                bdom->rkey[TO_KEYIDX(raddr)].av_idx[rail] != msg->addr)
+                break;
+            memcpy(stage->op + n * size, &ent[n].operands[0], size);
+            memcpy(stage->cmp + n * size, &ent[n].operands[1], size);
+            conn->atmv_rma_ioc[n].addr = TO_ADDR(raddr);
+            conn->atmv_rma_ioc[n].count = 1;
+            conn->atmv_rma_ioc[n].key = bdom->rkey[TO_KEYIDX(raddr)].rkey[rail];
         }
 
-        if (STAILQ_EMPTY(&fab_plus->context_free))
-            break;
-        stailq_entry = STAILQ_FIRST(&fab_plus->context_free);
-        STAILQ_REMOVE_HEAD(&fab_plus->context_free, ptrs);
-        context = container_of(stailq_entry, struct context, free_lentry);
+        context = container_of(STAILQ_FIRST(&fab_plus->context_free),
+                               struct context, free_lentry);
         context->conn = conn;
-        context->cmp_index = wqe->hdr.cmp_index;
+        context->cmp_index = cmp_index;
+        msg->context = context;
+        msg->desc = &fab_plus->stages_desc;
+        msg->rma_iov_count = n;
+        conn->atmv_op_ioc.addr = stage->op;
+        conn->atmv_op_ioc.count = n;
+        conn->atmv_cmp_ioc.addr = stage->cmp;
+        conn->atmv_cmp_ioc.count = n;
+        conn->atmv_res_ioc.addr = stage->res;
+        conn->atmv_res_ioc.count = n;
+        /* No non-fetching compare in libfabric. */
+        if (msg->op == FI_CSWAP)
+            rc = fi_compare_atomicmsg(fab_conn->ep, msg,
+                                      &conn->atmv_cmp_ioc,
+                                      &fab_plus->stages_desc, 1,
+                                      &conn->atmv_res_ioc,
+                                      &fab_plus->stages_desc, 1, flags);
+        else if (atmv->results)
+            rc = fi_fetch_atomicmsg(fab_conn->ep, msg, &conn->atmv_res_ioc,
+                                    &fab_plus->stages_desc, 1, flags);
+        else
+            rc = fi_atomicmsg(fab_conn->ep, msg, flags | rail_wr_flags);
+        record_io_start(rc, conn, ZHPEQ_SW_OPCODE_ATMV, msg->addr,
+                        stage->op, fab_plus->stages_desc,
+                        conn->atmv_rma_ioc[0].addr, conn->atmv_rma_ioc[0].key,
+                        n * size, context);
+        if (rc == -FI_EAGAIN)
+            return rc;
 
+        STAILQ_REMOVE_HEAD(&fab_plus->context_free, ptrs);
+        STAILQ_REMOVE_HEAD(&fab_plus->stage_free, ptrs);
+        context->atmv = atmv;
+        context->stage = stage;
+        context->atmv_idx = atmv->posted;
+        context->atmv_n = n;
         conn->tx_queued++;
+        atmv->pending++;
+        atmv->posted += n;
+        if (unlikely(rc < 0)) {
+            print_func_fi_errn(__func__, __LINE__, "fi_atomicmsg",
+                               msg->op, true, rc);
+            cq_write(context, rc);
+        }
+    }
 
-        switch (wqe->hdr.opcode & ~ZHPE_OFFLOADED_HW_OPCODE_FENCE) {
+    return 0;
+}
 
-        case ZHPE_OFFLOADED_HW_OPCODE_NOP:
-            cq_write(context, 0);
-            break;
+static ssize_t lfab_rwv(struct stuff *conn, struct zdom_data *bdom,
+                        struct zhpeq_vec *vec, struct context *context,
+                        uint64_t flags, bool put)
+{
+    zhpeu_trace();
+    struct fab_conn     *fab_conn = conn->fab_plus->fab_conn;
+    struct fi_tx_attr   *tx_attr = fab_conn->dom->finfo.info->tx_attr;
+    struct zhpeq_iov    *lcl = vec->iov;
+    struct zhpeq_iov    *rem = vec->iov + vec->n_lcl;
+    uint                rail = conn->op_rail;
+    struct fid_mr       *mr;
+    size_t              i;
 
-        case ZHPE_OFFLOADED_HW_OPCODE_PUT:
-            conn->msg.context = context;
-            laddr = wqe->dma.rd_addr;
-            mr = lcl_mr[TO_KEYIDX(laddr)];
-            /* Check if key unregistered. (Race handling.) */
-            if ((uintptr_t)mr & 1) {
-                cq_write(context, -EINVAL);
-                break;
-            }
-            conn->ldsc = fi_mr_desc(mr);
-            conn->msg_iov.iov_base = TO_PTR(TO_ADDR(laddr));
-            conn->msg_iov.iov_len = wqe->dma.len;
-            conn->rma_iov.len = wqe->dma.len;
-            raddr = wqe->dma.wr_addr;
-            conn->rma_iov.addr = TO_ADDR(raddr);
-            conn->rma_iov.key = bdom->rkey[TO_KEYIDX(raddr)].rkey;
-            conn->msg.addr = bdom->rkey[TO_KEYIDX(raddr)].av_idx;
-            rc = fi_writemsg(fab_conn->ep, &conn->msg, flags);
-            record_io_start(rc, conn, wqe->hdr.opcode, conn->msg.addr,
-                            conn->msg.msg_iov[0].iov_base, conn->msg.desc[0],
-                            conn->msg.rma_iov[0].addr, conn->msg.rma_iov[0].key,
-                            conn->msg.msg_iov[0].iov_len, conn->msg.context);
-            if (unlikely(rc < 0)) {
-                if (rc == -FI_EAGAIN) {
-                    cleanup_eagain(conn, context);
-                    goto eagain;
-                }
-                print_func_fi_err(__func__, __LINE__,
-                                  "fi_writemsg", "", rc);
-                cq_write(context, rc);
-                break;
-            }
-            break;
+    if (vec->n_lcl > tx_attr->iov_limit || vec->n_rem > tx_attr->rma_iov_limit)
+        return -FI_EINVAL;
+
+    for (i = 0; i < vec->n_lcl; i++) {
+        mr = bdom->lcl_mr[rail][TO_KEYIDX(lcl[i].addr)];
+        /* Check if key unregistered. (Race handling.) */
+        if ((uintptr_t)mr & 1)
+            return -FI_EINVAL;
+        conn->ldscv[i] = fi_mr_desc(mr);
+        conn->msgv_iov[i].iov_base = TO_PTR(TO_ADDR(lcl[i].addr));
+        conn->msgv_iov[i].iov_len = lcl[i].len;
+    }
+    conn->msgv.iov_count = vec->n_lcl;
+    conn->msgv.addr = bdom->rkey[TO_KEYIDX(rem[0].addr)].av_idx[rail];
+    for (i = 0; i < vec->n_rem; i++) {
+        /* One message, so one peer. */
+        if (bdom->rkey[TO_KEYIDX(rem[i].addr)].av_idx[rail] != conn->msgv.addr)
+            return -FI_EINVAL;
+        conn->rmav_iov[i].addr = TO_ADDR(rem[i].addr);
+        conn->rmav_iov[i].len = rem[i].len;
+        conn->rmav_iov[i].key = bdom->rkey[TO_KEYIDX(rem[i].addr)].rkey[rail];
+    }
+    conn->msgv.rma_iov_count = vec->n_rem;
+    conn->msgv.context = context;
+
+    if (put)
+        return fi_writemsg(fab_conn->ep, &conn->msgv, flags);
+    else
+        return fi_readmsg(fab_conn->ep, &conn->msgv, flags);
+}
 
-        case ZHPE_OFFLOADED_HW_OPCODE_GET:
-            conn->msg.context = context;
-            laddr = wqe->dma.wr_addr;
-            mr = lcl_mr[TO_KEYIDX(laddr)];
-            /* Check if key unregistered. (Race handling.) */
-            if ((uintptr_t)mr & 1) {
-                cq_write(context, -EINVAL);
+/*
+ * RMA to a key owned by a process on this node, done in place with a
+ * memcpy() or a cross-memory-attach system call; the completion is
+ * written at once. Returns false if the operation must go through the
+ * provider instead: the key isn't local, the transfer is shorter than
+ * cma_min, the key doesn't grant the remote access the operation needs
+ * (so the provider reports the error), or the kernel won't allow access
+ * to the peer (in which case the key stops being treated as local).
+ */
+static bool cma_rw(struct stuff *conn, struct zdom_data *bdom,
+                   struct context *context, uint8_t opcode, void *lcl,
+                   uint64_t raddr, size_t len, bool put)
+{
+    zhpeu_trace();
+    struct rkey         *rkey = &bdom->rkey[TO_KEYIDX(raddr)];
+    uint                rail = conn->op_rail;
+    pid_t               pid = rkey->pid;
+    uint64_t            addr = TO_ADDR(raddr);
+    struct iovec        liov;
+    struct iovec        riov;
+    ssize_t             rc;
+    int                 status;
+
+    if (likely(!pid) || len < cma_min)
+        return false;
+    if (!(rkey->access & (put ? ZHPEQ_MR_PUT_REMOTE : ZHPEQ_MR_GET_REMOTE)))
+        return false;
+    if (addr < rkey->vaddr || addr + len > rkey->vaddr + rkey->len) {
+        status = -EFAULT;
+        goto done;
+    }
+    if (pid == (pid_t)local_node.pid) {
+        if (put)
+            memcpy(TO_PTR(addr), lcl, len);
+        else
+            memcpy(lcl, TO_PTR(addr), len);
+        rc = len;
+    } else {
+        liov.iov_base = lcl;
+        liov.iov_len = len;
+        riov.iov_base = TO_PTR(addr);
+        riov.iov_len = len;
+        if (put)
+            rc = process_vm_writev(pid, &liov, 1, &riov, 1, 0);
+        else
+            rc = process_vm_readv(pid, &liov, 1, &riov, 1, 0);
+        if (rc == -1 && errno != EFAULT) {
+            print_func_err(__func__, __LINE__, "process_vm_writev/readv",
+                           "", -errno);
+            rkey->pid = 0;
+            return false;
+        }
+    }
+    status = (rc == -1 ? -EFAULT : (size_t)rc == len ? 0 : -EIO);
+
+ done:
+    record_io_start(status, conn, opcode, rkey->av_idx[rail], lcl, NULL, addr,
+                    rkey->rkey[rail], len, context);
+    cq_write(context, status);
+
+    return true;
+}
+
+/* Completions for all the engine's endpoints. */
+static void eng_completions(struct engine *eng)
+{
+    zhpeu_trace();
+    uint                r;
+
+    for (r = 0; r < n_rails; r++)
+        (void)fab_completions(eng->fab_plus[r].fab_conn->tx_cq, 0,
+                              cq_update, NULL);
+}
+
+/*
+ * Pick the rail for a WQE: the queue's home rail, except that transfers
+ * of rail_split bytes or more rotate across all of them and atomics stay
+ * on rail 0. A peer without an endpoint on the chosen rail is reached on
+ * rail 0. *len is set to the bytes to count against the rail and *peer
+ * to the peer's rail 0 address, FI_ADDR_NOTAVAIL if the WQE has none.
+ */
+static inline uint wqe_rail(struct stuff *conn, struct zdom_data *bdom,
+                            union zhpe_offloaded_hw_wq_entry *wqe, size_t *len,
+                            uint64_t *peer)
+{
+    zhpeu_trace();
+    uint                ret = conn->rail;
+    uint64_t            raddr;
+    struct zhpeq_vec    *vec;
+    struct zhpeq_atmv   *atmv;
+
+    *len = 0;
+    *peer = FI_ADDR_NOTAVAIL;
+    switch (wqe->hdr.opcode & ~ZHPE_OFFLOADED_HW_OPCODE_FENCE) {
+
+    case ZHPE_OFFLOADED_HW_OPCODE_PUT:
+        raddr = wqe->dma.wr_addr;
+        *len = wqe->dma.len;
+        break;
+
+    case ZHPE_OFFLOADED_HW_OPCODE_GET:
+        raddr = wqe->dma.rd_addr;
+        *len = wqe->dma.len;
+        break;
+
+    case ZHPE_OFFLOADED_HW_OPCODE_PUTIMM:
+    case ZHPE_OFFLOADED_HW_OPCODE_GETIMM:
+        raddr = wqe->imm.rem_addr;
+        *len = wqe->imm.len;
+        break;
+
+    case ZHPE_OFFLOADED_HW_OPCODE_ATM_SWAP:
+    case ZHPE_OFFLOADED_HW_OPCODE_ATM_ADD:
+    case ZHPE_OFFLOADED_HW_OPCODE_ATM_AND:
+    case ZHPE_OFFLOADED_HW_OPCODE_ATM_OR:
+    case ZHPE_OFFLOADED_HW_OPCODE_ATM_XOR:
+    case ZHPE_OFFLOADED_HW_OPCODE_ATM_SMIN:
+    case ZHPE_OFFLOADED_HW_OPCODE_ATM_SMAX:
+    case ZHPE_OFFLOADED_HW_OPCODE_ATM_UMIN:
+    case ZHPE_OFFLOADED_HW_OPCODE_ATM_UMAX:
+    case ZHPE_OFFLOADED_HW_OPCODE_ATM_CAS:
+        /* Atomics on one address must all go through one domain. */
+        raddr = wqe->atm.rem_addr;
+        ret = 0;
+        break;
+
+    case ZHPEQ_SW_OPCODE_ATMV:
+        atmv = TO_PTR(wqe->dma.rd_addr);
+        if (atmv->posted >= atmv->n_ent)
+            return 0;
+        raddr = atmv->ent[atmv->posted].rem_addr;
+        ret = 0;
+        break;
+
+    case ZHPEQ_SW_OPCODE_PUTV:
+    case ZHPEQ_SW_OPCODE_GETV:
+        vec = TO_PTR(wqe->dma.rd_addr);
+        if (!vec->n_rem)
+            return ret;
+        raddr = vec->iov[vec->n_lcl].addr;
+        *len = wqe->dma.len;
+        break;
+
+    default:
+        return ret;
+    }
+
+    *peer = bdom->rkey[TO_KEYIDX(raddr)].av_idx[0];
+    if (*len >= rail_split) {
+        ret = conn->rail_next;
+        conn->rail_next = (ret + 1 == n_rails ? 0 : ret + 1);
+    }
+    if (unlikely(bdom->rkey[TO_KEYIDX(raddr)].av_idx[ret] == FI_ADDR_NOTAVAIL))
+        ret = 0;
+
+    return ret;
+}
+
+/*
+ * A fence bit on an operation means it is not dispatched until all
+ * previous operations are complete; we can't just rely on the libfabric
+ * fence, since that is per endpoint and ours are not. So, everything
+ * posted must have completed and no older WQE may still be parked.
+ * Later WQEs to other peers are not held up by a waiting fence.
+ *
+ * Completion does not guarantee delivery. With one rail, everything
+ * went through the endpoint the fenced operation is posted on, and its
+ * FI_FENCE orders it behind them. With several, FI_FENCE on one rail
+ * says nothing about writes completed on another, so writes and
+ * non-fetching atomics ask for FI_DELIVERY_COMPLETE (rail_wr_flags) and
+ * are never injected: their completion then means the target has them.
+ * Reads and fetches can't complete before the target has acted.
+ */
+static bool fence_ready(struct stuff *conn, uint64_t seq)
+{
+    zhpeu_trace();
+    struct stailq_entry *entry;
+    struct lfab_pend    *pend;
+    struct lfab_park    *park;
+
+    STAILQ_FOREACH(entry, &conn->pend_head, ptrs) {
+        pend = container_of(entry, struct lfab_pend, lentry);
+        park = container_of(STAILQ_FIRST(&pend->park_head),
+                            struct lfab_park, lentry);
+        if (park->seq < seq)
+            return false;
+    }
+    if (conn->tx_queued != conn->tx_completed) {
+        eng_completions(conn->eng);
+        if (conn->tx_queued != conn->tx_completed)
+            return false;
+    }
+
+    return true;
+}
+
+/*
+ * Post one WQE on a rail. Returns 0 once the WQE is consumed, posted or
+ * completed with an error; -FI_EAGAIN if the provider pushed back,
+ * -EBUSY if it is fenced and must wait, and -ENOBUFS if the rail has no
+ * free contexts.
+ */
+static int wqe_post(struct stuff *conn, struct zdom_data *bdom,
+                    union zhpe_offloaded_hw_wq_entry *wqe, uint64_t seq,
+                    uint rail, size_t len)
+{
+    zhpeu_trace();
+    struct zhpeq        *zq = conn->zq;
+    struct fab_conn_plus *fab_plus = &conn->eng->fab_plus[rail];
+    struct fab_conn     *fab_conn = fab_plus->fab_conn;
+    struct fid_mr       **lcl_mr = bdom->lcl_mr[rail];
+    ssize_t             rc;
+    uint64_t            laddr;
+    uint64_t            raddr;
+    struct fid_mr       *mr;
+    uint64_t            flags = 0;
+    uint64_t            wr_flags;
+    struct context      *context;
+    char                *sendbuf;
+    struct stailq_entry *stailq_entry;
+    struct zhpeq_vec    *vec;
+    struct zhpeq_atmv   *atmv;
+    bool                put;
+
+    if (wqe->hdr.opcode & ZHPE_OFFLOADED_HW_OPCODE_FENCE) {
+        flags = FI_FENCE;
+        if (!fence_ready(conn, seq)) {
+            ZHPEQ_STATS_ADD(zhpeq_stats_backend(zq), fence_stalls, 1);
+            return -EBUSY;
+        }
+    }
+    wr_flags = flags | rail_wr_flags;
+
+    if (STAILQ_EMPTY(&fab_plus->context_free))
+        return -ENOBUFS;
+    conn->op_rail = rail;
+    conn->fab_plus = fab_plus;
+    stailq_entry = STAILQ_FIRST(&fab_plus->context_free);
+    STAILQ_REMOVE_HEAD(&fab_plus->context_free, ptrs);
+    context = container_of(stailq_entry, struct context, free_lentry);
+    context->conn = conn;
+    context->cmp_index = wqe->hdr.cmp_index;
+
+    conn->tx_queued++;
+
+    switch (wqe->hdr.opcode & ~ZHPE_OFFLOADED_HW_OPCODE_FENCE) {
+
+    case ZHPE_OFFLOADED_HW_OPCODE_NOP:
+        cq_write(context, 0);
+        break;
+
+    case ZHPE_OFFLOADED_HW_OPCODE_PUT:
+        conn->msg.context = context;
+        laddr = wqe->dma.rd_addr;
+        mr = lcl_mr[TO_KEYIDX(laddr)];
+        /* Check if key unregistered. (Race handling.) */
+        if ((uintptr_t)mr & 1) {
+            cq_write(context, -EINVAL);
+            break;
+        }
+        raddr = wqe->dma.wr_addr;
+        if (cma_rw(conn, bdom, context, wqe->hdr.opcode,
+                   TO_PTR(TO_ADDR(laddr)), raddr, wqe->dma.len, true))
+            break;
+        if (!wr_flags && wqe->dma.len <= fab_plus->inject_size) {
+            rc = lfab_inject(conn, bdom, context, wqe->hdr.opcode,
+                             TO_PTR(TO_ADDR(laddr)), wqe->dma.len, raddr);
+            if (likely(rc >= 0))
                 break;
+            if (rc == -FI_EAGAIN) {
+                cleanup_eagain(conn, context);
+                return -FI_EAGAIN;
             }
-            conn->ldsc = fi_mr_desc(mr);
-            conn->msg_iov.iov_base = TO_PTR(TO_ADDR(laddr));
-            conn->msg_iov.iov_len = wqe->dma.len;
-            conn->rma_iov.len = wqe->dma.len;
-            raddr = wqe->dma.rd_addr;
-            conn->rma_iov.addr = TO_ADDR(raddr);
-            conn->rma_iov.key = bdom->rkey[TO_KEYIDX(raddr)].rkey;
-            conn->msg.addr = bdom->rkey[TO_KEYIDX(raddr)].av_idx;
-            rc = fi_readmsg(fab_conn->ep, &conn->msg, flags);
-            record_io_start(rc, conn, wqe->hdr.opcode, conn->msg.addr,
-                            conn->msg.msg_iov[0].iov_base, conn->msg.desc[0],
-                            conn->msg.rma_iov[0].addr, conn->msg.rma_iov[0].key,
-                            conn->msg.msg_iov[0].iov_len, conn->msg.context);
-            if (unlikely(rc < 0)) {
-                if (rc == -FI_EAGAIN) {
-                    cleanup_eagain(conn, context);
-                    goto eagain;
-                }
-                print_func_fi_err(__func__, __LINE__,
-                                  "fi_readmsg", "", rc);
-                cq_write(context, rc);
-                break;
+            print_func_fi_err(__func__, __LINE__,
+                              "fi_inject_write", "", rc);
+            cq_write(context, rc);
+            break;
+        }
+        conn->ldsc = fi_mr_desc(mr);
+        conn->msg_iov.iov_base = TO_PTR(TO_ADDR(laddr));
+        conn->msg_iov.iov_len = wqe->dma.len;
+        conn->rma_iov.len = wqe->dma.len;
+        conn->rma_iov.addr = TO_ADDR(raddr);
+        conn->rma_iov.key = bdom->rkey[TO_KEYIDX(raddr)].rkey[rail];
+        conn->msg.addr = bdom->rkey[TO_KEYIDX(raddr)].av_idx[rail];
+        rc = fi_writemsg(fab_conn->ep, &conn->msg, wr_flags);
+        record_io_start(rc, conn, wqe->hdr.opcode, conn->msg.addr,
+                        conn->msg.msg_iov[0].iov_base, conn->msg.desc[0],
+                        conn->msg.rma_iov[0].addr, conn->msg.rma_iov[0].key,
+                        conn->msg.msg_iov[0].iov_len, conn->msg.context);
+        if (unlikely(rc < 0)) {
+            if (rc == -FI_EAGAIN) {
+                cleanup_eagain(conn, context);
+                return -FI_EAGAIN;
             }
+            print_func_fi_err(__func__, __LINE__,
+                              "fi_writemsg", "", rc);
+            cq_write(context, rc);
             break;
-
-        case ZHPE_OFFLOADED_HW_OPCODE_PUTIMM:
-            conn->msg.context = context;
-            /* No NULL descriptors! Use results buffer for sent data. */
-            sendbuf = context->result->data;
-            memcpy(sendbuf, wqe->imm.data, wqe->imm.len);
-            laddr = (uintptr_t)sendbuf;
-            conn->ldsc = fab_plus->results_desc;
-            conn->msg_iov.iov_base = TO_PTR(TO_ADDR(laddr));
-            conn->msg_iov.iov_len = wqe->imm.len;
-            conn->rma_iov.len = wqe->imm.len;
-            raddr = wqe->imm.rem_addr;
-            conn->rma_iov.addr = TO_ADDR(raddr);
-            conn->rma_iov.key = bdom->rkey[TO_KEYIDX(raddr)].rkey;
-            conn->msg.addr = bdom->rkey[TO_KEYIDX(raddr)].av_idx;
-            rc = fi_writemsg(fab_conn->ep, &conn->msg, flags);
-            record_io_start(rc, conn, wqe->hdr.opcode, conn->msg.addr,
-                            conn->msg.msg_iov[0].iov_base, conn->msg.desc[0],
-                            conn->msg.rma_iov[0].addr, conn->msg.rma_iov[0].key,
-                            conn->msg.msg_iov[0].iov_len, conn->msg.context);
-            if (unlikely(rc < 0)) {
-                if (rc == -FI_EAGAIN) {
-                    cleanup_eagain(conn, context);
-                    goto eagain;
-                }
-                print_func_fi_err(__func__, __LINE__,
-                                  "fi_writemsg", "", rc);
-                cq_write(context, rc);
-                break;
+        }
+        break;
+
+    case ZHPE_OFFLOADED_HW_OPCODE_GET:
+        conn->msg.context = context;
+        laddr = wqe->dma.wr_addr;
+        mr = lcl_mr[TO_KEYIDX(laddr)];
+        /* Check if key unregistered. (Race handling.) */
+        if ((uintptr_t)mr & 1) {
+            cq_write(context, -EINVAL);
+            break;
+        }
+        raddr = wqe->dma.rd_addr;
+        if (cma_rw(conn, bdom, context, wqe->hdr.opcode,
+                   TO_PTR(TO_ADDR(laddr)), raddr, wqe->dma.len, false))
+            break;
+        conn->ldsc = fi_mr_desc(mr);
+        conn->msg_iov.iov_base = TO_PTR(TO_ADDR(laddr));
+        conn->msg_iov.iov_len = wqe->dma.len;
+        conn->rma_iov.len = wqe->dma.len;
+        conn->rma_iov.addr = TO_ADDR(raddr);
+        conn->rma_iov.key = bdom->rkey[TO_KEYIDX(raddr)].rkey[rail];
+        conn->msg.addr = bdom->rkey[TO_KEYIDX(raddr)].av_idx[rail];
+        rc = fi_readmsg(fab_conn->ep, &conn->msg, flags);
+        record_io_start(rc, conn, wqe->hdr.opcode, conn->msg.addr,
+                        conn->msg.msg_iov[0].iov_base, conn->msg.desc[0],
+                        conn->msg.rma_iov[0].addr, conn->msg.rma_iov[0].key,
+                        conn->msg.msg_iov[0].iov_len, conn->msg.context);
+        if (unlikely(rc < 0)) {
+            if (rc == -FI_EAGAIN) {
+                cleanup_eagain(conn, context);
+                return -FI_EAGAIN;
             }
+            print_func_fi_err(__func__, __LINE__,
+                              "fi_readmsg", "", rc);
+            cq_write(context, rc);
             break;
+        }
+        break;
 
-        case ZHPE_OFFLOADED_HW_OPCODE_GETIMM:
-            conn->msg.context = context;
-            /* Return data in local results buffer. */
-            context->result_len = wqe->imm.len;
-            laddr = (uintptr_t)context->result->data;
-            conn->ldsc = fab_plus->results_desc;
-            conn->msg_iov.iov_base = TO_PTR(TO_ADDR(laddr));
-            conn->msg_iov.iov_len = wqe->imm.len;
-            conn->rma_iov.len = wqe->imm.len;
-            raddr = wqe->imm.rem_addr;
-            conn->rma_iov.addr = TO_ADDR(raddr);
-            conn->rma_iov.key = bdom->rkey[TO_KEYIDX(raddr)].rkey;
-            conn->msg.addr = bdom->rkey[TO_KEYIDX(raddr)].av_idx;
-            rc = fi_readmsg(fab_conn->ep, &conn->msg, flags);
-            record_io_start(rc, conn, wqe->hdr.opcode, conn->msg.addr,
-                            conn->msg.msg_iov[0].iov_base, conn->msg.desc[0],
-                            conn->msg.rma_iov[0].addr, conn->msg.rma_iov[0].key,
-                            conn->msg.msg_iov[0].iov_len, conn->msg.context);
-            if (unlikely(rc < 0)) {
-                if (rc == -FI_EAGAIN) {
-                    cleanup_eagain(conn, context);
-                    goto eagain;
-                }
-                print_func_fi_err(__func__, __LINE__,
-                                  "fi_readmsg", "", rc);
-                cq_write(context, rc);
+    case ZHPE_OFFLOADED_HW_OPCODE_PUTIMM:
+        raddr = wqe->imm.rem_addr;
+        if (cma_rw(conn, bdom, context, wqe->hdr.opcode, wqe->imm.data,
+                   raddr, wqe->imm.len, true))
+            break;
+        if (!wr_flags && wqe->imm.len <= fab_plus->inject_size) {
+            /* Straight from the WQE: no copy to the results buffer. */
+            rc = lfab_inject(conn, bdom, context, wqe->hdr.opcode,
+                             wqe->imm.data, wqe->imm.len, raddr);
+            if (likely(rc >= 0))
                 break;
+            if (rc == -FI_EAGAIN) {
+                cleanup_eagain(conn, context);
+                return -FI_EAGAIN;
             }
+            print_func_fi_err(__func__, __LINE__,
+                              "fi_inject_write", "", rc);
+            cq_write(context, rc);
             break;
-
-        case ZHPE_OFFLOADED_HW_OPCODE_ATM_ADD:
-        case ZHPE_OFFLOADED_HW_OPCODE_ATM_CAS:
-            conn->atm_msg.context = context;
-            /* Return data in local results buffer.
-             * No NULL descriptors! Use results buffer for sent data, too.
-             */
-            sendbuf = context->result->data;
-            if ((wqe->atm.size & ZHPE_OFFLOADED_HW_ATOMIC_SIZE_MASK) ==
-                ZHPE_OFFLOADED_HW_ATOMIC_SIZE_64) {
-                conn->atm_msg.datatype = FI_UINT64;
-                context->result_len = sizeof(uint64_t);
-            } else {
-                conn->atm_msg.datatype = FI_UINT32;
-                context->result_len = sizeof(uint32_t);
+        }
+        conn->msg.context = context;
+        /* No NULL descriptors! Use results buffer for sent data. */
+        sendbuf = context->result->data;
+        memcpy(sendbuf, wqe->imm.data, wqe->imm.len);
+        laddr = (uintptr_t)sendbuf;
+        conn->ldsc = fab_plus->results_desc;
+        conn->msg_iov.iov_base = TO_PTR(TO_ADDR(laddr));
+        conn->msg_iov.iov_len = wqe->imm.len;
+        conn->rma_iov.len = wqe->imm.len;
+        conn->rma_iov.addr = TO_ADDR(raddr);
+        conn->rma_iov.key = bdom->rkey[TO_KEYIDX(raddr)].rkey[rail];
+        conn->msg.addr = bdom->rkey[TO_KEYIDX(raddr)].av_idx[rail];
+        rc = fi_writemsg(fab_conn->ep, &conn->msg, wr_flags);
+        record_io_start(rc, conn, wqe->hdr.opcode, conn->msg.addr,
+                        conn->msg.msg_iov[0].iov_base, conn->msg.desc[0],
+                        conn->msg.rma_iov[0].addr, conn->msg.rma_iov[0].key,
+                        conn->msg.msg_iov[0].iov_len, conn->msg.context);
+        if (unlikely(rc < 0)) {
+            if (rc == -FI_EAGAIN) {
+                cleanup_eagain(conn, context);
+                return -FI_EAGAIN;
             }
-            memcpy(sendbuf, wqe->atm.operands, sizeof(wqe->atm.operands));
-            laddr = (uintptr_t)sendbuf;
-            conn->ldsc = fab_plus->results_desc;
-            conn->atm_op_ioc.addr = TO_PTR(TO_ADDR(laddr));
-            conn->atm_res_ioc.addr = conn->atm_op_ioc.addr;
-            conn->atm_cmp_ioc.addr =
-                conn->atm_op_ioc.addr + sizeof(wqe->atm.operands[0]);
-            raddr = wqe->atm.rem_addr;
-            conn->atm_rma_ioc.addr = TO_ADDR(raddr);
-            conn->atm_rma_ioc.key = bdom->rkey[TO_KEYIDX(raddr)].rkey;
-            conn->atm_msg.addr = bdom->rkey[TO_KEYIDX(raddr)].av_idx;
-            if ((wqe->hdr.opcode & ~ZHPE_OFFLOADED_HW_OPCODE_FENCE) !=
-                ZHPE_OFFLOADED_HW_OPCODE_ATM_ADD) {
-                conn->atm_msg.op = FI_CSWAP;
-                rc = fi_compare_atomicmsg(fab_conn->ep, &conn->atm_msg,
-                                          &conn->atm_cmp_ioc, &conn->ldsc, 1,
-                                          &conn->atm_res_ioc,
-                                          &fab_plus->results_desc, 1, flags);
-            } else {
-                conn->atm_msg.op = FI_SUM;
-                rc = fi_fetch_atomicmsg(fab_conn->ep, &conn->atm_msg,
-                                        &conn->atm_res_ioc,
-                                        &fab_plus->results_desc, 1, flags);
+            print_func_fi_err(__func__, __LINE__,
+                              "fi_writemsg", "", rc);
+            cq_write(context, rc);
+            break;
+        }
+        break;
+
+    case ZHPE_OFFLOADED_HW_OPCODE_GETIMM:
+        conn->msg.context = context;
+        /* Return data in local results buffer. */
+        context->result_len = wqe->imm.len;
+        laddr = (uintptr_t)context->result->data;
+        raddr = wqe->imm.rem_addr;
+        if (cma_rw(conn, bdom, context, wqe->hdr.opcode,
+                   context->result->data, raddr, wqe->imm.len, false))
+            break;
+        conn->ldsc = fab_plus->results_desc;
+        conn->msg_iov.iov_base = TO_PTR(TO_ADDR(laddr));
+        conn->msg_iov.iov_len = wqe->imm.len;
+        conn->rma_iov.len = wqe->imm.len;
+        conn->rma_iov.addr = TO_ADDR(raddr);
+        conn->rma_iov.key = bdom->rkey[TO_KEYIDX(raddr)].rkey[rail];
+        conn->msg.addr = bdom->rkey[TO_KEYIDX(raddr)].av_idx[rail];
+        rc = fi_readmsg(fab_conn->ep, &conn->msg, flags);
+        record_io_start(rc, conn, wqe->hdr.opcode, conn->msg.addr,
+                        conn->msg.msg_iov[0].iov_base, conn->msg.desc[0],
+                        conn->msg.rma_iov[0].addr, conn->msg.rma_iov[0].key,
+                        conn->msg.msg_iov[0].iov_len, conn->msg.context);
+        if (unlikely(rc < 0)) {
+            if (rc == -FI_EAGAIN) {
+                cleanup_eagain(conn, context);
+                return -FI_EAGAIN;
             }
-            record_io_start(rc, conn, wqe->hdr.opcode, conn->atm_msg.addr,
-                            conn->atm_msg.msg_iov[0].addr,
-                            conn->atm_msg.desc[0],
-                            conn->atm_msg.rma_iov[0].addr,
-                            conn->atm_msg.rma_iov[0].key,
-                            context->result_len, conn->msg.context);
-            if (rc < 0) {
-                if (rc == -FI_EAGAIN) {
-                    cleanup_eagain(conn, context);
-                    goto eagain;
-                }
-                print_func_fi_errn(__func__, __LINE__,
-                                   "fi_atomicmsg", conn->atm_msg.op, true, rc);
-                cq_write(context, rc);
-                break;
+            print_func_fi_err(__func__, __LINE__,
+                              "fi_readmsg", "", rc);
+            cq_write(context, rc);
+            break;
+        }
+        break;
+
+    case ZHPE_OFFLOADED_HW_OPCODE_ATM_SWAP:
+    case ZHPE_OFFLOADED_HW_OPCODE_ATM_ADD:
+    case ZHPE_OFFLOADED_HW_OPCODE_ATM_AND:
+    case ZHPE_OFFLOADED_HW_OPCODE_ATM_OR:
+    case ZHPE_OFFLOADED_HW_OPCODE_ATM_XOR:
+    case ZHPE_OFFLOADED_HW_OPCODE_ATM_SMIN:
+    case ZHPE_OFFLOADED_HW_OPCODE_ATM_SMAX:
+    case ZHPE_OFFLOADED_HW_OPCODE_ATM_UMIN:
+    case ZHPE_OFFLOADED_HW_OPCODE_ATM_UMAX:
+    case ZHPE_OFFLOADED_HW_OPCODE_ATM_CAS:
+        conn->atm_msg.context = context;
+        /* Return data in local results buffer.
+         * No NULL descriptors! Use results buffer for sent data, too.
+         */
+        sendbuf = context->result->data;
+        rc = lfab_atomic_op(&conn->atm_msg, wqe->hdr.opcode,
+                            ((wqe->atm.size &
+                              ZHPE_OFFLOADED_HW_ATOMIC_SIZE_MASK) ==
+                             ZHPE_OFFLOADED_HW_ATOMIC_SIZE_64));
+        if (rc < 0) {
+            cq_write(context, rc);
+            break;
+        }
+        if (wqe->atm.size & ZHPE_OFFLOADED_HW_ATOMIC_RETURN)
+            context->result_len = rc;
+        memcpy(sendbuf, wqe->atm.operands, sizeof(wqe->atm.operands));
+        laddr = (uintptr_t)sendbuf;
+        conn->ldsc = fab_plus->results_desc;
+        conn->atm_op_ioc.addr = TO_PTR(TO_ADDR(laddr));
+        conn->atm_res_ioc.addr = conn->atm_op_ioc.addr;
+        conn->atm_cmp_ioc.addr =
+            conn->atm_op_ioc.addr + sizeof(wqe->atm.operands[0]);
+        raddr = wqe->atm.rem_addr;
+        conn->atm_rma_ioc.addr = TO_ADDR(raddr);
+        conn->atm_rma_ioc.key = bdom->rkey[TO_KEYIDX(raddr)].rkey[rail];
+        conn->atm_msg.addr = bdom->rkey[TO_KEYIDX(raddr)].av_idx[rail];
+        /*
+         * libfabric has no non-fetching compare, so CAS always
+         * fetches; the other ops only fetch if the caller wants the
+         * old value.
+         */
+        if (conn->atm_msg.op == FI_CSWAP)
+            rc = fi_compare_atomicmsg(fab_conn->ep, &conn->atm_msg,
+                                      &conn->atm_cmp_ioc, &conn->ldsc, 1,
+                                      &conn->atm_res_ioc,
+                                      &fab_plus->results_desc, 1, flags);
+        else if (context->result_len)
+            rc = fi_fetch_atomicmsg(fab_conn->ep, &conn->atm_msg,
+                                    &conn->atm_res_ioc,
+                                    &fab_plus->results_desc, 1, flags);
+        else
+            rc = fi_atomicmsg(fab_conn->ep, &conn->atm_msg, wr_flags);
+        record_io_start(rc, conn, wqe->hdr.opcode, conn->atm_msg.addr,
+                        conn->atm_msg.msg_iov[0].addr,
+                        conn->atm_msg.desc[0],
+                        conn->atm_msg.rma_iov[0].addr,
+                        conn->atm_msg.rma_iov[0].key,
+                        context->result_len, conn->atm_msg.context);
+        if (rc < 0) {
+            context->result_len = 0;
+            if (rc == -FI_EAGAIN) {
+                cleanup_eagain(conn, context);
+                return -FI_EAGAIN;
             }
+            print_func_fi_errn(__func__, __LINE__,
+                               "fi_atomicmsg", conn->atm_msg.op, true, rc);
+            cq_write(context, rc);
             break;
+        }
+        break;
+
+    case ZHPEQ_SW_OPCODE_PUTV:
+    case ZHPEQ_SW_OPCODE_GETV:
+        vec = TO_PTR(wqe->dma.rd_addr);
+        put = ((wqe->hdr.opcode & ~ZHPE_OFFLOADED_HW_OPCODE_FENCE) ==
+               ZHPEQ_SW_OPCODE_PUTV);
+        rc = lfab_rwv(conn, bdom, vec, context, (put ? wr_flags : flags),
+                      put);
+        record_io_start(rc, conn, wqe->hdr.opcode, conn->msgv.addr,
+                        conn->msgv.msg_iov[0].iov_base, conn->msgv.desc[0],
+                        conn->msgv.rma_iov[0].addr,
+                        conn->msgv.rma_iov[0].key,
+                        wqe->dma.len, conn->msgv.context);
+        if (unlikely(rc < 0)) {
+            /* The WQE will be retried, so keep vec. */
+            if (rc == -FI_EAGAIN) {
+                cleanup_eagain(conn, context);
+                return -FI_EAGAIN;
+            }
+            print_func_fi_err(__func__, __LINE__,
+                              "fi_writemsg/fi_readmsg", "", rc);
+            cq_write(context, rc);
+        }
+        /* libfabric is done with the iov lists. */
+        free(vec);
+        break;
+
+    case ZHPEQ_SW_OPCODE_ATMV:
+        /*
+         * The WQE's own context holds the batch open until every
+         * piece is posted; the last to complete writes the entry.
+         */
+        atmv = TO_PTR(wqe->dma.rd_addr);
+        rc = lfab_atomicv(conn, bdom, atmv, wqe->hdr.cmp_index, flags);
+        if (rc == -FI_EAGAIN) {
+            cleanup_eagain(conn, context);
+            return -FI_EAGAIN;
+        }
+        context->atmv = atmv;
+        cq_write(context, 0);
+        break;
+
+    default:
+        cq_write(context, -EINVAL);
+        print_err("%s,%u:Unexpected opcode 0x%02x\n",
+                  __func__, __LINE__, wqe->hdr.opcode);
+        break;
+    }
+    ZHPEQ_STATS_ADD(zhpeq_stats_backend(zq), rail_bytes[rail], len);
 
-        default:
-            cq_write(context, -EINVAL);
-            print_err("%s,%u:Unexpected opcode 0x%02x\n",
-                      __func__, __LINE__, wqe->hdr.opcode);
-            goto done;
+    return 0;
+}
+
+static struct lfab_pend *pend_find(struct stuff *conn, uint64_t peer)
+{
+    zhpeu_trace();
+    struct stailq_entry *entry;
+    struct lfab_pend    *pend;
+
+    /* Only peers that are backed up are listed, so there are few. */
+    STAILQ_FOREACH(entry, &conn->pend_head, ptrs) {
+        pend = container_of(entry, struct lfab_pend, lentry);
+        if (pend->peer == peer)
+            return pend;
+    }
+
+    return NULL;
+}
+
+/* Copy a WQE out of the WQ onto its peer's list; false if out of room. */
+static bool wqe_park(struct stuff *conn, struct lfab_pend *pend,
+                     uint64_t peer, union zhpe_offloaded_hw_wq_entry *wqe,
+                     uint64_t seq)
+{
+    zhpeu_trace();
+    struct lfab_park    *park;
+
+    if (STAILQ_EMPTY(&conn->park_free))
+        return false;
+    if (!pend) {
+        if (STAILQ_EMPTY(&conn->pend_free))
+            return false;
+        pend = container_of(STAILQ_FIRST(&conn->pend_free),
+                            struct lfab_pend, lentry);
+        STAILQ_REMOVE_HEAD(&conn->pend_free, ptrs);
+        pend->peer = peer;
+        STAILQ_INIT(&pend->park_head);
+        STAILQ_INSERT_TAIL(&conn->pend_head, &pend->lentry, ptrs);
+    }
+    park = container_of(STAILQ_FIRST(&conn->park_free),
+                        struct lfab_park, lentry);
+    STAILQ_REMOVE_HEAD(&conn->park_free, ptrs);
+    park->seq = seq;
+    park->wqe = *wqe;
+    STAILQ_INSERT_TAIL(&pend->park_head, &park->lentry, ptrs);
+    conn->n_parked++;
+
+    return true;
+}
+
+/* Retry each peer's parked WQEs in order; false if out of contexts. */
+static bool park_retry(struct stuff *conn, struct zdom_data *bdom)
+{
+    zhpeu_trace();
+    struct stailq_entry *entry;
+    struct stailq_entry *next;
+    struct lfab_pend    *pend;
+    struct lfab_park    *park;
+    uint64_t            peer;
+    size_t              len;
+    uint                rail;
+    int                 rc;
+
+    for (entry = STAILQ_FIRST(&conn->pend_head); entry; entry = next) {
+        next = STAILQ_NEXT(entry, ptrs);
+        pend = container_of(entry, struct lfab_pend, lentry);
+        while (!STAILQ_EMPTY(&pend->park_head)) {
+            park = container_of(STAILQ_FIRST(&pend->park_head),
+                                struct lfab_park, lentry);
+            rail = wqe_rail(conn, bdom, &park->wqe, &len, &peer);
+            rc = wqe_post(conn, bdom, &park->wqe, park->seq, rail, len);
+            if (rc == -ENOBUFS)
+                return false;
+            if (rc < 0)
+                break;
+            STAILQ_REMOVE_HEAD(&pend->park_head, ptrs);
+            STAILQ_INSERT_HEAD(&conn->park_free, &park->lentry, ptrs);
+            conn->n_parked--;
+        }
+        if (STAILQ_EMPTY(&pend->park_head)) {
+            STAILQ_REMOVE(&conn->pend_head, entry, stailq_entry, ptrs);
+            STAILQ_INSERT_HEAD(&conn->pend_free, entry, ptrs);
         }
     }
- eagain:
-    /* Get completions. */
-    (void)fab_completions(fab_conn->tx_cq, 0, cq_update, zq);
+
+    return true;
+}
+
+/*
+ * A WQE that can't be posted, because the provider pushed back with
+ * -FI_EAGAIN or its fence must wait, is copied out of the WQ and parked
+ * on a list for its peer, so one congested destination doesn't stall
+ * the queue's traffic to everyone else. Later WQEs for a peer with
+ * parked WQEs queue behind them, keeping each peer's ops in order, and
+ * parked WQEs are retried before new ones are read. Running out of
+ * contexts is not peer-specific and still ends the sweep.
+ */
+static bool lfab_zq(struct stuff *conn)
+{
+    zhpeu_trace();
+    struct zhpeq        *zq = conn->zq;
+    struct zdom_data    *bdom = zq->zdom->backend_data;
+    uint16_t            qmask = zq->xqinfo.cmdq.ent - 1;
+    uint16_t            wq_head;
+    uint16_t            wq_tail;
+    union zhpe_offloaded_hw_wq_entry *wqe;
+    struct lfab_pend    *pend;
+    uint64_t            peer;
+    size_t              len;
+    uint                rail;
+    int                 rc;
+    bool                ret;
+
+    wq_head = ioread64(zq->qcm + ZHPE_OFFLOADED_XDM_QCM_CMD_QUEUE_HEAD_OFFSET) & qmask;
+    smp_rmb();
+    wq_tail = ioread64(zq->qcm + ZHPE_OFFLOADED_XDM_QCM_CMD_QUEUE_TAIL_OFFSET) & qmask;
+    if (conn->n_parked && !park_retry(conn, bdom))
+        goto done;
+    for (; wq_head != wq_tail;
+         wq_head = (wq_head + 1) & qmask, conn->wq_seq++) {
+
+        wqe = zq->wq + wq_head;
+        rail = wqe_rail(conn, bdom, wqe, &len, &peer);
+        pend = (conn->n_parked ? pend_find(conn, peer) : NULL);
+        if (!pend) {
+            rc = wqe_post(conn, bdom, wqe, conn->wq_seq, rail, len);
+            if (rc == -ENOBUFS)
+                break;
+            if (rc >= 0)
+                continue;
+        }
+        if (!wqe_park(conn, pend, peer, wqe, conn->wq_seq))
+            break;
+    }
 
  done:
+    /* Get completions. */
+    eng_completions(conn->eng);
+
     iowrite64(wq_head, zq->qcm + ZHPE_OFFLOADED_XDM_QCM_CMD_QUEUE_HEAD_OFFSET);
     /* FIXME: Problematic: orderly shutdown handshake needed in libfabric.
      * Key revocation needs to be skipped. Must deal with outstanding
      * av processing.
      */
+    ret = (conn->tx_queued != conn->tx_completed || conn->n_parked ||
+           wq_head != wq_tail);
+    if (conn->cq_tail != conn->cq_published &&
+        (!ret || get_cycles(NULL) - conn->cq_unpub_cycles >= cq_mod_cycles))
+        cq_publish(conn);
 
-    return (conn->tx_queued != conn->tx_completed || wq_head != wq_tail);
+    return ret;
 }
 
 static void *lfab_eng_thread(void *veng)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     struct engine       *eng = veng;
     bool                locked = false;
     struct timespec     ts_beg = { .tv_sec = 0 };
@@ -1098,6 +2320,17 @@ static void *lfab_eng_thread(void *veng)
     struct circleq_entry *circleq_entry;
     struct stuff        *conn;
     bool                outstanding;
+    cpu_set_t           cpus;
+    int                 rc;
+
+    if (eng->cpu != -1) {
+        CPU_ZERO(&cpus);
+        CPU_SET(eng->cpu, &cpus);
+        rc = -pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (rc < 0)
+            print_func_err(__func__, __LINE__, "pthread_setaffinity_np",
+                           "", rc);
+    }
 
     for (;;) {
         outstanding = false;
@@ -1138,9 +2371,223 @@ static void *lfab_eng_thread(void *veng)
     return NULL;
 }
 
+static int cpu_node(int cpu)
+{
+    zhpeu_trace();
+    int                 ret = -1;
+    char                *path = NULL;
+    DIR                 *dir;
+    struct dirent       *dent;
+
+    if (zhpeu_asprintf(&path, "/sys/devices/system/cpu/cpu%d", cpu) == -1)
+        goto done;
+    dir = opendir(path);
+    if (!dir)
+        goto done;
+    while ((dent = readdir(dir))) {
+        if (sscanf(dent->d_name, "node%d", &ret) == 1)
+            break;
+        ret = -1;
+    }
+    closedir(dir);
+
+ done:
+    free(path);
+
+    return ret;
+}
+
+/* Leaves local_node.pid zero, so no peer is local, if anything fails. */
+static void local_node_init(void)
+{
+    zhpeu_trace();
+    FILE                *fp;
+    struct stat         st;
+    bool                ok = false;
+
+    if (cma_min == UINT64_MAX)
+        return;
+    fp = fopen("/proc/sys/kernel/random/boot_id", "r");
+    if (!fp)
+        return;
+    if (fgets(local_node.boot_id, sizeof(local_node.boot_id), fp)) {
+        local_node.boot_id[strcspn(local_node.boot_id, "\n")] = '\0';
+        ok = !!local_node.boot_id[0];
+    }
+    fclose(fp);
+    /* Containers share the boot_id, but pids are per namespace. */
+    if (!ok || stat("/proc/self/ns/pid", &st) == -1)
+        return;
+    local_node.pidns = st.st_ino;
+    local_node.pid = getpid();
+    /*
+     * Yama ptrace_scope 1 would otherwise refuse peers that aren't
+     * parents. This lets any process of the same user attach to us,
+     * which is why the bypass must be asked for.
+     */
+    (void)prctl(PR_SET_PTRACER, PR_SET_PTRACER_ANY, 0, 0, 0);
+}
+
+static int engines_init(void)
+{
+    zhpeu_trace();
+    int                 ret = 0;
+    bool                do_auto = !!getenv("ZHPE_OFFLOADED_BACKEND_LIBFABRIC_AUTO");
+    char                *cpus = NULL;
+    const char          *s;
+    uint                n_cpus = 0;
+    int                 cpu[ENGINES_MAX];
+    char                *save;
+    char                *tok;
+    uint64_t            val;
+    uint                i;
+
+    if (backend_cpus) {
+        ret = -ENOMEM;
+        cpus = strdup_or_null(backend_cpus);
+        if (!cpus)
+            goto done;
+        for (tok = strtok_r(cpus, ",", &save); tok;
+             tok = strtok_r(NULL, ",", &save)) {
+            ret = -EINVAL;
+            if (n_cpus >= ENGINES_MAX)
+                goto done;
+            ret = parse_kb_uint64_t(__func__, __LINE__,
+                                    "ZHPE_OFFLOADED_BACKEND_LIBFABRIC_CPUS",
+                                    tok, &val, 0, 0, CPU_SETSIZE - 1,
+                                    PARSE_NUM);
+            if (ret < 0)
+                goto done;
+            cpu[n_cpus++] = val;
+        }
+        /* One engine per listed cpu unless told otherwise. */
+        if (n_cpus)
+            n_engines = n_cpus;
+    }
+    if (backend_engines) {
+        ret = parse_kb_uint64_t(__func__, __LINE__,
+                                "ZHPE_OFFLOADED_BACKEND_LIBFABRIC_ENGINES",
+                                backend_engines, &val, 0, 1, ENGINES_MAX,
+                                PARSE_NUM);
+        if (ret < 0)
+            goto done;
+        n_engines = val;
+    }
+    shard_numa = (backend_shard && !strcmp(backend_shard, "numa"));
+    /* A comma-separated list of domains opens one rail per domain. */
+    if (backend_dom) {
+        ret = -ENOMEM;
+        rail_buf = strdup_or_null(backend_dom);
+        if (!rail_buf)
+            goto done;
+        n_rails = 0;
+        for (tok = strtok_r(rail_buf, ",", &save); tok;
+             tok = strtok_r(NULL, ",", &save)) {
+            ret = -EINVAL;
+            if (n_rails >= RAILS_MAX) {
+                print_err("%s,%u:more than %u rails\n",
+                          __func__, __LINE__, RAILS_MAX);
+                goto done;
+            }
+            rail_names[n_rails++] = tok;
+        }
+        if (!n_rails)
+            n_rails = 1;
+    }
+    /* See fence_ready(). */
+    if (n_rails > 1)
+        rail_wr_flags = FI_DELIVERY_COMPLETE;
+    s = getenv("ZHPE_OFFLOADED_BACKEND_LIBFABRIC_RAIL_SPLIT");
+    if (s) {
+        /* "off" keeps every transfer on its queue's rail. */
+        if (!strcmp(s, "off"))
+            rail_split = UINT64_MAX;
+        else {
+            ret = parse_kb_uint64_t(__func__, __LINE__,
+                                    "ZHPE_OFFLOADED_BACKEND_LIBFABRIC_RAIL_SPLIT",
+                                    s, &rail_split, 0, 1, UINT64_MAX - 1,
+                                    PARSE_KB);
+            if (ret < 0)
+                goto done;
+        }
+    }
+
+    s = getenv("ZHPE_OFFLOADED_BACKEND_LIBFABRIC_CQ_MOD");
+    if (s) {
+        ret = parse_kb_uint64_t(__func__, __LINE__,
+                                "ZHPE_OFFLOADED_BACKEND_LIBFABRIC_CQ_MOD",
+                                s, &cq_mod_count, 0, 1, UINT32_MAX,
+                                PARSE_NUM);
+        if (ret < 0)
+            goto done;
+    }
+    val = CQ_MOD_NS;
+    s = getenv("ZHPE_OFFLOADED_BACKEND_LIBFABRIC_CQ_MOD_NS");
+    if (s) {
+        ret = parse_kb_uint64_t(__func__, __LINE__,
+                                "ZHPE_OFFLOADED_BACKEND_LIBFABRIC_CQ_MOD_NS",
+                                s, &val, 0, 0, NS_PER_SEC, PARSE_NUM);
+        if (ret < 0)
+            goto done;
+    }
+    cq_mod_cycles = val * get_tsc_freq() / NS_PER_SEC;
+    s = getenv("ZHPE_OFFLOADED_BACKEND_LIBFABRIC_INJECT");
+    if (s) {
+        ret = parse_kb_uint64_t(__func__, __LINE__,
+                                "ZHPE_OFFLOADED_BACKEND_LIBFABRIC_INJECT",
+                                s, &inject_max, 0, 0, UINT64_MAX, PARSE_KB);
+        if (ret < 0)
+            goto done;
+    }
+    s = getenv("ZHPE_OFFLOADED_BACKEND_LIBFABRIC_IO_RECORD");
+    if (s) {
+        ret = parse_kb_uint64_t(__func__, __LINE__,
+                                "ZHPE_OFFLOADED_BACKEND_LIBFABRIC_IO_RECORD",
+                                s, &io_rec_ents, 0, 0, (1UL << 24),
+                                PARSE_KIB);
+        if (ret < 0)
+            goto done;
+    }
+    s = getenv("ZHPE_OFFLOADED_BACKEND_LIBFABRIC_CMA");
+    if (s) {
+        /* Off unless asked for; "off" keeps the default. */
+        if (!strcmp(s, "off"))
+            cma_min = UINT64_MAX;
+        else {
+            ret = parse_kb_uint64_t(__func__, __LINE__,
+                                    "ZHPE_OFFLOADED_BACKEND_LIBFABRIC_CMA",
+                                    s, &cma_min, 0, 0, UINT64_MAX - 1,
+                                    PARSE_KB);
+            if (ret < 0)
+                goto done;
+        }
+    }
+    local_node_init();
+
+    ret = -ENOMEM;
+    engines = calloc_cachealigned(n_engines, sizeof(*engines));
+    if (!engines)
+        goto done;
+    for (i = 0; i < n_engines; i++) {
+        zhpeu_work_head_init(&engines[i].work_head);
+        CIRCLEQ_INIT(&engines[i].zq_head);
+        engines[i].do_auto = do_auto;
+        engines[i].cpu = (n_cpus ? cpu[i % n_cpus] : -1);
+        engines[i].node = (n_cpus ? cpu_node(engines[i].cpu) : -1);
+    }
+    /* Tracing is a diagnostic; run without it rather than fail. */
+    (void)io_record_init();
+    ret = 0;
+
+ done:
+    free(cpus);
+
+    return ret;
+}
+
 static int lfab_lib_init(struct zhpeq_attr *attr)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     attr->backend = ZHPE_OFFLOADED_BACKEND_LIBFABRIC;
     attr->z.max_tx_queues = (1U << 10);
     attr->z.max_rx_queues = (1U << 10);
@@ -1148,22 +2595,19 @@ static int lfab_lib_init(struct zhpeq_attr *attr)
     attr->z.max_rx_qlen   = (1U << 20) - 1;
     attr->z.max_dma_len   = (1U << 31);
 
-    zhpeu_work_head_init(&eng.work_head);
-    CIRCLEQ_INIT(&eng.zq_head);
-
-    return 0;
+    return engines_init();
 }
 
 static int lfab_qfree_pre(struct zhpeq *zq)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret = 0;
     struct lfab_work_qfree_pre data = {
         .conn           = zq->backend_data,
     };
 
     if (data.conn)
-        ret = lfab_eng_work_queue(&eng, worker_qfree_pre, &data);
+        ret = lfab_eng_work_queue(data.conn->eng, worker_qfree_pre, &data);
     zq->backend_data = NULL;
 
     return ret;
@@ -1171,26 +2615,30 @@ static int lfab_qfree_pre(struct zhpeq *zq)
 
 static int lfab_qfree(struct zhpeq *zq)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     return 0;
 }
 
 static int lfab_wq_signal(struct zhpeq *zq)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
+    struct stuff        *conn = zq->backend_data;
+    struct engine       *eng;
     struct circleq_entry *circleq_entry;
-    struct stuff        *conn;
 
-    if (eng.do_auto)
-        zhpeu_thr_wait_signal(&eng.work_head.thr_wait);
+    if (!conn)
+        return 0;
+    eng = conn->eng;
+    if (eng->do_auto)
+        zhpeu_thr_wait_signal(&eng->work_head.thr_wait);
     else {
-        /* Process all queues. */
-        mutex_lock(&eng.work_head.thr_wait.mutex);
-        CIRCLEQ_FOREACH(circleq_entry, &eng.zq_head, ptrs) {
+        /* Process all queues in this queue's shard. */
+        mutex_lock(&eng->work_head.thr_wait.mutex);
+        CIRCLEQ_FOREACH(circleq_entry, &eng->zq_head, ptrs) {
             conn = container_of(circleq_entry, struct stuff, lentry);
             lfab_zq(conn);
         }
-        mutex_unlock(&eng.work_head.thr_wait.mutex);
+        mutex_unlock(&eng->work_head.thr_wait.mutex);
     }
 
     return 0;
@@ -1198,18 +2646,27 @@ static int lfab_wq_signal(struct zhpeq *zq)
 
 static ssize_t lfab_cq_poll(struct zhpeq *zq, size_t hint)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     return lfab_wq_signal(zq);
 }
 
+static bool lfab_cq_can_block(struct zhpeq *zq)
+{
+    zhpeu_trace();
+    struct stuff        *conn = zq->backend_data;
+
+    /* Without an engine thread, the waiter has to drive progress. */
+    return (conn && conn->eng->do_auto);
+}
+
 static void free_lcl_mr(struct zdom_data *bdom, uint32_t index)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     struct free_index   old;
     struct free_index   new;
 
     for (old = atm_load_rlx(&bdom->lcl_mr_free);;) {
-        bdom->lcl_mr[index] = TO_PTR(old.index);
+        bdom->lcl_mr[0][index] = TO_PTR(old.index);
         new.index = (index << 1) | 1;
         new.seq = old.seq + 1;
         if (atm_cmpxchg(&bdom->lcl_mr_free, &old, new))
@@ -1220,7 +2677,7 @@ static void free_lcl_mr(struct zdom_data *bdom, uint32_t index)
 static bool worker_fi_close(struct zhpeu_work_head *head,
                             struct zhpeu_work *work)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     struct fid          *fid = work->data;
 
     work->status = fi_close(fid);
@@ -1231,7 +2688,7 @@ static bool worker_fi_close(struct zhpeu_work_head *head,
 static bool worker_fi_mr_reg(struct zhpeu_work_head *head,
                              struct zhpeu_work *work)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     struct lfab_work_fi_mr_reg *data = work->data;
 
     work->status = fi_mr_reg(data->domain, data->buf, data->len, data->access,
@@ -1246,21 +2703,19 @@ static int lfab_mr_reg(struct zhpeq_dom *zdom,
                        const void *buf, size_t len,
                        uint32_t access, struct zhpeq_key_data **qkdata_out)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret = -ENOMEM;
     struct zdom_data    *bdom = zdom->backend_data;
-    struct fab_dom      *fab_dom = bdom->fab_dom;
     struct zhpeq_mr_desc_v1 *desc = NULL;
-    struct fid_mr       *mr = NULL;
+    struct fid_mr       *mr[RAILS_MAX] = { NULL };
     struct lfab_work_fi_mr_reg data = {
-        .domain         = fab_dom->domain,
         .buf            = buf,
         .len            = len,
-        .mr_out         = &mr,
     };
     struct free_index   old;
     struct free_index   new;
     uint32_t            index;
+    uint                r;
 
     desc = malloc(sizeof(*desc));
     if (!desc)
@@ -1273,21 +2728,26 @@ static int lfab_mr_reg(struct zhpeq_dom *zdom,
         data.access |= FI_REMOTE_READ;
     if (access & ZHPEQ_MR_PUT_REMOTE)
         data.access |= FI_REMOTE_WRITE;
-    ret = lfab_eng_work_queue(&eng, worker_fi_mr_reg, &data);
-    if (ret < 0)
-        goto done;
+    for (r = 0; r < n_rails; r++) {
+        data.domain = bdom->fab_dom[r]->domain;
+        data.mr_out = &mr[r];
+        ret = lfab_eng_work_queue(engines, worker_fi_mr_reg, &data);
+        if (ret < 0)
+            goto done;
+    }
 
     ret = -ENOSPC;
     for (old = atm_load_rlx(&bdom->lcl_mr_free) ;;) {
         if (old.index == FREE_END)
             goto done;
         index = old.index >> 1;
-        new.index = (uintptr_t)bdom->lcl_mr[index];
+        new.index = (uintptr_t)bdom->lcl_mr[0][index];
         new.seq = old.seq + 1;
         if (atm_cmpxchg(&bdom->lcl_mr_free, &old, new))
             break;
     }
-    bdom->lcl_mr[index] = mr;
+    for (r = 0; r < n_rails; r++)
+        bdom->lcl_mr[r][index] = mr[r];
     desc->hdr.magic = ZHPE_OFFLOADED_MAGIC;
     desc->hdr.version = ZHPEQ_MR_V1;
     desc->qkdata.z.vaddr = (uintptr_t)buf;
@@ -1302,8 +2762,11 @@ static int lfab_mr_reg(struct zhpeq_dom *zdom,
 
  done:
     if (ret < 0) {
-        if (mr)
-            (void)lfab_eng_work_queue(&eng, worker_fi_close, &mr->fid);
+        for (r = 0; r < n_rails; r++) {
+            if (mr[r])
+                (void)lfab_eng_work_queue(engines, worker_fi_close,
+                                          &mr[r]->fid);
+        }
         free(desc);
     }
 
@@ -1312,18 +2775,28 @@ static int lfab_mr_reg(struct zhpeq_dom *zdom,
 
 static int lfab_mr_free(struct zhpeq_dom *zdom, struct zhpeq_key_data *qkdata)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret = -EINVAL;
     struct zdom_data    *bdom = zdom->backend_data;
     struct zhpeq_mr_desc_v1 *desc = container_of(qkdata,
                                                  struct zhpeq_mr_desc_v1,
                                                  qkdata);
     uint32_t            index = TO_KEYIDX(qkdata->z.zaddr);
+    struct fid_mr       *mr;
+    int                 rc;
+    uint                r;
 
     if (desc->hdr.magic != ZHPE_OFFLOADED_MAGIC || desc->hdr.version != ZHPEQ_MR_V1)
         goto done;
 
-    ret = lfab_eng_work_queue(&eng, worker_fi_close, &bdom->lcl_mr[index]->fid);
+    ret = 0;
+    for (r = n_rails; r-- > 0;) {
+        mr = bdom->lcl_mr[r][index];
+        if (r)
+            bdom->lcl_mr[r][index] = TO_PTR(1);
+        rc = lfab_eng_work_queue(engines, worker_fi_close, &mr->fid);
+        ret = (ret >= 0 ? rc : ret);
+    }
     free_lcl_mr(bdom, index);
     free(desc);
 
@@ -1333,12 +2806,12 @@ static int lfab_mr_free(struct zhpeq_dom *zdom, struct zhpeq_key_data *qkdata)
 
 static void free_rkey(struct zdom_data *bdom, uint32_t index)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     struct free_index   old;
     struct free_index   new;
 
     for (old = atm_load_rlx(&bdom->rkey_free) ;;) {
-        bdom->rkey[index].rkey = old.index;
+        bdom->rkey[index].rkey[0] = old.index;
         new.index = index;
         new.seq = old.seq + 1;
         if (atm_cmpxchg(&bdom->rkey_free, &old, new))
@@ -1351,16 +2824,28 @@ static int lfab_zmmu_import(struct zhpeq_dom *zdom, int open_idx,
                             bool cpu_visible,
                             struct zhpeq_key_data **qkdata_out)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret = -EINVAL;
     struct zdom_data    *bdom = zdom->backend_data;
     const struct key_data_packed *pdata = blob;
+    const struct lfab_av *av = NULL;
     struct zhpeq_mr_desc_v1 *desc = NULL;
+    struct rkey         *rkey;
     struct free_index   old;
     struct free_index   new;
+    size_t              n_keys;
+    uint64_t            key;
+    uint                r;
 
-    if (blob_len != sizeof(*pdata) || cpu_visible)
+    /* The rail 0 key is in pdata, any others follow it. */
+    if (blob_len < sizeof(*pdata) || cpu_visible)
+        goto done;
+    n_keys = blob_len - sizeof(*pdata);
+    if (n_keys % sizeof(key) || n_keys / sizeof(key) >= RAILS_MAX)
         goto done;
+    n_keys = n_keys / sizeof(key) + 1;
+    if (open_idx >= 0 && open_idx <= AV_MAX)
+        av = &bdom->av[open_idx];
 
     ret = -ENOMEM;
     desc = malloc(sizeof(*desc));
@@ -1374,13 +2859,28 @@ static int lfab_zmmu_import(struct zhpeq_dom *zdom, int open_idx,
     for (old = atm_load_rlx(&bdom->rkey_free) ;;) {
         if (old.index == FREE_END)
             goto done;
-        new.index = bdom->rkey[old.index].rkey;
+        new.index = bdom->rkey[old.index].rkey[0];
         new.seq = old.seq + 1;
         if (atm_cmpxchg(&bdom->rkey_free, &old, new))
             break;
     }
-    bdom->rkey[old.index].rkey = desc->qkdata.z.zaddr;
-    bdom->rkey[old.index].av_idx = open_idx;
+    rkey = &bdom->rkey[old.index];
+    rkey->rkey[0] = desc->qkdata.z.zaddr;
+    rkey->av_idx[0] = open_idx;
+    for (r = 1; r < RAILS_MAX; r++) {
+        rkey->rkey[r] = FI_KEY_NOTAVAIL;
+        rkey->av_idx[r] = FI_ADDR_NOTAVAIL;
+        if (r >= n_keys || !av || av->fi_addr[r] == FI_ADDR_NOTAVAIL)
+            continue;
+        memcpy(&key, (const char *)(pdata + 1) + (r - 1) * sizeof(key),
+               sizeof(key));
+        rkey->rkey[r] = be64toh(key);
+        rkey->av_idx[r] = av->fi_addr[r];
+    }
+    rkey->vaddr = desc->qkdata.z.vaddr;
+    rkey->len = desc->qkdata.z.len;
+    rkey->pid = (av ? av->pid : 0);
+    rkey->access = desc->qkdata.z.access;
     desc->qkdata.z.zaddr = (((uint64_t)old.index << KEY_SHIFT) +
                             TO_ADDR(desc->qkdata.z.vaddr));
     *qkdata_out = &desc->qkdata;
@@ -1396,7 +2896,7 @@ static int lfab_zmmu_import(struct zhpeq_dom *zdom, int open_idx,
 
 static int lfab_zmmu_free(struct zhpeq_dom *zdom, struct zhpeq_key_data *qkdata)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret = -EINVAL;
     struct zdom_data    *bdom = zdom->backend_data;
     struct zhpeq_mr_desc_v1 *desc = container_of(qkdata,
@@ -1420,32 +2920,42 @@ static int lfab_zmmu_export(struct zhpeq_dom *zdom,
                             const struct zhpeq_key_data *qkdata,
                             void *blob, size_t *blob_len)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret = -EOVERFLOW;
     struct zdom_data    *bdom = zdom->backend_data;
+    uint32_t            index = TO_KEYIDX(qkdata->z.zaddr);
+    size_t              len;
+    uint64_t            key;
+    uint                r;
 
-    if (*blob_len < sizeof(struct key_data_packed))
+    /* Peers pick the key for the rail they reach us on. */
+    len = sizeof(struct key_data_packed) + (n_rails - 1) * sizeof(key);
+    if (*blob_len < len)
         goto done;
 
-    pack_kdata(qkdata, blob,
-               fi_mr_key(bdom->lcl_mr[TO_KEYIDX(qkdata->z.zaddr)]));
+    pack_kdata(qkdata, blob, fi_mr_key(bdom->lcl_mr[0][index]));
+    for (r = 1; r < n_rails; r++) {
+        key = htobe64(fi_mr_key(bdom->lcl_mr[r][index]));
+        memcpy((char *)blob + sizeof(struct key_data_packed) +
+               (r - 1) * sizeof(key), &key, sizeof(key));
+    }
     ret = 0;
 
  done:
-    *blob_len = sizeof(struct key_data_packed);
+    *blob_len = len;
 
     return ret;
 }
 
 static void lfab_print_info(struct zhpeq *zq)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     struct fab_conn     *fab_conn = NULL;
     struct stuff        *conn;
 
     if (zq) {
         conn = zq->backend_data;
-        fab_conn = conn->fab_plus->fab_conn;
+        fab_conn = conn->eng->fab_plus[conn->rail].fab_conn;
     }
     fab_print_info(fab_conn);
 }
@@ -1453,7 +2963,7 @@ static void lfab_print_info(struct zhpeq *zq)
 static bool worker_fi_getname(struct zhpeu_work_head *head,
                               struct zhpeu_work *work)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     struct lfab_work_fi_getname *data = work->data;
 
     work->status = fi_getname(data->fid, data->buf, data->len_inout);
@@ -1463,10 +2973,10 @@ static bool worker_fi_getname(struct zhpeu_work_head *head,
 
 static int lfab_getaddr(struct zhpeq *zq, void *sa, size_t *sa_len)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret;
     struct stuff        *conn = zq->backend_data;
-    struct fab_conn     *fab_conn = conn->fab_plus->fab_conn;
+    struct fab_conn     *fab_conn = conn->eng->fab_plus[0].fab_conn;
     struct lfab_work_fi_getname data = {
         .fid            = &fab_conn->ep->fid,
         .buf            = sa,
@@ -1474,7 +2984,7 @@ static int lfab_getaddr(struct zhpeq *zq, void *sa, size_t *sa_len)
     };
     size_t              olen = *sa_len;
 
-    ret = lfab_eng_work_queue(&eng, worker_fi_getname, &data);
+    ret = lfab_eng_work_queue(conn->eng, worker_fi_getname, &data);
     if (ret >= 0) {
         if (!sockaddr_valid(sa, *sa_len, true))
             ret = -EAFNOSUPPORT;
@@ -1499,6 +3009,7 @@ static struct backend_ops ops = {
     .close              = lfab_close,
     .wq_signal          = lfab_wq_signal,
     .cq_poll            = lfab_cq_poll,
+    .cq_can_block       = lfab_cq_can_block,
     .mr_reg             = lfab_mr_reg,
     .mr_free            = lfab_mr_free,
     .zmmu_import        = lfab_zmmu_import,
@@ -1510,10 +3021,12 @@ static struct backend_ops ops = {
 
 void zhpeq_backend_libfabric_init(int fd)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     backend_prov = getenv("ZHPE_OFFLOADED_BACKEND_LIBFABRIC_PROV");
     backend_dom = getenv("ZHPE_OFFLOADED_BACKEND_LIBFABRIC_DOM");
-    eng.do_auto = !!getenv("ZHPE_OFFLOADED_BACKEND_LIBFABRIC_AUTO");
+    backend_engines = getenv("ZHPE_OFFLOADED_BACKEND_LIBFABRIC_ENGINES");
+    backend_cpus = getenv("ZHPE_OFFLOADED_BACKEND_LIBFABRIC_CPUS");
+    backend_shard = getenv("ZHPE_OFFLOADED_BACKEND_LIBFABRIC_SHARD");
 
     if (fd != -1)
         return;
@@ -0,0 +1,888 @@
+/*
+ * Copyright (C) 2019 Hewlett Packard Enterprise Development LP.
+ * All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <internal.h>
+
+#include <sys/prctl.h>
+#include <sys/uio.h>
+
+/*
+ * Software backend that executes commands itself, in the thread that
+ * calls zhpeq_signal(), zhpeq_cq_read(), or zhpeq_cq_wait(): data moves
+ * with memcpy() when the key was imported from this process and with
+ * process_vm_writev()/process_vm_readv() when it came from another
+ * process on the node. Completions are written in order, before the
+ * call returns. Atomics are only supported within a process. It is
+ * selected with ZHPE_OFFLOADED_BACKEND_LOOPBACK.
+ */
+
+#define KEY_SHIFT       47
+#define KEY_MASK_ADDR   (((uint64_t)1 << KEY_SHIFT) - 1)
+#define KEYTAB_SHIFT    (64 - KEY_SHIFT)
+#define KEYTAB_SIZE     ((size_t)1 << KEYTAB_SHIFT)
+
+#define TO_KEYIDX(_addr) ((_addr) >> KEY_SHIFT)
+#define TO_ADDR(_addr)  ((_addr) & KEY_MASK_ADDR)
+
+#define PEER_MAX        (1024)
+
+struct lb_peer {
+    pid_t               pid;
+    bool                used;
+};
+
+/* An imported key: len == 0 marks a free entry, so lookups fail. */
+struct lb_rkey {
+    uint64_t            vaddr;
+    uint64_t            len;
+    pid_t               pid;
+    uint32_t            access;
+    int32_t             next;
+};
+
+struct zdom_data {
+    pthread_mutex_t     peer_mutex;
+    struct lb_peer      peers[PEER_MAX];
+    struct lb_rkey      *rkey;
+    struct free_index   rkey_free;
+};
+
+struct lb_queue {
+    pthread_mutex_t     mutex;
+    uint32_t            cq_tail;
+};
+
+static int lb_lib_init(struct zhpeq_attr *attr)
+{
+    zhpeu_trace();
+    attr->backend = ZHPEQ_BACKEND_LOOPBACK;
+    attr->z.max_tx_queues = (1U << 10);
+    attr->z.max_rx_queues = (1U << 10);
+    attr->z.max_tx_qlen   = (1U << 16) - 1;
+    attr->z.max_rx_qlen   = (1U << 20) - 1;
+    attr->z.max_dma_len   = (1U << 31);
+
+    uuid_generate(zhpeq_uuid);
+
+    return 0;
+}
+
+static int lb_domain(struct zhpeq_dom *zdom)
+{
+    zhpeu_trace();
+    int                 ret = -ENOMEM;
+    struct zdom_data    *bdom;
+    size_t              i;
+
+    bdom = zdom->backend_data = calloc_cachealigned(1, sizeof(*bdom));
+    if (!bdom)
+        goto done;
+    mutex_init(&bdom->peer_mutex, NULL);
+
+    bdom->rkey = calloc_cachealigned(KEYTAB_SIZE, sizeof(*bdom->rkey));
+    if (!bdom->rkey)
+        goto done;
+    bdom->rkey_free.index = 0;
+    for (i = 0; i < KEYTAB_SIZE - 1; i++)
+        bdom->rkey[i].next = i + 1;
+    bdom->rkey[i].next = FREE_END;
+    ret = 0;
+
+ done:
+    return ret;
+}
+
+static int lb_domain_free(struct zhpeq_dom *zdom)
+{
+    zhpeu_trace();
+    struct zdom_data    *bdom = zdom->backend_data;
+
+    if (bdom) {
+        zdom->backend_data = NULL;
+        mutex_destroy(&bdom->peer_mutex);
+        free(bdom->rkey);
+        free(bdom);
+    }
+
+    return 0;
+}
+
+static int lb_qalloc(struct zhpeq *zq, int cmd_qlen, int cmp_qlen,
+                     int traffic_class, int priority, int slice_mask)
+{
+    zhpeu_trace();
+    /* Tell caller we don't have a driver. */
+    zq->fd = -1;
+    /* Use xqinfo for compatiblity with asic code. */
+    zq->xqinfo.qcm.size =
+        roundup64(ZHPE_XDM_QCM_CMPL_QUEUE_TAIL_TOGGLE_OFFSET + 8, page_size);
+    zq->xqinfo.qcm.off = 0;
+    zq->xqinfo.cmdq.ent = cmd_qlen;
+    zq->xqinfo.cmdq.size = roundup64(cmd_qlen * ZHPE_ENTRY_LEN, page_size);
+    zq->xqinfo.cmdq.off = 0;
+    zq->xqinfo.cmplq.ent = cmp_qlen;
+    zq->xqinfo.cmplq.size = roundup64(cmp_qlen * ZHPE_ENTRY_LEN, page_size);
+    zq->xqinfo.cmplq.off = 0;
+
+    return 0;
+}
+
+static int lb_qalloc_post(struct zhpeq *zq)
+{
+    zhpeu_trace();
+    struct lb_queue     *lbq;
+
+    lbq = calloc_cachealigned(1, sizeof(*lbq));
+    if (!lbq)
+        return -ENOMEM;
+    mutex_init(&lbq->mutex, NULL);
+    zq->backend_data = lbq;
+
+    return 0;
+}
+
+static int lb_qfree_pre(struct zhpeq *zq)
+{
+    zhpeu_trace();
+    struct lb_queue     *lbq = zq->backend_data;
+
+    /* Commands complete before the call that runs them returns. */
+    if (lbq) {
+        zq->backend_data = NULL;
+        mutex_destroy(&lbq->mutex);
+        free(lbq);
+    }
+
+    return 0;
+}
+
+static int lb_qfree(struct zhpeq *zq)
+{
+    zhpeu_trace();
+    return 0;
+}
+
+static int lb_getaddr(struct zhpeq *zq, void *sa, size_t *sa_len)
+{
+    zhpeu_trace();
+    int                 ret = -EOVERFLOW;
+    struct sockaddr_zhpe *sz = sa;
+
+    if (*sa_len < sizeof(*sz))
+        goto done;
+
+    sz->sz_family = AF_ZHPE;
+    memcpy(sz->sz_uuid, zhpeq_uuid, sizeof(sz->sz_uuid));
+    sz->sz_queue = getpid();
+    ret = 0;
+
+ done:
+    *sa_len = sizeof(*sz);
+
+    return ret;
+}
+
+static int lb_exchange(struct zhpeq *zq, int sock_fd, void *sa,
+                       size_t *sa_len)
+{
+    zhpeu_trace();
+    int                 ret;
+    struct sockaddr_zhpe *sz = sa;
+
+    *sa_len = sizeof(*sz);
+    ret = lb_getaddr(zq, sa, sa_len);
+    if (ret < 0 || sock_fd == -1)
+        goto done;
+
+    ret = sock_send_blob(sock_fd, sz, sizeof(*sz));
+    if (ret < 0)
+        goto done;
+    ret = sock_recv_fixed_blob(sock_fd, sz, sizeof(*sz));
+
+ done:
+    return ret;
+}
+
+static int lb_open(struct zhpeq *zq, void *sa)
+{
+    zhpeu_trace();
+    int                 ret = -EINVAL;
+    struct zdom_data    *bdom = zq->zdom->backend_data;
+    struct sockaddr_zhpe *sz = sa;
+    pid_t               pid;
+    int                 i;
+
+    if (sz->sz_family != AF_ZHPE)
+        goto done;
+    /* pid 0 means this process: no system call needed. */
+    pid = (uuid_compare(sz->sz_uuid, zhpeq_uuid) ? (pid_t)sz->sz_queue : 0);
+
+    ret = -ENOSPC;
+    mutex_lock(&bdom->peer_mutex);
+    for (i = 0; i < PEER_MAX; i++) {
+        if (bdom->peers[i].used)
+            continue;
+        bdom->peers[i].used = true;
+        bdom->peers[i].pid = pid;
+        ret = i;
+        break;
+    }
+    mutex_unlock(&bdom->peer_mutex);
+    /*
+     * The peer opens us in turn and must be allowed to use
+     * process_vm_writev() on us under Yama ptrace_scope 1. Only done
+     * once another process is actually opened.
+     */
+    if (ret >= 0 && pid)
+        (void)prctl(PR_SET_PTRACER, PR_SET_PTRACER_ANY, 0, 0, 0);
+
+ done:
+    return ret;
+}
+
+static int lb_close(struct zhpeq *zq, int open_idx)
+{
+    zhpeu_trace();
+    int                 ret = -EINVAL;
+    struct zdom_data    *bdom = zq->zdom->backend_data;
+
+    if (open_idx < 0 || open_idx >= PEER_MAX)
+        goto done;
+
+    mutex_lock(&bdom->peer_mutex);
+    ret = (bdom->peers[open_idx].used ? 0 : -ENOENT);
+    bdom->peers[open_idx].used = false;
+    mutex_unlock(&bdom->peer_mutex);
+
+ done:
+    return ret;
+}
+
+/* Translate a remote zaddr; fails unless [zaddr, zaddr + len) is covered. */
+static inline uint8_t rkey_lookup(struct zdom_data *bdom, uint64_t zaddr,
+                                  uint64_t len, uint32_t access,
+                                  pid_t *pid, void **ptr)
+{
+    struct lb_rkey      *rkey = &bdom->rkey[TO_KEYIDX(zaddr)];
+    uint64_t            addr = TO_ADDR(zaddr);
+
+    if ((rkey->access & access) != access || addr < rkey->vaddr ||
+        addr + len > rkey->vaddr + rkey->len)
+        return ZHPEQ_CQ_STATUS_FABRIC_ACCESS;
+    *pid = rkey->pid;
+    *ptr = TO_PTR(addr);
+
+    return ZHPEQ_CQ_STATUS_SUCCESS;
+}
+
+static uint8_t lb_copyv(pid_t pid, struct iovec *liov, size_t n_lcl,
+                        struct iovec *riov, size_t n_rem, size_t len, bool put)
+{
+    ssize_t             rc;
+    size_t              l;
+    size_t              r;
+    size_t              loff;
+    size_t              roff;
+    size_t              n;
+
+    if (pid) {
+        if (put)
+            rc = process_vm_writev(pid, liov, n_lcl, riov, n_rem, 0);
+        else
+            rc = process_vm_readv(pid, liov, n_lcl, riov, n_rem, 0);
+        if (rc == -1)
+            return (errno == EFAULT ? ZHPEQ_CQ_STATUS_FABRIC_ACCESS :
+                    ZHPEQ_CQ_STATUS_FABRIC_UNRECOVERABLE);
+        if ((size_t)rc != len)
+            return ZHPEQ_CQ_STATUS_FABRIC_UNRECOVERABLE;
+        return ZHPEQ_CQ_STATUS_SUCCESS;
+    }
+
+    /* Same pieces as zhpeq_rwv() would cut for hardware. */
+    for (l = r = loff = roff = 0; l < n_lcl && r < n_rem;) {
+        n = liov[l].iov_len - loff;
+        if (n > riov[r].iov_len - roff)
+            n = riov[r].iov_len - roff;
+        if (put)
+            memcpy((char *)riov[r].iov_base + roff,
+                   (char *)liov[l].iov_base + loff, n);
+        else
+            memcpy((char *)liov[l].iov_base + loff,
+                   (char *)riov[r].iov_base + roff, n);
+        loff += n;
+        roff += n;
+        if (loff == liov[l].iov_len) {
+            l++;
+            loff = 0;
+        }
+        if (roff == riov[r].iov_len) {
+            r++;
+            roff = 0;
+        }
+    }
+
+    return ZHPEQ_CQ_STATUS_SUCCESS;
+}
+
+static inline uint8_t lb_copy(struct zdom_data *bdom, void *lcl,
+                              uint64_t rem_zaddr, size_t len, bool put)
+{
+    uint8_t             ret;
+    pid_t               pid;
+    struct iovec        liov;
+    struct iovec        riov;
+
+    ret = rkey_lookup(bdom, rem_zaddr, len,
+                      (put ? ZHPEQ_MR_PUT_REMOTE : ZHPEQ_MR_GET_REMOTE),
+                      &pid, &riov.iov_base);
+    if (ret != ZHPEQ_CQ_STATUS_SUCCESS)
+        return ret;
+    if (!pid) {
+        if (put)
+            memcpy(riov.iov_base, lcl, len);
+        else
+            memcpy(lcl, riov.iov_base, len);
+        return ret;
+    }
+    liov.iov_base = lcl;
+    liov.iov_len = len;
+    riov.iov_len = len;
+
+    return lb_copyv(pid, &liov, 1, &riov, 1, len, put);
+}
+
+static uint8_t lb_rwv(struct zdom_data *bdom, struct zhpeq_vec *vec,
+                      size_t len, bool put)
+{
+    uint8_t             ret = ZHPEQ_CQ_STATUS_SUCCESS;
+    struct zhpeq_iov    *lcl = vec->iov;
+    struct zhpeq_iov    *rem = vec->iov + vec->n_lcl;
+    struct iovec        liov[ZHPEQ_IOV_MAX];
+    struct iovec        riov[ZHPEQ_IOV_MAX];
+    pid_t               pid0 = 0;
+    pid_t               pid;
+    size_t              i;
+
+    for (i = 0; i < vec->n_lcl; i++) {
+        liov[i].iov_base = TO_PTR(lcl[i].addr);
+        liov[i].iov_len = lcl[i].len;
+    }
+    for (i = 0; i < vec->n_rem; i++) {
+        ret = rkey_lookup(bdom, rem[i].addr, rem[i].len,
+                          (put ? ZHPEQ_MR_PUT_REMOTE : ZHPEQ_MR_GET_REMOTE),
+                          &pid, &riov[i].iov_base);
+        if (ret != ZHPEQ_CQ_STATUS_SUCCESS)
+            return ret;
+        /* One peer per operation, as with libfabric. */
+        if (!i)
+            pid0 = pid;
+        else if (pid != pid0)
+            return ZHPEQ_CQ_STATUS_BAD_CMD;
+        riov[i].iov_len = rem[i].len;
+    }
+
+    return lb_copyv(pid0, liov, vec->n_lcl, riov, vec->n_rem, len, put);
+}
+
+/*
+ * Atomics on memory in this process. CAS operands follow the libfabric
+ * backend: operands[0] is stored if the target equals operands[1].
+ */
+#define LB_ATOMIC(_name, _utype, _stype)                                \
+static bool _name(uint8_t opcode, void *vp, const void *op0,            \
+                  const void *op1, void *res)                           \
+{                                                                       \
+    _utype              *p = vp;                                        \
+    _utype              o0;                                             \
+    _utype              o1;                                             \
+    _utype              old;                                            \
+    _utype              new;                                            \
+                                                                        \
+    memcpy(&o0, op0, sizeof(o0));                                       \
+    memcpy(&o1, op1, sizeof(o1));                                       \
+                                                                        \
+    switch (opcode & ~ZHPE_OFFLOADED_HW_OPCODE_FENCE) {                 \
+                                                                        \
+    case ZHPE_OFFLOADED_HW_OPCODE_ATM_SWAP:                             \
+        old = __atomic_exchange_n(p, o0, __ATOMIC_ACQ_REL);             \
+        break;                                                          \
+                                                                        \
+    case ZHPE_OFFLOADED_HW_OPCODE_ATM_ADD:                              \
+        old = __atomic_fetch_add(p, o0, __ATOMIC_ACQ_REL);              \
+        break;                                                          \
+                                                                        \
+    case ZHPE_OFFLOADED_HW_OPCODE_ATM_AND:                              \
+        old = __atomic_fetch_and(p, o0, __ATOMIC_ACQ_REL);              \
+        break;                                                          \
+                                                                        \
+    case ZHPE_OFFLOADED_HW_OPCODE_ATM_OR:                               \
+        old = __atomic_fetch_or(p, o0, __ATOMIC_ACQ_REL);               \
+        break;                                                          \
+                                                                        \
+    case ZHPE_OFFLOADED_HW_OPCODE_ATM_XOR:                              \
+        old = __atomic_fetch_xor(p, o0, __ATOMIC_ACQ_REL);              \
+        break;                                                          \
+                                                                        \
+    case ZHPE_OFFLOADED_HW_OPCODE_ATM_CAS:                              \
+        old = o1;                                                       \
+        (void)__atomic_compare_exchange_n(p, &old, o0, false,           \
+                                          __ATOMIC_ACQ_REL,             \
+                                          __ATOMIC_ACQUIRE);            \
+        break;                                                          \
+                                                                        \
+    case ZHPE_OFFLOADED_HW_OPCODE_ATM_SMIN:                             \
+    case ZHPE_OFFLOADED_HW_OPCODE_ATM_SMAX:                             \
+    case ZHPE_OFFLOADED_HW_OPCODE_ATM_UMIN:                             \
+    case ZHPE_OFFLOADED_HW_OPCODE_ATM_UMAX:                             \
+        old = __atomic_load_n(p, __ATOMIC_ACQUIRE);                     \
+        do {                                                            \
+            switch (opcode & ~ZHPE_OFFLOADED_HW_OPCODE_FENCE) {         \
+                                                                        \
+            case ZHPE_OFFLOADED_HW_OPCODE_ATM_SMIN:                     \
+                new = ((_stype)o0 < (_stype)old ? o0 : old);            \
+                break;                                                  \
+                                                                        \
+            case ZHPE_OFFLOADED_HW_OPCODE_ATM_SMAX:                     \
+                new = ((_stype)o0 > (_stype)old ? o0 : old);            \
+                break;                                                  \
+                                                                        \
+            case ZHPE_OFFLOADED_HW_OPCODE_ATM_UMIN:                     \
+                new = (o0 < old ? o0 : old);                            \
+                break;                                                  \
+                                                                        \
+            default:                                                    \
+                new = (o0 > old ? o0 : old);                            \
+                break;                                                  \
+            }                                                           \
+        } while (new != old &&                                          \
+                 !__atomic_compare_exchange_n(p, &old, new, false,      \
+                                              __ATOMIC_ACQ_REL,         \
+                                              __ATOMIC_ACQUIRE));       \
+        break;                                                          \
+                                                                        \
+    default:                                                            \
+        return false;                                                   \
+    }                                                                   \
+    if (res)                                                            \
+        memcpy(res, &old, sizeof(old));                                 \
+                                                                        \
+    return true;                                                        \
+}
+
+LB_ATOMIC(lb_atomic32, uint32_t, int32_t)
+LB_ATOMIC(lb_atomic64, uint64_t, int64_t)
+
+static uint8_t lb_atomic(struct zdom_data *bdom, uint8_t opcode,
+                         uint64_t rem_zaddr, size_t size, const void *op0,
+                         const void *op1, void *res)
+{
+    uint8_t             ret;
+    pid_t               pid;
+    void                *ptr;
+
+    ret = rkey_lookup(bdom, rem_zaddr, size,
+                      ZHPEQ_MR_GET_REMOTE | ZHPEQ_MR_PUT_REMOTE, &pid, &ptr);
+    if (ret != ZHPEQ_CQ_STATUS_SUCCESS)
+        return ret;
+    /* No way to be atomic in another address space. */
+    if (pid || ((uintptr_t)ptr & (size - 1)))
+        return ZHPEQ_CQ_STATUS_BAD_CMD;
+    if (!(size == sizeof(uint64_t) ?
+          lb_atomic64(opcode, ptr, op0, op1, res) :
+          lb_atomic32(opcode, ptr, op0, op1, res)))
+        return ZHPEQ_CQ_STATUS_BAD_CMD;
+
+    return ret;
+}
+
+static uint8_t lb_atomicv(struct zdom_data *bdom, struct zhpeq_atmv *atmv)
+{
+    uint8_t             ret = ZHPEQ_CQ_STATUS_SUCCESS;
+    struct zhpeq_atomic_ent *ent;
+    uint8_t             rc;
+    size_t              i;
+
+    for (i = 0; i < atmv->n_ent; i++) {
+        ent = &atmv->ent[i];
+        rc = lb_atomic(bdom, ent->op, ent->rem_addr, atmv->size,
+                       &ent->operands[0], &ent->operands[1],
+                       (atmv->results ?
+                        (char *)atmv->results + i * atmv->size : NULL));
+        if (rc != ZHPEQ_CQ_STATUS_SUCCESS)
+            ret = rc;
+    }
+
+    return ret;
+}
+
+static inline void cq_write(struct zhpeq *zq, struct lb_queue *lbq,
+                            union zhpe_offloaded_hw_cq_entry *cqe,
+                            uint16_t cmp_index, uint8_t status)
+{
+    uint32_t            qmask = zq->xqinfo.cmplq.ent - 1;
+
+    cqe->entry.index = cmp_index;
+    cqe->entry.status = status;
+    smp_wmb();
+    cqe->entry.valid = cq_valid(lbq->cq_tail, qmask);
+    lbq->cq_tail++;
+}
+
+/* Run every committed command; completions are published once per pass. */
+static void lb_zq(struct zhpeq *zq)
+{
+    zhpeu_trace();
+    struct lb_queue     *lbq = zq->backend_data;
+    struct zdom_data    *bdom = zq->zdom->backend_data;
+    uint32_t            qmask = zq->xqinfo.cmdq.ent - 1;
+    uint32_t            cqmask = zq->xqinfo.cmplq.ent - 1;
+    uint32_t            cq_start;
+    uint16_t            wq_head;
+    uint16_t            wq_tail;
+    union zhpe_offloaded_hw_wq_entry *wqe;
+    union zhpe_offloaded_hw_cq_entry *cqe;
+    uint8_t             opcode;
+    uint8_t             status;
+    size_t              size;
+
+    if (!lbq)
+        return;
+
+    mutex_lock(&lbq->mutex);
+    cq_start = lbq->cq_tail;
+    wq_head = ioread64(zq->qcm + ZHPE_OFFLOADED_XDM_QCM_CMD_QUEUE_HEAD_OFFSET) & qmask;
+    smp_rmb();
+    wq_tail = ioread64(zq->qcm + ZHPE_OFFLOADED_XDM_QCM_CMD_QUEUE_TAIL_OFFSET) & qmask;
+    for (; wq_head != wq_tail; wq_head = (wq_head + 1) & qmask) {
+
+        wqe = zq->wq + wq_head;
+        cqe = zq->cq + (lbq->cq_tail & cqmask);
+        /* Commands run in order, so fences are already satisfied. */
+        opcode = wqe->hdr.opcode & ~ZHPE_OFFLOADED_HW_OPCODE_FENCE;
+
+        switch (opcode) {
+
+        case ZHPE_OFFLOADED_HW_OPCODE_NOP:
+            status = ZHPEQ_CQ_STATUS_SUCCESS;
+            break;
+
+        case ZHPE_OFFLOADED_HW_OPCODE_PUT:
+            status = lb_copy(bdom, TO_PTR(wqe->dma.rd_addr), wqe->dma.wr_addr,
+                             wqe->dma.len, true);
+            break;
+
+        case ZHPE_OFFLOADED_HW_OPCODE_GET:
+            status = lb_copy(bdom, TO_PTR(wqe->dma.wr_addr), wqe->dma.rd_addr,
+                             wqe->dma.len, false);
+            break;
+
+        case ZHPE_OFFLOADED_HW_OPCODE_PUTIMM:
+            status = lb_copy(bdom, wqe->imm.data, wqe->imm.rem_addr,
+                             wqe->imm.len, true);
+            break;
+
+        case ZHPE_OFFLOADED_HW_OPCODE_GETIMM:
+            /* Straight into the completion. */
+            status = lb_copy(bdom, cqe->entry.result.data, wqe->imm.rem_addr,
+                             wqe->imm.len, false);
+            break;
+
+        case ZHPE_OFFLOADED_HW_OPCODE_ATM_SWAP:
+        case ZHPE_OFFLOADED_HW_OPCODE_ATM_ADD:
+        case ZHPE_OFFLOADED_HW_OPCODE_ATM_AND:
+        case ZHPE_OFFLOADED_HW_OPCODE_ATM_OR:
+        case ZHPE_OFFLOADED_HW_OPCODE_ATM_XOR:
+        case ZHPE_OFFLOADED_HW_OPCODE_ATM_SMIN:
+        case ZHPE_OFFLOADED_HW_OPCODE_ATM_SMAX:
+        case ZHPE_OFFLOADED_HW_OPCODE_ATM_UMIN:
+        case ZHPE_OFFLOADED_HW_OPCODE_ATM_UMAX:
+        case ZHPE_OFFLOADED_HW_OPCODE_ATM_CAS:
+            size = (((wqe->atm.size & ZHPE_OFFLOADED_HW_ATOMIC_SIZE_MASK) ==
+                     ZHPE_OFFLOADED_HW_ATOMIC_SIZE_64) ?
+                    sizeof(uint64_t) : sizeof(uint32_t));
+            status = lb_atomic(bdom, opcode, wqe->atm.rem_addr, size,
+                               &wqe->atm.operands[0], &wqe->atm.operands[1],
+                               ((wqe->atm.size &
+                                 ZHPE_OFFLOADED_HW_ATOMIC_RETURN) ?
+                                cqe->entry.result.data : NULL));
+            break;
+
+        case ZHPEQ_SW_OPCODE_PUTV:
+        case ZHPEQ_SW_OPCODE_GETV:
+            status = lb_rwv(bdom, TO_PTR(wqe->dma.rd_addr), wqe->dma.len,
+                            (opcode == ZHPEQ_SW_OPCODE_PUTV));
+            free(TO_PTR(wqe->dma.rd_addr));
+            break;
+
+        case ZHPEQ_SW_OPCODE_ATMV:
+            status = lb_atomicv(bdom, TO_PTR(wqe->dma.rd_addr));
+            free(TO_PTR(wqe->dma.rd_addr));
+            break;
+
+        default:
+            status = ZHPEQ_CQ_STATUS_BAD_CMD;
+            print_err("%s,%u:Unexpected opcode 0x%02x\n",
+                      __func__, __LINE__, wqe->hdr.opcode);
+            break;
+        }
+        cq_write(zq, lbq, cqe, wqe->hdr.cmp_index, status);
+    }
+    iowrite64(wq_head, zq->qcm + ZHPE_OFFLOADED_XDM_QCM_CMD_QUEUE_HEAD_OFFSET);
+    if (lbq->cq_tail != cq_start) {
+        iowrite64(lbq->cq_tail & cqmask,
+                  zq->qcm + ZHPE_XDM_QCM_CMPL_QUEUE_TAIL_TOGGLE_OFFSET);
+        zhpeq_cq_notify(zq);
+    }
+    mutex_unlock(&lbq->mutex);
+}
+
+static int lb_wq_signal(struct zhpeq *zq)
+{
+    zhpeu_trace();
+    lb_zq(zq);
+
+    return 0;
+}
+
+static ssize_t lb_cq_poll(struct zhpeq *zq, size_t hint)
+{
+    zhpeu_trace();
+    lb_zq(zq);
+
+    return 0;
+}
+
+static bool lb_cq_can_block(struct zhpeq *zq)
+{
+    zhpeu_trace();
+    /* No one else will run the commands. */
+    return false;
+}
+
+static int lb_mr_reg(struct zhpeq_dom *zdom,
+                     const void *buf, size_t len,
+                     uint32_t access, struct zhpeq_key_data **qkdata_out)
+{
+    zhpeu_trace();
+    int                 ret = -ENOMEM;
+    struct zhpeq_mr_desc_v1 *desc;
+
+    desc = malloc(sizeof(*desc));
+    if (!desc)
+        goto done;
+    /* Local zaddrs are just virtual addresses. */
+    desc->hdr.magic = ZHPE_OFFLOADED_MAGIC;
+    desc->hdr.version = ZHPEQ_MR_V1;
+    desc->qkdata.z.vaddr = (uintptr_t)buf;
+    desc->qkdata.z.len = len;
+    desc->qkdata.z.zaddr = TO_ADDR(desc->qkdata.z.vaddr);
+    desc->qkdata.laddr = desc->qkdata.z.zaddr;
+    desc->qkdata.z.access = access;
+    *qkdata_out = &desc->qkdata;
+    ret = 0;
+
+ done:
+    return ret;
+}
+
+static int lb_mr_free(struct zhpeq_dom *zdom, struct zhpeq_key_data *qkdata)
+{
+    zhpeu_trace();
+    int                 ret = -EINVAL;
+    struct zhpeq_mr_desc_v1 *desc = container_of(qkdata,
+                                                 struct zhpeq_mr_desc_v1,
+                                                 qkdata);
+
+    if (desc->hdr.magic != ZHPE_OFFLOADED_MAGIC || desc->hdr.version != ZHPEQ_MR_V1)
+        goto done;
+    free(desc);
+    ret = 0;
+
+ done:
+    return ret;
+}
+
+static int lb_zmmu_import(struct zhpeq_dom *zdom, int open_idx,
+                          const void *blob, size_t blob_len,
+                          bool cpu_visible,
+                          struct zhpeq_key_data **qkdata_out)
+{
+    zhpeu_trace();
+    int                 ret = -EINVAL;
+    struct zdom_data    *bdom = zdom->backend_data;
+    const struct key_data_packed *pdata = blob;
+    struct zhpeq_mr_desc_v1 *desc = NULL;
+    struct lb_rkey      *rkey;
+    struct free_index   old;
+    struct free_index   new;
+    pid_t               pid;
+    bool                used;
+
+    if (blob_len != sizeof(*pdata) || cpu_visible ||
+        open_idx < 0 || open_idx >= PEER_MAX)
+        goto done;
+    mutex_lock(&bdom->peer_mutex);
+    used = bdom->peers[open_idx].used;
+    pid = bdom->peers[open_idx].pid;
+    mutex_unlock(&bdom->peer_mutex);
+    ret = -ENOENT;
+    if (!used)
+        goto done;
+
+    ret = -ENOMEM;
+    desc = malloc(sizeof(*desc));
+    if (!desc)
+        goto done;
+    desc->hdr.magic = ZHPE_OFFLOADED_MAGIC;
+    desc->hdr.version = ZHPEQ_MR_V1 | ZHPEQ_MR_REMOTE;
+    unpack_kdata(pdata, &desc->qkdata);
+
+    ret = -ENOSPC;
+    for (old = atm_load_rlx(&bdom->rkey_free) ;;) {
+        if (old.index == FREE_END)
+            goto done;
+        new.index = bdom->rkey[old.index].next;
+        new.seq = old.seq + 1;
+        if (atm_cmpxchg(&bdom->rkey_free, &old, new))
+            break;
+    }
+    rkey = &bdom->rkey[old.index];
+    rkey->vaddr = desc->qkdata.z.vaddr;
+    rkey->pid = pid;
+    rkey->access = desc->qkdata.z.access;
+    rkey->len = desc->qkdata.z.len;
+    desc->qkdata.z.zaddr = (((uint64_t)old.index << KEY_SHIFT) +
+                            TO_ADDR(desc->qkdata.z.vaddr));
+    *qkdata_out = &desc->qkdata;
+
+    ret = 0;
+
+ done:
+    if (ret < 0)
+        free(desc);
+
+    return ret;
+}
+
+static int lb_zmmu_free(struct zhpeq_dom *zdom, struct zhpeq_key_data *qkdata)
+{
+    zhpeu_trace();
+    int                 ret = -EINVAL;
+    struct zdom_data    *bdom = zdom->backend_data;
+    struct zhpeq_mr_desc_v1 *desc = container_of(qkdata,
+                                                 struct zhpeq_mr_desc_v1,
+                                                 qkdata);
+    uint32_t            index = TO_KEYIDX(qkdata->z.zaddr);
+    struct free_index   old;
+    struct free_index   new;
+
+    if (desc->hdr.magic != ZHPE_OFFLOADED_MAGIC ||
+        desc->hdr.version != (ZHPEQ_MR_V1 | ZHPEQ_MR_REMOTE))
+        goto done;
+
+    bdom->rkey[index].len = 0;
+    bdom->rkey[index].access = 0;
+    for (old = atm_load_rlx(&bdom->rkey_free) ;;) {
+        bdom->rkey[index].next = old.index;
+        new.index = index;
+        new.seq = old.seq + 1;
+        if (atm_cmpxchg(&bdom->rkey_free, &old, new))
+            break;
+    }
+    free(desc);
+    ret = 0;
+
+ done:
+    return ret;
+}
+
+static int lb_zmmu_export(struct zhpeq_dom *zdom,
+                          const struct zhpeq_key_data *qkdata,
+                          void *blob, size_t *blob_len)
+{
+    zhpeu_trace();
+    int                 ret = -EOVERFLOW;
+
+    if (*blob_len < sizeof(struct key_data_packed))
+        goto done;
+
+    pack_kdata(qkdata, blob, qkdata->z.zaddr);
+    ret = 0;
+
+ done:
+    *blob_len = sizeof(struct key_data_packed);
+
+    return ret;
+}
+
+static void lb_print_info(struct zhpeq *zq)
+{
+    zhpeu_trace();
+    printf("loopback      : pid %d\n", getpid());
+}
+
+static struct backend_ops ops = {
+    .lib_init           = lb_lib_init,
+    .domain             = lb_domain,
+    .domain_free        = lb_domain_free,
+    .qalloc             = lb_qalloc,
+    .qalloc_post        = lb_qalloc_post,
+    .qfree_pre          = lb_qfree_pre,
+    .qfree              = lb_qfree,
+    .exchange           = lb_exchange,
+    .open               = lb_open,
+    .close              = lb_close,
+    .wq_signal          = lb_wq_signal,
+    .cq_poll            = lb_cq_poll,
+    .cq_can_block       = lb_cq_can_block,
+    .mr_reg             = lb_mr_reg,
+    .mr_free            = lb_mr_free,
+    .zmmu_import        = lb_zmmu_import,
+    .zmmu_free          = lb_zmmu_free,
+    .zmmu_export        = lb_zmmu_export,
+    .print_info         = lb_print_info,
+    .getaddr            = lb_getaddr,
+};
+
+void zhpeq_backend_loopback_init(int fd)
+{
+    zhpeu_trace();
+    if (!getenv("ZHPE_OFFLOADED_BACKEND_LOOPBACK"))
+        return;
+
+    zhpeq_register_backend(ZHPEQ_BACKEND_LOOPBACK, &ops);
+}
@@ -43,18 +43,25 @@
 
 static int              dev_fd = -1;
 static pthread_mutex_t  dev_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   dev_cond = PTHREAD_COND_INITIALIZER;
 static void             *dev_uuid_tree;
 static void             *dev_mr_tree;
 
+/*
+ * Tree entries are pending while their driver command is in flight;
+ * anyone who finds a pending entry waits on dev_cond for it to settle.
+ */
 struct dev_uuid_tree_entry {
     uuid_t              uuid;
     int32_t             use_count;
     bool                fam;
+    bool                pending;
 };
 
 struct dev_mr_tree_entry {
     struct zhpeq_key_data *qkdata;
     int32_t             use_count;
+    bool                pending;
 };
 
 static struct zhpe_offloaded_global_shared_data *shared_global;
@@ -69,61 +76,237 @@ struct zdom_data {
     } *nodes;
 };
 
-/* For the moment, we will do all driver I/O synchronously.*/
+/*
+ * Driver command channel: each request is written with hdr.index naming
+ * a slot and whichever waiter finds no one reading reads responses and
+ * hands them to their slots by index. Up to drv_depth commands can be in
+ * flight and no lock is held across a driver round trip.
+ */
+
+#define DRV_SLOTS       (64)
+
+struct drv_cmd {
+    union zhpe_offloaded_op *op;
+    size_t              req_len;
+    size_t              rsp_len;
+};
+
+struct drv_batch {
+    uint32_t            outstanding;
+    int                 status;
+};
+
+struct drv_slot {
+    struct drv_cmd      *cmd;
+    struct drv_batch    *batch;
+    int                 opcode;
+    int                 status;
+    bool                done;
+};
 
-static int __driver_cmd(union zhpe_offloaded_op *op, size_t req_len, size_t rsp_len)
+static int drv_dev_open(void)
 {
-    int                 ret = 0;
-    int                 opcode = op->hdr.opcode;
-    ssize_t             res;
+    return open(DEV_NAME, O_RDWR);
+}
 
-    op->hdr.version = ZHPE_OFFLOADED_OP_VERSION;
-    op->hdr.index = 0;
+static ssize_t drv_dev_write(int fd, const void *buf, size_t len)
+{
+    return write(fd, buf, len);
+}
 
-    res = write(dev_fd, op, req_len);
-    ret = check_func_io(__func__, __LINE__, "write", DEV_NAME,
-                        req_len, res, 0);
-    if (ret < 0)
-        goto done;
+static ssize_t drv_dev_read(int fd, void *buf, size_t len)
+{
+    return read(fd, buf, len);
+}
 
-    res = read(dev_fd, op, rsp_len);
-    ret = check_func_io(__func__, __LINE__, "read", DEV_NAME,
-                        rsp_len, res, 0);
-    if (ret < 0)
-        goto done;
-    ret = -EIO;
-    if (res < sizeof(op->hdr)) {
-        print_err("%s,%u:Unexpected short read %lu\n",
-                  __func__, __LINE__, res);
-        goto done;
+static void *drv_dev_mmap(size_t len, int fd, off_t offset, int *error)
+{
+    return do_mmap(NULL, len, PROT_READ, MAP_SHARED, fd, offset, error);
+}
+
+static struct zhpe_offloaded_driver_ops drv_dev_ops = {
+    .open               = drv_dev_open,
+    .write              = drv_dev_write,
+    .read               = drv_dev_read,
+    .mmap               = drv_dev_mmap,
+};
+
+static struct zhpe_offloaded_driver_ops *drv_ops = &drv_dev_ops;
+static pthread_mutex_t  drv_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   drv_cond = PTHREAD_COND_INITIALIZER;
+static struct drv_slot  drv_slots[DRV_SLOTS];
+static uint64_t         drv_depth = DRV_SLOTS;
+static bool             drv_reading;
+
+/* Called with drv_mutex held. */
+static struct drv_slot *drv_slot_get(void)
+{
+    uint32_t            i;
+
+    for (i = 0; i < drv_depth; i++) {
+        if (!drv_slots[i].cmd)
+            return &drv_slots[i];
     }
-    ret = -EINVAL;
-    if (!expected_saw("version", ZHPE_OFFLOADED_OP_VERSION, op->hdr.version))
+
+    return NULL;
+}
+
+/* Called with drv_mutex held. */
+static void drv_slot_done(struct drv_slot *slot, int status)
+{
+    slot->status = status;
+    slot->done = true;
+}
+
+/*
+ * Called with drv_mutex held; returns the slots back to the pool and
+ * the number returned.
+ */
+static uint32_t drv_reap(struct drv_batch *batch)
+{
+    uint32_t            ret = 0;
+    struct drv_slot     *slot;
+    uint32_t            i;
+
+    for (i = 0; i < drv_depth; i++) {
+        slot = &drv_slots[i];
+        if (slot->batch != batch || !slot->done)
+            continue;
+        slot->cmd->op->hdr.status = slot->status;
+        if (batch->status >= 0 && slot->status < 0)
+            batch->status = slot->status;
+        slot->cmd = NULL;
+        slot->batch = NULL;
+        batch->outstanding--;
+        ret++;
+        cond_broadcast(&drv_cond);
+    }
+
+    return ret;
+}
+
+/* Called with drv_mutex held. */
+static void drv_dispatch(union zhpe_offloaded_op *rsp, ssize_t res)
+{
+    struct drv_slot     *slot;
+    int                 status;
+
+    if (rsp->hdr.index >= drv_depth ||
+        !(slot = &drv_slots[rsp->hdr.index])->cmd || slot->done) {
+        print_err("%s,%u:unexpected response index %u\n",
+                  __func__, __LINE__, (uint)rsp->hdr.index);
+        return;
+    }
+
+    status = -EINVAL;
+    if (!expected_saw("version", ZHPE_OFFLOADED_OP_VERSION, rsp->hdr.version))
         goto done;
-    if (!expected_saw("opcode", opcode | ZHPE_OFFLOADED_OP_RESPONSE, op->hdr.opcode))
+    if (!expected_saw("opcode", slot->opcode | ZHPE_OFFLOADED_OP_RESPONSE,
+                      rsp->hdr.opcode))
         goto done;
-    if (!expected_saw("index", 0, op->hdr.index))
+    status = -EIO;
+    if ((size_t)res < slot->cmd->rsp_len) {
+        print_err("%s,%u:Unexpected short read %ld\n",
+                  __func__, __LINE__, res);
         goto done;
-    ret = op->hdr.status;
-    if (ret < 0)
+    }
+    memcpy(slot->cmd->op, rsp, slot->cmd->rsp_len);
+    status = rsp->hdr.status;
+    if (status < 0)
         print_err("%s,%u:zhpe command 0x%02x returned error %d:%s\n",
-                  __func__, __LINE__, op->hdr.opcode,
-                  -ret, strerror(-ret));
+                  __func__, __LINE__, rsp->hdr.opcode,
+                  -status, strerror(-status));
 
  done:
+    drv_slot_done(slot, status);
+}
 
-    return ret;
+/* Called with drv_mutex held; drops it while reading. */
+static void drv_read_one(void)
+{
+    union zhpe_offloaded_op rsp;
+    ssize_t             res;
+    int                 rc;
+    uint32_t            i;
+
+    drv_reading = true;
+    mutex_unlock(&drv_mutex);
+    res = drv_ops->read(dev_fd, &rsp, sizeof(rsp));
+    rc = check_func_io(__func__, __LINE__, "read", DEV_NAME,
+                       sizeof(rsp.hdr), res, 0);
+    mutex_lock(&drv_mutex);
+    drv_reading = false;
+    if (rc >= 0)
+        drv_dispatch(&rsp, res);
+    else {
+        /* The channel is broken: fail everything in flight. */
+        for (i = 0; i < drv_depth; i++) {
+            if (drv_slots[i].cmd && !drv_slots[i].done)
+                drv_slot_done(&drv_slots[i], rc);
+        }
+    }
+    cond_broadcast(&drv_cond);
 }
 
-static int driver_cmd(union zhpe_offloaded_op *op, size_t req_len, size_t rsp_len)
+/*
+ * Issue n_cmds driver commands and wait for all of them. Each command's
+ * status is left in its op->hdr.status; the first error is returned.
+ */
+static int driver_cmd_batch(struct drv_cmd *cmds, size_t n_cmds)
 {
-    int                 ret;
+    struct drv_batch    batch = { 0 };
+    size_t              next = 0;
+    struct drv_slot     *slot;
+    union zhpe_offloaded_op *op;
+    ssize_t             res;
+    int                 rc;
 
-    mutex_lock(&dev_mutex);
-    ret = __driver_cmd(op, req_len, rsp_len);
-    mutex_unlock(&dev_mutex);
+    mutex_lock(&drv_mutex);
+    for (;;) {
+        while (next < n_cmds && (slot = drv_slot_get())) {
+            slot->cmd = &cmds[next++];
+            slot->batch = &batch;
+            slot->done = false;
+            batch.outstanding++;
+            op = slot->cmd->op;
+            slot->opcode = op->hdr.opcode;
+            op->hdr.version = ZHPE_OFFLOADED_OP_VERSION;
+            op->hdr.index = slot - drv_slots;
+            mutex_unlock(&drv_mutex);
+            res = drv_ops->write(dev_fd, op, slot->cmd->req_len);
+            rc = check_func_io(__func__, __LINE__, "write", DEV_NAME,
+                               slot->cmd->req_len, res, 0);
+            mutex_lock(&drv_mutex);
+            if (rc < 0)
+                drv_slot_done(slot, rc);
+        }
+        /*
+         * Slots we just freed are ours to reuse: waiting here with
+         * nothing outstanding would wait for a wakeup nobody will send.
+         */
+        if (drv_reap(&batch) && next < n_cmds)
+            continue;
+        if (next == n_cmds && !batch.outstanding)
+            break;
+        if (batch.outstanding && !drv_reading)
+            drv_read_one();
+        else
+            cond_wait(&drv_cond, &drv_mutex);
+    }
+    mutex_unlock(&drv_mutex);
 
-    return ret;
+    return batch.status;
+}
+
+static int driver_cmd(union zhpe_offloaded_op *op, size_t req_len, size_t rsp_len)
+{
+    struct drv_cmd      cmd = {
+        .op             = op,
+        .req_len        = req_len,
+        .rsp_len        = rsp_len,
+    };
+
+    return driver_cmd_batch(&cmd, 1);
 }
 
 static int zhpe_offloaded_lib_init(struct zhpeq_attr *attr)
@@ -132,8 +315,15 @@ static int zhpe_offloaded_lib_init(struct zhpeq_attr *attr)
     union zhpe_offloaded_op       op;
     union zhpe_offloaded_req      *req = &op.req;
     union zhpe_offloaded_rsp      *rsp = &op.rsp;
+    const char          *s;
 
-    dev_fd = open(DEV_NAME, O_RDWR);
+    s = getenv("ZHPE_OFFLOADED_DRIVER_DEPTH");
+    if (s && parse_kb_uint64_t(__func__, __LINE__,
+                               "ZHPE_OFFLOADED_DRIVER_DEPTH", s, &drv_depth,
+                               0, 1, DRV_SLOTS, PARSE_NUM) < 0)
+        goto done;
+
+    dev_fd = drv_ops->open();
     if (dev_fd == -1) {
         ret = -errno;
         print_func_err(__func__, __LINE__, "open", DEV_NAME, ret);
@@ -145,14 +335,12 @@ static int zhpe_offloaded_lib_init(struct zhpeq_attr *attr)
     if (ret < 0)
         goto done;
 
-    shared_global = do_mmap(NULL, rsp->init.global_shared_size, PROT_READ,
-                            MAP_SHARED, dev_fd, rsp->init.global_shared_offset,
-                            &ret);
+    shared_global = drv_ops->mmap(rsp->init.global_shared_size, dev_fd,
+                                  rsp->init.global_shared_offset, &ret);
     if (!shared_global)
         goto done;
-    shared_local = do_mmap(NULL, rsp->init.local_shared_size, PROT_READ,
-                           MAP_SHARED, dev_fd, rsp->init.local_shared_offset,
-                           &ret);
+    shared_local = drv_ops->mmap(rsp->init.local_shared_size, dev_fd,
+                                 rsp->init.local_shared_offset, &ret);
     if (!shared_local)
         goto done;
     ret = -EINVAL;
@@ -196,20 +384,27 @@ static int uuid_free(uuid_t *uu)
 
     mutex_lock(&dev_mutex);
     tval = tfind(uu, &dev_uuid_tree, compare_uuid);
-    if (tval) {
-        uue = *tval;
-        if (!--(uue->use_count)) {
-            (void)tdelete(uu, &dev_uuid_tree, compare_uuid);
-            if (uuid_compare(*uu, zhpeq_uuid)) {
-                req->hdr.opcode = ZHPE_OFFLOADED_OP_UUID_FREE;
-                memcpy(req->uuid_free.uuid, *uu, sizeof(req->uuid_free.uuid));
-                ret =__driver_cmd(&op, sizeof(req->uuid_free),
-                                  sizeof(rsp->uuid_free));
-            }
-            free(uue);
-        }
-    } else
+    if (!tval) {
         ret = -ENOENT;
+        goto done;
+    }
+    uue = *tval;
+    if (--(uue->use_count))
+        goto done;
+    /* Leave it in the tree, pending, until the driver has let it go. */
+    uue->pending = true;
+    mutex_unlock(&dev_mutex);
+    if (uuid_compare(uue->uuid, zhpeq_uuid)) {
+        req->hdr.opcode = ZHPE_OFFLOADED_OP_UUID_FREE;
+        memcpy(req->uuid_free.uuid, uue->uuid, sizeof(req->uuid_free.uuid));
+        ret = driver_cmd(&op, sizeof(req->uuid_free), sizeof(rsp->uuid_free));
+    }
+    mutex_lock(&dev_mutex);
+    (void)tdelete(&uue->uuid, &dev_uuid_tree, compare_uuid);
+    cond_broadcast(&dev_cond);
+    free(uue);
+
+ done:
     mutex_unlock(&dev_mutex);
 
     return ret;
@@ -317,53 +512,73 @@ static int zhpe_offloaded_open(struct zhpeq *zq, void *sa)
     union zhpe_offloaded_rsp      *rsp = &op.rsp;
     struct zdom_node    *node;
     void                **tval;
-    struct dev_uuid_tree_entry *uue;
+    struct dev_uuid_tree_entry *uue = NULL;
+    bool                import = false;
 
     if (sz->sz_family != AF_ZHPE)
         return -EINVAL;
 
     mutex_lock(&dev_mutex);
-    tval = tsearch(&sz->sz_uuid, &dev_uuid_tree, compare_uuid);
-    if (tval) {
+    for (;;) {
+        tval = tsearch(&sz->sz_uuid, &dev_uuid_tree, compare_uuid);
+        if (!tval) {
+            ret = -ENOMEM;
+            print_func_err(__func__, __LINE__, "tsearch", "", ret);
+            break;
+        }
         uue = *tval;
-        if (uue != (void *)&sz->sz_uuid)
+        if (uue == (void *)&sz->sz_uuid) {
+            import = true;
+            break;
+        }
+        if (!uue->pending) {
             uue->use_count++;
-        else {
-            uue = malloc(sizeof(*uue));
-            if (!uue)
-                ret = -ENOMEM;
-            if (ret >= 0) {
-                *tval = uue;
-                memcpy(uue->uuid, sz->sz_uuid, sizeof(uue->uuid));
-                uue->use_count = 1;
-                uue->fam = ((sz->sz_queue & ZHPE_OFFLOADED_SA_TYPE_MASK) ==
-                            ZHPE_OFFLOADED_SA_TYPE_FAM);
-
-                req->hdr.opcode = ZHPE_OFFLOADED_OP_UUID_IMPORT;
-                memcpy(req->uuid_import.uuid, sz->sz_uuid,
-                       sizeof(req->uuid_import.uuid));
-                if (uue->fam) {
-                    memcpy(req->uuid_import.mgr_uuid, sz[1].sz_uuid,
-                           sizeof(req->uuid_import.mgr_uuid));
-                    req->uuid_import.uu_flags = UUID_IS_FAM;
-                } else {
-                    memset(req->uuid_import.mgr_uuid, 0,
-                           sizeof(req->uuid_import.mgr_uuid));
-                    req->uuid_import.uu_flags = 0;
-                }
-                ret = __driver_cmd(&op, sizeof(req->uuid_import),
-                                   sizeof(rsp->uuid_import));
-            }
-            if (ret < 0) {
-                (void)tdelete(&sz->sz_uuid, &dev_uuid_tree, compare_uuid);
-                free(uue);
-            }
+            break;
+        }
+        cond_wait(&dev_cond, &dev_mutex);
+    }
+    if (import) {
+        uue = malloc(sizeof(*uue));
+        if (uue) {
+            *tval = uue;
+            memcpy(uue->uuid, sz->sz_uuid, sizeof(uue->uuid));
+            uue->use_count = 1;
+            uue->fam = ((sz->sz_queue & ZHPE_OFFLOADED_SA_TYPE_MASK) ==
+                        ZHPE_OFFLOADED_SA_TYPE_FAM);
+            uue->pending = true;
+        } else {
+            ret = -ENOMEM;
+            (void)tdelete(&sz->sz_uuid, &dev_uuid_tree, compare_uuid);
+            import = false;
         }
-    } else {
-        ret = -ENOMEM;
-        print_func_err(__func__, __LINE__, "tsearch", "", ret);
     }
     mutex_unlock(&dev_mutex);
+
+    if (import) {
+        req->hdr.opcode = ZHPE_OFFLOADED_OP_UUID_IMPORT;
+        memcpy(req->uuid_import.uuid, sz->sz_uuid,
+               sizeof(req->uuid_import.uuid));
+        if (uue->fam) {
+            memcpy(req->uuid_import.mgr_uuid, sz[1].sz_uuid,
+                   sizeof(req->uuid_import.mgr_uuid));
+            req->uuid_import.uu_flags = UUID_IS_FAM;
+        } else {
+            memset(req->uuid_import.mgr_uuid, 0,
+                   sizeof(req->uuid_import.mgr_uuid));
+            req->uuid_import.uu_flags = 0;
+        }
+        ret = driver_cmd(&op, sizeof(req->uuid_import),
+                         sizeof(rsp->uuid_import));
+        mutex_lock(&dev_mutex);
+        if (ret >= 0)
+            uue->pending = false;
+        else {
+            (void)tdelete(&uue->uuid, &dev_uuid_tree, compare_uuid);
+            free(uue);
+        }
+        cond_broadcast(&dev_cond);
+        mutex_unlock(&dev_mutex);
+    }
     if (ret < 0)
         goto done;
 
@@ -447,21 +662,14 @@ static int compare_qkdata(const void *key1, const void *key2)
     return ret;
 }
 
-static int zhpe_offloaded_mr_reg(struct zhpeq_dom *zdom,
-                       const void *buf, size_t len,
-                       uint32_t access, struct zhpeq_key_data **qkdata_out)
+static struct zhpeq_mr_desc_v1 *mr_desc_alloc(const void *buf, size_t len,
+                                              uint32_t access)
 {
-    int                 ret = -ENOMEM;
-    struct zhpeq_mr_desc_v1 *desc = NULL;
-    union zhpe_offloaded_op       op;
-    union zhpe_offloaded_req      *req = &op.req;
-    union zhpe_offloaded_rsp      *rsp = &op.rsp;
-    void                **tval;
-    struct dev_mr_tree_entry *mre;
+    struct zhpeq_mr_desc_v1 *desc;
 
     desc = malloc(sizeof(*desc));
     if (!desc)
-        goto done;
+        return NULL;
     /* Zero access is expected to work. */
     if (!access)
         access = ZHPEQ_MR_PUT;
@@ -472,48 +680,126 @@ static int zhpe_offloaded_mr_reg(struct zhpeq_dom *zdom,
     desc->qkdata.laddr = (uintptr_t)buf;
     desc->qkdata.z.len = len;
     desc->qkdata.z.access = access;
-    *qkdata_out = &desc->qkdata;
 
-    mutex_lock(&dev_mutex);
-    tval = tsearch(qkdata_out, &dev_mr_tree, compare_qkdata);
-    if (tval) {
+    return desc;
+}
+
+/*
+ * Called with dev_mutex held. Returns 0 if *qkdata_out was replaced by an
+ * existing registration, 1 if a pending entry was added and the caller
+ * must issue MR_REG and call mr_tree_done(), or -EAGAIN if the key is
+ * pending for someone else and wait is false.
+ */
+static int mr_tree_get(struct zhpeq_key_data **qkdata_out,
+                       struct dev_mr_tree_entry **mre_out, bool wait)
+{
+    int                 ret;
+    void                **tval;
+    struct dev_mr_tree_entry *mre;
+
+    for (;;) {
+        tval = tsearch(qkdata_out, &dev_mr_tree, compare_qkdata);
+        if (!tval) {
+            ret = -ENOMEM;
+            print_func_err(__func__, __LINE__, "tsearch", "", ret);
+            break;
+        }
         mre = *tval;
-        if (mre != (void *)qkdata_out) {
-            *qkdata_out = mre->qkdata;
-            mre->use_count++;
-            free(desc);
-            ret = 0;
-        } else {
+        if (mre == (void *)qkdata_out) {
             mre = malloc(sizeof(*mre));
-            if (mre) {
-                *tval = mre;
-                req->hdr.opcode = ZHPE_OFFLOADED_OP_MR_REG;
-                req->mr_reg.vaddr = (uintptr_t)buf;
-                req->mr_reg.len = len;
-                req->mr_reg.access = desc->access_plus;
-                ret = __driver_cmd(&op, sizeof(req->mr_reg),
-                                   sizeof(rsp->mr_reg));
-            }
-            if (ret >= 0) {
-                desc->qkdata.z.zaddr = rsp->mr_reg.rsp_zaddr;
-                mre->qkdata = *qkdata_out;
-                mre->use_count = 1;
-            } else {
+            if (!mre) {
+                ret = -ENOMEM;
                 (void)tdelete(qkdata_out, &dev_mr_tree, compare_qkdata);
-                free(mre);
+                break;
             }
+            *tval = mre;
+            mre->qkdata = *qkdata_out;
+            mre->use_count = 1;
+            mre->pending = true;
+            *mre_out = mre;
+            ret = 1;
+            break;
         }
-    } else
-        print_func_err(__func__, __LINE__, "tsearch", "", ret);
+        if (!mre->pending) {
+            *qkdata_out = mre->qkdata;
+            mre->use_count++;
+            ret = 0;
+            break;
+        }
+        ret = -EAGAIN;
+        if (!wait)
+            break;
+        cond_wait(&dev_cond, &dev_mutex);
+    }
+
+    return ret;
+}
+
+static void mr_reg_req(union zhpe_offloaded_op *op,
+                       struct zhpeq_mr_desc_v1 *desc)
+{
+    union zhpe_offloaded_req      *req = &op->req;
+
+    req->hdr.opcode = ZHPE_OFFLOADED_OP_MR_REG;
+    req->mr_reg.vaddr = desc->qkdata.z.vaddr;
+    req->mr_reg.len = desc->qkdata.z.len;
+    req->mr_reg.access = desc->access_plus;
+}
+
+/* Called with dev_mutex held; on failure the entry and its desc go away. */
+static void mr_tree_done(struct dev_mr_tree_entry *mre,
+                         union zhpe_offloaded_op *op)
+{
+    struct zhpeq_mr_desc_v1 *desc = container_of(mre->qkdata,
+                                                 struct zhpeq_mr_desc_v1,
+                                                 qkdata);
+
+    if (op->hdr.status >= 0) {
+        desc->qkdata.z.zaddr = op->rsp.mr_reg.rsp_zaddr;
+        mre->pending = false;
+    } else {
+        (void)tdelete(&mre->qkdata, &dev_mr_tree, compare_qkdata);
+        free(desc);
+        free(mre);
+    }
+    cond_broadcast(&dev_cond);
+}
+
+static int zhpe_offloaded_mr_reg(struct zhpeq_dom *zdom,
+                       const void *buf, size_t len,
+                       uint32_t access, struct zhpeq_key_data **qkdata_out)
+{
+    int                 ret = -ENOMEM;
+    struct zhpeq_mr_desc_v1 *desc;
+    union zhpe_offloaded_op       op;
+    union zhpe_offloaded_req      *req = &op.req;
+    union zhpe_offloaded_rsp      *rsp = &op.rsp;
+    struct dev_mr_tree_entry *mre;
+
+    desc = mr_desc_alloc(buf, len, access);
+    if (!desc)
+        goto done;
+    *qkdata_out = &desc->qkdata;
+
+    mutex_lock(&dev_mutex);
+    ret = mr_tree_get(qkdata_out, &mre, true);
+    mutex_unlock(&dev_mutex);
+    if (ret <= 0) {
+        free(desc);
+        goto done;
+    }
+
+    mr_reg_req(&op, desc);
+    ret = driver_cmd(&op, sizeof(req->mr_reg), sizeof(rsp->mr_reg));
+    mutex_lock(&dev_mutex);
+    mr_tree_done(mre, &op);
     mutex_unlock(&dev_mutex);
 
  done:
-    if (ret < 0) {
-        free(desc);
+    if (ret < 0)
         *qkdata_out = NULL;
-    }
 
-    return ret;
+    return (ret < 0 ? ret : 0);
 }
 
 static int zhpe_offloaded_mr_free(struct zhpeq_dom *zdom, struct zhpeq_key_data *qkdata)
@@ -534,25 +820,138 @@ static int zhpe_offloaded_mr_free(struct zhpeq_dom *zdom, struct zhpeq_key_data
 
     mutex_lock(&dev_mutex);
     tval = tfind(&qkdata, &dev_mr_tree, compare_qkdata);
-    if (tval) {
-        ret = 0;
-        mre = *tval;
-        if (!--(mre->use_count)) {
-            (void)tdelete(&qkdata, &dev_mr_tree, compare_qkdata);
-            req->hdr.opcode = ZHPE_OFFLOADED_OP_MR_FREE;
-            req->mr_free.vaddr = desc->qkdata.z.vaddr;
-            req->mr_free.len = desc->qkdata.z.len;
-            req->mr_free.access = desc->access_plus;
-            req->mr_free.rsp_zaddr = desc->qkdata.z.zaddr;
-            ret = __driver_cmd(&op, sizeof(req->mr_free), sizeof(rsp->mr_free));
+    if (!tval) {
+        ret = -ENOENT;
+        goto unlock;
+    }
+    ret = 0;
+    mre = *tval;
+    if (--(mre->use_count))
+        goto unlock;
+    /* Leave it in the tree, pending, until the driver has let it go. */
+    mre->pending = true;
+    mutex_unlock(&dev_mutex);
+    req->hdr.opcode = ZHPE_OFFLOADED_OP_MR_FREE;
+    req->mr_free.vaddr = desc->qkdata.z.vaddr;
+    req->mr_free.len = desc->qkdata.z.len;
+    req->mr_free.access = desc->access_plus;
+    req->mr_free.rsp_zaddr = desc->qkdata.z.zaddr;
+    ret = driver_cmd(&op, sizeof(req->mr_free), sizeof(rsp->mr_free));
+    mutex_lock(&dev_mutex);
+    (void)tdelete(&qkdata, &dev_mr_tree, compare_qkdata);
+    cond_broadcast(&dev_cond);
+    free(desc);
+    free(mre);
+ unlock:
+    mutex_unlock(&dev_mutex);
+
+ done:
+    return ret;
+}
+
+/* Called with dev_mutex held; drops it while the driver works. */
+static int mr_batch_flush(struct drv_cmd *cmds, struct dev_mr_tree_entry **mres,
+                          size_t *idx, size_t *n_cmds,
+                          struct zhpeq_key_data **qkdata_out)
+{
+    int                 ret;
+    size_t              i;
+
+    if (!*n_cmds)
+        return 0;
+    mutex_unlock(&dev_mutex);
+    ret = driver_cmd_batch(cmds, *n_cmds);
+    mutex_lock(&dev_mutex);
+    for (i = 0; i < *n_cmds; i++) {
+        if (cmds[i].op->hdr.status < 0)
+            qkdata_out[idx[i]] = NULL;
+        mr_tree_done(mres[i], cmds[i].op);
+    }
+    *n_cmds = 0;
+
+    return ret;
+}
+
+static int zhpe_offloaded_mr_reg_batch(struct zhpeq_dom *zdom,
+                                       const struct zhpeq_iov *iov,
+                                       size_t n_iov, uint32_t access,
+                                       struct zhpeq_key_data **qkdata_out)
+{
+    int                 ret = -ENOMEM;
+    struct drv_cmd      *cmds = NULL;
+    union zhpe_offloaded_op *ops = NULL;
+    struct dev_mr_tree_entry **mres = NULL;
+    size_t              *idx = NULL;
+    size_t              n_cmds = 0;
+    size_t              i;
+    int                 rc;
+    struct zhpeq_mr_desc_v1 *desc;
+
+    memset(qkdata_out, 0, n_iov * sizeof(*qkdata_out));
+    cmds = calloc(n_iov, sizeof(*cmds));
+    ops = calloc(n_iov, sizeof(*ops));
+    mres = calloc(n_iov, sizeof(*mres));
+    idx = calloc(n_iov, sizeof(*idx));
+    if (!cmds || !ops || !mres || !idx)
+        goto done;
+
+    /*
+     * New keys go to the driver as one batch. If a key is pending for
+     * someone else, flush ours before waiting so we never sleep holding
+     * pending entries another thread may be waiting on.
+     */
+    ret = 0;
+    mutex_lock(&dev_mutex);
+    for (i = 0; i < n_iov && ret >= 0; ) {
+        desc = mr_desc_alloc((void *)(uintptr_t)iov[i].addr, iov[i].len,
+                             access);
+        if (!desc) {
+            ret = -ENOMEM;
+            break;
+        }
+        qkdata_out[i] = &desc->qkdata;
+        rc = mr_tree_get(&qkdata_out[i], &mres[n_cmds], !n_cmds);
+        if (rc <= 0) {
             free(desc);
-            free(mre);
+            if (rc == -EAGAIN) {
+                qkdata_out[i] = NULL;
+                ret = mr_batch_flush(cmds, mres, idx, &n_cmds, qkdata_out);
+                continue;
+            }
+            if (rc < 0) {
+                qkdata_out[i] = NULL;
+                ret = rc;
+            }
+            i++;
+            continue;
         }
-    } else
-        ret = -ENOENT;
+        mr_reg_req(&ops[n_cmds], desc);
+        cmds[n_cmds].op = &ops[n_cmds];
+        cmds[n_cmds].req_len = sizeof(ops->req.mr_reg);
+        cmds[n_cmds].rsp_len = sizeof(ops->rsp.mr_reg);
+        idx[n_cmds] = i++;
+        n_cmds++;
+    }
+    rc = mr_batch_flush(cmds, mres, idx, &n_cmds, qkdata_out);
+    if (ret >= 0)
+        ret = rc;
     mutex_unlock(&dev_mutex);
 
+    /* All or nothing. */
+    if (ret < 0) {
+        for (i = 0; i < n_iov; i++) {
+            if (qkdata_out[i])
+                (void)zhpe_offloaded_mr_free(zdom, qkdata_out[i]);
+            qkdata_out[i] = NULL;
+        }
+    }
+
  done:
+    free(cmds);
+    free(ops);
+    free(mres);
+    free(idx);
+
     return ret;
 }
 
@@ -763,6 +1162,7 @@ struct backend_ops ops = {
     .wq_signal          = zhpe_offloaded_wq_signal,
     .mr_reg             = zhpe_offloaded_mr_reg,
     .mr_free            = zhpe_offloaded_mr_free,
+    .mr_reg_batch       = zhpe_offloaded_mr_reg_batch,
     .zmmu_import        = zhpe_offloaded_zmmu_import,
     .zmmu_fam_import    = zhpe_offloaded_zmmu_fam_import,
     .zmmu_free          = zhpe_offloaded_zmmu_free,
@@ -777,5 +1177,7 @@ void zhpeq_backend_zhpe_offloaded_init(int fd)
     if (fd == -1)
         return;
 
+    if (zhpe_offloaded_mock_enabled())
+        drv_ops = &zhpe_offloaded_mock_ops;
     zhpeq_register_backend(ZHPE_OFFLOADED_BACKEND_ZHPE, &ops);
 }
@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) 2019 Hewlett Packard Enterprise Development LP.
+ * All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <sys/eventfd.h>
+#include <sys/queue.h>
+
+#include <internal.h>
+
+/*
+ * In-process stand-in for the zhpe driver, so the command channel and the
+ * registration paths can be exercised without hardware. It is used when
+ * the device cannot be opened and ZHPE_OFFLOADED_DRIVER_MOCK=<usec> is
+ * set: every command takes <usec> in write() and responses are returned
+ * newest first, so completions always arrive out of order. There are no
+ * hardware queues, so XQALLOC fails with ENOSYS.
+ */
+
+struct mock_rsp {
+    SLIST_ENTRY(mock_rsp) next;
+    union zhpe_offloaded_op op;
+};
+
+static pthread_mutex_t  mock_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   mock_cond = PTHREAD_COND_INITIALIZER;
+static SLIST_HEAD(, mock_rsp) mock_head = SLIST_HEAD_INITIALIZER(mock_head);
+static bool             mock_enabled;
+static uint64_t         mock_usec;
+
+static void mock_cmd(union zhpe_offloaded_op *op)
+{
+    union zhpe_offloaded_req      *req = &op->req;
+    union zhpe_offloaded_rsp      *rsp = &op->rsp;
+    int                 status = 0;
+
+    switch (req->hdr.opcode) {
+
+    case ZHPE_OFFLOADED_OP_INIT:
+        uuid_generate(rsp->init.uuid);
+        rsp->init.global_shared_offset = 0;
+        rsp->init.global_shared_size = page_size;
+        rsp->init.local_shared_offset = page_size;
+        rsp->init.local_shared_size = page_size;
+        break;
+
+    case ZHPE_OFFLOADED_OP_MR_REG:
+        /* Any unique value will do. */
+        rsp->mr_reg.rsp_zaddr = req->mr_reg.vaddr;
+        break;
+
+    case ZHPE_OFFLOADED_OP_RMR_IMPORT:
+        rsp->rmr_import.req_addr = req->rmr_import.rsp_zaddr;
+        break;
+
+    case ZHPE_OFFLOADED_OP_MR_FREE:
+    case ZHPE_OFFLOADED_OP_RMR_FREE:
+    case ZHPE_OFFLOADED_OP_UUID_IMPORT:
+    case ZHPE_OFFLOADED_OP_UUID_FREE:
+    case ZHPE_OFFLOADED_OP_XQFREE:
+        break;
+
+    case ZHPE_OFFLOADED_OP_XQALLOC:
+        status = -ENOSYS;
+        break;
+
+    default:
+        status = -EINVAL;
+        break;
+    }
+    rsp->hdr.opcode = req->hdr.opcode | ZHPE_OFFLOADED_OP_RESPONSE;
+    rsp->hdr.status = status;
+}
+
+static int mock_open(void)
+{
+    return eventfd(0, 0);
+}
+
+static ssize_t mock_write(int fd, const void *buf, size_t len)
+{
+    struct mock_rsp     *mrsp;
+
+    if (len < sizeof(mrsp->op.hdr) || len > sizeof(mrsp->op)) {
+        errno = EINVAL;
+        return -1;
+    }
+    mrsp = calloc(1, sizeof(*mrsp));
+    if (!mrsp)
+        return -1;
+    memcpy(&mrsp->op, buf, len);
+    mock_cmd(&mrsp->op);
+    if (mock_usec)
+        usleep(mock_usec);
+    mutex_lock(&mock_mutex);
+    SLIST_INSERT_HEAD(&mock_head, mrsp, next);
+    cond_signal(&mock_cond);
+    mutex_unlock(&mock_mutex);
+
+    return len;
+}
+
+static ssize_t mock_read(int fd, void *buf, size_t len)
+{
+    struct mock_rsp     *mrsp;
+
+    mutex_lock(&mock_mutex);
+    while (!(mrsp = SLIST_FIRST(&mock_head)))
+        cond_wait(&mock_cond, &mock_mutex);
+    SLIST_REMOVE_HEAD(&mock_head, next);
+    mutex_unlock(&mock_mutex);
+    if (len > sizeof(mrsp->op))
+        len = sizeof(mrsp->op);
+    memcpy(buf, &mrsp->op, len);
+    free(mrsp);
+
+    return len;
+}
+
+static void *mock_mmap(size_t len, int fd, off_t offset, int *error)
+{
+    void                *ret;
+    struct zhpe_offloaded_global_shared_data *global;
+    struct zhpe_offloaded_local_shared_data *local;
+
+    ret = do_mmap(NULL, len, PROT_READ | PROT_WRITE,
+                  MAP_ANONYMOUS | MAP_PRIVATE, -1, 0, error);
+    if (!ret)
+        goto done;
+    if (!offset) {
+        global = ret;
+        global->magic = ZHPE_OFFLOADED_MAGIC;
+        global->version = ZHPE_OFFLOADED_GLOBAL_SHARED_VERSION;
+    } else {
+        local = ret;
+        local->magic = ZHPE_OFFLOADED_MAGIC;
+        local->version = ZHPE_OFFLOADED_LOCAL_SHARED_VERSION;
+    }
+
+ done:
+    return ret;
+}
+
+struct zhpe_offloaded_driver_ops zhpe_offloaded_mock_ops = {
+    .open               = mock_open,
+    .write              = mock_write,
+    .read               = mock_read,
+    .mmap               = mock_mmap,
+};
+
+int zhpe_offloaded_mock_open(void)
+{
+    const char          *s = getenv("ZHPE_OFFLOADED_DRIVER_MOCK");
+
+    if (!s)
+        return -1;
+    if (parse_kb_uint64_t(__func__, __LINE__, "ZHPE_OFFLOADED_DRIVER_MOCK",
+                          s, &mock_usec, 0, 0, UINT64_MAX, PARSE_NUM) < 0)
+        return -1;
+    mock_enabled = true;
+
+    return mock_open();
+}
+
+bool zhpe_offloaded_mock_enabled(void)
+{
+    return mock_enabled;
+}
@@ -41,7 +41,7 @@
 
 void fab_dom_init(struct fab_dom *dom)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     memset(dom, 0, sizeof(*dom));
     dom->av_mutex = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
     atm_inc(&dom->use_count);
@@ -49,14 +49,14 @@ void fab_dom_init(struct fab_dom *dom)
 
 static void onfree_dom(struct fab_dom *dom, void *data)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     free(dom);
 }
 
 struct fab_dom *_fab_dom_alloc(void (*onfree)(struct fab_dom *dom, void *data),
                                void *data, const char *callf, uint line)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     struct fab_dom      *ret;
 
     ret = zhpeu_malloc_aligned(L1_CACHE_BYTES, sizeof(*ret), callf, line);
@@ -74,7 +74,7 @@ struct fab_dom *_fab_dom_alloc(void (*onfree)(struct fab_dom *dom, void *data),
 
 void fab_conn_init(struct fab_dom *dom, struct fab_conn *conn)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     memset(conn, 0, sizeof(*conn));
     conn->dom = dom;
     atm_inc(&dom->use_count);
@@ -83,7 +83,7 @@ void fab_conn_init(struct fab_dom *dom, struct fab_conn *conn)
 
 static void onfree_conn(struct fab_conn *conn, void *data)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     free(conn);
 }
 
@@ -92,7 +92,7 @@ struct fab_conn *_fab_conn_alloc(struct fab_dom *dom,
                                                 void *data),
                                  void *data, const char *callf, uint line)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     struct fab_conn     *ret;
 
     ret = zhpeu_malloc_aligned(L1_CACHE_BYTES, sizeof(*ret), callf, line);
@@ -110,12 +110,12 @@ struct fab_conn *_fab_conn_alloc(struct fab_dom *dom,
 
 static void dummy_free(void *key)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
 }
 
 void fab_finfo_free(struct fab_info *finfo)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     FREE_IF(finfo->info, fi_freeinfo);
     FREE_IF(finfo->hints, fi_freeinfo);
     free(finfo->service);
@@ -124,7 +124,7 @@ void fab_finfo_free(struct fab_info *finfo)
 
 int fab_dom_free(struct fab_dom *dom)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret = 0;
     int32_t             use_count;
     int                 rc;
@@ -156,7 +156,7 @@ int fab_dom_free(struct fab_dom *dom)
 
 int fab_conn_free(struct fab_conn *conn)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret = 0;
     int32_t             use_count;
     int                 rc;
@@ -197,7 +197,7 @@ static int finfo_init(const char *callf, uint line,
                       enum fi_ep_type ep_type, struct fi_info *hints,
                       struct fab_info *finfo)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret = -FI_ENOMEM;
 
     memset(finfo, 0, sizeof(*finfo));
@@ -246,7 +246,7 @@ static int finfo_init(const char *callf, uint line,
 
 static int finfo_getinfo(const char *callf, uint line, struct fab_info *finfo)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret;
     struct fi_info      *info;
 
@@ -294,7 +294,7 @@ int _fab_dom_setup(const char *callf, uint line,
                    const char *provider, const char *domain,
                    enum fi_ep_type ep_type, struct fab_dom *dom)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret;
     struct fi_av_attr   av_attr = { .type = FI_AV_TABLE };
 
@@ -309,6 +309,8 @@ int _fab_dom_setup(const char *callf, uint line,
                               FI_CONTEXT | FI_CONTEXT2);
     /* dom->finfo->hints->domain_attr->data_progress = FI_PROGRESS_MANUAL; */
     dom->finfo.hints->domain_attr->mr_mode = FI_MR_BASIC;
+    if (dom->threading != FI_THREAD_UNSPEC)
+        dom->finfo.hints->domain_attr->threading = dom->threading;
     dom->finfo.hints->addr_format = FI_SOCKADDR;
 
     ret = finfo_getinfo(callf, line, &dom->finfo);
@@ -345,7 +347,7 @@ int _fab_dom_getinfo(const char *callf, uint line,
                      const char *service, const char *node, bool passive,
                      struct fab_dom *dom, struct fab_info *finfo)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret;
 
     ret = finfo_init(callf, line, service, node, passive, NULL, NULL, 0,
@@ -361,7 +363,7 @@ int _fab_dom_getinfo(const char *callf, uint line,
 int _fab_listener_setup(const char *callf, uint line, int backlog,
                         struct fab_conn *listener)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret;
     struct fi_info      *info = fab_conn_info(listener);
     struct fi_eq_attr   eq_attr = { .wait_obj = FI_WAIT_UNSPEC };
@@ -407,7 +409,7 @@ int _fab_listener_wait_and_accept(const char *callf, uint line,
                                   size_t tx_size, size_t rx_size,
                                   struct fab_conn *conn)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret = 0;
     struct fi_eq_cm_entry entry;
 
@@ -441,7 +443,7 @@ int _fab_listener_wait_and_accept(const char *callf, uint line,
 int _fab_connect(const char *callf, uint line, int timeout,
                  size_t tx_size, size_t rx_size, struct fab_conn *conn)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret;
     struct fi_info      *info = fab_conn_info(conn);
     struct fi_eq_attr   eq_attr = { .wait_obj = FI_WAIT_UNSPEC };
@@ -478,7 +480,7 @@ int _fab_ep_setup(const char *callf, uint line,
                   struct fab_conn *conn, struct fid_eq *eq,
                   size_t tx_size, size_t rx_size)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret;
     struct fi_info      *info = fab_conn_info(conn);
     struct fi_cq_attr   tx_cq_attr =  {
@@ -550,7 +552,7 @@ int _fab_eq_cm_event(const char *callf, uint line,
                      struct fab_conn *conn, int timeout, uint32_t expected,
                      struct fi_eq_cm_entry *entry)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     ssize_t             ret;
     struct fi_eq_err_entry fi_eq_err;
     uint32_t            event;
@@ -589,7 +591,7 @@ int _fab_mrmem_alloc(const char *callf, uint line,
                      struct fab_conn *conn, struct fab_mrmem *mrmem,
                      size_t len, uint64_t access)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret = 0;
 
     ret = -posix_memalign(&mrmem->mem, page_size, len);
@@ -616,7 +618,7 @@ int _fab_mrmem_alloc(const char *callf, uint line,
 
 int fab_mrmem_free(struct fab_mrmem *mrmem)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret = 0;
 
     if (!mrmem)
@@ -634,7 +636,7 @@ ssize_t _fab_completions(const char *callf, uint line,
                          void (*cq_update)(void *arg, void *cqe, bool err),
                          void *arg)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     ssize_t             ret = 0;
     ssize_t             rc;
     ssize_t             len;
@@ -684,7 +686,7 @@ ssize_t _fab_completions(const char *callf, uint line,
 
 void fab_print_info(struct fab_conn *conn)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 rc;
     struct fab_dom      dom;
     struct fab_info     finfo = { NULL };
@@ -720,7 +722,7 @@ void fab_print_info(struct fab_conn *conn)
 int _fab_av_ep(const char *callf, uint line, struct fab_conn *conn,
                size_t tx_size, size_t rx_size)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     return _fab_ep_setup(callf, line, conn, NULL, tx_size, rx_size);
 }
 
@@ -729,7 +731,7 @@ int _fab_cq_sread(const char *callf, uint line,
                   size_t count, void *cond, int timeout,
                   struct fi_cq_err_entry *fi_cqerr)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     ssize_t             ret = 0;
     int                 rc;
     struct fi_cq_err_entry err_entry;
@@ -772,7 +774,7 @@ int _fab_cq_read(const char *callf, uint line,
                  struct fid_cq *cq, struct fi_cq_tagged_entry *fi_cqe,
                  size_t count, struct fi_cq_err_entry *fi_cqerr)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     ssize_t             ret = 0;
     int                 rc;
     struct fi_cq_err_entry err_entry;
@@ -814,7 +816,7 @@ int _fab_cq_read(const char *callf, uint line,
 int _fab_av_xchg_addr(const char *callf, uint line, struct fab_conn *conn,
                       int sock_fd, union sockaddr_in46 *ep_addr)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret;
     size_t              addr_len = sizeof(*ep_addr);
     in_port_t           save_port;
@@ -856,7 +858,7 @@ struct xchg_retry_args {
 
 static int xchg_retry(void *vargs)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     struct xchg_retry_args *args = vargs;
     struct timespec     ts_cur;
 
@@ -873,7 +875,7 @@ static int xchg_retry(void *vargs)
 int _fab_av_xchg(const char *callf, uint line, struct fab_conn *conn,
                  int sock_fd, int timeout, fi_addr_t *fi_addr)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret;
     bool                fi_addr_valid = false;
     int                 (*retry)(void *args) = xchg_retry;
@@ -919,13 +921,13 @@ struct av_tree_entry {
 
 static int compare_sa(const void *key1, const void *key2)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     return sockaddr_cmp(key1, key2);
 }
 
 static int compare_fi(const void *key1, const void *key2)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     fi_addr_t           fi_addr1 = *(const fi_addr_t *)key1;
     fi_addr_t           fi_addr2 = *(const fi_addr_t *)key2;
 
@@ -935,7 +937,7 @@ static int compare_fi(const void *key1, const void *key2)
 int _fab_av_insert(const char *callf, uint line, struct fab_dom *dom,
                    union sockaddr_in46 *saddr, fi_addr_t *fi_addr)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret;
     struct av_tree_entry *ave = NULL;
     void                **tval = NULL;
@@ -1005,7 +1007,7 @@ int _fab_av_insert(const char *callf, uint line, struct fab_dom *dom,
 int _fab_av_remove(const char *callf, uint line, struct fab_dom *dom,
                    fi_addr_t fi_addr)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret;
     struct av_tree_entry *ave;
     void                **tval;
@@ -1039,7 +1041,7 @@ int _fab_av_wait_send(const char *callf, uint line, struct fab_conn *conn,
                       fi_addr_t fi_addr,
                       int (*retry)(void *retry_arg), void *retry_arg)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret;
 
     /* Do zero length fi_inject until it stops returning FI_EAGAIN. */
@@ -1067,7 +1069,7 @@ int _fab_av_wait_recv(const char *callf, uint line, struct fab_conn *conn,
                       fi_addr_t fi_addr,
                       int (*retry)(void *retry_arg), void *retry_arg)
 {
-    PRINT_DEBUG;
+    zhpeu_trace();
     int                 ret;
     struct fi_context2  fi_ctxt;
     struct fi_msg_tagged fi_tmsg = {
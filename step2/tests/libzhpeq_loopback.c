@@ -0,0 +1,512 @@
+/*
+ * Copyright (C) 2019 Hewlett Packard Enterprise Development LP.
+ * All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <internal.h>
+
+/*
+ * Run the calls that build several commands at once, and striped
+ * transfers, against this process: one registered buffer is split into
+ * a local half and a "remote" half reached through a key imported from
+ * ourselves. Needs ZHPE_OFFLOADED_BACKEND_LOOPBACK, which runs the
+ * commands as completions are polled.
+ */
+
+#define BUF_LEN         ((size_t)64 * 1024)
+#define POLL_MAX        (1000000)
+
+static struct zhpeq_dom *zdom;
+static struct zhpeq     *zq;
+static struct zhpeq_key_data *lcl_kdata;
+static struct zhpeq_key_data *rem_kdata;
+static char             *buf;
+static char             *lcl_buf;
+static char             *rem_buf;
+static uint64_t         lcl_zaddr;
+static uint64_t         rem_zaddr;
+
+static void usage(bool help) __attribute__ ((__noreturn__));
+
+static void usage(bool help)
+{
+    print_usage(help, "Usage:%s\n", appname);
+
+    exit(255);
+}
+
+static void fill(char *p, size_t len, uint seed)
+{
+    size_t              i;
+
+    for (i = 0; i < len; i++)
+        p[i] = (char)(seed + i * 7);
+}
+
+static int check(const char *label, const void *p1, const void *p2,
+                 size_t len)
+{
+    if (!memcmp(p1, p2, len))
+        return 0;
+    print_err("%s:data mismatch\n", label);
+
+    return -EIO;
+}
+
+/* Read n completions, which must carry contexts[] in order. */
+static int wait_cq(struct zhpeq *zq, void * const *contexts, size_t n)
+{
+    struct zhpeq_cq_entry cqe;
+    ssize_t             rc;
+    size_t              i;
+    uint                polls;
+
+    for (i = 0; i < n; i++) {
+        for (polls = 0; !(rc = zhpeq_cq_read(zq, &cqe, 1)); polls++) {
+            if (polls == POLL_MAX) {
+                print_err("%s,%u:completion %lu never arrived\n",
+                          __func__, __LINE__, i);
+                return -ETIMEDOUT;
+            }
+        }
+        if (rc < 0) {
+            print_func_err(__func__, __LINE__, "zhpeq_cq_read", "", rc);
+            return rc;
+        }
+        if (cqe.z.status != ZHPEQ_CQ_STATUS_SUCCESS) {
+            print_err("%s,%u:completion %lu status %d\n",
+                      __func__, __LINE__, i, cqe.z.status);
+            return -EIO;
+        }
+        if (cqe.z.context != contexts[i]) {
+            print_err("%s,%u:completion %lu context %p, expected %p\n",
+                      __func__, __LINE__, i, cqe.z.context, contexts[i]);
+            return -EIO;
+        }
+    }
+
+    return 0;
+}
+
+static int test_batch(void)
+{
+    int                 ret;
+    uint64_t            imm = 0x0123456789abcdefULL;
+    void                *contexts[4] = { &contexts[0], &contexts[1],
+                                         &contexts[2], &contexts[3] };
+    struct zhpeq_op     zops[4] = {
+        {
+            .op         = ZHPEQ_OP_PUT,
+            .context    = contexts[0],
+            .rw         = { lcl_zaddr, 1024, rem_zaddr },
+        },
+        {
+            .op         = ZHPEQ_OP_PUTI,
+            .context    = contexts[1],
+            .imm        = { &imm, sizeof(imm), rem_zaddr + 2048 },
+        },
+        {
+            .op         = ZHPEQ_OP_GET,
+            .context    = contexts[2],
+            .rw         = { lcl_zaddr + 4096, 1024, rem_zaddr + 4096 },
+        },
+        {
+            .op         = ZHPEQ_OP_NOP,
+            .fence      = true,
+            .context    = contexts[3],
+        },
+    };
+    int64_t             qindex;
+
+    fill(lcl_buf, BUF_LEN, 1);
+    fill(rem_buf, BUF_LEN, 2);
+
+    /* Behind our own uncommitted reservation, it must refuse. */
+    qindex = zhpeq_reserve(zq, 1);
+    if (qindex < 0) {
+        print_func_err(__func__, __LINE__, "zhpeq_reserve", "", qindex);
+        return qindex;
+    }
+    ret = zhpeq_submit_batch(zq, zops, ARRAY_SIZE(zops));
+    if (ret != -EAGAIN) {
+        print_err("%s,%u:zhpeq_submit_batch() returned %d, expected %d\n",
+                  __func__, __LINE__, ret, -EAGAIN);
+        return -EIO;
+    }
+    /* Fenced, to cover the single-op path as well as the batch one. */
+    ret = zhpeq_nop(zq, qindex, true, &qindex);
+    if (ret >= 0)
+        ret = zhpeq_commit(zq, qindex, 1);
+    if (ret >= 0)
+        ret = wait_cq(zq, (void *[]){ &qindex }, 1);
+    if (ret < 0)
+        return ret;
+
+    ret = zhpeq_submit_batch(zq, zops, ARRAY_SIZE(zops));
+    if (ret < 0) {
+        print_func_err(__func__, __LINE__, "zhpeq_submit_batch", "", ret);
+        return ret;
+    }
+    ret = wait_cq(zq, contexts, ARRAY_SIZE(contexts));
+    if (ret >= 0)
+        ret = check("put", rem_buf, lcl_buf, 1024);
+    if (ret >= 0)
+        ret = check("puti", rem_buf + 2048, (char *)&imm, sizeof(imm));
+    if (ret >= 0)
+        ret = check("get", lcl_buf + 4096, rem_buf + 4096, 1024);
+
+    return ret;
+}
+
+static int test_rwv(void)
+{
+    int                 ret;
+    void                *context = &ret;
+    /* The two sides are split at different places. */
+    struct zhpeq_iov    lcl[3] = {
+        { lcl_zaddr,            1000 },
+        { lcl_zaddr + 2048,     3000 },
+        { lcl_zaddr + 8192,     96 },
+    };
+    struct zhpeq_iov    rem[2] = {
+        { rem_zaddr + 512,      2500 },
+        { rem_zaddr + 16384,    1596 },
+    };
+
+    fill(lcl_buf, BUF_LEN, 3);
+    fill(rem_buf, BUF_LEN, 4);
+    ret = zhpeq_putv(zq, false, lcl, ARRAY_SIZE(lcl), rem, ARRAY_SIZE(rem),
+                     context);
+    if (ret < 0) {
+        print_func_err(__func__, __LINE__, "zhpeq_putv", "", ret);
+        return ret;
+    }
+    ret = wait_cq(zq, &context, 1);
+    if (ret >= 0)
+        ret = check("putv", rem_buf + 512, lcl_buf, 1000);
+    if (ret >= 0)
+        ret = check("putv", rem_buf + 1512, lcl_buf + 2048, 1500);
+    if (ret >= 0)
+        ret = check("putv", rem_buf + 16384, lcl_buf + 3548, 1500);
+    if (ret >= 0)
+        ret = check("putv", rem_buf + 17884, lcl_buf + 8192, 96);
+    if (ret < 0)
+        return ret;
+
+    /* And back again, over a fresh local pattern. */
+    fill(lcl_buf, BUF_LEN, 5);
+    ret = zhpeq_getv(zq, true, lcl, ARRAY_SIZE(lcl), rem, ARRAY_SIZE(rem),
+                     context);
+    if (ret < 0) {
+        print_func_err(__func__, __LINE__, "zhpeq_getv", "", ret);
+        return ret;
+    }
+    ret = wait_cq(zq, &context, 1);
+    if (ret >= 0)
+        ret = check("getv", lcl_buf, rem_buf + 512, 1000);
+    if (ret >= 0)
+        ret = check("getv", lcl_buf + 2048, rem_buf + 1512, 1500);
+    if (ret >= 0)
+        ret = check("getv", lcl_buf + 3548, rem_buf + 16384, 1500);
+    if (ret >= 0)
+        ret = check("getv", lcl_buf + 8192, rem_buf + 17884, 96);
+
+    return ret;
+}
+
+static int test_atomicv(void)
+{
+    int                 ret;
+    void                *context = &ret;
+    uint64_t            *rem = (void *)rem_buf;
+    uint64_t            results[4];
+    size_t              i;
+    /* CAS stores operands[0] if the target equals operands[1]. */
+    struct zhpeq_atomic_ent ents[4] = {
+        { ZHPEQ_ATOMIC_ADD,  rem_zaddr,
+          { { .z.op64 = 5 } } },
+        { ZHPEQ_ATOMIC_SWAP, rem_zaddr + sizeof(*rem),
+          { { .z.op64 = 7 } } },
+        { ZHPEQ_ATOMIC_CAS,  rem_zaddr + 2 * sizeof(*rem),
+          { { .z.op64 = 99 }, { .z.op64 = 30 } } },
+        { ZHPEQ_ATOMIC_CAS,  rem_zaddr + 3 * sizeof(*rem),
+          { { .z.op64 = 99 }, { .z.op64 = 41 } } },
+    };
+    static const uint64_t old[4] = { 10, 20, 30, 40 };
+    static const uint64_t new[4] = { 15, 7, 99, 40 };
+
+    for (i = 0; i < ARRAY_SIZE(old); i++)
+        rem[i] = old[i];
+    memset(results, 0, sizeof(results));
+    ret = zhpeq_atomicv(zq, false, ZHPEQ_ATOMIC_SIZE64, ents,
+                        ARRAY_SIZE(ents), results, context);
+    if (ret < 0) {
+        print_func_err(__func__, __LINE__, "zhpeq_atomicv", "", ret);
+        return ret;
+    }
+    ret = wait_cq(zq, &context, 1);
+    if (ret >= 0)
+        ret = check("atomicv results", results, old, sizeof(old));
+    if (ret >= 0)
+        ret = check("atomicv values", rem, new, sizeof(new));
+
+    return ret;
+}
+
+/* Read completions from zs until the one for context arrives. */
+static int wait_stripe(struct zhpeq_stripe *zs, void *context)
+{
+    struct zhpeq_cq_entry cqe;
+    ssize_t             rc;
+    uint                polls;
+
+    for (polls = 0; !(rc = zhpeq_stripe_cq_read(zs, &cqe, 1)); polls++) {
+        if (polls == POLL_MAX) {
+            print_err("%s,%u:completion never arrived\n", __func__, __LINE__);
+            return -ETIMEDOUT;
+        }
+    }
+    if (rc < 0) {
+        print_func_err(__func__, __LINE__, "zhpeq_stripe_cq_read", "", rc);
+        return rc;
+    }
+    if (cqe.z.status != ZHPEQ_CQ_STATUS_SUCCESS) {
+        print_err("%s,%u:completion status %d\n",
+                  __func__, __LINE__, cqe.z.status);
+        return -EIO;
+    }
+    if (cqe.z.context != context) {
+        print_err("%s,%u:completion context %p, expected %p\n",
+                  __func__, __LINE__, cqe.z.context, context);
+        return -EIO;
+    }
+
+    return 0;
+}
+
+static int test_stripe(void)
+{
+    int                 ret;
+    void                *context = &ret;
+    struct zhpeq_stripe *zs = NULL;
+    /* Odd length and offset so the last piece is short. */
+    size_t              off = 100;
+    size_t              len = BUF_LEN - 2 * off;
+
+    /*
+     * Small queues and chunks, so most pieces wait for completions
+     * before they are posted.
+     */
+    ret = zhpeq_stripe_alloc(zdom, 3, 4, 0, 0, 4096, &zs);
+    if (ret < 0) {
+        print_func_err(__func__, __LINE__, "zhpeq_stripe_alloc", "", ret);
+        goto done;
+    }
+
+    fill(lcl_buf, BUF_LEN, 6);
+    fill(rem_buf, BUF_LEN, 7);
+    ret = zhpeq_stripe_put(zs, false, lcl_zaddr + off, len, rem_zaddr + off,
+                           context);
+    if (ret < 0) {
+        print_func_err(__func__, __LINE__, "zhpeq_stripe_put", "", ret);
+        goto done;
+    }
+    ret = wait_stripe(zs, context);
+    if (ret >= 0)
+        ret = check("stripe_put", rem_buf + off, lcl_buf + off, len);
+    if (ret < 0)
+        goto done;
+
+    fill(lcl_buf, BUF_LEN, 8);
+    ret = zhpeq_stripe_get(zs, true, lcl_zaddr, len, rem_zaddr + off,
+                           context);
+    if (ret < 0) {
+        print_func_err(__func__, __LINE__, "zhpeq_stripe_get", "", ret);
+        goto done;
+    }
+    ret = wait_stripe(zs, context);
+    if (ret >= 0)
+        ret = check("stripe_get", lcl_buf, rem_buf + off, len);
+
+ done:
+    if (zs) {
+        int             rc = zhpeq_stripe_free(zs);
+
+        if (rc < 0) {
+            print_func_err(__func__, __LINE__, "zhpeq_stripe_free", "", rc);
+            if (ret >= 0)
+                ret = rc;
+        }
+    }
+
+    return ret;
+}
+
+static const struct {
+    const char          *name;
+    int                 (*func)(void);
+} tests[] = {
+    { "zhpeq_submit_batch", test_batch },
+    { "zhpeq_putv/getv", test_rwv },
+    { "zhpeq_atomicv", test_atomicv },
+    { "zhpeq_stripe_put/get", test_stripe },
+};
+
+static int setup(void)
+{
+    int                 ret;
+    union sockaddr_in46 sa;
+    size_t              sa_len = sizeof(sa);
+    char                blob[ZHPEQ_KEY_BLOB_MAX];
+    size_t              blob_len = sizeof(blob);
+    int                 open_idx;
+
+    ret = -posix_memalign((void **)&buf, page_size, 2 * BUF_LEN);
+    if (ret < 0) {
+        print_func_err(__func__, __LINE__, "posix_memalign", "", ret);
+        goto done;
+    }
+    lcl_buf = buf;
+    rem_buf = buf + BUF_LEN;
+
+    ret = zhpeq_domain_alloc(&zdom);
+    if (ret < 0) {
+        print_func_err(__func__, __LINE__, "zhpeq_domain_alloc", "", ret);
+        goto done;
+    }
+    ret = zhpeq_alloc(zdom, 64, 64, 0, 0, 0, &zq);
+    if (ret < 0) {
+        print_func_err(__func__, __LINE__, "zhpeq_alloc", "", ret);
+        goto done;
+    }
+    /* No socket: our own address, which we then open. */
+    ret = zhpeq_backend_exchange(zq, -1, &sa, &sa_len);
+    if (ret < 0) {
+        print_func_err(__func__, __LINE__, "zhpeq_backend_exchange", "",
+                       ret);
+        goto done;
+    }
+    ret = zhpeq_backend_open(zq, &sa);
+    if (ret < 0) {
+        print_func_err(__func__, __LINE__, "zhpeq_backend_open", "", ret);
+        goto done;
+    }
+    open_idx = ret;
+
+    ret = zhpeq_mr_reg(zdom, buf, 2 * BUF_LEN,
+                       (ZHPEQ_MR_GET | ZHPEQ_MR_PUT |
+                        ZHPEQ_MR_GET_REMOTE | ZHPEQ_MR_PUT_REMOTE),
+                       &lcl_kdata);
+    if (ret < 0) {
+        print_func_err(__func__, __LINE__, "zhpeq_mr_reg", "", ret);
+        goto done;
+    }
+    ret = zhpeq_lcl_key_access(lcl_kdata, lcl_buf, BUF_LEN, 0, &lcl_zaddr);
+    if (ret < 0) {
+        print_func_err(__func__, __LINE__, "zhpeq_lcl_key_access", "", ret);
+        goto done;
+    }
+    ret = zhpeq_zmmu_export(zdom, lcl_kdata, blob, &blob_len);
+    if (ret < 0) {
+        print_func_err(__func__, __LINE__, "zhpeq_zmmu_export", "", ret);
+        goto done;
+    }
+    ret = zhpeq_zmmu_import(zdom, open_idx, blob, blob_len, false,
+                            &rem_kdata);
+    if (ret < 0) {
+        print_func_err(__func__, __LINE__, "zhpeq_zmmu_import", "", ret);
+        goto done;
+    }
+    ret = zhpeq_rem_key_access(rem_kdata, (uintptr_t)rem_buf, BUF_LEN, 0,
+                               &rem_zaddr);
+    if (ret < 0) {
+        print_func_err(__func__, __LINE__, "zhpeq_rem_key_access", "", ret);
+        goto done;
+    }
+
+ done:
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    int                 ret = 1;
+    struct zhpeq_attr   attr;
+    int                 rc;
+    size_t              i;
+
+    zhpeq_util_init(argv[0], LOG_DEBUG, false);
+
+    if (argc != 1)
+        usage(false);
+
+    rc = zhpeq_init(ZHPEQ_API_VERSION);
+    if (rc < 0) {
+        print_func_err(__func__, __LINE__, "zhpeq_init", "", rc);
+        goto done;
+    }
+    rc = zhpeq_query_attr(&attr);
+    if (rc < 0) {
+        print_func_err(__func__, __LINE__, "zhpeq_query_attr", "", rc);
+        goto done;
+    }
+    if (attr.backend != ZHPEQ_BACKEND_LOOPBACK) {
+        print_err("%s:set ZHPE_OFFLOADED_BACKEND_LOOPBACK\n", appname);
+        goto done;
+    }
+    if (setup() < 0)
+        goto done;
+
+    for (i = 0; i < ARRAY_SIZE(tests); i++) {
+        rc = tests[i].func();
+        printf("%s:%s %s\n", appname, tests[i].name,
+               (rc < 0 ? "failed" : "passed"));
+        if (rc < 0)
+            goto done;
+    }
+    ret = 0;
+
+ done:
+    if (rem_kdata)
+        zhpeq_zmmu_free(zdom, rem_kdata);
+    if (lcl_kdata)
+        zhpeq_mr_free(zdom, lcl_kdata);
+    zhpeq_free(zq);
+    zhpeq_domain_free(zdom);
+    free(buf);
+
+    printf("%s:done, ret = %d\n", appname, ret);
+
+    return ret;
+}
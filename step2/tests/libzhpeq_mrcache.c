@@ -0,0 +1,204 @@
+/*
+ * Copyright (C) 2019 Hewlett Packard Enterprise Development LP.
+ * All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <internal.h>
+
+/*
+ * Drive the registration cache directly against a stub backend, with no
+ * budget so every free evicts. Each round registers two ranges with the
+ * same start address, which the tree must keep apart, frees them, and
+ * checks that nothing is left behind to be hit or invalidated.
+ */
+
+#define BASE            ((uintptr_t)0x100000)
+#define STRIDE          ((uintptr_t)0x10000)
+
+static uint64_t         regs;
+static uint64_t         frees;
+
+static int stub_mr_reg(struct zhpeq_dom *zdom, const void *buf, size_t len,
+                       uint32_t access, struct zhpeq_key_data **qkdata_out)
+{
+    struct zhpeq_key_data *qkdata;
+
+    qkdata = calloc(1, sizeof(*qkdata));
+    if (!qkdata)
+        return -ENOMEM;
+    qkdata->z.vaddr = (uintptr_t)buf;
+    qkdata->z.len = len;
+    qkdata->z.access = access;
+    *qkdata_out = qkdata;
+    regs++;
+
+    return 0;
+}
+
+static int stub_mr_free(struct zhpeq_dom *zdom, struct zhpeq_key_data *qkdata)
+{
+    free(qkdata);
+    frees++;
+
+    return 0;
+}
+
+static struct backend_ops stub_ops = {
+    .mr_reg             = stub_mr_reg,
+    .mr_free            = stub_mr_free,
+};
+
+static void usage(bool help) __attribute__ ((__noreturn__));
+
+static void usage(bool help)
+{
+    print_usage(help, "Usage:%s [<rounds>]\n", appname);
+
+    exit(255);
+}
+
+static int reg(struct zhpeq_dom *zdom, uintptr_t addr, size_t len,
+               struct zhpeq_key_data **qkdata_out)
+{
+    int                 ret;
+
+    ret = zhpeq_mr_cache_reg(zdom, (void *)addr, len, ZHPEQ_MR_PUT,
+                             qkdata_out);
+    if (ret < 0)
+        print_func_err(__func__, __LINE__, "zhpeq_mr_cache_reg", "", ret);
+
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    int                 ret = 1;
+    struct zhpeq_dom    *zdom = NULL;
+    struct zhpeq_key_data **qk = NULL;
+    uint64_t            rounds = 1000;
+    uint64_t            i;
+    uint64_t            before;
+    int                 rc;
+
+    zhpeq_util_init(argv[0], LOG_DEBUG, false);
+
+    if (argc > 2)
+        usage(false);
+    if (argc == 2 &&
+        parse_kb_uint64_t(__func__, __LINE__, "rounds", argv[1], &rounds,
+                          0, 1, SIZE_MAX / (2 * sizeof(*qk)), PARSE_KB) < 0)
+        usage(false);
+
+    zdom = calloc(1, sizeof(*zdom));
+    qk = calloc(2 * rounds, sizeof(*qk));
+    if (!zdom || !qk) {
+        print_func_err(__func__, __LINE__, "calloc", "", -ENOMEM);
+        goto done;
+    }
+    rc = zhpeq_mr_cache_init(zdom, &stub_ops, 0);
+    if (rc < 0) {
+        print_func_err(__func__, __LINE__, "zhpeq_mr_cache_init", "", rc);
+        goto done;
+    }
+
+    /* The longer range isn't covered by the shorter, so both are new. */
+    for (i = 0; i < rounds; i++) {
+        if (reg(zdom, BASE + i * STRIDE, 4096, &qk[2 * i]) < 0 ||
+            reg(zdom, BASE + i * STRIDE, 8192, &qk[2 * i + 1]) < 0)
+            goto done;
+    }
+    if (regs != 2 * rounds) {
+        print_err("%s,%u:%Lu registrations, expected %Lu\n",
+                  __func__, __LINE__, (ullong)regs, (ullong)(2 * rounds));
+        goto done;
+    }
+    for (i = 0; i < 2 * rounds; i++) {
+        rc = zhpeq_mr_cache_free(zdom, qk[i]);
+        qk[i] = NULL;
+        if (rc < 0) {
+            print_func_err(__func__, __LINE__, "zhpeq_mr_cache_free", "", rc);
+            goto done;
+        }
+    }
+    if (frees != regs) {
+        print_err("%s,%u:%Lu frees, expected %Lu\n",
+                  __func__, __LINE__, (ullong)frees, (ullong)regs);
+        goto done;
+    }
+
+    /* Every entry was evicted: this must find nothing to drop. */
+    rc = zhpeq_mr_cache_invalidate(zdom, (void *)BASE, rounds * STRIDE);
+    if (rc < 0) {
+        print_func_err(__func__, __LINE__, "zhpeq_mr_cache_invalidate", "",
+                       rc);
+        goto done;
+    }
+    if (frees != regs) {
+        print_err("%s,%u:invalidate freed %Lu stale entries\n",
+                  __func__, __LINE__, (ullong)(frees - regs));
+        goto done;
+    }
+
+    /* And a new request must miss rather than hit an evicted entry. */
+    before = regs;
+    if (reg(zdom, BASE, 4096, &qk[0]) < 0)
+        goto done;
+    if (regs != before + 1) {
+        print_err("%s,%u:hit an evicted registration\n", __func__, __LINE__);
+        goto done;
+    }
+    rc = zhpeq_mr_cache_free(zdom, qk[0]);
+    qk[0] = NULL;
+    if (rc < 0) {
+        print_func_err(__func__, __LINE__, "zhpeq_mr_cache_free", "", rc);
+        goto done;
+    }
+
+    ret = 0;
+
+ done:
+    if (zdom && zdom->mr_cache) {
+        for (i = 0; i < 2 * rounds; i++) {
+            if (qk[i])
+                (void)zhpeq_mr_cache_free(zdom, qk[i]);
+        }
+        (void)zhpeq_mr_cache_destroy(zdom);
+    }
+    free(qk);
+    free(zdom);
+
+    printf("%s:done, ret = %d\n", appname, ret);
+
+    return ret;
+}
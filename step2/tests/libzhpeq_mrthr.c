@@ -0,0 +1,250 @@
+/*
+ * Copyright (C) 2019 Hewlett Packard Enterprise Development LP.
+ * All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <internal.h>
+
+#include <limits.h>
+
+/*
+ * Register and free page-sized pieces of one mapping from several threads
+ * at once, one at a time and with zhpeq_mr_reg_batch(). Without hardware,
+ * run with ZHPE_OFFLOADED_DRIVER_MOCK=<usec> to use the mock driver.
+ */
+
+struct args {
+    pthread_t           thread;
+    struct zhpeq_dom    *zdom;
+    char                *base;
+    uint64_t            regs;
+    uint64_t            cycles;
+    uint64_t            batch_cycles;
+    int                 rc;
+};
+
+static void usage(bool help) __attribute__ ((__noreturn__));
+
+static void usage(bool help)
+{
+    print_usage(
+        help,
+        "Usage:%s <threads> <regs>[k|m|g|K|M|G]\n"
+        "Each of <threads> registers and frees <regs> pages individually\n"
+        "and then as a batch, reporting average time per registration.\n",
+        appname);
+
+    exit(255);
+}
+
+static int check_keys(struct args *args, struct zhpeq_key_data **qk)
+{
+    uint64_t            i;
+
+    for (i = 0; i < args->regs; i++) {
+        if (qk[i]->z.vaddr != (uintptr_t)(args->base + i * page_size) ||
+            qk[i]->z.len != page_size) {
+            print_err("%s,%u:key %Lu mismatch\n",
+                      __func__, __LINE__, (ullong)i);
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+static void *thread_run(void *vargs)
+{
+    struct args         *args = vargs;
+    struct zhpeq_key_data **qk = NULL;
+    struct zhpeq_iov    *iov = NULL;
+    uint32_t            access = (ZHPEQ_MR_GET | ZHPEQ_MR_PUT |
+                                  ZHPEQ_MR_GET_REMOTE | ZHPEQ_MR_PUT_REMOTE);
+    uint64_t            start;
+    uint64_t            i;
+    int                 rc;
+
+    args->rc = -ENOMEM;
+    qk = calloc(args->regs, sizeof(*qk));
+    iov = calloc(args->regs, sizeof(*iov));
+    if (!qk || !iov)
+        goto done;
+
+    start = get_cycles(NULL);
+    for (i = 0; i < args->regs; i++) {
+        args->rc = zhpeq_mr_reg(args->zdom, args->base + i * page_size,
+                                page_size, access, &qk[i]);
+        if (args->rc < 0) {
+            print_func_err(__func__, __LINE__, "zhpeq_mr_reg", "", args->rc);
+            goto done;
+        }
+    }
+    args->rc = check_keys(args, qk);
+    for (i = 0; i < args->regs; i++) {
+        rc = zhpeq_mr_free(args->zdom, qk[i]);
+        qk[i] = NULL;
+        if (rc < 0) {
+            print_func_err(__func__, __LINE__, "zhpeq_mr_free", "", rc);
+            if (args->rc >= 0)
+                args->rc = rc;
+        }
+    }
+    args->cycles = get_cycles(NULL) - start;
+    if (args->rc < 0)
+        goto done;
+
+    for (i = 0; i < args->regs; i++) {
+        iov[i].addr = (uintptr_t)(args->base + i * page_size);
+        iov[i].len = page_size;
+    }
+    start = get_cycles(NULL);
+    args->rc = zhpeq_mr_reg_batch(args->zdom, iov, args->regs, access, qk);
+    if (args->rc < 0) {
+        print_func_err(__func__, __LINE__, "zhpeq_mr_reg_batch", "", args->rc);
+        goto done;
+    }
+    args->rc = check_keys(args, qk);
+    for (i = 0; i < args->regs; i++) {
+        rc = zhpeq_mr_free(args->zdom, qk[i]);
+        qk[i] = NULL;
+        if (rc < 0) {
+            print_func_err(__func__, __LINE__, "zhpeq_mr_free", "", rc);
+            if (args->rc >= 0)
+                args->rc = rc;
+        }
+    }
+    args->batch_cycles = get_cycles(NULL) - start;
+
+ done:
+    free(qk);
+    free(iov);
+
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    int                 ret = 255;
+    struct zhpeq_dom    *zdom = NULL;
+    char                *map = NULL;
+    struct args         *args = NULL;
+    size_t              req = 0;
+    uint64_t            threads;
+    uint64_t            regs;
+    uint64_t            cycles = 0;
+    uint64_t            batch_cycles = 0;
+    uint64_t            i;
+    int                 rc;
+
+    zhpeq_util_init(argv[0], LOG_DEBUG, false);
+
+    rc = zhpeq_init(ZHPEQ_API_VERSION);
+    if (rc < 0) {
+        print_func_err(__func__, __LINE__, "zhpeq_init", "", rc);
+        goto done;
+    }
+
+    if (argc == 1)
+        usage(true);
+
+    if (argc != 3)
+        usage(false);
+
+    if (parse_kb_uint64_t(__func__, __LINE__,
+                          "threads", argv[1], &threads,
+                          0, 1, 1024, PARSE_NUM) < 0)
+        usage(false);
+    if (parse_kb_uint64_t(__func__, __LINE__,
+                          "regs", argv[2], &regs,
+                          0, 1, SIZE_MAX, PARSE_KIB | PARSE_KB) < 0)
+        usage(false);
+
+    ret = 1;
+
+    rc = zhpeq_domain_alloc(&zdom);
+    if (rc < 0) {
+        print_func_err(__func__, __LINE__, "zhpeq_domain_alloc", "", rc);
+        goto done;
+    }
+
+    /* Every thread registers the same pages, so keys are shared, too. */
+    req = regs * page_size;
+    map = mmap(NULL, req, PROT_READ | PROT_WRITE,
+               MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+    if (map == MAP_FAILED) {
+        map = NULL;
+        print_func_err(__func__, __LINE__, "mmap", "", errno);
+        goto done;
+    }
+
+    args = calloc(threads, sizeof(*args));
+    if (!args) {
+        print_func_err(__func__, __LINE__, "calloc", "", -ENOMEM);
+        goto done;
+    }
+    for (i = 0; i < threads; i++) {
+        args[i].zdom = zdom;
+        args[i].base = map;
+        args[i].regs = regs;
+        rc = -pthread_create(&args[i].thread, NULL, thread_run, &args[i]);
+        if (rc < 0) {
+            print_func_err(__func__, __LINE__, "pthread_create", "", rc);
+            threads = i;
+            break;
+        }
+    }
+    for (i = 0; i < threads; i++) {
+        (void)pthread_join(args[i].thread, NULL);
+        if (args[i].rc < 0)
+            rc = args[i].rc;
+        cycles += args[i].cycles;
+        batch_cycles += args[i].batch_cycles;
+    }
+    if (rc < 0)
+        goto done;
+    printf("%s:threads %Lu regs %Lu single %.3lf usec batch %.3lf usec\n",
+           appname, (ullong)threads, (ullong)regs,
+           cycles_to_usec(cycles, threads * regs),
+           cycles_to_usec(batch_cycles, threads * regs));
+
+    ret = 0;
+
+ done:
+    free(args);
+    if (map)
+        munmap(map, req);
+    zhpeq_domain_free(zdom);
+
+    return ret;
+}
@@ -59,6 +59,8 @@ struct cli_wire_msg {
     bool                copy_mode;
     bool                once_mode;
     bool                unidir_mode;
+    bool                spsc_mode;
+    bool                huge_mode;
 };
 
 struct mem_wire_msg {
@@ -96,6 +98,8 @@ struct args {
     bool                once_mode;
     bool                seconds_mode;
     bool                unidir_mode;
+    bool                spsc_mode;
+    bool                huge_mode;
 };
 
 struct stuff {
@@ -138,11 +142,16 @@ static void stuff_free(struct stuff *stuff)
 
     if (stuff->zq) {
         zhpeq_zmmu_free(stuff->zdom, stuff->zq_remote_kdata);
-        zhpeq_mr_free(stuff->zdom, stuff->zq_local_kdata);
+        if (!stuff->args->huge_mode)
+            zhpeq_mr_free(stuff->zdom, stuff->zq_local_kdata);
     }
     if (stuff->open_idx != -1)
         zhpeq_backend_close(stuff->zq, stuff->open_idx);
     zhpeq_free(stuff->zq);
+    if (stuff->args->huge_mode) {
+        zhpeq_mem_free(stuff->zdom, stuff->tx_addr);
+        stuff->tx_addr = NULL;
+    }
     zhpeq_domain_free(stuff->zdom);
 
     free(stuff->rx_rcv);
@@ -173,6 +182,19 @@ static int do_mem_setup(struct stuff *conn)
     req = conn->ring_entry_aligned * args->ring_entries;
     off = conn->ring_end_off = req;
     req *= 2;
+    if (args->huge_mode) {
+        /* Registered by the allocator. */
+        ret = zhpeq_mem_alloc(conn->zdom, req,
+                              ZHPEQ_MEM_HUGE_2M | ZHPEQ_MEM_NUMA,
+                              &conn->tx_addr, &conn->zq_local_kdata);
+        if (ret < 0) {
+            print_func_err(__func__, __LINE__, "zhpeq_mem_alloc", "", ret);
+            goto done;
+        }
+        memset(conn->tx_addr, TX_NONE, req);
+        conn->rx_addr = conn->tx_addr + off;
+        goto key;
+    }
     conn->tx_addr = mmap((void *)(uintptr_t)args->bufaddr, req,
                          PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_SHARED,
                          -1 , 0);
@@ -192,6 +214,7 @@ static int do_mem_setup(struct stuff *conn)
         print_func_err(__func__, __LINE__, "zhpeq_mr_reg", "", ret);
         goto done;
     }
+ key:
     ret = zhpeq_lcl_key_access(conn->zq_local_kdata, conn->tx_addr,
                                req, 0, &conn->zq_local_tx_zaddr);
     if (ret < 0) {
@@ -385,6 +408,27 @@ static ssize_t do_progress(struct zhpeq *zq, size_t *tx_cmp)
     return ret;
 }
 
+/* Bandwidth per rail of a multi-rail backend, then in total. */
+static void print_rail_bw(struct zhpeq *zq, const struct zhpeq_stats *start,
+                          uint64_t cycles)
+{
+    struct zhpeq_stats  end;
+    double              usec = cycles_to_usec(cycles, 1);
+    uint64_t            total = 0;
+    uint64_t            bytes;
+    size_t              i;
+
+    if (zhpeq_stats_get(zq, &end) < 0 || usec <= 0)
+        return;
+    printf("%s:bw MB/s rails", appname);
+    for (i = 0; i < ARRAY_SIZE(end.rail_bytes); i++) {
+        bytes = end.rail_bytes[i] - start->rail_bytes[i];
+        total += bytes;
+        printf(" %.3lf", (double)bytes / usec);
+    }
+    printf(" total %.3lf\n", (double)total / usec);
+}
+
 static int do_server_pong(struct stuff *conn)
 {
     int                 ret = 0;
@@ -462,7 +506,8 @@ static int do_server_pong(struct stuff *conn)
     }
     op_count = tx_count - warmup_count;
     zhpeq_print_info(conn->zq);
-    printf("%s:op_cnt/warmup %lu/%lu\n", appname, op_count, warmup_count);
+    printf("%s:op_cnt/warmup %lu/%lu%s\n", appname, op_count, warmup_count,
+           (args->spsc_mode ? " spsc" : ""));
 
  done:
 
@@ -488,6 +533,7 @@ static int do_client_pong(struct stuff *conn)
     uint64_t            lat_comp = 0;
     uint64_t            lat_write = 0;
     uint64_t            q_max1 = 0;
+    struct zhpeq_stats  stats1 = { { 0 } };
     uint64_t            tx_count;
     uint64_t            rx_count;
     uint64_t            warmup_count;
@@ -558,6 +604,7 @@ static int do_client_pong(struct stuff *conn)
                 lat_comp = 0;
                 lat_write = 0;
                 q_max1 = 0;
+                (void)zhpeq_stats_get(conn->zq, &stats1);
                 /* FALLTHROUGH */
 
             case TX_RUNNING:
@@ -603,7 +650,8 @@ static int do_client_pong(struct stuff *conn)
     lat_total1 = get_cycles(NULL) - lat_total1;
     op_count = tx_count - warmup_count;
     zhpeq_print_info(conn->zq);
-    printf("%s:op_cnt/warmup %lu/%lu\n", appname, op_count, warmup_count);
+    printf("%s:op_cnt/warmup %lu/%lu%s\n", appname, op_count, warmup_count,
+           (args->spsc_mode ? " spsc" : ""));
     printf("%s:lat ave1/ave2/min2/max2 %.3lf/%.3lf/%.3lf/%.3lf\n", appname,
            cycles_to_usec(lat_total1, op_count * 2),
            cycles_to_usec(lat_total2, op_count * 2),
@@ -611,6 +659,7 @@ static int do_client_pong(struct stuff *conn)
     printf("%s:lat comp/write %.3lf/%.3lf qmax %lu\n",  appname,
            cycles_to_usec(lat_comp, op_count),
            cycles_to_usec(lat_write, op_count), q_max1);
+    print_rail_bw(conn->zq, &stats1, lat_total1);
 
  done:
     return ret;
@@ -638,6 +687,7 @@ static int do_client_unidir(struct stuff *conn)
     uint64_t            lat_total1 = 0;
     uint64_t            lat_comp = 0;
     uint64_t            lat_write = 0;
+    struct zhpeq_stats  stats1 = { { 0 } };
     uint64_t            tx_count;
     uint64_t            op_count;
     uint64_t            warmup_count;
@@ -676,6 +726,7 @@ static int do_client_unidir(struct stuff *conn)
             lat_total1 = get_cycles(NULL);
             lat_comp = 0;
             lat_write = 0;
+            (void)zhpeq_stats_get(conn->zq, &stats1);
             /* FALLTHROUGH */
 
         case TX_RUNNING:
@@ -699,9 +750,9 @@ static int do_client_unidir(struct stuff *conn)
         zq_rx_addr = conn->zq_remote_rx_zaddr + tx_off;
         /* Write op flag. */
         *tx_addr = tx_flag_out;
+        now = get_cycles(NULL);
         ret = zq_write(conn->zq, false, zq_tx_addr, args->ring_entry_len,
                        zq_rx_addr);
-        now = get_cycles(NULL);
         lat_write += get_cycles(NULL) - now;
         if (ret < 0)
             goto done;
@@ -716,12 +767,14 @@ static int do_client_unidir(struct stuff *conn)
     lat_total1 = get_cycles(NULL) - lat_total1;
     op_count = tx_count - warmup_count;
     zhpeq_print_info(conn->zq);
-    printf("%s:op_cnt/warmup %lu/%lu\n", appname, op_count, warmup_count);
+    printf("%s:op_cnt/warmup %lu/%lu%s\n", appname, op_count, warmup_count,
+           (args->spsc_mode ? " spsc" : ""));
     printf("%s:lat ave1 %.3lf\n", appname,
            cycles_to_usec(lat_total1, op_count));
     printf("%s:lat comp/write %.3lf/%.3lf\n", appname,
            cycles_to_usec(lat_comp, op_count),
            cycles_to_usec(lat_write, op_count));
+    print_rail_bw(conn->zq, &stats1, lat_total1);
 
  done:
     return ret;
@@ -755,9 +808,11 @@ int do_zq_setup(struct stuff *conn)
         print_func_err(__func__, __LINE__, "zhpeq_domain_alloc", "", ret);
         goto done;
     }
-    /* Allocate zqueue. */
-    ret = zhpeq_alloc(conn->zdom, conn->tx_avail + 1, conn->tx_avail + 1,
-                      0, 0, 0,  &conn->zq);
+    /* Allocate zqueue; each side has only one thread using it. */
+    ret = zhpeq_alloc_flags(conn->zdom, conn->tx_avail + 1,
+                            conn->tx_avail + 1, 0, 0, 0,
+                            (args->spsc_mode ? ZHPEQ_ALLOC_SPSC : 0),
+                            &conn->zq);
     if (ret < 0) {
         print_func_err(__func__, __LINE__, "zhpeq_qalloc", "", ret);
         goto done;
@@ -811,6 +866,8 @@ static int do_server_one(const struct args *oargs, int conn_fd)
     args->copy_mode = !!cli_msg.copy_mode;
     args->once_mode = !!cli_msg.once_mode;
     args->unidir_mode = !!cli_msg.unidir_mode;
+    args->spsc_mode = !!cli_msg.spsc_mode;
+    args->huge_mode = !!cli_msg.huge_mode;
 
     /* Dummy for ordering. */
     ret = sock_send_blob(conn.sock_fd, NULL, 0);
@@ -914,6 +971,8 @@ static int do_client(const struct args *args)
     cli_msg.copy_mode = args->copy_mode;
     cli_msg.once_mode = args->once_mode;
     cli_msg.unidir_mode = args->unidir_mode;
+    cli_msg.spsc_mode = args->spsc_mode;
+    cli_msg.huge_mode = args->huge_mode;
 
     ret = sock_send_blob(conn.sock_fd, &cli_msg, sizeof(cli_msg));
     if (ret < 0)
@@ -963,7 +1022,7 @@ static void usage(bool help)
 {
     print_usage(
         help,
-        "Usage:%s [-acosu] [-t <txqlen>] [-b <address>]\n"
+        "Usage:%s [-acHosSu] [-t <txqlen>] [-b <address>]\n"
         "    <port> [<node> <entry_len> <ring_entries>"
         " <op_count/seconds>]\n"
         "All sizes may be postfixed with [kmgtKMGT] to specify the"
@@ -974,8 +1033,11 @@ static void usage(bool help)
         " -a : cache line align entries\n"
         " -b <address> : try to allocate buffer at address\n"
         " -c : copy mode\n"
+        " -H : registered hugepage ring buffers from zhpeq_mem_alloc()\n"
         " -o : run once and then server will exit\n"
         " -s : treat the final argument as seconds\n"
+        " -S : single-producer/single-consumer queues; compare the\n"
+        "      comp/write per-op times with and without it\n"
         " -t <txqlen> : length of tx request queue\n"
         " -u : uni-directional client-to-server traffic (no copy)\n"
         " -w <ops> : number of warmup operations\n"
@@ -1011,7 +1073,7 @@ int main(int argc, char **argv)
     if (argc == 1)
         usage(true);
 
-    while ((opt = getopt(argc, argv, "ab:cost:uw:")) != -1) {
+    while ((opt = getopt(argc, argv, "ab:cHosSt:uw:")) != -1) {
 
         /* All opts are client only, now. */
         client_opt = true;
@@ -1039,6 +1101,12 @@ int main(int argc, char **argv)
             args.copy_mode = true;
             break;
 
+        case 'H':
+            if (args.huge_mode)
+                usage(false);
+            args.huge_mode = true;
+            break;
+
         case 'o':
             if (args.once_mode)
                 usage(false);
@@ -1051,6 +1119,12 @@ int main(int argc, char **argv)
             args.seconds_mode = true;
             break;
 
+        case 'S':
+            if (args.spsc_mode)
+                usage(false);
+            args.spsc_mode = true;
+            break;
+
         case 't':
             if (args.tx_avail)
                 usage(false);
@@ -1081,7 +1155,8 @@ int main(int argc, char **argv)
         }
     }
 
-    if (args.copy_mode && args.unidir_mode)
+    if ((args.copy_mode && args.unidir_mode) ||
+        (args.huge_mode && args.bufaddr))
         usage(false);
 
     opt = argc - optind;
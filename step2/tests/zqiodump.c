@@ -0,0 +1,220 @@
+/*
+ * Copyright (C) 2017-2018 Hewlett Packard Enterprise Development LP.
+ * All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <zhpeq.h>
+#include <zhpeq_util.h>
+
+#include <fcntl.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct dump_rec {
+    struct zhpeq_io_rec rec;
+    uint32_t            eng;
+};
+
+static void usage(bool help) __attribute__ ((__noreturn__));
+
+static void usage(bool help)
+{
+    print_usage(
+        help,
+        "Usage:%s [-n <records>] <pid>\n"
+        "Dump the libfabric engine op trace of a process started with\n"
+        "ZHPE_OFFLOADED_BACKEND_LIBFABRIC_IO_RECORD=<entries>, oldest first,\n"
+        "with times in microseconds relative to the oldest record shown.\n"
+        " -n <records> : only the newest <records> of each engine\n",
+        appname);
+
+    exit(help ? 0 : 255);
+}
+
+static int rec_compare(const void *v1, const void *v2)
+{
+    const struct dump_rec *r1 = v1;
+    const struct dump_rec *r2 = v2;
+
+    if (r1->rec.tsc != r2->rec.tsc)
+        return (r1->rec.tsc < r2->rec.tsc ? -1 : 1);
+
+    return 0;
+}
+
+/* Copy out the records of one ring that were stable during the copy. */
+static size_t ring_copy(const struct zhpeq_io_shm *shm,
+                        const struct zhpeq_io_ring *ring, uint32_t eng,
+                        uint64_t max, struct zhpeq_io_rec *snap,
+                        struct dump_rec *out)
+{
+    size_t              ret = 0;
+    uint64_t            ents = shm->ring_ents;
+    uint64_t            start;
+    uint64_t            end;
+    uint64_t            first;
+    uint64_t            i;
+
+    start = atm_load(&ring->idx);
+    for (i = 0; i < ents; i++)
+        snap[i] = ring->rec[i];
+    smp_rmb();
+    end = atm_load(&ring->idx);
+
+    first = (end >= ents ? end - ents + 1 : 0);
+    if (start - first > max)
+        first = start - max;
+    for (i = first; i < start; i++) {
+        out[ret].rec = snap[i & (ents - 1)];
+        out[ret++].eng = eng;
+    }
+
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    int                 ret = 1;
+    int                 fd = -1;
+    struct zhpeq_io_shm *shm = NULL;
+    size_t              shm_len = 0;
+    struct dump_rec     *recs = NULL;
+    struct zhpeq_io_rec *snap = NULL;
+    size_t              n_recs = 0;
+    uint64_t            max = UINT64_MAX;
+    const struct zhpeq_io_ring *ring;
+    const struct zhpeq_io_rec *rec;
+    uint64_t            pid;
+    char                name[32];
+    struct stat         st;
+    size_t              i;
+    int                 opt;
+    int                 rc;
+
+    zhpeq_util_init(argv[0], LOG_DEBUG, false);
+
+    if (argc == 1)
+        usage(true);
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+
+        switch (opt) {
+
+        case 'n':
+            if (max != UINT64_MAX)
+                usage(false);
+            if (parse_kb_uint64_t(__func__, __LINE__, "records",
+                                  optarg, &max, 0, 1,
+                                  UINT64_MAX - 1, PARSE_KB | PARSE_KIB) < 0)
+                usage(false);
+            break;
+
+        default:
+            usage(false);
+
+        }
+    }
+
+    if (argc - optind != 1)
+        usage(false);
+    if (parse_kb_uint64_t(__func__, __LINE__, "pid", argv[optind], &pid, 0,
+                          1, INT32_MAX, PARSE_NUM) < 0)
+        usage(false);
+
+    snprintf(name, sizeof(name), "/zhpeq_io.%Lu", (ullong)pid);
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1) {
+        rc = -errno;
+        print_func_err(__func__, __LINE__, "shm_open", name, rc);
+        goto done;
+    }
+    if (fstat(fd, &st) == -1) {
+        rc = -errno;
+        print_func_err(__func__, __LINE__, "fstat", name, rc);
+        goto done;
+    }
+    shm_len = st.st_size;
+    if (shm_len < page_size) {
+        print_err("%s,%u:%s too small\n", __func__, __LINE__, name);
+        goto done;
+    }
+    shm = do_mmap(NULL, shm_len, PROT_READ, MAP_SHARED, fd, 0, &rc);
+    if (!shm)
+        goto done;
+    if (atm_load(&shm->magic) != ZHPEQ_IO_SHM_MAGIC ||
+        shm->version != ZHPEQ_IO_SHM_VERSION ||
+        shm_len < page_size + shm->n_rings * shm->ring_len) {
+        print_err("%s,%u:%s not a version %u trace object\n",
+                  __func__, __LINE__, name, ZHPEQ_IO_SHM_VERSION);
+        goto done;
+    }
+
+    recs = calloc(shm->n_rings * shm->ring_ents, sizeof(*recs));
+    snap = calloc(shm->ring_ents, sizeof(*snap));
+    if (!recs || !snap) {
+        print_func_err(__func__, __LINE__, "calloc", "", -ENOMEM);
+        goto done;
+    }
+    for (i = 0; i < shm->n_rings; i++) {
+        ring = (void *)((char *)shm + page_size + i * shm->ring_len);
+        n_recs += ring_copy(shm, ring, i, max, snap, recs + n_recs);
+    }
+    qsort(recs, n_recs, sizeof(*recs), rec_compare);
+
+    for (i = 0; i < n_recs; i++) {
+        rec = &recs[i].rec;
+        printf("%14.3f eng %3u seq %8Lu %s op 0x%02x zq 0x%Lx ctx 0x%Lx"
+               " status %d", (double)(rec->tsc - recs[0].rec.tsc) *
+               1000000.0 / shm->tsc_freq, recs[i].eng, (ullong)rec->seq,
+               (rec->type == ZHPEQ_IO_REC_POST ? "post" : "done"), rec->op,
+               (ullong)rec->zq_id, (ullong)rec->context, rec->status);
+        if (rec->type == ZHPEQ_IO_REC_POST)
+            printf(" fi_addr %Lu buf 0x%Lx raddr 0x%Lx rkey 0x%Lx len %Lu",
+                   (ullong)rec->fi_addr, (ullong)rec->buf,
+                   (ullong)rec->raddr, (ullong)rec->rkey, (ullong)rec->len);
+        printf("\n");
+    }
+    ret = 0;
+
+ done:
+    free(recs);
+    free(snap);
+    if (shm)
+        munmap(shm, shm_len);
+    if (fd != -1)
+        close(fd);
+
+    return ret;
+}
@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2017-2018 Hewlett Packard Enterprise Development LP.
+ * All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <zhpeq.h>
+#include <zhpeq_util.h>
+
+#include <fcntl.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char *op_names[] = {
+    [ZHPEQ_OP_NOP]      = "nop",
+    [ZHPEQ_OP_PUT]      = "put",
+    [ZHPEQ_OP_GET]      = "get",
+    [ZHPEQ_OP_PUTI]     = "puti",
+    [ZHPEQ_OP_GETI]     = "geti",
+    [ZHPEQ_OP_ATOMIC]   = "atomic",
+};
+
+static void usage(bool help) __attribute__ ((__noreturn__));
+
+static void usage(bool help)
+{
+    print_usage(help, "Usage:%s <pid>\n"
+                "Print the counters of every zhpeq queue in a process\n"
+                "started with ZHPEQ_STATS_SHM set.\n", appname);
+
+    exit(255);
+}
+
+static void print_stats(const struct zhpeq_stats_shm_queue *sq)
+{
+    struct zhpeq_stats  sum;
+    uint64_t            *dst = (void *)&sum;
+    const uint64_t      *src;
+    size_t              i;
+    size_t              j;
+
+    /* Counters are updated without locks; a snapshot may be slightly torn. */
+    memset(&sum, 0, sizeof(sum));
+    for (i = 0; i < ZHPEQ_STATS_BLKS; i++) {
+        src = (const void *)&sq->blk[i].s;
+        for (j = 0; j < sizeof(sum) / sizeof(*dst); j++)
+            dst[j] += atm_load_rlx(&src[j]);
+    }
+
+    printf("%s:queue 0x%Lx domain 0x%Lx\n", appname,
+           (ullong)sq->zq_id, (ullong)sq->dom_id);
+    for (i = 0; i < ARRAY_SIZE(sum.ops); i++) {
+        if (sum.ops[i])
+            printf("  %-14s %Lu\n", op_names[i], (ullong)sum.ops[i]);
+    }
+    printf("  %-14s %Lu\n", "bytes", (ullong)sum.bytes);
+    printf("  %-14s %Lu\n", "fences", (ullong)sum.fences);
+    printf("  %-14s %Lu\n", "fence_stalls", (ullong)sum.fence_stalls);
+    printf("  %-14s %Lu\n", "reserve_eagain", (ullong)sum.reserve_eagain);
+    printf("  %-14s %Lu\n", "cq_entries", (ullong)sum.cq_entries);
+    printf("  %-14s %Lu\n", "cq_errors", (ullong)sum.cq_errors);
+    printf("  %-14s %Lu\n", "cq_read_full", (ullong)sum.cq_read_full);
+    printf("  %-14s", "occupancy");
+    for (i = 0; i < ARRAY_SIZE(sum.occupancy); i++)
+        printf(" %Lu", (ullong)sum.occupancy[i]);
+    printf("\n");
+    printf("  %-14s", "rail_bytes");
+    for (i = 0; i < ARRAY_SIZE(sum.rail_bytes); i++)
+        printf(" %Lu", (ullong)sum.rail_bytes[i]);
+    printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+    int                 ret = 1;
+    int                 fd = -1;
+    struct zhpeq_stats_shm *shm = NULL;
+    size_t              shm_len = 0;
+    uint64_t            pid;
+    char                name[32];
+    struct stat         st;
+    uint32_t            i;
+    int                 rc;
+
+    zhpeq_util_init(argv[0], LOG_DEBUG, false);
+
+    if (argc == 1)
+        usage(true);
+    if (argc != 2)
+        usage(false);
+    if (parse_kb_uint64_t(__func__, __LINE__, "pid", argv[1], &pid, 0, 1,
+                          INT32_MAX, PARSE_NUM) < 0)
+        usage(false);
+
+    snprintf(name, sizeof(name), "/zhpeq_stats.%Lu", (ullong)pid);
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1) {
+        rc = -errno;
+        print_func_err(__func__, __LINE__, "shm_open", name, rc);
+        goto done;
+    }
+    if (fstat(fd, &st) == -1) {
+        rc = -errno;
+        print_func_err(__func__, __LINE__, "fstat", name, rc);
+        goto done;
+    }
+    shm_len = st.st_size;
+    if (shm_len < sizeof(*shm)) {
+        print_err("%s,%u:%s too small\n", __func__, __LINE__, name);
+        goto done;
+    }
+    shm = do_mmap(NULL, shm_len, PROT_READ, MAP_SHARED, fd, 0, &rc);
+    if (!shm)
+        goto done;
+    if (atm_load(&shm->magic) != ZHPEQ_STATS_SHM_MAGIC ||
+        shm->version != ZHPEQ_STATS_SHM_VERSION ||
+        shm_len < sizeof(*shm) + shm->n_queues * sizeof(shm->queue[0])) {
+        print_err("%s,%u:%s not a version %u stats object\n",
+                  __func__, __LINE__, name, ZHPEQ_STATS_SHM_VERSION);
+        goto done;
+    }
+
+    for (i = 0; i < shm->n_queues; i++) {
+        if (atm_load(&shm->queue[i].in_use))
+            print_stats(&shm->queue[i]);
+    }
+    ret = 0;
+
+ done:
+    if (shm)
+        munmap(shm, shm_len);
+    if (fd != -1)
+        close(fd);
+
+    return ret;
+}